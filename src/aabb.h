@@ -0,0 +1,63 @@
+#ifndef AABB_H
+#define AABB_H
+#include <limits>
+#include <algorithm>
+#include <glm/glm.hpp>
+#include "ray.h"
+
+struct aabb
+{
+	glm::vec3 min{ std::numeric_limits<float>::infinity() };
+	glm::vec3 max{ -std::numeric_limits<float>::infinity() };
+
+	void grow(const glm::vec3& point) noexcept
+	{
+		min = glm::min(min, point);
+		max = glm::max(max, point);
+	}
+	void grow(const aabb& other) noexcept
+	{
+		min = glm::min(min, other.min);
+		max = glm::max(max, other.max);
+	}
+	[[nodiscard]] bool empty() const noexcept
+	{
+		return min.x > max.x || min.y > max.y || min.z > max.z;
+	}
+	[[nodiscard]] glm::vec3 centroid() const noexcept
+	{
+		return (min + max) * 0.5f;
+	}
+	[[nodiscard]] float surface_area() const noexcept
+	{
+		if (empty())
+			return 0.0f;
+		const auto e = max - min;
+		return 2.0f * (e.x * e.y + e.y * e.z + e.z * e.x);
+	}
+	// Bounds of this box after transforming it with trans
+	[[nodiscard]] aabb transformed(const glm::mat4& trans) const noexcept
+	{
+		aabb result;
+		for (int corner = 0; corner < 8; ++corner)
+		{
+			const glm::vec3 local{
+				corner & 1 ? max.x : min.x,
+				corner & 2 ? max.y : min.y,
+				corner & 4 ? max.z : min.z
+			};
+			result.grow(glm::vec3{ trans * glm::vec4{ local, 1.0f } });
+		}
+		return result;
+	}
+	// Ray parameter at which r enters the box, or infinity if it misses it
+	[[nodiscard]] float intersect(const ray& r, const glm::vec3& inv_dir) const noexcept
+	{
+		const auto t0 = (min - r.origin) * inv_dir;
+		const auto t1 = (max - r.origin) * inv_dir;
+		const auto t_near = std::max({ std::min(t0.x, t1.x), std::min(t0.y, t1.y), std::min(t0.z, t1.z), 0.0f });
+		const auto t_far = std::min({ std::max(t0.x, t1.x), std::max(t0.y, t1.y), std::max(t0.z, t1.z) });
+		return t_near <= t_far ? t_near : std::numeric_limits<float>::infinity();
+	}
+};
+#endif // AABB_H
@@ -0,0 +1,84 @@
+#ifndef ALIAS_TABLE_H
+#define ALIAS_TABLE_H
+#include <algorithm>
+#include <cstdint>
+#include <span>
+#include <vector>
+
+// Samples an index with probability proportional to its weight in O(1), using Vose's alias method
+class alias_table
+{
+	struct entry
+	{
+		float probability; // of keeping the index rather than taking its alias
+		uint32_t alias;
+	};
+	std::vector<entry> entries;
+	std::vector<float> pmf;
+	double total = 0.0;
+public:
+	alias_table() = default;
+	explicit alias_table(std::span<const float> weights) :
+		entries(weights.size()),
+		pmf(weights.size())
+	{
+		for (const auto w : weights)
+			total += std::max(w, 0.0f);
+		if (total <= 0.0)
+			return;
+		const auto n = weights.size();
+		std::vector<double> scaled(n);
+		std::vector<uint32_t> small, large;
+		for (uint32_t i = 0; i < n; ++i)
+		{
+			pmf[i] = static_cast<float>(std::max(weights[i], 0.0f) / total);
+			scaled[i] = pmf[i] * static_cast<double>(n);
+			(scaled[i] < 1.0 ? small : large).push_back(i);
+		}
+		while (!small.empty() && !large.empty())
+		{
+			const auto s = small.back();
+			small.pop_back();
+			const auto l = large.back();
+			entries[s] = { static_cast<float>(scaled[s]), l };
+			scaled[l] -= 1.0 - scaled[s];
+			if (scaled[l] < 1.0)
+			{
+				large.pop_back();
+				small.push_back(l);
+			}
+		}
+		// Whatever is left is 1 up to rounding
+		for (const auto i : small)
+			entries[i] = { 1.0f, i };
+		for (const auto i : large)
+			entries[i] = { 1.0f, i };
+	}
+
+	[[nodiscard]] bool empty() const noexcept
+	{
+		return total <= 0.0;
+	}
+	[[nodiscard]] size_t size() const noexcept
+	{
+		return entries.size();
+	}
+	[[nodiscard]] double total_weight() const noexcept
+	{
+		return total;
+	}
+	// Probability of sampling index
+	[[nodiscard]] float pmf_of(size_t index) const noexcept
+	{
+		return pmf[index];
+	}
+	// Maps u in [0, 1) to an index. The table must not be empty.
+	[[nodiscard]] uint32_t sample(float u) const noexcept
+	{
+		const auto scaled = u * static_cast<float>(entries.size());
+		const auto index = std::min(static_cast<size_t>(scaled), entries.size() - 1);
+		const auto& e = entries[index];
+		return scaled - static_cast<float>(index) < e.probability ? static_cast<uint32_t>(index) : e.alias;
+	}
+};
+#endif // ALIAS_TABLE_H
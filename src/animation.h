@@ -0,0 +1,62 @@
+#ifndef ANIMATION_H
+#define ANIMATION_H
+#include <vector>
+#include <cmath>
+#include <algorithm>
+#include <stdexcept>
+#include <glm/glm.hpp>
+#include "transform.h"
+
+// Keyframed transform, interpolating position and scale linearly and orientation spherically
+class transform_animation
+{
+public:
+	struct keyframe
+	{
+		float time;
+		transform value;
+	};
+private:
+	std::vector<keyframe> keys;
+	bool looping;
+public:
+	explicit transform_animation(std::vector<keyframe> keyframes, bool looping = true) :
+		keys{ std::move(keyframes) },
+		looping{ looping }
+	{
+		if (keys.empty())
+		{
+			throw std::runtime_error("An animation needs at least one keyframe");
+		}
+		std::sort(keys.begin(), keys.end(), [](const keyframe& a, const keyframe& b) { return a.time < b.time; });
+	}
+
+	[[nodiscard]] float duration() const noexcept
+	{
+		return keys.back().time - keys.front().time;
+	}
+	[[nodiscard]] transform evaluate(float time) const noexcept
+	{
+		if (looping && duration() > 0.0f)
+		{
+			time = keys.front().time + std::fmod(time - keys.front().time, duration());
+			if (time < keys.front().time)
+				time += duration();
+		}
+		if (time <= keys.front().time)
+			return keys.front().value;
+		if (time >= keys.back().time)
+			return keys.back().value;
+
+		const auto next = std::upper_bound(keys.begin(), keys.end(), time, [](float t, const keyframe& key) { return t < key.time; });
+		const auto& [t1, b] = *next;
+		const auto& [t0, a] = *(next - 1);
+		const auto t = (time - t0) / (t1 - t0);
+		return transform{
+			glm::mix(a.get_position(), b.get_position(), t),
+			glm::slerp(a.get_orientation(), b.get_orientation(), t),
+			glm::mix(a.get_scale(), b.get_scale(), t)
+		};
+	}
+};
+#endif // ANIMATION_H
@@ -0,0 +1,172 @@
+#ifndef BENCHMARK_H
+#define BENCHMARK_H
+#include <algorithm>
+#include <cmath>
+#include <cstdint>
+#include <filesystem>
+#include <iostream>
+#include <limits>
+#include <memory>
+#include <optional>
+#include <stdexcept>
+#include <thread>
+#include <vector>
+#include <stb_image.h>
+#include "world.h"
+#include "camera.h"
+#include "cpu_dispatch.h"
+#include "framebuffer.h"
+#include "image_writer.h"
+#include "job_pool.h"
+#include "math_policy.h"
+#include "offline_renderer.h"
+#include "utility.h"
+
+struct benchmark_settings
+{
+	render_settings render;
+	int repeats = 3;
+	// Image to measure the error against, usually rendered by the exact math policy
+	std::filesystem::path reference;
+	// Where to write the rendered image, e.g. to use it as a reference later
+	std::filesystem::path output;
+};
+
+struct benchmark_result
+{
+	const char* policy;
+	const char* isa; // variant of the kernels
+	double seconds; // best of the repeats
+	std::optional<double> rmse;
+};
+
+[[nodiscard]] inline framebuffer load_linear_image(const std::filesystem::path& path)
+{
+	int width, height, channels;
+	const std::unique_ptr<float, decltype(&stbi_image_free)> data{
+		stbi_loadf(path.string().c_str(), &width, &height, &channels, 4), &stbi_image_free };
+	if (!data)
+	{
+		throw std::runtime_error("Cannot load " + path.string() + ": " + stbi_failure_reason());
+	}
+	framebuffer result;
+	result.update_size_for_overwrite(width, height);
+	auto buffer = result.buffer();
+	for (size_t i = 0; i < result.width() * result.height(); ++i)
+	{
+		buffer.data[i] = glm::vec4{ data.get()[4 * i], data.get()[4 * i + 1], data.get()[4 * i + 2], data.get()[4 * i + 3] };
+	}
+	return result;
+}
+
+// Root mean square error of the color channels
+[[nodiscard]] inline double rmse(const framebuffer& image, const framebuffer& reference)
+{
+	if (image.width() != reference.width() || image.height() != reference.height())
+	{
+		throw std::runtime_error("The reference image is " + std::to_string(reference.width()) + "x" + std::to_string(reference.height()) +
+			", not " + std::to_string(image.width()) + "x" + std::to_string(image.height()));
+	}
+	double sum = 0.0;
+	const auto pixel_count = image.width() * image.height();
+	for (size_t i = 0; i < pixel_count; ++i)
+	{
+		const auto diff = glm::vec3{ image.buffer().data[i] } - glm::vec3{ reference.buffer().data[i] };
+		sum += dot(diff, diff);
+	}
+	return std::sqrt(sum / static_cast<double>(3 * pixel_count));
+}
+
+// Mean squared error relative to the reference's brightness, so that dark regions count as much as bright ones
+[[nodiscard]] inline double relmse(const framebuffer& image, const framebuffer& reference)
+{
+	if (image.width() != reference.width() || image.height() != reference.height())
+	{
+		throw std::runtime_error("The reference image doesn't match the size of the render");
+	}
+	double sum = 0.0;
+	const auto pixel_count = image.width() * image.height();
+	for (size_t i = 0; i < pixel_count; ++i)
+	{
+		const glm::vec3 value{ image.buffer().data[i] };
+		const glm::vec3 expected{ reference.buffer().data[i] };
+		for (int c = 0; c < 3; ++c)
+		{
+			const double diff = value[c] - expected[c];
+			sum += diff * diff / (static_cast<double>(expected[c]) * expected[c] + 1e-2);
+		}
+	}
+	return sum / static_cast<double>(3 * pixel_count);
+}
+
+// Renders the scene from cam with the math policy the renderer was built with.
+// The frames are seeded identically, so the error against a reference rendered
+// by another build only comes from the different precision.
+inline benchmark_result run_benchmark(const world& scene, const camera& cam, const benchmark_settings& settings, job_pool& pool)
+{
+	framebuffer image;
+	benchmark_result result{ default_math::name, isa_name(active_isa()), std::numeric_limits<double>::infinity(), std::nullopt };
+	for (int repeat = 0; repeat < std::max(settings.repeats, 1); ++repeat)
+	{
+		const auto start = time_now();
+		render_frame(scene, cam, settings.render, pool, 0, image);
+		result.seconds = std::min(result.seconds, time_now() - start);
+	}
+	if (!settings.reference.empty())
+	{
+		result.rmse = rmse(image, load_linear_image(settings.reference));
+	}
+	if (!settings.output.empty() && !write_image(settings.output, image))
+	{
+		throw std::runtime_error("Cannot write " + settings.output.string());
+	}
+	return result;
+}
+
+// FNV-1a over the bits of every pixel, to tell whether two renders are exactly the same
+[[nodiscard]] inline uint64_t image_hash(const framebuffer& image) noexcept
+{
+	uint64_t hash = 0xcbf29ce484222325ull;
+	const auto bytes = reinterpret_cast<const unsigned char*>(image.buffer().data);
+	for (size_t i = 0; i < image.width() * image.height() * sizeof(glm::vec4); ++i)
+	{
+		hash = (hash ^ bytes[i]) * 0x100000001b3ull;
+	}
+	return hash;
+}
+
+// Renders the benchmark frame on pools of 1, 4 and max_threads workers (0 for one per CPU)
+// and prints the hash of every image. Returns whether they all match, which they must,
+// as every sample is seeded by its pixel alone.
+inline bool check_determinism(const world& scene, const camera& cam, const benchmark_settings& settings, size_t max_threads, std::ostream& out)
+{
+	if (max_threads == 0)
+		max_threads = std::max(std::thread::hardware_concurrency(), 1u);
+	std::vector<size_t> thread_counts{ 1, 4, max_threads };
+	std::sort(thread_counts.begin(), thread_counts.end());
+	thread_counts.erase(std::unique(thread_counts.begin(), thread_counts.end()), thread_counts.end());
+
+	framebuffer image;
+	std::optional<uint64_t> first;
+	bool consistent = true;
+	for (const auto threads : thread_counts)
+	{
+		job_pool pool{ threads };
+		render_frame(scene, cam, settings.render, pool, 0, image);
+		const auto hash = image_hash(image);
+		out << "threads=" << threads << " hash=" << std::hex << hash << std::dec << '\n';
+		consistent &= !first || *first == hash;
+		first = first.value_or(hash);
+	}
+	return consistent;
+}
+
+// One line of key=value pairs, so that runs of differently built renderers can be collected by a script
+inline std::ostream& operator<<(std::ostream& out, const benchmark_result& result)
+{
+	out << "policy=" << result.policy << " isa=" << result.isa << " seconds=" << result.seconds;
+	if (result.rmse)
+		out << " rmse=" << *result.rmse;
+	return out;
+}
+#endif // BENCHMARK_H
@@ -0,0 +1,335 @@
+#ifndef BIDIRECTIONAL_H
+#define BIDIRECTIONAL_H
+#include <algorithm>
+#include <array>
+#include <limits>
+#include <vector>
+#include <glm/glm.hpp>
+#include "world.h"
+#include "camera.h"
+#include "splat_buffer.h"
+#include "utility.h"
+
+// Bidirectional path tracer. Every sample traces a path from the camera and one from a
+// random point on an emissive object, and connects every vertex of one to every vertex of
+// the other, weighting all ways of building a path against each other by the power heuristic.
+// This finds light focused by glass onto diffuse surfaces, which paths from the camera
+// only hit by chance. Paths can only be connected at diffuse surfaces, as those are the only
+// ones whose scattering can be evaluated; everything else is treated like a mirror.
+// The environment isn't a light here, and is found by the camera path as in world::raytrace.
+// Connections to the camera land on other pixels and are splatted. The sum of the splats of
+// a frame, divided by its samples per pixel, must be added to the pixels.
+class bidirectional_tracer
+{
+	struct vertex
+	{
+		glm::vec3 position;
+		glm::vec3 normal; // facing the side the path came from; geometric on lights
+		glm::vec3 beta; // throughput of the path up to the vertex
+		glm::vec3 reflectance; // of the diffuse lobe
+		const raytraceable* object; // nullptr for the camera
+		// Densities per unit area of sampling the vertex coming from the camera and from the light
+		float pdf_fwd;
+		float pdf_rev;
+		bool delta; // can't be connected to
+		bool light; // on an emissive surface
+	};
+
+	const world& scene;
+	const camera& cam;
+	splat_buffer& splats;
+	glm::vec3 cam_position;
+	float image_area;
+	int max_depth;
+	std::vector<vertex> camera_path, light_path;
+public:
+	bidirectional_tracer(const world& scene, const camera& cam, splat_buffer& splats, int max_depth) :
+		scene{ scene },
+		cam{ cam },
+		splats{ splats },
+		cam_position{ cam.trans.get_position() },
+		image_area{ cam.image_area(splats.width(), splats.height()) },
+		max_depth{ std::max(max_depth, 1) }
+	{
+		camera_path.resize(this->max_depth + 1);
+		light_path.resize(this->max_depth);
+	}
+
+	// Light reaching the camera along r, which get_ray must have returned for the size of
+	// the splat buffer. Splats what the light path brings to the camera.
+	[[nodiscard]] glm::vec3 trace(const ray& r, int& seed) noexcept
+	{
+		glm::vec3 color{ 0, 0, 0 };
+		camera_path[0] = { cam_position, {}, glm::vec3{ 1, 1, 1 }, {}, nullptr, 1.0f, 0.0f, false, false };
+		const auto cos_theta = cam.cos_to_axis(r.direction);
+		const auto camera_count = walk(r, glm::vec3{ 1, 1, 1 }, 1.0f / (image_area * cos_theta * cos_theta * cos_theta), camera_path.data(), 1, camera_path.size(), true, seed, color);
+		const auto light_count = scene.emitters.empty() ? 0 : start_light_path(seed);
+
+		for (size_t t = 1; t <= camera_count; ++t)
+		{
+			for (size_t s = 0; s <= light_count; ++s)
+			{
+				// A light seen straight from the camera is only found by the camera path
+				if (s + t < 2 || (s == 1 && t == 1) || static_cast<int>(s + t) - 1 > max_depth)
+					continue;
+				if (t == 1)
+				{
+					if (s > 0)
+						splat(s, seed);
+					continue;
+				}
+				color += connect(s, t, seed);
+			}
+		}
+		return color;
+	}
+private:
+	// Picks a point on a light and continues from there. Returns the number of vertices.
+	[[nodiscard]] size_t start_light_path(int& seed) noexcept
+	{
+		const auto emitter = scene.sample_emitter(seed);
+		if (emitter.pdf <= 0.0f)
+			return 0;
+		const auto& point = emitter.point;
+		const auto emission = emitter.object->mat->emission(point.pos, point.normal, -point.normal, true, point.tex, seed);
+		light_path[0] = { point.pos, point.normal, emission / emitter.pdf, {}, emitter.object, emitter.pdf, 0.0f, false, true };
+		// Both sides emit, each with a cosine distribution
+		const auto side = frand(seed) < 0.5f ? point.normal : -point.normal;
+		const auto dir = default_math::normalize(side + random_unit_sphere_vector(seed));
+		const auto pdf = emission_pdf(point.normal, dir);
+		if (pdf <= 0.0f)
+			return 1;
+		glm::vec3 unused;
+		return walk(ray{ point.pos + dir * 0.005f, dir }, light_path[0].beta * std::abs(dot(point.normal, dir)) / pdf, pdf, light_path.data(), 1, light_path.size(), false, seed, unused);
+	}
+	// Extends path from its last vertex along r, which was sampled with density pdf per
+	// unit solid angle, until it leaves the scene, is absorbed or has max_count vertices.
+	// The camera path also gathers the light from the environment into escaped.
+	size_t walk(ray r, glm::vec3 beta, float pdf, vertex* path, size_t count, size_t max_count, bool from_camera, int& seed, glm::vec3& escaped) const noexcept
+	{
+		float env_bsdf_pdf = 0.0f;
+		while (count < max_count)
+		{
+			const auto hit = scene.closest_hit(r, 0, std::numeric_limits<float>::infinity(), nullptr);
+			if (!hit.object)
+			{
+				if (from_camera)
+				{
+					auto color = scene.backdrop(r.direction);
+					if (env_bsdf_pdf > 0.0f)
+						color *= world::power_heuristic(env_bsdf_pdf, scene.env->pdf(r.direction));
+					escaped += beta * color;
+				}
+				break;
+			}
+			const auto [position, normal, front_facing, tex] = hit.object->surface(r, hit);
+			auto& prev = path[count - 1];
+			auto& v = path[count];
+			v = { position, normal, beta, hit.object->mat->diffuse_reflectance(tex), hit.object, 0.0f, 0.0f, true, false };
+			v.pdf_fwd = to_area(pdf, prev, v);
+			if (hit.object->mat->emissive())
+			{
+				// Lights end paths; those from the light have no use for them
+				v.light = true;
+				v.delta = false;
+				count += from_camera;
+				break;
+			}
+			++count;
+			const auto shade_info = hit.object->mat->shade(position, normal, r.direction, front_facing, tex, seed);
+			if (!shade_info.scattered)
+				break;
+			// The densities of the next vertex are converted from where the path leaves, which
+			// portals move to their other side
+			v.position = shade_info.scattered->origin;
+			v.normal = hit.object->mat->exit_normal(normal);
+			const auto dir = default_math::normalize(shade_info.scattered->direction);
+			float next_pdf = 0.0f;
+			env_bsdf_pdf = 0.0f;
+			if (v.reflectance != glm::vec3{ 0, 0, 0 })
+			{
+				v.delta = false;
+				next_pdf = std::max(dot(normal, dir), 0.0f) / static_cast<float>(pi);
+				prev.pdf_rev = to_area(std::max(dot(normal, -r.direction), 0.0f) / static_cast<float>(pi), v, prev);
+				if (from_camera && scene.env && scene.env->emits())
+				{
+					escaped += beta * scene.sample_environment(position, normal, v.reflectance, seed, nullptr);
+					env_bsdf_pdf = next_pdf;
+				}
+			}
+			beta *= shade_info.attenuation;
+			const auto cone_width = r.cone_width + r.cone_spread * hit.t;
+			r = ray{ shade_info.scattered->origin + dir * 0.005f, dir, cone_width, r.cone_spread };
+			pdf = next_pdf;
+		}
+		return count;
+	}
+
+	// Contribution of the path made of the first s vertices of the light path and the first
+	// t > 1 of the camera path, weighted against the other ways of sampling it
+	[[nodiscard]] glm::vec3 connect(size_t s, size_t t, int& seed) noexcept
+	{
+		const auto& pt = camera_path[t - 1];
+		if (s == 0)
+		{
+			if (!pt.light)
+				return glm::vec3{ 0, 0, 0 };
+			const auto& prev = camera_path[t - 2];
+			const auto emission = pt.object->mat->emission(pt.position, pt.normal, pt.position - prev.position, true, {}, seed);
+			return pt.beta * emission * mis_weight(s, t);
+		}
+		const auto& qs = light_path[s - 1];
+		if (pt.delta || pt.light || qs.delta)
+			return glm::vec3{ 0, 0, 0 };
+		const auto f = connection(qs, pt);
+		if (f == glm::vec3{ 0, 0, 0 })
+			return glm::vec3{ 0, 0, 0 };
+		return qs.beta * f * pt.beta * mis_weight(s, t);
+	}
+	// Connects the first s vertices of the light path straight to the camera
+	void splat(size_t s, int& seed) noexcept
+	{
+		const auto& qs = light_path[s - 1];
+		if (qs.delta)
+			return;
+		const auto dir = qs.position - cam_position;
+		const auto uv = cam.project(dir);
+		if (!uv)
+			return;
+		const auto f = connection(qs, camera_path[0]);
+		if (f == glm::vec3{ 0, 0, 0 })
+			return;
+		splats.splat(*uv, qs.beta * f * mis_weight(s, 1));
+	}
+	// Scattering at a and b towards each other, times the geometry term and visibility
+	[[nodiscard]] glm::vec3 connection(const vertex& a, const vertex& b) const noexcept
+	{
+		const auto d = b.position - a.position;
+		const auto dist2 = dot(d, d);
+		const auto dir = d / std::sqrt(dist2);
+		const auto fa = scattering(a, dir);
+		const auto fb = scattering(b, -dir);
+		if (fa == glm::vec3{ 0, 0, 0 } || fb == glm::vec3{ 0, 0, 0 })
+			return glm::vec3{ 0, 0, 0 };
+		const auto dist = std::sqrt(dist2);
+		if (scene.occluded(ray{ a.position + dir * 0.005f, dir }, dist - 0.01f))
+			return glm::vec3{ 0, 0, 0 };
+		return fa * fb * cosine(a, dir) * cosine(b, -dir) / dist2;
+	}
+	// Of the vertex towards dir: importance for the camera, emission for lights, the BSDF otherwise
+	[[nodiscard]] glm::vec3 scattering(const vertex& v, const glm::vec3& dir) const noexcept
+	{
+		if (!v.object)
+		{
+			const auto cos_theta = cam.cos_to_axis(dir);
+			if (cos_theta <= 0.0f)
+				return glm::vec3{ 0, 0, 0 };
+			return glm::vec3{ 1.0f / (image_area * sqr(sqr(cos_theta))) };
+		}
+		if (v.light)
+			return glm::vec3{ 1, 1, 1 }; // emission is part of beta
+		if (dot(v.normal, dir) <= 0.0f)
+			return glm::vec3{ 0, 0, 0 };
+		return v.reflectance / static_cast<float>(pi);
+	}
+	[[nodiscard]] float cosine(const vertex& v, const glm::vec3& dir) const noexcept
+	{
+		return v.object ? std::abs(dot(v.normal, dir)) : cam.cos_to_axis(dir);
+	}
+	[[nodiscard]] static float emission_pdf(const glm::vec3& normal, const glm::vec3& dir) noexcept
+	{
+		return 0.5f * std::abs(dot(normal, dir)) / static_cast<float>(pi);
+	}
+	// Turns a density per unit solid angle at from into one per unit area at to
+	[[nodiscard]] static float to_area(float pdf, const vertex& from, const vertex& to) noexcept
+	{
+		const auto d = to.position - from.position;
+		const auto dist2 = dot(d, d);
+		if (to.object)
+			pdf *= std::abs(dot(to.normal, d)) / std::sqrt(dist2);
+		return pdf / dist2;
+	}
+	// Density per unit area of v sampling next. None of the vertices that can be connected
+	// to depend on where the path came from.
+	[[nodiscard]] float pdf(const vertex& v, const vertex& next) const noexcept
+	{
+		const auto dir = default_math::normalize(next.position - v.position);
+		float solid_angle;
+		if (!v.object)
+		{
+			const auto uv = cam.project(dir);
+			const auto cos_theta = cam.cos_to_axis(dir);
+			if (!uv || uv->x < -0.5f / static_cast<float>(splats.width() - 1) || uv->x > 1.0f + 0.5f / static_cast<float>(splats.width() - 1)
+				|| uv->y < -0.5f / static_cast<float>(splats.height() - 1) || uv->y > 1.0f + 0.5f / static_cast<float>(splats.height() - 1))
+				return 0.0f;
+			solid_angle = 1.0f / (image_area * cos_theta * cos_theta * cos_theta);
+		}
+		else if (v.light)
+			solid_angle = emission_pdf(v.normal, dir);
+		else
+			solid_angle = std::max(dot(v.normal, dir), 0.0f) / static_cast<float>(pi);
+		return to_area(solid_angle, v, next);
+	}
+	// Power heuristic weight of the strategy with s light and t camera vertices, among all
+	// that could have sampled the same path. The ratios of their densities are accumulated
+	// vertex by vertex, and vertices that can't be connected to don't count.
+	[[nodiscard]] float mis_weight(size_t s, size_t t) noexcept
+	{
+		if (s + t == 2)
+			return 1.0f;
+		auto& pt = camera_path[t - 1];
+		vertex* qs = s > 0 ? &light_path[s - 1] : nullptr;
+		vertex* pt_minus = t > 1 ? &camera_path[t - 2] : nullptr;
+		vertex* qs_minus = s > 1 ? &light_path[s - 2] : nullptr;
+
+		// The densities in the other direction, through the connection, replace the stored ones for now
+		struct saved { float* value; float old; };
+		std::array<saved, 4> restore{};
+		size_t restore_count = 0;
+		const auto assign = [&](float& value, float new_value)
+		{
+			restore[restore_count++] = { &value, value };
+			value = new_value;
+		};
+		if (s > 0)
+		{
+			assign(pt.pdf_rev, pdf(*qs, pt));
+			assign(qs->pdf_rev, pdf(pt, *qs));
+			if (qs_minus)
+				assign(qs_minus->pdf_rev, pdf(*qs, *qs_minus));
+			if (pt_minus)
+				assign(pt_minus->pdf_rev, pdf(pt, *pt_minus));
+		}
+		else
+		{
+			assign(pt.pdf_rev, scene.emitter_pdf(pt.object, pt.position));
+			if (pt_minus)
+				assign(pt_minus->pdf_rev, to_area(emission_pdf(pt.normal, default_math::normalize(pt_minus->position - pt.position)), pt, *pt_minus));
+		}
+
+		const auto remap = [](float pdf) { return pdf != 0.0f ? pdf : 1.0f; };
+		float sum = 0.0f;
+		float ratio = 1.0f;
+		for (size_t i = t - 1; i > 0; --i)
+		{
+			ratio *= remap(camera_path[i].pdf_rev) / remap(camera_path[i].pdf_fwd);
+			if (!camera_path[i].delta && !camera_path[i - 1].delta)
+				sum += ratio * ratio;
+		}
+		ratio = 1.0f;
+		for (size_t i = s; i-- > 0;)
+		{
+			ratio *= remap(light_path[i].pdf_rev) / remap(light_path[i].pdf_fwd);
+			if (!light_path[i].delta && (i == 0 || !light_path[i - 1].delta))
+				sum += ratio * ratio;
+		}
+
+		while (restore_count > 0)
+		{
+			--restore_count;
+			*restore[restore_count].value = restore[restore_count].old;
+		}
+		return 1.0f / (1.0f + sum);
+	}
+};
+#endif // BIDIRECTIONAL_H
@@ -0,0 +1,320 @@
+#ifndef BVH_H
+#define BVH_H
+#include <vector>
+#include <span>
+#include <array>
+#include <numeric>
+#include <algorithm>
+#include <cstdint>
+#include <glm/glm.hpp>
+#include "aabb.h"
+#include "ray.h"
+#include "ray_packet.h"
+#include "job_pool.h"
+
+// Bounding volume hierarchy over a set of primitive bounds, built with binned SAH.
+// When primitives move it is refitted in place, and rebuilt only once refitting
+// has made it noticeably worse than a fresh build.
+class bvh
+{
+	struct node
+	{
+		aabb bounds;
+		uint32_t first; // leaf: first index into indices, interior: left child (right is first + 1)
+		uint32_t count; // 0 for interior nodes
+	};
+
+	constexpr static int bin_count = 12;
+	constexpr static uint32_t max_leaf_size = 4;
+	constexpr static float traversal_cost = 1.0f;
+	constexpr static float intersection_cost = 2.0f;
+	// Rebuild once the refitted tree is estimated to be this much slower than a fresh one
+	constexpr static float rebuild_threshold = 1.3f;
+	// Past this depth splits fall back to the median, which bounds the traversal stack
+	constexpr static int max_sah_depth = 48;
+	// Subtrees at least this large are built in parallel with their siblings, given a pool
+	constexpr static uint32_t parallel_subtree_size = 4096;
+
+	std::vector<node> nodes;
+	std::vector<uint32_t> indices;
+	float build_cost = 0.0f;
+
+	// Splits tree[node_idx] and its children in turn. Children are appended to tree, so the
+	// nodes of a subtree are contiguous and come in the same order however it was built.
+	void subdivide(std::vector<node>& tree, uint32_t node_idx, std::span<const aabb> bounds, job_pool* pool, int depth)
+	{
+		auto& n = tree[node_idx];
+		aabb centroid_bounds;
+		for (auto i = n.first; i < n.first + n.count; ++i)
+			centroid_bounds.grow(bounds[indices[i]].centroid());
+
+		// Find the cheapest split among the bin boundaries of every axis
+		int best_axis = -1;
+		int best_split = 0;
+		float best_cost = intersection_cost * static_cast<float>(n.count);
+		for (int axis = 0; axis < 3 && depth < max_sah_depth; ++axis)
+		{
+			const auto extent = centroid_bounds.max[axis] - centroid_bounds.min[axis];
+			if (extent <= 0.0f)
+				continue;
+			std::array<aabb, bin_count> bins{};
+			std::array<uint32_t, bin_count> bin_sizes{};
+			for (auto i = n.first; i < n.first + n.count; ++i)
+			{
+				const auto& b = bounds[indices[i]];
+				const auto bin = std::min(bin_count - 1, static_cast<int>((b.centroid()[axis] - centroid_bounds.min[axis]) / extent * bin_count));
+				bins[bin].grow(b);
+				++bin_sizes[bin];
+			}
+			std::array<float, bin_count - 1> left_cost{};
+			aabb left;
+			uint32_t left_size = 0;
+			for (int split = 0; split < bin_count - 1; ++split)
+			{
+				left.grow(bins[split]);
+				left_size += bin_sizes[split];
+				left_cost[split] = left.surface_area() * static_cast<float>(left_size);
+			}
+			aabb right;
+			uint32_t right_size = 0;
+			for (int split = bin_count - 2; split >= 0; --split)
+			{
+				right.grow(bins[split + 1]);
+				right_size += bin_sizes[split + 1];
+				const auto cost = traversal_cost + intersection_cost *
+					(left_cost[split] + right.surface_area() * static_cast<float>(right_size)) / n.bounds.surface_area();
+				if (cost < best_cost)
+				{
+					best_cost = cost;
+					best_axis = axis;
+					best_split = split;
+				}
+			}
+		}
+		if (best_axis < 0 && n.count <= max_leaf_size)
+			return;
+
+		// No useful SAH split (e.g. identical centroids) but too many primitives for a leaf: split in the middle
+		auto middle = indices.begin() + n.first + n.count / 2;
+		if (best_axis >= 0)
+		{
+			const auto extent = centroid_bounds.max[best_axis] - centroid_bounds.min[best_axis];
+			middle = std::partition(indices.begin() + n.first, indices.begin() + n.first + n.count, [&](uint32_t idx)
+			{
+				const auto bin = std::min(bin_count - 1, static_cast<int>((bounds[idx].centroid()[best_axis] - centroid_bounds.min[best_axis]) / extent * bin_count));
+				return bin <= best_split;
+			});
+		}
+		const auto left_count = static_cast<uint32_t>(middle - indices.begin()) - n.first;
+		if (left_count == 0 || left_count == n.count)
+			return;
+
+		const auto left_idx = static_cast<uint32_t>(tree.size());
+		const auto first = n.first;
+		const auto count = n.count;
+		tree[node_idx].first = left_idx;
+		tree[node_idx].count = 0;
+		// n is invalidated from here on
+		tree.push_back({ {}, first, left_count });
+		tree.push_back({ {}, first + left_count, count - left_count });
+		for (const auto child : { left_idx, left_idx + 1 })
+		{
+			for (auto i = tree[child].first; i < tree[child].first + tree[child].count; ++i)
+				tree[child].bounds.grow(bounds[indices[i]]);
+		}
+		if (!pool || count < parallel_subtree_size)
+		{
+			subdivide(tree, left_idx, bounds, pool, depth + 1);
+			subdivide(tree, left_idx + 1, bounds, pool, depth + 1);
+			return;
+		}
+		// The children reorder disjoint ranges of indices, so they are built into trees of
+		// their own at the same time and then appended, as the serial build would have
+		std::array<std::vector<node>, 2> subtrees;
+		pool->parallel_for(0, 2, 1, [&](size_t child)
+		{
+			auto& subtree = subtrees[child];
+			subtree.reserve(2 * static_cast<size_t>(tree[left_idx + child].count));
+			subtree.push_back(tree[left_idx + child]);
+			subdivide(subtree, 0, bounds, pool, depth + 1);
+		});
+		for (uint32_t child = 0; child < 2; ++child)
+		{
+			const auto& subtree = subtrees[child];
+			// Node i > 0 of the subtree lands at base + i - 1
+			const auto base = static_cast<uint32_t>(tree.size());
+			const auto place = [&](node moved)
+			{
+				if (moved.count == 0)
+					moved.first += base - 1;
+				return moved;
+			};
+			tree[left_idx + child] = place(subtree.front());
+			for (size_t i = 1; i < subtree.size(); ++i)
+				tree.push_back(place(subtree[i]));
+		}
+	}
+public:
+	// Builds the tree over bounds, with the subtrees of large scenes built in parallel if
+	// a pool is given. The tree is the same either way.
+	void build(std::span<const aabb> bounds, job_pool* pool = nullptr)
+	{
+		nodes.clear();
+		indices.resize(bounds.size());
+		std::iota(indices.begin(), indices.end(), 0u);
+		if (bounds.empty())
+			return;
+		nodes.reserve(2 * bounds.size());
+		nodes.push_back({ {}, 0, static_cast<uint32_t>(bounds.size()) });
+		for (const auto& b : bounds)
+			nodes.front().bounds.grow(b);
+		subdivide(nodes, 0, bounds, pool, 0);
+		build_cost = cost();
+	}
+	// Updates the node bounds after primitives moved, keeping the topology.
+	// Returns true if the tree had degraded enough to be rebuilt instead.
+	bool refit(std::span<const aabb> bounds)
+	{
+		// Children are always stored after their parent
+		for (auto node_idx = nodes.size(); node_idx-- > 0;)
+		{
+			auto& n = nodes[node_idx];
+			n.bounds = {};
+			if (n.count > 0)
+			{
+				for (auto i = n.first; i < n.first + n.count; ++i)
+					n.bounds.grow(bounds[indices[i]]);
+			}
+			else
+			{
+				n.bounds.grow(nodes[n.first].bounds);
+				n.bounds.grow(nodes[n.first + 1].bounds);
+			}
+		}
+		if (cost() > build_cost * rebuild_threshold)
+		{
+			build(bounds);
+			return true;
+		}
+		return false;
+	}
+	// Expected cost of tracing a ray through the tree, relative to intersecting the root box
+	[[nodiscard]] float cost() const noexcept
+	{
+		if (nodes.empty())
+			return 0.0f;
+		const auto root_area = nodes.front().bounds.surface_area();
+		if (root_area <= 0.0f)
+			return 0.0f;
+		float total = 0.0f;
+		for (const auto& n : nodes)
+		{
+			const auto relative_area = n.bounds.surface_area() / root_area;
+			total += relative_area * (n.count > 0 ? intersection_cost * static_cast<float>(n.count) : traversal_cost);
+		}
+		return total;
+	}
+	// Calls visit(primitive_idx) for every primitive whose bounds r may hit before
+	// the ray parameter max_t. visit may lower max_t as it finds hits.
+	template <typename Func>
+	void traverse(const ray& r, const float& max_t, Func&& visit) const
+	{
+		if (nodes.empty())
+			return;
+		const auto inv_dir = 1.0f / r.direction;
+		// Strict, as missed boxes are at infinity, which max_t still is until something is hit
+		const auto closer = [&](float t) { return t < max_t; };
+
+		struct entry
+		{
+			uint32_t node;
+			float t;
+		};
+		std::array<entry, 128> stack;
+		size_t stack_size = 0;
+		stack[stack_size++] = { 0, nodes.front().bounds.intersect(r, inv_dir) };
+		while (stack_size > 0)
+		{
+			const auto [node_idx, t] = stack[--stack_size];
+			// max_t may have shrunk since the node was pushed
+			if (!closer(t))
+				continue;
+			const auto& n = nodes[node_idx];
+			if (n.count > 0)
+			{
+				for (auto i = n.first; i < n.first + n.count; ++i)
+					visit(indices[i]);
+				continue;
+			}
+			// Visit the nearer child first so that it can cull the farther one
+			entry first{ n.first, nodes[n.first].bounds.intersect(r, inv_dir) };
+			entry second{ n.first + 1, nodes[n.first + 1].bounds.intersect(r, inv_dir) };
+			if (second.t < first.t)
+				std::swap(first, second);
+			if (closer(second.t))
+				stack[stack_size++] = second;
+			if (closer(first.t))
+				stack[stack_size++] = first;
+		}
+	}
+	// Whether test(primitive_idx) returns true for any primitive whose bounds r hits before
+	// max_t. Stops at the first such primitive, so nodes are visited in no particular order.
+	template <typename Func>
+	[[nodiscard]] bool any(const ray& r, float max_t, Func&& test) const
+	{
+		if (nodes.empty())
+			return false;
+		const auto inv_dir = 1.0f / r.direction;
+		std::array<uint32_t, 128> stack;
+		size_t stack_size = 0;
+		stack[stack_size++] = 0;
+		while (stack_size > 0)
+		{
+			const auto& n = nodes[stack[--stack_size]];
+			if (!(n.bounds.intersect(r, inv_dir) < max_t))
+				continue;
+			if (n.count > 0)
+			{
+				for (auto i = n.first; i < n.first + n.count; ++i)
+				{
+					if (test(indices[i]))
+						return true;
+				}
+				continue;
+			}
+			stack[stack_size++] = n.first + 1;
+			stack[stack_size++] = n.first;
+		}
+		return false;
+	}
+	// Calls visit(primitive_idx) for every primitive whose bounds the packet's frustum
+	// overlaps closer than its far_t. visit may lower far_t as it finds hits.
+	template <typename Func>
+	void traverse(const ray_packet& p, Func&& visit) const
+	{
+		if (nodes.empty())
+			return;
+		std::array<uint32_t, 128> stack;
+		size_t stack_size = 0;
+		stack[stack_size++] = 0;
+		while (stack_size > 0)
+		{
+			const auto& n = nodes[stack[--stack_size]];
+			if (!p.may_hit(n.bounds))
+				continue;
+			if (n.count > 0)
+			{
+				for (auto i = n.first; i < n.first + n.count; ++i)
+					visit(indices[i]);
+				continue;
+			}
+			// Nearer child on top
+			auto first = n.first, second = n.first + 1;
+			if (p.distance(nodes[second].bounds) < p.distance(nodes[first].bounds))
+				std::swap(first, second);
+			stack[stack_size++] = second;
+			stack[stack_size++] = first;
+		}
+	}
+};
+#endif // BVH_H
@@ -1,8 +1,14 @@
 #ifndef CAMERA_H
 #define CAMERA_H
+#include <algorithm>
+#include <array>
+#include <limits>
+#include <optional>
 #include <glm/glm.hpp>
 #include "transform.h"
 #include "ray.h"
+#include "ray_packet.h"
+#include "simd.h"
 #include "utility.h"
 
 class camera
@@ -26,9 +32,81 @@ public:
 		vertical = viewport_height * trans.up();
 		lower_left_corner = -horizontal / 2.0f - vertical / 2.0f - trans.forward();
 	}
-	ray get_ray(float u, float v) const
+	// Angle covered by one pixel of an image height pixels tall
+	[[nodiscard]] float pixel_spread(size_t height) const noexcept
 	{
-		return ray{ trans.get_position(), normalize(lower_left_corner + u * horizontal + v * vertical) };
+		return length(vertical) / static_cast<float>(height);
+	}
+	ray get_ray(float u, float v, float pixel_spread = 0.0f) const
+	{
+		return ray{ trans.get_position(), glm::normalize(lower_left_corner + u * horizontal + v * vertical), 0.0f, pixel_spread };
+	}
+	// Image coordinates (u, v) of the ray that get_ray would return in direction dir,
+	// if dir points in front of the camera. Pixel x of an image w pixels wide is at u = x / (w - 1).
+	[[nodiscard]] std::optional<glm::vec2> project(const glm::vec3& dir) const noexcept
+	{
+		const auto center = lower_left_corner + 0.5f * horizontal + 0.5f * vertical;
+		const auto depth = dot(dir, center) / dot(center, center);
+		if (depth <= 0.0f)
+			return std::nullopt;
+		const auto on_plane = dir / depth - center;
+		return glm::vec2{ 0.5f + dot(on_plane, horizontal) / dot(horizontal, horizontal), 0.5f + dot(on_plane, vertical) / dot(vertical, vertical) };
+	}
+	// Cosine between dir and the viewing direction
+	[[nodiscard]] float cos_to_axis(const glm::vec3& dir) const noexcept
+	{
+		const auto center = lower_left_corner + 0.5f * horizontal + 0.5f * vertical;
+		return dot(dir, center) / (length(dir) * length(center));
+	}
+	// Area of the image plane at unit distance covered by the pixels of a width x height image
+	[[nodiscard]] float image_area(size_t width, size_t height) const noexcept
+	{
+		const auto pixel_width = length(horizontal) / static_cast<float>(width - 1);
+		const auto pixel_height = length(vertical) / static_cast<float>(height - 1);
+		return pixel_width * pixel_height * static_cast<float>(width * height);
+	}
+	// Starts the rays of the first count lanes of p at the image coordinates in u and v,
+	// four lanes at a time. u and v are padded up to p.padded_size().
+	void get_packet(std::array<float, ray_packet::max_size>& u, std::array<float, ray_packet::max_size>& v, size_t count, float pixel_spread, ray_packet& p) const noexcept
+	{
+		p.origin = trans.get_position();
+		p.cone_spread = pixel_spread;
+		p.size = count;
+		p.far_t = std::numeric_limits<float>::infinity();
+		std::fill_n(u.begin() + count, p.padded_size() - count, u[0]);
+		std::fill_n(v.begin() + count, p.padded_size() - count, v[0]);
+		for (size_t lane = 0; lane < p.padded_size(); lane += 4)
+		{
+			const auto lu = f32x4::load(u.data() + lane);
+			const auto lv = f32x4::load(v.data() + lane);
+			const auto x = f32x4::broadcast(lower_left_corner.x) + lu * f32x4::broadcast(horizontal.x) + lv * f32x4::broadcast(vertical.x);
+			const auto y = f32x4::broadcast(lower_left_corner.y) + lu * f32x4::broadcast(horizontal.y) + lv * f32x4::broadcast(vertical.y);
+			const auto z = f32x4::broadcast(lower_left_corner.z) + lu * f32x4::broadcast(horizontal.z) + lv * f32x4::broadcast(vertical.z);
+			const auto inv_length = f32x4::broadcast(1.0f) / sqrt(x * x + y * y + z * z);
+			(x * inv_length).store(p.dx.data() + lane);
+			(y * inv_length).store(p.dy.data() + lane);
+			(z * inv_length).store(p.dz.data() + lane);
+			f32x4::broadcast(std::numeric_limits<float>::infinity()).store(p.t.data() + lane);
+		}
+		std::fill_n(p.object.begin(), p.padded_size(), nullptr);
+
+		// The directions span the image plane between the extremes of u and v, widened
+		// a little so that rounding can't cull what the outermost rays hit
+		const auto [u_min, u_max] = std::minmax_element(u.begin(), u.begin() + count);
+		const auto [v_min, v_max] = std::minmax_element(v.begin(), v.begin() + count);
+		const auto margin = 1e-4f * (*u_max - *u_min + *v_max - *v_min) + 1e-6f;
+		const auto corner = [&](float cu, float cv) { return lower_left_corner + cu * horizontal + cv * vertical; };
+		const auto c00 = corner(*u_min - margin, *v_min - margin);
+		const auto c10 = corner(*u_max + margin, *v_min - margin);
+		const auto c01 = corner(*u_min - margin, *v_max + margin);
+		const auto c11 = corner(*u_max + margin, *v_max + margin);
+		const auto center = c00 + c10 + c01 + c11;
+		p.frustum = { cross(c00, c01), cross(c11, c10), cross(c10, c00), cross(c01, c11) };
+		for (auto& n : p.frustum)
+		{
+			if (dot(n, center) < 0.0f)
+				n = -n;
+		}
 	}
 };
 #endif // CAMERA_H
@@ -0,0 +1,94 @@
+#ifndef CAMERA_PATH_H
+#define CAMERA_PATH_H
+#include <vector>
+#include <string>
+#include <fstream>
+#include <sstream>
+#include <filesystem>
+#include <stdexcept>
+#include <algorithm>
+#include <glm/glm.hpp>
+#include "animation.h"
+#include "camera.h"
+#include "utility.h"
+
+// Keyframed camera transform and vertical field of view.
+// Text format, one keyframe per line, '#' starts a comment:
+//   time  x y z  pitch yaw roll  fov
+// with the position in world units and the angles in degrees.
+class camera_path
+{
+	struct fov_key
+	{
+		float time;
+		float fov;
+	};
+	transform_animation motion;
+	std::vector<fov_key> fov_keys;
+
+	camera_path(std::vector<transform_animation::keyframe> keys, std::vector<fov_key> fovs) :
+		motion{ std::move(keys), false },
+		fov_keys{ std::move(fovs) }
+	{
+		std::sort(fov_keys.begin(), fov_keys.end(), [](const fov_key& a, const fov_key& b) { return a.time < b.time; });
+	}
+public:
+	[[nodiscard]] static camera_path load(const std::filesystem::path& path)
+	{
+		std::ifstream file{ path };
+		if (!file)
+		{
+			throw std::runtime_error("Cannot open camera path " + path.string());
+		}
+		std::vector<transform_animation::keyframe> keys;
+		std::vector<fov_key> fovs;
+		std::string line;
+		for (size_t line_number = 1; std::getline(file, line); ++line_number)
+		{
+			line = line.substr(0, line.find('#'));
+			if (line.find_first_not_of(" \t\r") == std::string::npos)
+				continue;
+			std::istringstream in{ line };
+			float time, fov;
+			glm::vec3 position, euler;
+			if (!(in >> time >> position.x >> position.y >> position.z >> euler.x >> euler.y >> euler.z >> fov))
+			{
+				throw std::runtime_error(path.string() + ":" + std::to_string(line_number) + ": expected 'time x y z pitch yaw roll fov'");
+			}
+			keys.push_back({ time, transform{ position, glm::radians(euler), { 1, 1, 1 } } });
+			fovs.push_back({ time, fov });
+		}
+		if (keys.empty())
+		{
+			throw std::runtime_error("Camera path " + path.string() + " has no keyframes");
+		}
+		return { std::move(keys), std::move(fovs) };
+	}
+
+	[[nodiscard]] float start_time() const noexcept
+	{
+		return fov_keys.front().time;
+	}
+	[[nodiscard]] float duration() const noexcept
+	{
+		return motion.duration();
+	}
+	[[nodiscard]] float fov(float time) const noexcept
+	{
+		if (time <= fov_keys.front().time)
+			return fov_keys.front().fov;
+		if (time >= fov_keys.back().time)
+			return fov_keys.back().fov;
+		const auto next = std::upper_bound(fov_keys.begin(), fov_keys.end(), time, [](float t, const fov_key& key) { return t < key.time; });
+		const auto& prev = *(next - 1);
+		return glm::mix(prev.fov, next->fov, (time - prev.time) / (next->time - prev.time));
+	}
+	[[nodiscard]] camera camera_at(float time, float aspect_ratio) const
+	{
+		camera cam;
+		cam.trans = motion.evaluate(time);
+		cam.update(fov(time), aspect_ratio);
+		return cam;
+	}
+};
+#endif // CAMERA_PATH_H
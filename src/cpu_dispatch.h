@@ -0,0 +1,122 @@
+#ifndef CPU_DISPATCH_H
+#define CPU_DISPATCH_H
+#include <atomic>
+#include <stdexcept>
+#include <string>
+#include <utility>
+
+// Instruction sets the hot kernels are compiled for, besides the baseline the build targets.
+// isa_dispatch runs a kernel as compiled for the best of them that the CPU supports, or the
+// one chosen with select_isa.
+enum class isa_level
+{
+	baseline, // whatever the compiler flags allow
+	sse42,
+	avx2,
+	avx512    // F, VL, DQ and BW
+};
+
+// GCC and Clang can compile a function for other instruction sets than the rest of the
+// build, which the variants need. Elsewhere only the baseline exists.
+#if (defined(__GNUC__) || defined(__clang__)) && (defined(__x86_64__) || defined(__i386__))
+#define CPU_DISPATCH_VARIANTS
+#endif
+
+[[nodiscard]] inline const char* isa_name(isa_level level) noexcept
+{
+	switch (level)
+	{
+	case isa_level::sse42: return "sse4.2";
+	case isa_level::avx2: return "avx2";
+	case isa_level::avx512: return "avx512";
+	default: return "baseline";
+	}
+}
+
+[[nodiscard]] inline isa_level parse_isa_level(const std::string& name)
+{
+	if (name == "baseline") return isa_level::baseline;
+	if (name == "sse4.2") return isa_level::sse42;
+	if (name == "avx2") return isa_level::avx2;
+	if (name == "avx512") return isa_level::avx512;
+	throw std::runtime_error("Unknown instruction set '" + name + "', expected baseline, sse4.2, avx2 or avx512");
+}
+
+// Best variant this CPU and OS can run
+[[nodiscard]] inline isa_level detect_isa_level() noexcept
+{
+#ifdef CPU_DISPATCH_VARIANTS
+	// Also checks that the OS saves the wider registers
+	__builtin_cpu_init();
+	if (__builtin_cpu_supports("avx512f") && __builtin_cpu_supports("avx512vl") && __builtin_cpu_supports("avx512dq") && __builtin_cpu_supports("avx512bw"))
+		return isa_level::avx512;
+	if (__builtin_cpu_supports("avx2"))
+		return isa_level::avx2;
+	if (__builtin_cpu_supports("sse4.2") && __builtin_cpu_supports("popcnt"))
+		return isa_level::sse42;
+#endif
+	return isa_level::baseline;
+}
+
+namespace detail {
+	inline std::atomic<isa_level> active_isa{ detect_isa_level() };
+
+#ifdef CPU_DISPATCH_VARIANTS
+	// Everything the kernel calls inline is compiled for the variant too. Calls through
+	// function pointers and virtual functions go to the baseline code. A clone of the
+	// variant, e.g. with unused arguments removed, could lose the flattening in GCC.
+	// FMA is left out, so that every variant rounds alike and renders the same image.
+#ifdef __clang__
+#define CPU_DISPATCH_VARIANT(isa) [[gnu::target(isa), gnu::flatten]]
+#else
+#define CPU_DISPATCH_VARIANT(isa) [[gnu::target(isa), gnu::flatten, gnu::noclone]]
+#endif
+	template <auto Kernel, typename... Args>
+	CPU_DISPATCH_VARIANT("sse4.2,popcnt") decltype(auto) run_sse42(Args&&... args)
+	{
+		return Kernel(std::forward<Args>(args)...);
+	}
+	template <auto Kernel, typename... Args>
+	CPU_DISPATCH_VARIANT("avx2") decltype(auto) run_avx2(Args&&... args)
+	{
+		return Kernel(std::forward<Args>(args)...);
+	}
+	template <auto Kernel, typename... Args>
+	CPU_DISPATCH_VARIANT("avx512f,avx512vl,avx512dq,avx512bw") decltype(auto) run_avx512(Args&&... args)
+	{
+		return Kernel(std::forward<Args>(args)...);
+	}
+#endif
+}
+
+// Variant isa_dispatch runs
+[[nodiscard]] inline isa_level active_isa() noexcept
+{
+	return detail::active_isa.load(std::memory_order_relaxed);
+}
+
+// Makes isa_dispatch run the given variant, e.g. to compare them. Throws if the CPU can't run it.
+inline void select_isa(isa_level level)
+{
+	if (level > detect_isa_level())
+		throw std::runtime_error(std::string{ "This CPU or build can't run the " } + isa_name(level) + " kernels");
+	detail::active_isa.store(level, std::memory_order_relaxed);
+}
+
+// Calls Kernel, a function, as compiled for active_isa(). Member functions need a function
+// calling them, as flatten only follows direct calls.
+template <auto Kernel, typename... Args>
+decltype(auto) isa_dispatch(Args&&... args)
+{
+#ifdef CPU_DISPATCH_VARIANTS
+	switch (active_isa())
+	{
+	case isa_level::avx512: return detail::run_avx512<Kernel>(std::forward<Args>(args)...);
+	case isa_level::avx2: return detail::run_avx2<Kernel>(std::forward<Args>(args)...);
+	case isa_level::sse42: return detail::run_sse42<Kernel>(std::forward<Args>(args)...);
+	default: break;
+	}
+#endif
+	return Kernel(std::forward<Args>(args)...);
+}
+#endif // CPU_DISPATCH_H
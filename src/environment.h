@@ -0,0 +1,127 @@
+#ifndef ENVIRONMENT_H
+#define ENVIRONMENT_H
+#include <algorithm>
+#include <cmath>
+#include <filesystem>
+#include <memory>
+#include <stdexcept>
+#include <vector>
+#include <stb_image.h>
+#include <glm/glm.hpp>
+#include "alias_table.h"
+#include "utility.h"
+
+// Equirectangular HDR image of the light arriving from infinitely far away.
+// The top row of the image is straight up, which is -y in world space.
+// Directions are importance sampled in proportion to the luminance of the
+// texels times their solid angle, picking a row and then a column from alias tables.
+class environment_map
+{
+	size_t width = 0, height = 0;
+	std::vector<glm::vec3> texels;
+	alias_table rows;
+	std::vector<alias_table> columns; // within each row
+public:
+	struct sample
+	{
+		glm::vec3 direction;
+		glm::vec3 radiance;
+		float pdf; // per unit solid angle
+	};
+
+	environment_map(std::vector<glm::vec3> image, size_t width, size_t height, float intensity = 1.0f) :
+		width{ width },
+		height{ height },
+		texels{ std::move(image) }
+	{
+		if (width == 0 || height == 0 || texels.size() != width * height)
+		{
+			throw std::invalid_argument("Environment map size doesn't match its texels");
+		}
+		std::vector<float> row_weights(height);
+		std::vector<float> weights(width);
+		columns.reserve(height);
+		for (size_t y = 0; y < height; ++y)
+		{
+			// Rows near the poles cover less solid angle
+			const auto sin_theta = std::sin((static_cast<float>(y) + 0.5f) / static_cast<float>(height) * static_cast<float>(pi));
+			for (size_t x = 0; x < width; ++x)
+			{
+				auto& texel = texels[y * width + x];
+				texel *= intensity;
+				weights[x] = dot(texel, glm::vec3{ 0.2126f, 0.7152f, 0.0722f }) * sin_theta;
+			}
+			columns.emplace_back(weights);
+			row_weights[y] = static_cast<float>(columns.back().total_weight());
+		}
+		rows = alias_table{ row_weights };
+	}
+
+	[[nodiscard]] static std::shared_ptr<environment_map> load(const std::filesystem::path& path, float intensity = 1.0f)
+	{
+		int width, height, channels;
+		const std::unique_ptr<float, decltype(&stbi_image_free)> data{
+			stbi_loadf(path.string().c_str(), &width, &height, &channels, 3), &stbi_image_free };
+		if (!data)
+		{
+			throw std::runtime_error("Cannot load environment map " + path.string() + ": " + stbi_failure_reason());
+		}
+		std::vector<glm::vec3> image(static_cast<size_t>(width) * height);
+		for (size_t i = 0; i < image.size(); ++i)
+		{
+			image[i] = { data.get()[3 * i], data.get()[3 * i + 1], data.get()[3 * i + 2] };
+		}
+		return std::make_shared<environment_map>(std::move(image), width, height, intensity);
+	}
+
+	// Whether there is any light to sample
+	[[nodiscard]] bool emits() const noexcept
+	{
+		return !rows.empty();
+	}
+
+	[[nodiscard]] glm::vec3 radiance(const glm::vec3& dir) const noexcept
+	{
+		return texels[texel_index(dir)];
+	}
+	// Density with which sample() picks dir
+	[[nodiscard]] float pdf(const glm::vec3& dir) const noexcept
+	{
+		if (!emits())
+			return 0.0f;
+		const auto index = texel_index(dir);
+		const auto y = index / width;
+		return pdf_of(y, index % width);
+	}
+	// Needs emits()
+	[[nodiscard]] sample sample_direction(int& seed) const noexcept
+	{
+		const auto y = rows.sample(frand(seed));
+		const auto x = columns[y].sample(frand(seed));
+		const auto u = (static_cast<float>(x) + frand(seed)) / static_cast<float>(width);
+		const auto v = (static_cast<float>(y) + frand(seed)) / static_cast<float>(height);
+		const auto phi = (u - 0.5f) * 2.0f * static_cast<float>(pi);
+		const auto theta = v * static_cast<float>(pi);
+		const auto sin_theta = std::sin(theta);
+		const glm::vec3 direction{ sin_theta * std::cos(phi), -std::cos(theta), sin_theta * std::sin(phi) };
+		return { direction, texels[y * width + x], pdf_of(y, x) };
+	}
+private:
+	[[nodiscard]] size_t texel_index(const glm::vec3& dir) const noexcept
+	{
+		const auto u = 0.5f + std::atan2(dir.z, dir.x) / (2.0f * static_cast<float>(pi));
+		const auto v = std::acos(std::clamp(-dir.y, -1.0f, 1.0f)) / static_cast<float>(pi);
+		const auto x = std::min(static_cast<size_t>(std::max(u, 0.0f) * static_cast<float>(width)), width - 1);
+		const auto y = std::min(static_cast<size_t>(std::max(v, 0.0f) * static_cast<float>(height)), height - 1);
+		return y * width + x;
+	}
+	[[nodiscard]] float pdf_of(size_t y, size_t x) const noexcept
+	{
+		// The texel's probability spread over its solid angle, 2 pi^2 sin(theta) / (width * height),
+		// evaluated at the row center like the sampling weights
+		const auto sin_theta = std::sin((static_cast<float>(y) + 0.5f) / static_cast<float>(height) * static_cast<float>(pi));
+		const auto probability = rows.pmf_of(y) * columns[y].pmf_of(x);
+		return probability * static_cast<float>(width * height) / (2.0f * static_cast<float>(pi * pi) * sin_theta);
+	}
+};
+#endif // ENVIRONMENT_H
@@ -0,0 +1,211 @@
+#ifndef FRAME_STREAM_H
+#define FRAME_STREAM_H
+#include <algorithm>
+#include <atomic>
+#include <cstdint>
+#include <cstring>
+#include <limits>
+#include <stdexcept>
+#include <string>
+#if defined(__unix__) || defined(__APPLE__)
+#include <fcntl.h>
+#include <sys/mman.h>
+#include <sys/stat.h>
+#include <unistd.h>
+#define FRAME_STREAM_SUPPORTED
+#endif
+#include <glm/glm.hpp>
+#include "pixel.h"
+
+// Layout of the shared memory object, which is all a reader in another process needs.
+// A segment holds a ring of slot_count frames of one size. Frame n (counting from 1)
+// goes to slot n % slot_count, and each slot is:
+//   slot_header | dirty bitmap at dirty_offset | BGRA8 pixels at pixel_offset, row by row
+// A reader takes latest, checks that the slot's sequence equals it, reads the pixels in
+// place and checks the sequence again: if it changed, the writer reused the slot meanwhile.
+// Bit i of the bitmap is set if a pixel of tile (i % tiles_x, i / tiles_x) differs from
+// the previous frame; the first frame of a segment has all bits set. When a frame of another size comes, the writer sets retired and
+// replaces the object, so readers must reopen it by name.
+namespace frame_stream_layout {
+	constexpr uint32_t magic = 0x53465243; // "CRFS"
+	constexpr uint32_t version = 1;
+
+	struct header
+	{
+		uint32_t magic;
+		uint32_t version;
+		uint32_t slot_count;
+		uint32_t tile_size;
+		uint32_t width, height;
+		uint32_t tiles_x, tiles_y;
+		uint64_t slot_offset, slot_stride; // from the start of the segment
+		uint64_t dirty_offset, pixel_offset; // from the start of a slot
+		alignas(64) uint64_t latest; // atomic, 0 before the first frame
+		uint32_t retired; // atomic
+	};
+	struct alignas(64) slot_header
+	{
+		uint64_t sequence; // atomic, 0 while the slot is written
+		uint64_t samples; // accumulated per pixel
+	};
+
+	[[nodiscard]] constexpr uint64_t align(uint64_t size) noexcept
+	{
+		return (size + 63) & ~uint64_t{ 63 };
+	}
+}
+
+// Publishes frames to a POSIX shared memory object, for viewers, compositors or encoders
+// running in other processes. The renderer writes the pixels straight into the slot,
+// and nothing ever waits for a reader.
+class shared_frame_stream
+{
+	using header = frame_stream_layout::header;
+	using slot_header = frame_stream_layout::slot_header;
+
+	std::string name;
+	void* memory = nullptr;
+	size_t memory_size = 0;
+	uint64_t sequence = 0;
+	slot_header* current = nullptr;
+public:
+	constexpr static uint32_t tile_size = 32;
+	constexpr static uint32_t slot_count = 3;
+
+	// name is that of the shared memory object, e.g. "/cpuraytracer"
+	explicit shared_frame_stream(std::string name) :
+		name{ name.starts_with('/') ? std::move(name) : "/" + name }
+	{
+		static_assert(std::atomic_ref<uint64_t>::is_always_lock_free, "Readers in other processes need lock free atomics");
+#ifndef FRAME_STREAM_SUPPORTED
+		throw std::runtime_error("Shared memory frame streams aren't supported on this platform");
+#endif
+	}
+	shared_frame_stream(const shared_frame_stream&) = delete;
+	shared_frame_stream& operator=(const shared_frame_stream&) = delete;
+	~shared_frame_stream()
+	{
+		release();
+	}
+
+	// Starts writing the next frame, replacing the segment if the size changed
+	void begin_frame(size_t width, size_t height)
+	{
+		if (!memory || segment().width != width || segment().height != height)
+		{
+			release();
+			create(static_cast<uint32_t>(width), static_cast<uint32_t>(height));
+		}
+		++sequence;
+		const auto& h = segment();
+		current = reinterpret_cast<slot_header*>(static_cast<char*>(memory) + h.slot_offset + sequence % h.slot_count * h.slot_stride);
+		std::atomic_ref{ current->sequence }.store(0, std::memory_order_relaxed);
+		std::atomic_thread_fence(std::memory_order_release);
+		std::memset(dirty(), 0, (h.tiles_x * h.tiles_y + 63) / 64 * sizeof(uint64_t));
+	}
+	// Of the frame being written
+	[[nodiscard]] pixel* pixels() const noexcept
+	{
+		return reinterpret_cast<pixel*>(reinterpret_cast<char*>(current) + segment().pixel_offset);
+	}
+	// Marks the tile holding the width x height pixels at (x, y) as changed if any of them
+	// differ from the previous frame. They must lie within one tile, as the 8x8 blocks of
+	// the renderer do. Safe to call from several threads.
+	void mark_if_changed(uint32_t x, uint32_t y, uint32_t width, uint32_t height) noexcept
+	{
+		const auto& h = segment();
+		const auto* previous = previous_pixels();
+		bool changed = !previous;
+		for (auto row = y; row < y + height && !changed; ++row)
+		{
+			const auto offset = static_cast<size_t>(row) * h.width + x;
+			changed = std::memcmp(pixels() + offset, previous + offset, width * sizeof(pixel)) != 0;
+		}
+		if (!changed)
+			return;
+		const auto bit = y / tile_size * h.tiles_x + x / tile_size;
+		std::atomic_ref{ dirty()[bit / 64] }.fetch_or(uint64_t{ 1 } << (bit % 64), std::memory_order_relaxed);
+	}
+	// Makes the frame visible to readers. Every write to it must happen before.
+	void publish(uint64_t samples) noexcept
+	{
+		current->samples = samples;
+		std::atomic_ref{ current->sequence }.store(sequence, std::memory_order_release);
+		std::atomic_ref{ segment().latest }.store(sequence, std::memory_order_release);
+	}
+private:
+	[[nodiscard]] header& segment() const noexcept
+	{
+		return *static_cast<header*>(memory);
+	}
+	// Of the frame published before the current one, or nullptr if the segment has none
+	[[nodiscard]] const pixel* previous_pixels() const noexcept
+	{
+		const auto& h = segment();
+		if (sequence < 2)
+			return nullptr;
+		const auto* slot = static_cast<const char*>(memory) + h.slot_offset + (sequence - 1) % h.slot_count * h.slot_stride;
+		return reinterpret_cast<const pixel*>(slot + h.pixel_offset);
+	}
+	[[nodiscard]] uint64_t* dirty() const noexcept
+	{
+		return reinterpret_cast<uint64_t*>(reinterpret_cast<char*>(current) + segment().dirty_offset);
+	}
+	void create(uint32_t width, uint32_t height)
+	{
+#ifdef FRAME_STREAM_SUPPORTED
+		using frame_stream_layout::align;
+		header h{};
+		h.magic = frame_stream_layout::magic;
+		h.version = frame_stream_layout::version;
+		h.slot_count = slot_count;
+		h.tile_size = tile_size;
+		h.width = width;
+		h.height = height;
+		h.tiles_x = (width + tile_size - 1) / tile_size;
+		h.tiles_y = (height + tile_size - 1) / tile_size;
+		h.dirty_offset = align(sizeof(slot_header));
+		// Pixels start on a page, so readers can hand them to APIs wanting that
+		h.pixel_offset = (h.dirty_offset + align((h.tiles_x * h.tiles_y + 63) / 64 * sizeof(uint64_t)) + 4095) & ~uint64_t{ 4095 };
+		h.slot_offset = 4096;
+		h.slot_stride = (h.pixel_offset + uint64_t{ width } * height * sizeof(pixel) + 4095) & ~uint64_t{ 4095 };
+
+		const auto size = h.slot_offset + h.slot_stride * slot_count;
+		const auto fd = ::shm_open(name.c_str(), O_CREAT | O_RDWR, 0644);
+		if (fd < 0)
+		{
+			throw std::runtime_error("Cannot create the shared memory object " + name + ": " + std::strerror(errno));
+		}
+		const auto mapped = ::ftruncate(fd, static_cast<off_t>(size)) == 0
+			? ::mmap(nullptr, size, PROT_READ | PROT_WRITE, MAP_SHARED, fd, 0)
+			: MAP_FAILED;
+		::close(fd);
+		if (mapped == MAP_FAILED)
+		{
+			::shm_unlink(name.c_str());
+			throw std::runtime_error("Cannot map the shared memory object " + name + ": " + std::strerror(errno));
+		}
+		memory = mapped;
+		memory_size = size;
+		segment() = h;
+		sequence = 0;
+#else
+		(void)width;
+		(void)height;
+#endif
+	}
+	void release() noexcept
+	{
+#ifdef FRAME_STREAM_SUPPORTED
+		if (!memory)
+			return;
+		std::atomic_ref{ segment().retired }.store(1, std::memory_order_release);
+		::munmap(memory, memory_size);
+		// Readers keep their mapping of the old object until they reopen the name
+		::shm_unlink(name.c_str());
+		memory = nullptr;
+		current = nullptr;
+#endif
+	}
+};
+#endif // FRAME_STREAM_H
@@ -2,23 +2,48 @@
 #define FRAMEBUFFER_H
 
 #include <memory>
+#include <algorithm>
 #include <glm/glm.hpp>
 #include "array_wrapper.h"
+#include "pixel.h"
 
-class framebuffer
+template <typename T>
+class basic_framebuffer
 {
-	std::unique_ptr<glm::vec4[]> m_buffer{};
+	std::unique_ptr<T[]> m_buffer{};
 	size_t m_width{}, m_height{};
 public:
+	basic_framebuffer() = default;
+	basic_framebuffer(const basic_framebuffer& other) :
+		m_buffer{ std::make_unique_for_overwrite<T[]>(other.m_width * other.m_height) },
+		m_width{ other.m_width },
+		m_height{ other.m_height }
+	{
+		std::copy_n(other.m_buffer.get(), m_width * m_height, m_buffer.get());
+	}
+	basic_framebuffer(basic_framebuffer&&) noexcept = default;
+	basic_framebuffer& operator=(const basic_framebuffer& other)
+	{
+		return *this = basic_framebuffer{ other };
+	}
+	basic_framebuffer& operator=(basic_framebuffer&&) noexcept = default;
+
 	void update_size(size_t new_width, size_t new_height)
 	{
 		m_width = new_width;
 		m_height = new_height;
-		m_buffer = std::make_unique<glm::vec4[]>(m_width * m_height);
+		m_buffer = std::make_unique<T[]>(m_width * m_height);
+	}
+	// Leaves the memory untouched, so its pages are placed on the NUMA node of the thread that writes them first
+	void update_size_for_overwrite(size_t new_width, size_t new_height)
+	{
+		m_width = new_width;
+		m_height = new_height;
+		m_buffer = std::make_unique_for_overwrite<T[]>(m_width * m_height);
 	}
 	[[nodiscard]] auto buffer() const
 	{
-		return array_wrapper<glm::vec4, 2>{m_buffer.get(), m_height, m_width};
+		return array_wrapper<T, 2>{m_buffer.get(), m_height, m_width};
 	}
 	[[nodiscard]] size_t width() const
 	{
@@ -29,4 +54,7 @@ public:
 		return m_height;
 	}
 };
+
+using framebuffer = basic_framebuffer<glm::vec4>;
+using pixel_buffer = basic_framebuffer<pixel>;
 #endif // FRAMEBUFFER_H
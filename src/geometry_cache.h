@@ -0,0 +1,444 @@
+#ifndef GEOMETRY_CACHE_H
+#define GEOMETRY_CACHE_H
+#include <algorithm>
+#include <array>
+#include <atomic>
+#include <cerrno>
+#include <cstdint>
+#include <cstring>
+#include <filesystem>
+#include <fstream>
+#include <functional>
+#include <memory>
+#include <mutex>
+#include <span>
+#include <sstream>
+#include <stdexcept>
+#include <string>
+#include <unordered_map>
+#include <utility>
+#include <vector>
+#if defined(__unix__) || defined(__APPLE__)
+#include <fcntl.h>
+#include <sys/mman.h>
+#include <sys/stat.h>
+#include <unistd.h>
+#define GEOMETRY_CACHE_SUPPORTED
+#endif
+#include <glm/glm.hpp>
+#include "aabb.h"
+
+class geometry_cache;
+
+namespace detail {
+	// On disk, a mesh is stored as a header, the top of its bounding volume hierarchy and a
+	// table of clusters, followed by the clusters, each starting on a page of its own. A
+	// cluster holds the triangles below one leaf of the top tree together with a hierarchy
+	// of their own, so that tracing a ray through it touches nothing else. Clusters follow
+	// each other in the order of the tree, so that nearby clusters are nearby on disk.
+	struct clustered_mesh_header
+	{
+		std::array<char, 4> magic;
+		uint32_t node_count; // of the top tree
+		uint32_t cluster_count;
+		uint32_t triangle_count;
+	};
+	inline constexpr std::array<char, 4> clustered_mesh_magic{ 'R', 'G', 'C', '1' };
+	inline constexpr uint64_t cluster_alignment = 4096;
+	inline constexpr uint32_t max_cluster_triangles = 1 << 10;
+
+	// Laid out as in bvh
+	struct mesh_node
+	{
+		aabb bounds;
+		uint32_t first; // leaf: first triangle, or the cluster in the top tree, interior: left child (right is first + 1)
+		uint32_t count; // 0 for interior nodes
+	};
+	struct mesh_triangle
+	{
+		glm::vec3 v0, v1, v2;
+	};
+	struct mesh_cluster_info
+	{
+		uint64_t offset; // in bytes from the start of the file
+		uint32_t node_count; // the triangles follow the nodes
+		uint32_t triangle_count;
+	};
+
+	[[nodiscard]] inline uint64_t cluster_size(const mesh_cluster_info& info) noexcept
+	{
+		return info.node_count * sizeof(mesh_node) + info.triangle_count * sizeof(mesh_triangle);
+	}
+
+	// Vertices and faces of a Wavefront OBJ file, with polygons split into fans of triangles
+	[[nodiscard]] inline std::vector<mesh_triangle> load_obj(const std::filesystem::path& source)
+	{
+		std::ifstream in{ source };
+		if (!in)
+			throw std::runtime_error("Cannot open mesh " + source.string());
+		std::vector<glm::vec3> vertices;
+		std::vector<mesh_triangle> triangles;
+		std::vector<uint32_t> face;
+		std::string line;
+		for (size_t line_number = 1; std::getline(in, line); ++line_number)
+		{
+			std::istringstream words{ line };
+			std::string keyword;
+			words >> keyword;
+			const auto fail = [&](const std::string& what)
+			{
+				throw std::runtime_error(source.string() + ":" + std::to_string(line_number) + ": " + what);
+			};
+			if (keyword == "v")
+			{
+				glm::vec3 v;
+				if (!(words >> v.x >> v.y >> v.z))
+					fail("expected three coordinates");
+				vertices.push_back(v);
+			}
+			else if (keyword == "f")
+			{
+				face.clear();
+				// Only the position of v, v/vt, v//vn and v/vt/vn is used
+				for (std::string vertex; words >> vertex;)
+				{
+					long idx = 0;
+					try
+					{
+						idx = std::stol(vertex.substr(0, vertex.find('/')));
+					}
+					catch (const std::logic_error&)
+					{
+						fail("invalid vertex '" + vertex + "'");
+					}
+					// Negative indices count back from the last vertex
+					const auto resolved = idx < 0 ? static_cast<long>(vertices.size()) + idx : idx - 1;
+					if (resolved < 0 || resolved >= static_cast<long>(vertices.size()))
+						fail("vertex " + vertex + " doesn't exist");
+					face.push_back(static_cast<uint32_t>(resolved));
+				}
+				if (face.size() < 3)
+					fail("a face needs at least three vertices");
+				for (size_t i = 2; i < face.size(); ++i)
+					triangles.push_back({ vertices[face[0]], vertices[face[i - 1]], vertices[face[i]] });
+			}
+		}
+		if (triangles.empty())
+			throw std::runtime_error("Mesh " + source.string() + " has no faces");
+		return triangles;
+	}
+
+	// Hierarchy over triangles, which are reordered so that every leaf holds a range of them.
+	// Median splits along the widest axis keep it balanced, so that it's shallow enough for
+	// a fixed traversal stack whatever the mesh.
+	inline void build_mesh_tree(std::span<mesh_triangle> triangles, uint32_t leaf_size, std::vector<mesh_node>& nodes)
+	{
+		const auto centroid = [](const mesh_triangle& tri) { return (tri.v0 + tri.v1 + tri.v2) / 3.0f; };
+		const auto subdivide = [&](const auto& self, uint32_t node_idx) -> void
+		{
+			const auto first = nodes[node_idx].first;
+			const auto count = nodes[node_idx].count;
+			for (auto i = first; i < first + count; ++i)
+			{
+				nodes[node_idx].bounds.grow(triangles[i].v0);
+				nodes[node_idx].bounds.grow(triangles[i].v1);
+				nodes[node_idx].bounds.grow(triangles[i].v2);
+			}
+			if (count <= leaf_size)
+				return;
+			aabb centroid_bounds;
+			for (auto i = first; i < first + count; ++i)
+				centroid_bounds.grow(centroid(triangles[i]));
+			const auto extent = centroid_bounds.max - centroid_bounds.min;
+			const auto axis = extent.x >= extent.y && extent.x >= extent.z ? 0 : extent.y >= extent.z ? 1 : 2;
+			const auto left_count = count / 2;
+			std::nth_element(triangles.begin() + first, triangles.begin() + first + left_count, triangles.begin() + first + count,
+				[&](const mesh_triangle& a, const mesh_triangle& b) { return centroid(a)[axis] < centroid(b)[axis]; });
+			const auto left_idx = static_cast<uint32_t>(nodes.size());
+			nodes[node_idx].first = left_idx;
+			nodes[node_idx].count = 0;
+			nodes.push_back({ {}, first, left_count });
+			nodes.push_back({ {}, first + left_count, count - left_count });
+			self(self, left_idx);
+			self(self, left_idx + 1);
+		};
+		nodes.push_back({ {}, 0, static_cast<uint32_t>(triangles.size()) });
+		subdivide(subdivide, static_cast<uint32_t>(nodes.size() - 1));
+	}
+
+	// Converts an OBJ mesh into the clustered format, with at most cluster_triangles triangles
+	// per cluster. This is the only time all of its triangles are in memory.
+	inline void write_clustered_mesh(const std::filesystem::path& source, const std::filesystem::path& destination, uint32_t cluster_triangles)
+	{
+		auto triangles = load_obj(source);
+		std::vector<mesh_node> top;
+		build_mesh_tree(triangles, cluster_triangles, top);
+		// Leaves are numbered in the order of their triangles, which is the order of the tree
+		std::vector<uint32_t> leaves;
+		for (uint32_t idx = 0; idx < top.size(); ++idx)
+		{
+			if (top[idx].count > 0)
+				leaves.push_back(idx);
+		}
+		std::sort(leaves.begin(), leaves.end(), [&](uint32_t a, uint32_t b) { return top[a].first < top[b].first; });
+
+		const clustered_mesh_header header{ clustered_mesh_magic, static_cast<uint32_t>(top.size()), static_cast<uint32_t>(leaves.size()), static_cast<uint32_t>(triangles.size()) };
+		const auto align = [](uint64_t offset) { return (offset + cluster_alignment - 1) / cluster_alignment * cluster_alignment; };
+		std::vector<mesh_cluster_info> clusters(leaves.size());
+		std::vector<std::vector<mesh_node>> cluster_nodes(leaves.size());
+		auto offset = align(sizeof(header) + top.size() * sizeof(mesh_node) + clusters.size() * sizeof(mesh_cluster_info));
+		for (uint32_t cluster = 0; cluster < leaves.size(); ++cluster)
+		{
+			auto& leaf = top[leaves[cluster]];
+			build_mesh_tree(std::span{ triangles }.subspan(leaf.first, leaf.count), 4, cluster_nodes[cluster]);
+			clusters[cluster] = { offset, static_cast<uint32_t>(cluster_nodes[cluster].size()), leaf.count };
+			offset = align(offset + cluster_size(clusters[cluster]));
+			leaf.first = cluster;
+		}
+
+		std::filesystem::create_directories(destination.parent_path());
+		const auto temporary = std::filesystem::path{ destination }.concat(".tmp");
+		{
+			std::ofstream out{ temporary, std::ios::binary };
+			out.write(reinterpret_cast<const char*>(&header), sizeof(header));
+			out.write(reinterpret_cast<const char*>(top.data()), static_cast<std::streamsize>(top.size() * sizeof(mesh_node)));
+			out.write(reinterpret_cast<const char*>(clusters.data()), static_cast<std::streamsize>(clusters.size() * sizeof(mesh_cluster_info)));
+			const std::vector<char> padding(cluster_alignment, 0);
+			uint32_t first = 0;
+			for (uint32_t cluster = 0; cluster < clusters.size(); ++cluster)
+			{
+				out.write(padding.data(), static_cast<std::streamsize>(clusters[cluster].offset - static_cast<uint64_t>(out.tellp())));
+				out.write(reinterpret_cast<const char*>(cluster_nodes[cluster].data()), static_cast<std::streamsize>(cluster_nodes[cluster].size() * sizeof(mesh_node)));
+				out.write(reinterpret_cast<const char*>(triangles.data() + first), static_cast<std::streamsize>(clusters[cluster].triangle_count * sizeof(mesh_triangle)));
+				first += clusters[cluster].triangle_count;
+			}
+			if (!out)
+				throw std::runtime_error("Cannot write clustered mesh " + temporary.string());
+		}
+		// Other processes never see a partially written mesh
+		std::filesystem::rename(temporary, destination);
+	}
+}
+
+// A mesh opened through a geometry_cache, which owns it. The clusters are mapped into memory
+// and read through cluster(), which pages them in.
+class mesh_file
+{
+	friend class geometry_cache;
+public:
+	struct cluster_view
+	{
+		const detail::mesh_node* nodes;
+		const detail::mesh_triangle* triangles;
+	};
+private:
+	enum : uint8_t { paged_out, resident, referenced };
+
+	std::vector<detail::mesh_node> m_nodes;
+	std::vector<detail::mesh_cluster_info> m_clusters;
+	std::unique_ptr<std::atomic<uint8_t>[]> states;
+	const char* data = nullptr;
+	size_t size = 0;
+
+	explicit mesh_file(const std::filesystem::path& path)
+	{
+#ifndef GEOMETRY_CACHE_SUPPORTED
+		throw std::runtime_error("Memory mapped meshes aren't supported on this platform");
+#else
+		const auto fd = ::open(path.c_str(), O_RDONLY);
+		if (fd < 0)
+			throw std::runtime_error("Cannot open clustered mesh " + path.string() + ": " + std::strerror(errno));
+		struct stat info{};
+		detail::clustered_mesh_header header{};
+		const auto header_read = ::fstat(fd, &info) == 0 && ::pread(fd, &header, sizeof(header), 0) == static_cast<ssize_t>(sizeof(header));
+		if (!header_read || header.magic != detail::clustered_mesh_magic || header.node_count == 0 || header.cluster_count == 0)
+		{
+			::close(fd);
+			throw std::runtime_error("Invalid clustered mesh " + path.string());
+		}
+		size = static_cast<size_t>(info.st_size);
+		void* mapped = ::mmap(nullptr, size, PROT_READ, MAP_PRIVATE, fd, 0);
+		::close(fd);
+		if (mapped == MAP_FAILED)
+			throw std::runtime_error("Cannot map clustered mesh " + path.string() + ": " + std::strerror(errno));
+		data = static_cast<const char*>(mapped);
+		// Clusters are paged in whole when they're first needed, read ahead would only bring in others
+		::madvise(mapped, size, MADV_RANDOM);
+
+		const auto tables = sizeof(header) + header.node_count * sizeof(detail::mesh_node) + header.cluster_count * sizeof(detail::mesh_cluster_info);
+		if (tables > size)
+		{
+			::munmap(mapped, size);
+			throw std::runtime_error("Invalid clustered mesh " + path.string());
+		}
+		const auto* nodes = reinterpret_cast<const detail::mesh_node*>(data + sizeof(header));
+		m_nodes.assign(nodes, nodes + header.node_count);
+		const auto* clusters = reinterpret_cast<const detail::mesh_cluster_info*>(nodes + header.node_count);
+		m_clusters.assign(clusters, clusters + header.cluster_count);
+		for (const auto& c : m_clusters)
+		{
+			if (c.offset % detail::cluster_alignment != 0 || c.offset + detail::cluster_size(c) > size)
+			{
+				::munmap(mapped, size);
+				throw std::runtime_error("Invalid clustered mesh " + path.string());
+			}
+		}
+		states = std::make_unique<std::atomic<uint8_t>[]>(m_clusters.size());
+#endif
+	}
+	[[nodiscard]] cluster_view view(uint32_t cluster) const noexcept
+	{
+		const auto& info = m_clusters[cluster];
+		const auto* nodes = reinterpret_cast<const detail::mesh_node*>(data + info.offset);
+		return { nodes, reinterpret_cast<const detail::mesh_triangle*>(nodes + info.node_count) };
+	}
+	void advise(uint32_t cluster, [[maybe_unused]] bool needed) const noexcept
+	{
+#ifdef GEOMETRY_CACHE_SUPPORTED
+		const auto& info = m_clusters[cluster];
+		// Clusters start on pages of their own, so no other cluster is touched
+		::madvise(const_cast<char*>(data) + info.offset, detail::cluster_size(info), needed ? MADV_WILLNEED : MADV_DONTNEED);
+#endif
+	}
+public:
+	mesh_file(const mesh_file&) = delete;
+	mesh_file& operator=(const mesh_file&) = delete;
+	~mesh_file()
+	{
+#ifdef GEOMETRY_CACHE_SUPPORTED
+		if (data)
+			::munmap(const_cast<char*>(data), size);
+#endif
+	}
+
+	// Top of the hierarchy, whose leaves hold the index of a cluster in first. Always in memory.
+	[[nodiscard]] const std::vector<detail::mesh_node>& nodes() const noexcept
+	{
+		return m_nodes;
+	}
+	[[nodiscard]] const std::vector<detail::mesh_cluster_info>& clusters() const noexcept
+	{
+		return m_clusters;
+	}
+};
+
+// Keeps the clusters of all meshes that rays went through recently in memory, up to a budget
+// in bytes. Beyond it, the least recently used ones, as approximated by a CLOCK sweep, are
+// handed back to the OS, which reads them from disk again when they're needed. A render with
+// more geometry than fits becomes slower rather than running out of memory.
+// The budget is approximate: a thread still tracing through a cluster that's being evicted
+// pages in what it reads again without counting it.
+class geometry_cache
+{
+	size_t budget;
+	uint32_t cluster_triangles;
+	std::filesystem::path directory;
+	std::mutex files_mutex;
+	std::vector<std::unique_ptr<mesh_file>> files;
+	// Clustered copy to the file mapped from it, so that reopening a mesh doesn't map it again
+	std::unordered_map<std::string, const mesh_file*> opened;
+	// Resident clusters, which the CLOCK hand sweeps over. A cluster is in it at most once,
+	// so it's reserved for all clusters of the open files and paging in never allocates.
+	std::mutex resident_mutex;
+	std::vector<std::pair<const mesh_file*, uint32_t>> ring;
+	size_t cluster_count = 0;
+	size_t hand = 0;
+	std::atomic<size_t> m_resident_bytes{ 0 };
+	std::atomic<size_t> m_faults{ 0 };
+	std::atomic<size_t> m_evictions{ 0 };
+
+	void page_in(const mesh_file& file, uint32_t cluster) noexcept
+	{
+		std::lock_guard lk{ resident_mutex };
+		if (file.states[cluster].exchange(mesh_file::referenced) != mesh_file::paged_out)
+			return;
+		++m_faults;
+		file.advise(cluster, true);
+		m_resident_bytes += detail::cluster_size(file.clusters()[cluster]);
+		ring.emplace_back(&file, cluster);
+		// Referenced clusters lose their reference and get a second chance. The one just
+		// paged in is kept, as it's about to be read.
+		while (m_resident_bytes > budget && ring.size() > 1)
+		{
+			hand %= ring.size();
+			const auto [victim_file, victim] = ring[hand];
+			auto& state = victim_file->states[victim];
+			uint8_t expected = mesh_file::resident;
+			if ((victim_file == &file && victim == cluster) || !state.compare_exchange_strong(expected, mesh_file::paged_out))
+			{
+				if (victim_file != &file || victim != cluster)
+					state.store(mesh_file::resident, std::memory_order_relaxed);
+				++hand;
+				continue;
+			}
+			victim_file->advise(victim, false);
+			m_resident_bytes -= detail::cluster_size(victim_file->clusters()[victim]);
+			++m_evictions;
+			ring[hand] = ring.back();
+			ring.pop_back();
+		}
+	}
+public:
+	constexpr static size_t default_budget = size_t{ 1024 } << 20;
+
+	// Clustered copies of the source meshes are kept in directory, so that they're only converted once
+	explicit geometry_cache(size_t budget_bytes = default_budget, uint32_t cluster_triangles = 512,
+		std::filesystem::path directory = std::filesystem::temp_directory_path() / "cpuraytracer-geometry") :
+		budget{ budget_bytes },
+		cluster_triangles{ std::clamp<uint32_t>(cluster_triangles, 4, detail::max_cluster_triangles) },
+		directory{ std::move(directory) }
+	{
+	}
+
+	// Converts the mesh if there's no up to date clustered copy yet, and returns the file mapped
+	// before if there's one. Meshes have to be opened before rendering starts.
+	[[nodiscard]] const mesh_file& open(const std::filesystem::path& mesh)
+	{
+		const auto source = std::filesystem::absolute(mesh);
+		const auto stamp = std::to_string(std::filesystem::file_size(source)) + "_" +
+			std::to_string(std::filesystem::last_write_time(source).time_since_epoch().count()) + "_" + std::to_string(cluster_triangles);
+		const auto clustered = directory / (std::to_string(std::hash<std::string>{}(source.string())) + "_" + stamp + ".rgc");
+		std::lock_guard lk{ files_mutex };
+		if (const auto it = opened.find(clustered.string()); it != opened.end())
+			return *it->second;
+		if (!std::filesystem::exists(clustered))
+			detail::write_clustered_mesh(source, clustered, cluster_triangles);
+		std::unique_ptr<mesh_file> file{ new mesh_file{ clustered } };
+		{
+			std::lock_guard resident_lk{ resident_mutex };
+			ring.reserve(cluster_count + file->clusters().size());
+			cluster_count += file->clusters().size();
+		}
+		files.push_back(std::move(file));
+		opened.emplace(clustered.string(), files.back().get());
+		return *files.back();
+	}
+
+	// Nodes and triangles of a cluster of file, which are paged in if they aren't resident.
+	// They stay readable after eviction, which only makes reading them slower.
+	[[nodiscard]] mesh_file::cluster_view cluster(const mesh_file& file, uint32_t cluster) noexcept
+	{
+		auto& state = file.states[cluster];
+		auto current = state.load(std::memory_order_relaxed);
+		if (current == mesh_file::resident)
+			state.compare_exchange_strong(current, mesh_file::referenced, std::memory_order_relaxed);
+		if (current == mesh_file::paged_out)
+			page_in(file, cluster);
+		return file.view(cluster);
+	}
+
+	// Clusters paged in, including those paged in again after eviction
+	[[nodiscard]] size_t faults() const noexcept
+	{
+		return m_faults;
+	}
+	[[nodiscard]] size_t evictions() const noexcept
+	{
+		return m_evictions;
+	}
+	[[nodiscard]] size_t resident_bytes() const noexcept
+	{
+		return m_resident_bytes;
+	}
+};
+#endif // GEOMETRY_CACHE_H
@@ -0,0 +1,135 @@
+#ifndef GUIDED_TRACER_H
+#define GUIDED_TRACER_H
+#include <algorithm>
+#include <limits>
+#include <vector>
+#include <glm/glm.hpp>
+#include "world.h"
+#include "path_guide.h"
+#include "utility.h"
+
+// Path tracer whose diffuse surfaces scatter either like the material or along the light a
+// path_guide has learned, weighted by the density of choosing either way. Every path records
+// the light it brought back from its diffuse bounces into the guide, to train it for its next
+// iteration. Other materials scatter as they do in world::raytrace, as only the directions of
+// diffuse surfaces have a known density.
+class guided_tracer
+{
+	// Of the bounces at trained diffuse surfaces that follow the guide
+	constexpr static float guide_fraction = 0.5f;
+
+	struct vertex
+	{
+		uint32_t leaf;
+		glm::vec3 direction;
+		float pdf;
+		glm::vec3 beta; // throughput of the path including the bounce
+		glm::vec3 radiance; // brought back along direction
+	};
+
+	const world& scene;
+	path_guide& guide;
+	int max_depth;
+	std::vector<vertex> vertices;
+public:
+	guided_tracer(const world& scene, path_guide& guide, int max_depth) :
+		scene{ scene },
+		guide{ guide },
+		max_depth{ max_depth }
+	{
+		vertices.reserve(std::max(max_depth, 0));
+	}
+
+	// Bounds of the scene for the guide; unbounded objects fall into its outermost regions
+	[[nodiscard]] static aabb scene_bounds(const world& scene) noexcept
+	{
+		aabb bounds;
+		for (const auto& b : scene.object_bounds)
+			bounds.grow(b);
+		return bounds;
+	}
+
+	// Light reaching the camera along r
+	[[nodiscard]] glm::vec3 trace(ray r, int& seed)
+	{
+		vertices.clear();
+		glm::vec3 color{ 0, 0, 0 };
+		glm::vec3 beta{ 1, 1, 1 };
+		// Density with which the last hit chose r, if it also sampled the environment
+		float scatter_pdf = 0.0f;
+		const auto add = [&](const glm::vec3& light)
+		{
+			const auto contribution = beta * light;
+			color += contribution;
+			for (auto& v : vertices)
+				v.radiance += contribution / glm::max(v.beta, glm::vec3{ 1e-20f });
+		};
+		const auto env_emits = scene.env && scene.env->emits();
+		for (int depth = 0; depth < max_depth; ++depth)
+		{
+			const auto hit = scene.closest_hit(r, 0, std::numeric_limits<float>::infinity(), nullptr);
+			if (!hit.object)
+			{
+				auto light = scene.backdrop(r.direction);
+				if (scatter_pdf > 0.0f)
+					light *= world::power_heuristic(scatter_pdf, scene.env->pdf(r.direction));
+				add(light);
+				break;
+			}
+			const auto [position, normal, front_facing, tex] = hit.object->surface(r, hit);
+			const auto& mat = *hit.object->mat;
+			add(mat.emission(position, normal, r.direction, front_facing, tex, seed));
+			const auto shade_info = mat.shade(position, normal, r.direction, front_facing, tex, seed);
+			if (!shade_info.scattered)
+				break;
+			const auto reflectance = mat.diffuse_reflectance(tex);
+			auto dir = default_math::normalize(shade_info.scattered->direction);
+			scatter_pdf = 0.0f;
+			if (reflectance == glm::vec3{ 0, 0, 0 })
+			{
+				beta *= shade_info.attenuation;
+			}
+			else
+			{
+				const auto leaf = guide.locate(position);
+				const auto fraction = guide.trained(leaf) ? guide_fraction : 0.0f;
+				const auto mixture_pdf = [&](const glm::vec3& d)
+				{
+					const auto bsdf_pdf = std::max(dot(normal, d), 0.0f) / static_cast<float>(pi);
+					return fraction > 0.0f ? fraction * guide.pdf(leaf, d) + (1.0f - fraction) * bsdf_pdf : bsdf_pdf;
+				};
+				if (env_emits)
+					add(sample_environment(position, normal, reflectance, mixture_pdf, seed));
+				if (fraction > 0.0f && frand(seed) < fraction)
+					dir = guide.sample(leaf, seed);
+				const auto cos_theta = dot(normal, dir);
+				const auto pdf = mixture_pdf(dir);
+				if (cos_theta <= 0.0f || pdf <= 0.0f)
+					break;
+				beta *= reflectance * cos_theta / (static_cast<float>(pi) * pdf);
+				if (env_emits)
+					scatter_pdf = pdf;
+				vertices.push_back({ leaf, dir, pdf, beta, glm::vec3{ 0, 0, 0 } });
+			}
+			const auto cone_width = r.cone_width + r.cone_spread * hit.t;
+			r = ray{ shade_info.scattered->origin + dir * 0.005f, dir, cone_width, r.cone_spread };
+		}
+		for (const auto& v : vertices)
+			guide.record(v.leaf, v.direction, v.pdf, (v.radiance.r + v.radiance.g + v.radiance.b) / 3.0f);
+		return color;
+	}
+private:
+	// As world::sample_environment, weighted against scattering with mixture_pdf
+	template <typename Pdf>
+	[[nodiscard]] glm::vec3 sample_environment(const glm::vec3& position, const glm::vec3& normal, const glm::vec3& reflectance, const Pdf& mixture_pdf, int& seed) const noexcept
+	{
+		const auto light = scene.env->sample_direction(seed);
+		const auto cos_theta = dot(normal, light.direction);
+		if (cos_theta <= 0.0f || light.pdf <= 0.0f)
+			return glm::vec3{ 0, 0, 0 };
+		if (scene.occluded(ray{ position + light.direction * 0.005f, light.direction }, std::numeric_limits<float>::infinity()))
+			return glm::vec3{ 0, 0, 0 };
+		return reflectance / static_cast<float>(pi) * light.radiance * cos_theta / light.pdf * world::power_heuristic(light.pdf, mixture_pdf(light.direction));
+	}
+};
+#endif // GUIDED_TRACER_H
@@ -0,0 +1,61 @@
+#ifndef HEATMAP_H
+#define HEATMAP_H
+#include <algorithm>
+#include <array>
+#include <cmath>
+#include <glm/glm.hpp>
+
+// What the debug heatmap shows instead of the render. The per-pixel costs are
+// kept as a vec3 of (bounces, intersection tests, nanoseconds), averaged over frames.
+enum class heatmap_mode
+{
+	off,
+	bounces,
+	intersection_tests,
+	time
+};
+
+[[nodiscard]] inline heatmap_mode next_heatmap_mode(heatmap_mode mode) noexcept
+{
+	return static_cast<heatmap_mode>((static_cast<int>(mode) + 1) % 4);
+}
+
+[[nodiscard]] inline const char* heatmap_mode_name(heatmap_mode mode) noexcept
+{
+	switch (mode)
+	{
+	case heatmap_mode::bounces: return "bounces";
+	case heatmap_mode::intersection_tests: return "intersection tests";
+	case heatmap_mode::time: return "time";
+	default: return "off";
+	}
+}
+
+// Position of the cost on the color scale, in [0, 1]. Bounces are shown linearly up to
+// max_bounces; tests and time logarithmically, from 1 to 4096 tests and 100ns to 1ms.
+[[nodiscard]] inline float heatmap_scale(heatmap_mode mode, const glm::vec3& cost, int max_bounces) noexcept
+{
+	switch (mode)
+	{
+	case heatmap_mode::bounces:
+		return std::clamp(cost.x / static_cast<float>(max_bounces), 0.0f, 1.0f);
+	case heatmap_mode::intersection_tests:
+		return std::clamp(std::log2(std::max(cost.y, 1.0f)) / 12.0f, 0.0f, 1.0f);
+	case heatmap_mode::time:
+		return std::clamp(std::log10(std::max(cost.z, 100.0f) / 100.0f) / 4.0f, 0.0f, 1.0f);
+	default:
+		return 0.0f;
+	}
+}
+
+// Black, blue, cyan, green, yellow, red, white
+[[nodiscard]] inline glm::vec3 heatmap_color(float t) noexcept
+{
+	static const std::array<glm::vec3, 7> stops{ {
+		{ 0, 0, 0 }, { 0, 0, 1 }, { 0, 1, 1 }, { 0, 1, 0 }, { 1, 1, 0 }, { 1, 0, 0 }, { 1, 1, 1 }
+	} };
+	const auto x = std::clamp(t, 0.0f, 1.0f) * static_cast<float>(stops.size() - 1);
+	const auto i = std::min(static_cast<size_t>(x), stops.size() - 2);
+	return glm::mix(stops[i], stops[i + 1], x - static_cast<float>(i));
+}
+#endif // HEATMAP_H
@@ -0,0 +1,102 @@
+#ifndef IMAGE_WRITER_H
+#define IMAGE_WRITER_H
+#include <filesystem>
+#include <string>
+#include <array>
+#include <cstring>
+#include <memory>
+#include <stb_image_write.h>
+
+#include "cpu_dispatch.h"
+#include "framebuffer.h"
+#include "pixel.h"
+
+struct image_format
+{
+    using func_t = bool(*)(const std::string&, const framebuffer&);
+    const char* friendly_name;
+    const char* extension_list;
+    func_t write_func;
+};
+
+namespace detail {
+    inline void convert_pixels(const glm::vec4* colors, size_t count, pixel* pixels) noexcept
+    {
+        for (size_t pixel_idx = 0; pixel_idx < count; ++pixel_idx)
+        {
+            pixels[pixel_idx] = pixel{ colors[pixel_idx] }.to_rgba();
+        }
+    }
+    inline std::unique_ptr<pixel[]> to_pixels(const framebuffer& fb)
+    {
+        auto pixels = std::make_unique_for_overwrite<pixel[]>(fb.height() * fb.width());
+        isa_dispatch<&convert_pixels>(fb.buffer().data, fb.width() * fb.height(), pixels.get());
+        return pixels;
+    }
+}
+
+inline constexpr std::array<image_format, 5> image_formats{ {
+    {
+        "Portable Network Graphics",
+        "png",
+        [](const std::string& path, const framebuffer& fb) -> bool
+        {
+            return stbi_write_png(path.c_str(), fb.width(), fb.height(), 4, detail::to_pixels(fb).get(),0);
+        }
+    },
+    {
+        "Bitmap",
+        "bmp,dib",
+        [](const std::string& path, const framebuffer& fb) -> bool
+        {
+            return stbi_write_bmp(path.c_str(), fb.width(), fb.height(), 4, detail::to_pixels(fb).get());
+        }
+    },
+    {
+        "TARGA",
+        "tga,icb,vda,vst",
+        [](const std::string& path, const framebuffer& fb) -> bool
+        {
+            return stbi_write_tga(path.c_str(), fb.width(), fb.height(), 4, detail::to_pixels(fb).get());
+        }
+    },
+    {
+        "RGBE",
+        "hdr",
+        [](const std::string& path, const framebuffer& fb) -> bool
+        {
+            return stbi_write_hdr(path.c_str(), fb.width(), fb.height(), 4, &fb.buffer().data->x);
+        }
+    },
+    {
+        "JPEG",
+        "jpg,jpeg,jpe,jif,jfif,jfi",
+        [](const std::string& path, const framebuffer& fb) -> bool
+        {
+            return stbi_write_jpg(path.c_str(), fb.width(), fb.height(), 4, detail::to_pixels(fb).get(), 100);
+        }
+    }
+} };
+
+// Format matching the extension of path, or nullptr if it isn't supported
+[[nodiscard]] inline const image_format* find_image_format(const std::filesystem::path& path)
+{
+    const auto extension = path.extension().string();
+    if (extension.size() < 2)
+        return nullptr;
+    for (const auto& format : image_formats)
+    {
+        if (std::strstr(format.extension_list, extension.c_str() + 1) != nullptr)
+        {
+            return &format;
+        }
+    }
+    return nullptr;
+}
+
+inline bool write_image(const std::filesystem::path& path, const framebuffer& fb)
+{
+    const auto format = find_image_format(path);
+    return format && format->write_func(path.string(), fb);
+}
+#endif // IMAGE_WRITER_H
@@ -0,0 +1,355 @@
+#ifndef JOB_POOL_H
+#define JOB_POOL_H
+#include <vector>
+#include <deque>
+#include <thread>
+#include <atomic>
+#include <mutex>
+#include <condition_variable>
+#include <functional>
+#include <future>
+#include <memory>
+#include <algorithm>
+#include <exception>
+#include <limits>
+#include "topology.h"
+
+class job_pool;
+
+namespace detail {
+	struct job_node
+	{
+		std::function<void()> work;
+		// Unfinished dependencies, plus one held while the job is being submitted
+		std::atomic<size_t> blockers{ 1 };
+		std::atomic<bool> finished{ false };
+		std::mutex m;
+		std::vector<std::shared_ptr<job_node>> continuations;
+	};
+}
+
+// Handle to a job submitted to a job_pool, behaving like a std::shared_future
+template <typename T>
+class job
+{
+	friend class job_pool;
+
+	job_pool* pool{};
+	std::shared_ptr<detail::job_node> node;
+	std::shared_future<T> result;
+public:
+	job() = default;
+
+	[[nodiscard]] bool valid() const noexcept
+	{
+		return node != nullptr;
+	}
+	// False for a job that was never submitted
+	[[nodiscard]] bool ready() const noexcept
+	{
+		return node && node->finished;
+	}
+	// Pool threads keep running other jobs while they wait
+	void wait() const;
+	decltype(auto) get() const
+	{
+		wait();
+		return result.get();
+	}
+	// Runs func once this job has finished
+	template <typename Func>
+	auto then(Func&& func) const;
+};
+
+struct tile_range
+{
+	size_t x_begin, y_begin;
+	size_t x_end, y_end;
+};
+
+// Persistent pool of (optionally pinned) worker threads running a graph of jobs.
+// Jobs start as soon as all the jobs they depend on have finished.
+class job_pool
+{
+	std::vector<cpu_slot> slots;
+	std::vector<size_t> groups;
+	size_t m_group_count = 0;
+	std::vector<std::thread> threads;
+	std::mutex m;
+	std::condition_variable cv; // idle workers, woken for new jobs
+	std::condition_variable done_cv; // threads in wait(), woken when jobs finish
+	std::atomic<size_t> waiters{ 0 }; // threads in wait()
+	size_t helping_waiters = 0; // of those, pool threads running queued jobs meanwhile
+	std::deque<std::shared_ptr<detail::job_node>> queue;
+	bool stopping = false;
+
+	inline static thread_local const job_pool* current_pool = nullptr;
+	inline static thread_local size_t current_idx = 0;
+
+	void enqueue(std::shared_ptr<detail::job_node> node)
+	{
+		bool wake_waiters;
+		{
+			std::lock_guard lk{ m };
+			queue.push_back(std::move(node));
+			wake_waiters = helping_waiters > 0;
+		}
+		cv.notify_one();
+		if (wake_waiters)
+			done_cv.notify_all();
+	}
+	void release(const std::shared_ptr<detail::job_node>& node)
+	{
+		if (--node->blockers == 0)
+			enqueue(node);
+	}
+	void add_dependency(const std::shared_ptr<detail::job_node>& node, const std::shared_ptr<detail::job_node>& dependency)
+	{
+		if (!dependency)
+			return;
+		++node->blockers;
+		std::unique_lock lk{ dependency->m };
+		if (dependency->finished)
+		{
+			lk.unlock();
+			--node->blockers;
+			return;
+		}
+		dependency->continuations.push_back(node);
+	}
+	void execute(const std::shared_ptr<detail::job_node>& node)
+	{
+		node->work();
+		node->work = nullptr;
+		std::vector<std::shared_ptr<detail::job_node>> continuations;
+		{
+			std::lock_guard lk{ node->m };
+			node->finished = true;
+			continuations.swap(node->continuations);
+		}
+		for (auto& continuation : continuations)
+			release(continuation);
+		// A waiter counted itself before it checked finished, so either it sees the job as
+		// finished or it is counted here. Taking the lock makes sure it is asleep by then.
+		if (waiters > 0)
+		{
+			{
+				std::lock_guard lk{ m };
+			}
+			done_cv.notify_all();
+		}
+	}
+	void worker(size_t idx)
+	{
+		(void)pin_current_thread(slots[idx].cpu);
+		current_pool = this;
+		current_idx = idx;
+		std::unique_lock lk{ m };
+		while (true)
+		{
+			cv.wait(lk, [&] { return stopping || !queue.empty(); });
+			if (queue.empty())
+				return;
+			auto node = std::move(queue.front());
+			queue.pop_front();
+			lk.unlock();
+			execute(node);
+			lk.lock();
+		}
+	}
+	template <typename Func>
+	auto make_job(Func&& func)
+	{
+		using result_t = std::invoke_result_t<std::decay_t<Func>>;
+		auto task = std::make_shared<std::packaged_task<result_t()>>(std::forward<Func>(func));
+		job<result_t> handle;
+		handle.pool = this;
+		handle.node = std::make_shared<detail::job_node>();
+		handle.node->work = [task] { (*task)(); };
+		handle.result = task->get_future().share();
+		return handle;
+	}
+public:
+	constexpr static size_t no_worker = std::numeric_limits<size_t>::max();
+
+	// A worker_count of 0 means one worker per CPU allowed by the placement policy
+	explicit job_pool(size_t worker_count = 0, placement_policy placement = placement_policy::none) :
+		slots{ cpu_topology::detect().assign(worker_count, placement) },
+		groups(slots.size())
+	{
+		// Slots come sorted by node, so groups are contiguous ranges of workers
+		for (size_t i = 0; i < slots.size(); ++i)
+		{
+			if (i == 0 || slots[i].node != slots[i - 1].node)
+				++m_group_count;
+			groups[i] = m_group_count - 1;
+		}
+		threads.reserve(slots.size());
+		for (size_t i = 0; i < slots.size(); ++i)
+			threads.emplace_back(&job_pool::worker, this, i);
+	}
+	job_pool(const job_pool&) = delete;
+	job_pool& operator=(const job_pool&) = delete;
+	// Finishes every job that was already submitted
+	~job_pool()
+	{
+		{
+			std::lock_guard lk{ m };
+			stopping = true;
+		}
+		cv.notify_all();
+		for (auto& thread : threads)
+			thread.join();
+	}
+
+	template <typename Func, typename... Deps>
+	auto submit(Func&& func, const job<Deps>&... dependencies)
+	{
+		auto handle = make_job(std::forward<Func>(func));
+		(add_dependency(handle.node, dependencies.node), ...);
+		release(handle.node);
+		return handle;
+	}
+	template <typename Func, typename Dep>
+	auto submit(Func&& func, const std::vector<job<Dep>>& dependencies)
+	{
+		auto handle = make_job(std::forward<Func>(func));
+		for (const auto& dependency : dependencies)
+			add_dependency(handle.node, dependency.node);
+		release(handle.node);
+		return handle;
+	}
+
+	template <typename T>
+	void wait(const job<T>& j)
+	{
+		const auto& node = *j.node;
+		const auto helping = current_pool == this;
+		std::unique_lock lk{ m };
+		++waiters;
+		if (helping)
+			++helping_waiters;
+		while (!node.finished)
+		{
+			if (helping && !queue.empty())
+			{
+				auto other = std::move(queue.front());
+				queue.pop_front();
+				lk.unlock();
+				execute(other);
+				lk.lock();
+			}
+			else
+			{
+				done_cv.wait(lk);
+			}
+		}
+		--waiters;
+		if (helping)
+			--helping_waiters;
+	}
+
+	// Calls func(i) for every i in [begin, end), in chunks of grain indices.
+	// The calling thread takes part and the call returns once all chunks are done.
+	template <typename Func>
+	void parallel_for(size_t begin, size_t end, size_t grain, Func&& func)
+	{
+		if (begin >= end)
+			return;
+		grain = std::max<size_t>(grain, 1);
+		const auto chunk_count = (end - begin + grain - 1) / grain;
+		std::atomic<size_t> next_chunk{ 0 };
+		const auto run_chunks = [&]
+		{
+			for (size_t chunk; (chunk = next_chunk++) < chunk_count;)
+			{
+				const auto chunk_begin = begin + chunk * grain;
+				const auto chunk_end = std::min(chunk_begin + grain, end);
+				for (auto i = chunk_begin; i < chunk_end; ++i)
+					func(i);
+			}
+		};
+		const auto helper_count = std::min(chunk_count, worker_count()) - (current_pool == this ? 1 : 0);
+		std::vector<job<void>> helpers;
+		helpers.reserve(helper_count);
+		for (size_t i = 0; i < helper_count; ++i)
+			helpers.push_back(submit(run_chunks));
+
+		std::exception_ptr error;
+		if (current_pool == this)
+		{
+			try
+			{
+				run_chunks();
+			}
+			catch (...)
+			{
+				error = std::current_exception();
+			}
+		}
+		for (const auto& helper : helpers)
+		{
+			wait(helper);
+			try
+			{
+				helper.result.get();
+			}
+			catch (...)
+			{
+				if (!error)
+					error = std::current_exception();
+			}
+		}
+		if (error)
+			std::rethrow_exception(error);
+	}
+	// Splits [0, width) x [0, height) into tiles and calls func(tile_range) for each of them
+	template <typename Func>
+	void parallel_for_tiles(size_t width, size_t height, size_t tile_size, Func&& func)
+	{
+		const auto tiles_x = (width + tile_size - 1) / tile_size;
+		const auto tiles_y = (height + tile_size - 1) / tile_size;
+		parallel_for(0, tiles_x * tiles_y, 1, [&](size_t tile)
+		{
+			const auto x = tile % tiles_x * tile_size;
+			const auto y = tile / tiles_x * tile_size;
+			func(tile_range{ x, y, std::min(x + tile_size, width), std::min(y + tile_size, height) });
+		});
+	}
+
+	[[nodiscard]] size_t worker_count() const noexcept
+	{
+		return slots.size();
+	}
+	[[nodiscard]] size_t group_count() const noexcept
+	{
+		return m_group_count;
+	}
+	// Index of the NUMA node group the worker runs on, in [0, group_count())
+	[[nodiscard]] size_t worker_group(size_t worker_idx) const noexcept
+	{
+		return groups[worker_idx];
+	}
+	[[nodiscard]] size_t group_worker_count(size_t group) const noexcept
+	{
+		return std::count(groups.begin(), groups.end(), group);
+	}
+	// Index of the calling worker thread, or no_worker when called from outside the pool
+	[[nodiscard]] size_t current_worker() const noexcept
+	{
+		return current_pool == this ? current_idx : no_worker;
+	}
+};
+
+template <typename T>
+void job<T>::wait() const
+{
+	pool->wait(*this);
+}
+template <typename T>
+template <typename Func>
+auto job<T>::then(Func&& func) const
+{
+	return pool->submit(std::forward<Func>(func), *this);
+}
+#endif // JOB_POOL_H
@@ -9,6 +9,8 @@
 #include <algorithm>
 #include <array>
 #include <filesystem>
+#include <chrono>
+#include <unordered_map>
 
 #include "window.h"
 #include "camera_controller.h"
@@ -17,138 +19,1001 @@
 #include "camera.h"
 #include "framebuffer.h"
 #include "scheduler.h"
+#include "triple_buffer.h"
 #include "world.h"
 #include "save_render_dialog.h"
+#include "options.h"
+#include "scenes.h"
+#include "texture.h"
+#include "geometry_cache.h"
+#include "heatmap.h"
+#include "object_edit.h"
+#include "offline_renderer.h"
+#include "benchmark.h"
+#include "bidirectional.h"
+#include "photon_tracer.h"
+#include "guided_tracer.h"
+#include "splat_buffer.h"
+#include "quality_harness.h"
+#include "render_server.h"
+#include "frame_stream.h"
+#include "cpu_dispatch.h"
 
 class render_scheduler : public scheduler<render_scheduler> {
     friend class scheduler<render_scheduler>;
 
+    // Everything the workers need to know about the view, handed over between frames
+    struct view_state
+    {
+        camera cam;
+        uint32_t width, height;
+        bool changed;
+        heatmap_mode heatmap;
+        bool ambient_occlusion; // preview instead of path tracing
+        bool bidirectional; // path tracer used unless a preview is shown
+        bool photon_mapping; // of the caustics, unless tracing bidirectionally
+        bool guiding; // of the path tracer, unless one of the above is used
+
+        [[nodiscard]] bool traces_bidirectionally() const noexcept
+        {
+            return bidirectional && heatmap == heatmap_mode::off && !ambient_occlusion;
+        }
+        [[nodiscard]] bool maps_photons() const noexcept
+        {
+            return photon_mapping && !bidirectional && heatmap == heatmap_mode::off && !ambient_occlusion;
+        }
+        [[nodiscard]] bool guides_paths() const noexcept
+        {
+            return guiding && !photon_mapping && !bidirectional && heatmap == heatmap_mode::off && !ambient_occlusion;
+        }
+        // The path tracer alone, whose paths record the objects they touch
+        [[nodiscard]] bool traces_plain_paths() const noexcept
+        {
+            return !guiding && !photon_mapping && !bidirectional && heatmap == heatmap_mode::off && !ambient_occlusion;
+        }
+    };
+
 	window wnd;
-    framebuffer fb;
-    world world_;
     camera cam;
     orbit_camera_controller cam_controller{cam};
-    size_t frameIdx = 0;
+    std::mutex view_mutex;
+    view_state pending_view{};
+
+    // Contiguous range of rows of 8x8 pixel blocks rendered by the workers of one NUMA node
+    struct alignas(64) row_band
+    {
+        std::atomic<uint32_t> next;
+        uint32_t end;
+    };
+
+    world world_;
+    // Pages in the clusters of the scene's meshes, if it has any
+    std::shared_ptr<const geometry_cache> geometry;
+    std::vector<std::unique_ptr<world>> node_worlds;
+    std::vector<std::once_flag> node_world_built;
+    std::vector<row_band> bands;
+    framebuffer fb;
+    // Averaged (bounces, intersection tests, nanoseconds) per pixel, while the heatmap is shown
+    basic_framebuffer<glm::vec3> costs;
+    triple_buffer<pixel_buffer> frames;
+    // Copy of the frames for other processes, if requested
+    std::unique_ptr<shared_frame_stream> stream;
+    // Light splatted by the bidirectional path tracer. A frame splats into one buffer while
+    // its pixels take what the previous, finished frame splatted into the other one.
+    std::array<splat_buffer, 2> splats;
+    size_t splat_frame = 0; // the buffer splatted into is splats[splat_frame % 2]
+    // Splats of the accumulated frames before the current one, per pixel
+    basic_framebuffer<glm::vec3> splat_sums;
+    // fb holds the average of this many frames, which were traced bidirectionally if fb_bidirectional
+    size_t fb_frames = 0;
+    bool fb_bidirectional = false;
+    // Shot anew before every frame that maps photons, into the same memory
+    photon_map photons;
+    size_t photon_count = 100000;
+    // Trained by the guided frames, and refined once they've traced 1, 2, 4, ... samples per pixel.
+    // Made anew for the scene bounds it covers whenever they change.
+    std::unique_ptr<path_guide> guide;
+    aabb guide_bounds;
+    int guide_frames = 0;
+    int guide_iteration_frames = 1;
+    view_state render_view{};
+    size_t accumulated_frames = 0;
+    // Per 8x8 block of pixels, the frames accumulated into it and the objects their paths
+    // touched meanwhile, as world::object_bit. Edits only restart the blocks they affect.
+    std::vector<uint32_t> block_frames;
+    std::vector<uint64_t> block_touched;
+    uint32_t blocks_x = 0;
+    // Object each pixel's primary ray hit in the last frame that traced plain paths
+    basic_framebuffer<uint32_t> object_ids;
+    bool object_ids_valid = false;
+    // The first hits of each pixel's primary rays in the first frames of its block. Later frames
+    // cycle through their jitters and start their paths at these hits, as long as the block
+    // isn't restarted.
+    static constexpr uint32_t cached_primary_hits = 4;
+    basic_framebuffer<std::array<world::primary_hit, cached_primary_hits>> primary_hits;
+    bool cache_primary_hits = false;
+    uint32_t selected = world::no_object;
+    bool left_button_down = false;
+    // The material of each edited object's last edit, as objects only point to their materials
+    std::unordered_map<uint32_t, std::unique_ptr<material>> edited_materials;
+    static constexpr int max_depth = 32;
+    static constexpr float ao_radius = 1.0f;
+    // Whether primary rays are traced in packets
+    bool packets = true;
+    bool scene_animated = false;
+    std::atomic<bool> animation_playing{ true };
+    double animation_time = 0.0;
+    double last_sync_time = time_now();
     std::atomic<double> productive_frame_time;
+    std::atomic<size_t> rendered_frame_count{ 0 };
+
+    size_t presented_frame_count = 0;
     double time = time_now();
-    int worker_scanline_count{};
+    double stats_time = time;
 	
 	struct worker_data
     {
-        int offset_seed;
+        size_t group;
     };
     worker_data worker_init(size_t worker_idx)
     {
-        return { init_seed() ^ static_cast<int>(worker_idx * 63748) };
+        const auto group = worker_group(worker_idx);
+        // Runs on the pinned thread, so the replica is allocated on its node
+        if (group_count() > 1)
+        {
+            std::call_once(node_world_built[group], [&] { node_worlds[group] = std::make_unique<world>(world_); });
+        }
+        return { group };
+    }
+    [[nodiscard]] const world& scene(size_t group) const noexcept
+    {
+        return node_worlds.empty() ? world_ : *node_worlds[group];
+    }
+    void reset_bands(uint32_t height) noexcept
+    {
+        const auto rows = (height + ray_packet::block_size - 1) / ray_packet::block_size;
+        uint32_t begin = 0;
+        size_t workers_before = 0;
+        for (size_t group = 0; group < bands.size(); ++group)
+        {
+            workers_before += group_worker_count(group);
+            const auto end = static_cast<uint32_t>(rows * workers_before / worker_count());
+            bands[group].next = begin;
+            bands[group].end = end;
+            begin = end;
+        }
+    }
+    // Restarts the accumulation of every block of an image of the given size
+    void reset_blocks(size_t width, size_t height)
+    {
+        constexpr auto block = ray_packet::block_size;
+        blocks_x = static_cast<uint32_t>((width + block - 1) / block);
+        const auto rows = (height + block - 1) / block;
+        block_frames.assign(blocks_x * rows, 0);
+        block_touched.assign(blocks_x * rows, 0);
+        if (object_ids.width() != width || object_ids.height() != height)
+        {
+            object_ids.update_size_for_overwrite(width, height);
+            object_ids_valid = false;
+        }
+        // Only plain paths start from cached hits, so the other modes don't hold on to the cache
+        if (!cache_primary_hits || !render_view.traces_plain_paths())
+            primary_hits = {};
+        else if (primary_hits.width() != width || primary_hits.height() != height)
+            primary_hits.update_size_for_overwrite(width, height);
+    }
+    // Offset of a pixel's primary ray within it in the given frame of its block, which narrows
+    // as the frames accumulate
+    [[nodiscard]] static float sample_offset(uint32_t x, uint32_t y, uint32_t frame) noexcept
+    {
+        auto seed = pixel_seed(0, x, y, frame);
+        return sfrand(seed) * (1.0f - 1.0f / static_cast<float>(frame + 1));
+    }
+    // Seed of the rest of a pixel's path in the given frame of its block, past the draw of the
+    // frame's own sample_offset
+    [[nodiscard]] static int sample_seed(uint32_t x, uint32_t y, uint32_t frame) noexcept
+    {
+        auto seed = pixel_seed(0, x, y, frame);
+        (void)sfrand(seed);
+        return seed;
+    }
+    // Seeds the given frame's sample of the pixels of a block, block_width wide and starting at
+    // (block_x, block_y), row by row, and jitters their image coordinates as in jitter_frame
+    static void jitter_pixels(uint32_t block_x, uint32_t block_y, uint32_t block_width, uint32_t count, uint32_t frame, uint32_t jitter_frame, float xMax, float yMax, int* seeds, float* us, float* vs) noexcept
+    {
+        const auto pixel_width = 1.0f / xMax;
+        const auto pixel_height = 1.0f / yMax;
+        for (uint32_t lane = 0; lane < count; ++lane) {
+            const auto x = block_x + lane % block_width;
+            const auto y = block_y + lane / block_width;
+            // Seeded by pixel and sample, so that the image doesn't depend on the number of workers
+            seeds[lane] = sample_seed(x, y, frame);
+            const auto off = sample_offset(x, y, jitter_frame);
+            us[lane] = x / xMax + off * pixel_width;
+            vs[lane] = y / yMax + off * pixel_height;
+        }
+    }
+    // Converts the colors of a block, block_width wide, to the pixels of an image stride pixels
+    // wide, and to stream_pixels too unless it is null
+    static void store_pixels(const glm::vec4* colors, uint32_t block_width, uint32_t count, size_t stride, pixel* pixels, pixel* stream_pixels) noexcept
+    {
+        for (uint32_t lane = 0; lane < count; ++lane) {
+            const auto offset = lane / block_width * stride + lane % block_width;
+            const pixel out{ colors[lane] };
+            pixels[offset] = out;
+            if (stream_pixels)
+                stream_pixels[offset] = out;
+        }
+    }
+    // Takes rows from the worker's own node first, then helps out the other nodes
+    [[nodiscard]] bool claim_row(size_t group, uint32_t& row) noexcept
+    {
+        for (size_t i = 0; i < bands.size(); ++i)
+        {
+            auto& band = bands[(group + i) % bands.size()];
+            if (band.next.load(std::memory_order_relaxed) < band.end)
+            {
+                row = band.next++;
+                if (row < band.end)
+                    return true;
+            }
+        }
+        return false;
     }
 	void worker_run(size_t worker_idx, worker_data& data)
     {
 	    auto time0 = time_now();
-        const unsigned yBegin = worker_scanline_count * worker_idx;
-    	const auto yEnd = std::min(yBegin + worker_scanline_count, wnd.height());
-        const float yMax = wnd.height() - 1;
-        const auto xBegin = 0;
-        const int xEnd = wnd.width();
-        const float xMax = wnd.width() - 1;
-        auto wnd_buffer = wnd.buffer();
+        const auto& target = frames.back();
+        const auto& cam = render_view.cam;
+        const auto& scene = this->scene(data.group);
+        const float yMax = target.height() - 1;
+        const auto xBegin = 0u;
+        const auto xEnd = static_cast<uint32_t>(target.width());
+        const float xMax = xEnd - 1;
+        auto frame_buffer = target.buffer();
         auto fb_buffer = fb.buffer();
-        const auto weightNew = 1.0f / static_cast<float>(cam_controller.frames_still() + 1);
-        const auto weightOld = 1.0f - weightNew;
-        const auto pixelWidth = 1.0f / xMax;
-        const auto pixelHeight = 1.0f / yMax;
-        for (auto y = yBegin; y < yEnd; ++y) {
-            for (auto x = xBegin; x < xEnd; ++x) {
-                const auto off = sfrand(data.offset_seed) * weightOld;
-                const auto u = x / xMax + off * pixelWidth;
-                const auto v = y / yMax + off * pixelHeight;
-
-                auto r = cam.get_ray(u, v);
-
-                const glm::vec3 newColor = world_.raytrace(r, 32, data.offset_seed);
-                const glm::vec3 oldColor{ fb_buffer[y][x] };
-                auto finalColor = glm::vec4{ newColor * weightNew + oldColor * weightOld, 1.0f };
-
-                wnd_buffer[y][x] = pixel{ finalColor };
-                fb_buffer[y][x] = finalColor;
+        auto cost_buffer = costs.buffer();
+        const auto stream_pixels = stream ? stream->pixels() : nullptr;
+        const auto heatmap = render_view.heatmap;
+        const auto spread = cam.pixel_spread(target.height());
+        constexpr auto block = static_cast<uint32_t>(ray_packet::block_size);
+        const auto height = static_cast<uint32_t>(target.height());
+        const auto bidirectional = render_view.traces_bidirectionally();
+        const auto photon_mapping = render_view.maps_photons();
+        const auto guiding = render_view.guides_paths();
+        const auto plain_paths = render_view.traces_plain_paths();
+        const auto use_packets = packets && plain_paths;
+        const photon_tracer caustics_tracer{ scene, photons, max_depth };
+        std::optional<guided_tracer> guided;
+        if (guiding)
+            guided.emplace(scene, *guide, max_depth);
+        std::optional<bidirectional_tracer> tracer;
+        if (bidirectional)
+            tracer.emplace(scene, cam, splats[splat_frame % 2], max_depth);
+        auto& previous_splats = splats[(splat_frame + 1) % 2];
+        auto splat_sum_buffer = splat_sums.buffer();
+        ray_packet packet;
+        std::array<float, ray_packet::max_size> us, vs;
+        std::array<int, ray_packet::max_size> seeds;
+        std::array<glm::vec3, ray_packet::max_size> colors, newCosts;
+        std::array<glm::vec4, ray_packet::max_size> display;
+        std::array<world::trace_stats, ray_packet::max_size> paths;
+        auto id_buffer = object_ids.buffer();
+        auto hit_buffer = primary_hits.buffer();
+        std::array<world::primary_hit, ray_packet::max_size> firsts;
+        const auto cache_hits = cache_primary_hits && plain_paths;
+        uint32_t row;
+        while (claim_row(data.group, row)) {
+            const auto yBegin = row * block;
+            const auto yEnd = std::min(yBegin + block, height);
+            for (auto blockX = xBegin; blockX < xEnd; blockX += block) {
+                const auto blockWidth = std::min<uint32_t>(block, xEnd - blockX);
+                const auto count = blockWidth * (yEnd - yBegin);
+                const auto block_idx = row * blocks_x + blockX / block;
+                const auto block_frame = block_frames[block_idx];
+                const auto accumulate = block_frame > 0;
+                const auto weightNew = 1.0f / static_cast<float>(block_frame + 1);
+                const auto weightOld = 1.0f - weightNew;
+                // Frames after the cached ones retrace the primary rays of those
+                const auto cache_slot = block_frame % cached_primary_hits;
+                const auto reuse_hits = cache_hits && block_frame >= cached_primary_hits;
+                // and jitter them the same way as the frame that cached them
+                const auto jitter_frame = reuse_hits ? cache_slot : block_frame;
+                // Restarted blocks gather the caustic photons within the widest radius again
+                const auto gather_radius = photon_mapping ? photon_tracer::gather_radius(block_frame) : 0.0f;
+                isa_dispatch<&jitter_pixels>(blockX, yBegin, blockWidth, count, block_frame, jitter_frame, xMax, yMax, seeds.data(), us.data(), vs.data());
+
+                if (plain_paths)
+                    std::fill_n(paths.begin(), count, world::trace_stats{});
+                if (reuse_hits)
+                {
+                    for (uint32_t lane = 0; lane < count; ++lane) {
+                        const auto& first = hit_buffer[yBegin + lane / blockWidth][blockX + lane % blockWidth][cache_slot];
+                        colors[lane] = scene.raytrace_from(cam.get_ray(us[lane], vs[lane], spread), first, max_depth, seeds[lane], paths[lane]);
+                    }
+                }
+                else if (use_packets)
+                {
+                    cam.get_packet(us, vs, count, spread, packet);
+                    scene.raytrace(packet, max_depth, seeds.data(), colors.data(), paths.data(), cache_hits ? firsts.data() : nullptr);
+                    if (cache_hits)
+                    {
+                        for (uint32_t lane = 0; lane < count; ++lane)
+                            hit_buffer[yBegin + lane / blockWidth][blockX + lane % blockWidth][cache_slot] = firsts[lane];
+                    }
+                }
+                else
+                {
+                    for (uint32_t lane = 0; lane < count; ++lane) {
+                        auto r = cam.get_ray(us[lane], vs[lane], spread);
+                        if (bidirectional)
+                        {
+                            colors[lane] = tracer->trace(r, seeds[lane]);
+                            continue;
+                        }
+                        if (photon_mapping)
+                        {
+                            colors[lane] = caustics_tracer.trace(r, seeds[lane], gather_radius);
+                            continue;
+                        }
+                        if (guiding)
+                        {
+                            colors[lane] = guided->trace(r, seeds[lane]);
+                            continue;
+                        }
+                        if (cache_hits)
+                        {
+                            auto& first = hit_buffer[yBegin + lane / blockWidth][blockX + lane % blockWidth][cache_slot];
+                            colors[lane] = scene.raytrace(r, max_depth, seeds[lane], paths[lane], first);
+                            continue;
+                        }
+                        if (plain_paths)
+                        {
+                            colors[lane] = scene.raytrace(r, max_depth, seeds[lane], paths[lane]);
+                            continue;
+                        }
+                        if (heatmap == heatmap_mode::off)
+                        {
+                            colors[lane] = glm::vec3{ scene.ambient_occlusion(r, ao_radius, seeds[lane]) };
+                            continue;
+                        }
+                        world::trace_stats stats;
+                        const auto start = std::chrono::steady_clock::now();
+                        colors[lane] = scene.raytrace(r, max_depth, seeds[lane], stats);
+                        const auto ns = std::chrono::duration<float, std::nano>(std::chrono::steady_clock::now() - start).count();
+                        newCosts[lane] = { stats.bounces, stats.intersection_tests, ns };
+                    }
+                }
+
+                for (uint32_t lane = 0; lane < count; ++lane) {
+                    const auto x = blockX + lane % blockWidth;
+                    const auto y = yBegin + lane / blockWidth;
+                    const auto newColor = colors[lane];
+                    // The first frame after a resize is the first touch of the framebuffer, so it must not read it
+                    auto finalColor = glm::vec4{ newColor, 1.0f };
+                    if (accumulate)
+                    {
+                        const glm::vec3 oldColor{ fb_buffer[y][x] };
+                        finalColor = glm::vec4{ newColor * weightNew + oldColor * weightOld, 1.0f };
+                    }
+                    fb_buffer[y][x] = finalColor;
+
+                    auto& out = display[lane];
+                    if (bidirectional)
+                    {
+                        // The previous frame has finished splatting. On the first frame, what it
+                        // splatted belongs to another view.
+                        const auto previous = previous_splats.take(x, y);
+                        const auto splat_sum = accumulate ? splat_sum_buffer[y][x] + previous : glm::vec3{ 0, 0, 0 };
+                        splat_sum_buffer[y][x] = splat_sum;
+                        out = accumulate ? finalColor + glm::vec4{ splat_sum / static_cast<float>(block_frame), 0.0f } : finalColor;
+                    }
+                    else if (heatmap == heatmap_mode::off)
+                    {
+                        out = finalColor;
+                    }
+                    else
+                    {
+                        const auto cost = accumulate ? newCosts[lane] * weightNew + cost_buffer[y][x] * weightOld : newCosts[lane];
+                        cost_buffer[y][x] = cost;
+                        out = glm::vec4{ heatmap_color(heatmap_scale(heatmap, cost, max_depth)), 1.0f };
+                    }
+                }
+                const auto block_offset = static_cast<size_t>(yBegin) * xEnd + blockX;
+                isa_dispatch<&store_pixels>(display.data(), blockWidth, count, xEnd, &frame_buffer[yBegin][blockX], stream_pixels ? stream_pixels + block_offset : nullptr);
+                if (stream)
+                    stream->mark_if_changed(blockX, yBegin, blockWidth, yEnd - yBegin);
+                if (plain_paths)
+                {
+                    uint64_t touched = accumulate ? block_touched[block_idx] : 0;
+                    for (uint32_t lane = 0; lane < count; ++lane)
+                    {
+                        touched |= paths[lane].touched;
+                        id_buffer[yBegin + lane / blockWidth][blockX + lane % blockWidth] = paths[lane].first_hit;
+                    }
+                    block_touched[block_idx] = touched;
+                }
+                block_frames[block_idx] = block_frame + 1;
             }
         }
     	
         productive_frame_time += (time_now() - time0);
     }
+    // Runs between frames while all workers are parked
+    void worker_sync()
+    {
+        frames.publish();
+        if (stream)
+            stream->publish(accumulated_frames + 1);
+        ++rendered_frame_count;
+        fb_frames = accumulated_frames + 1;
+        fb_bidirectional = render_view.traces_bidirectionally();
+        object_ids_valid = render_view.traces_plain_paths();
+        if (render_view.guides_paths() && ++guide_frames == guide_iteration_frames)
+        {
+            guide->refine(pool(), guide_iteration_frames);
+            guide_frames = 0;
+            guide_iteration_frames *= 2;
+        }
+        {
+            std::lock_guard lk{ view_mutex };
+            render_view = pending_view;
+            pending_view.changed = false;
+        }
+        accumulated_frames = render_view.changed ? 0 : accumulated_frames + 1;
+        // Advance animations; the BVHs are refitted rather than rebuilt
+        const auto now = time_now();
+        if (scene_animated && animation_playing)
+        {
+            animation_time += now - last_sync_time;
+            // Replicas of nodes whose workers haven't run yet are copied from world_ once they do
+            for (auto& node_world : node_worlds)
+            {
+                if (node_world)
+                    (void)node_world->update(static_cast<float>(animation_time));
+            }
+            if (world_.update(static_cast<float>(animation_time)))
+            {
+                accumulated_frames = 0;
+                const auto bounds = guided_tracer::scene_bounds(world_);
+                if (bounds.min != guide_bounds.min || bounds.max != guide_bounds.max)
+                    reset_guide();
+            }
+        }
+        last_sync_time = now;
+        if (fb.width() != render_view.width || fb.height() != render_view.height)
+        {
+            fb.update_size_for_overwrite(render_view.width, render_view.height);
+            accumulated_frames = 0;
+        }
+        if (render_view.heatmap != heatmap_mode::off && (costs.width() != render_view.width || costs.height() != render_view.height))
+        {
+            costs.update_size_for_overwrite(render_view.width, render_view.height);
+            accumulated_frames = 0;
+        }
+        if (frames.back().width() != render_view.width || frames.back().height() != render_view.height)
+        {
+            frames.back().update_size_for_overwrite(render_view.width, render_view.height);
+        }
+        if (render_view.traces_bidirectionally() && (!fb_bidirectional || splat_sums.width() != render_view.width || splat_sums.height() != render_view.height))
+        {
+            for (auto& buffer : splats)
+                buffer.resize(render_view.width, render_view.height);
+            splat_sums.update_size_for_overwrite(render_view.width, render_view.height);
+            accumulated_frames = 0;
+        }
+        ++splat_frame;
+        if (accumulated_frames == 0)
+            reset_blocks(render_view.width, render_view.height);
+        if (render_view.maps_photons())
+        {
+            // The workers are parked, so the photons are shot by all of them
+            photon_tracer::emit(world_, pool(), photon_count, accumulated_frames, max_depth, photons);
+        }
+        reset_bands(render_view.height);
+        if (stream)
+        {
+            // The renderer goes on without the stream rather than stall on it
+            try
+            {
+                stream->begin_frame(render_view.width, render_view.height);
+            }
+            catch (const std::exception& e)
+            {
+                std::cerr << e.what() << "; no longer streaming the frames\n";
+                stream.reset();
+            }
+        }
+    }
 	
+    // Forgets what the guide has learned, which belongs to the scene as it was
+    void reset_guide()
+    {
+        guide_bounds = guided_tracer::scene_bounds(world_);
+        guide = std::make_unique<path_guide>(guide_bounds);
+        guide_frames = 0;
+        guide_iteration_frames = 1;
+    }
+    // Restarts the whole image, for edits that can change what any path finds
+    void restart_all()
+    {
+        accumulated_frames = 0;
+        reset_blocks(render_view.width, render_view.height);
+        reset_guide();
+        if (render_view.maps_photons())
+            photon_tracer::emit(world_, pool(), photon_count, accumulated_frames, max_depth, photons);
+    }
+    // Applies edit to the selected object in every copy of the world. Material edits restart the
+    // blocks whose paths touched it, while moves restart the whole image, as the object's new
+    // shadows and reflections can fall on any block. Returns whether it applied.
+    bool apply_edit(object_edit edit)
+    {
+        const auto& object = world_.object(selected);
+        std::optional<transform> trans;
+        std::unique_ptr<material> mat;
+        if (edits_transform(edit))
+            trans = edited_transform(object.get_transform(), edit);
+        else
+            mat = edited_material(*object.mat, edit);
+        if (!trans && !mat)
+            return false;
+        const auto apply = [&](world& w)
+        {
+            if (trans)
+                w.set_transform(selected, *trans);
+            if (mat)
+                w.set_material(selected, *mat);
+        };
+        apply(world_);
+        for (auto& node_world : node_worlds)
+        {
+            if (node_world)
+                apply(*node_world);
+        }
+        // No copy of the world points to the material of the object's previous edit anymore
+        if (mat)
+            edited_materials[selected] = std::move(mat);
+        if (trans || !render_view.traces_plain_paths())
+        {
+            restart_all();
+            return true;
+        }
+        const auto bit = world::object_bit(selected);
+        for (size_t idx = 0; idx < block_frames.size(); ++idx)
+        {
+            if (block_touched[idx] & bit)
+                block_frames[idx] = 0;
+        }
+        return true;
+    }
+
     bool main_run()
 	{
-		const bool should_run = wnd.update();
+        if (frames.acquire())
+        {
+            ++presented_frame_count;
+        }
+		const bool should_run = wnd.update(frames.front());
+        wnd.sync();
 
 		const auto deltaTime = time_now() - time;
-    	// Update frame time
+        time = time_now();
+    	// Report present and render rates separately, once per second
+        if (time - stats_time >= 1.0)
         {
-            time = time_now();
-            const auto framesPerSecond = 1.0 / deltaTime;
-            std::cout << framesPerSecond << " FPS, " << "Real: " << deltaTime * 1000.0 << "ms, Prod total: "
-                << productive_frame_time * 1000.0 << "ms, Prod per thread: " << productive_frame_time * 1000.0 / worker_count() << "ms\n";
+            const auto elapsed = time - stats_time;
+            const size_t rendered = rendered_frame_count.exchange(0);
+            std::cout << "Present: " << presented_frame_count / elapsed << " FPS, Render: " << rendered / elapsed << " FPS, Prod per thread: "
+                << (rendered ? productive_frame_time * 1000.0 / worker_count() / rendered : 0.0) << "ms\n";
+            if (geometry)
+                std::cout << "Geometry: " << (geometry->resident_bytes() >> 20) << " MiB resident, " << geometry->faults() << " cluster faults\n";
             productive_frame_time = 0.0;
-            ++frameIdx;
+            presented_frame_count = 0;
+            stats_time = time;
         }
-        // Update window and view
+        // Update view and hand it over to the workers for their next frame
         {
             cam_controller.update(wnd, deltaTime);
-            if (wnd.resized())
+            std::lock_guard lk{ view_mutex };
+            pending_view.cam = cam;
+            pending_view.width = wnd.width();
+            pending_view.height = wnd.height();
+            pending_view.changed |= cam_controller.frames_still() == 0;
+        }
+        // Select the object under the cursor, from the ids of the last frame if it recorded them
+        const auto left_button = wnd.is_mouse_button_pressed(MOUSE_LEFT);
+        if (left_button && !left_button_down) {
+            const auto [mouse_x, mouse_y] = wnd.mouse_pos();
+            const auto u = std::clamp(static_cast<float>(mouse_x) / static_cast<float>(std::max(wnd.width(), 2u) - 1), 0.0f, 1.0f);
+            const auto v = std::clamp(static_cast<float>(mouse_y) / static_cast<float>(std::max(wnd.height(), 2u) - 1), 0.0f, 1.0f);
+            run_synchronized([&]
             {
-                fb.update_size(wnd.width(), wnd.height());
+                if (object_ids_valid)
+                {
+                    const auto x = static_cast<size_t>(u * static_cast<float>(object_ids.width() - 1) + 0.5f);
+                    const auto y = static_cast<size_t>(v * static_cast<float>(object_ids.height() - 1) + 0.5f);
+                    selected = object_ids.buffer()[y][x];
+                }
+                else
+                {
+                    selected = world_.pick(render_view.cam.get_ray(u, v));
+                }
+            });
+            if (selected == world::no_object)
+                std::cout << "Selected: nothing\n";
+            else
+                std::cout << "Selected: object " << selected << '\n';
+        }
+        left_button_down = left_button;
+        // Edit the selected object
+        if (selected != world::no_object) {
+            for (const auto key : { 'h', 'l', 'k', 'j', 'u', 'n', '=', '-', 'c', '[', ']', ',', '.' }) {
+                if (!wnd.is_key_pressed(key))
+                    continue;
+                const auto edit = *object_edit_for_key(key);
+                bool applied = false;
+                size_t restarted = 0;
+                run_synchronized([&]
+                {
+                    applied = apply_edit(edit);
+                    restarted = static_cast<size_t>(std::count(block_frames.begin(), block_frames.end(), 0u));
+                });
+                if (applied)
+                    std::cout << "Edited object " << selected << ", restarted " << restarted << " of " << block_frames.size() << " blocks\n";
             }
-            worker_scanline_count = wnd.height() / worker_count() + (wnd.height() % worker_count() > 0);
         }
-        // Save dialog
+        // Pause or resume animations
+        if (wnd.is_key_pressed(' ')) {
+            animation_playing = !animation_playing;
+        }
+        // Cycle through the debug heatmaps
+        if (wnd.is_key_pressed('o')) {
+            std::lock_guard lk{ view_mutex };
+            pending_view.heatmap = next_heatmap_mode(pending_view.heatmap);
+            pending_view.changed = true;
+            std::cout << "Heatmap: " << heatmap_mode_name(pending_view.heatmap) << '\n';
+        }
+        // Switch between the path tracer and the ambient occlusion preview
+        if (wnd.is_key_pressed('i')) {
+            std::lock_guard lk{ view_mutex };
+            pending_view.ambient_occlusion = !pending_view.ambient_occlusion;
+            pending_view.changed = true;
+            std::cout << "Integrator: " << (pending_view.ambient_occlusion ? "ambient occlusion" : "path tracing") << '\n';
+        }
+        // Switch between the path tracer and the bidirectional one
+        if (wnd.is_key_pressed('b')) {
+            std::lock_guard lk{ view_mutex };
+            pending_view.bidirectional = !pending_view.bidirectional;
+            pending_view.changed = true;
+            std::cout << "Path tracer: " << (pending_view.bidirectional ? "bidirectional" : "unidirectional") << '\n';
+        }
+        // Switch between path tracing the caustics and gathering them from photons
+        if (wnd.is_key_pressed('m')) {
+            std::lock_guard lk{ view_mutex };
+            pending_view.photon_mapping = !pending_view.photon_mapping;
+            pending_view.changed = true;
+            std::cout << "Caustics: " << (pending_view.photon_mapping ? "photon mapping" : "path tracing") << '\n';
+        }
+        // Switch path guiding on or off; the guide keeps what it has learned
+        if (wnd.is_key_pressed('g')) {
+            std::lock_guard lk{ view_mutex };
+            pending_view.guiding = !pending_view.guiding;
+            pending_view.changed = true;
+            std::cout << "Path guiding: " << (pending_view.guiding ? "on" : "off") << '\n';
+        }
+        // Save dialog, which exports the costs as float channels while a heatmap is shown
         if (wnd.is_key_pressed('p')) {
-            save_render_dialog(fb);
+            framebuffer snapshot;
+            bool export_costs = false;
+            run_synchronized([&]
+            {
+                export_costs = render_view.heatmap != heatmap_mode::off && costs.width() == fb.width() && costs.height() == fb.height();
+                if (export_costs)
+                {
+                    snapshot.update_size_for_overwrite(costs.width(), costs.height());
+                    for (size_t i = 0; i < costs.width() * costs.height(); ++i)
+                        snapshot.buffer().data[i] = glm::vec4{ costs.buffer().data[i], 1.0f };
+                }
+                else
+                {
+                    snapshot = fb;
+                    // Including the splats of the last frame, which its pixels haven't taken yet
+                    if (fb_bidirectional)
+                    {
+                        const auto& last = splats[(splat_frame + 1) % 2];
+                        for (size_t y = 0; y < snapshot.height(); ++y)
+                            for (size_t x = 0; x < snapshot.width(); ++x)
+                                snapshot.buffer()[y][x] += glm::vec4{ (splat_sums.buffer()[y][x] + last.get(x, y)) / static_cast<float>(fb_frames), 0.0f };
+                    }
+                }
+            });
+            if (export_costs)
+                save_float_image_dialog(snapshot, "costs.hdr");
+            else
+                save_render_dialog(snapshot);
         }
-    	// Disable synchronization
-        enable_synchronization = cam_controller.frames_still() <= 20;
     	
         return should_run;
     }
 public:
-    render_scheduler() :
-        wnd{ "CPU Raytracer", 800, 608 }
+    render_scheduler(const render_options& options, world&& scene, std::shared_ptr<const geometry_cache> geometry = nullptr) :
+        scheduler{ options.thread_count, options.placement },
+        wnd{ "CPU Raytracer", 800, 608 },
+        world_{ std::move(scene) },
+        geometry{ std::move(geometry) },
+        node_worlds(group_count() > 1 ? group_count() : 0),
+        node_world_built(group_count()),
+        bands(group_count())
     {
-        fb.update_size(wnd.width(), wnd.height());
+        packets = options.packets;
+        cache_primary_hits = options.primary_cache;
+        if (options.photons > 0)
+            photon_count = options.photons;
+        pending_view = { cam, wnd.width(), wnd.height(), true, heatmap_mode::off, false, options.bidirectional, options.photons > 0, options.guiding };
+        render_view = pending_view;
+        reset_bands(wnd.height());
+        reset_blocks(wnd.width(), wnd.height());
+        fb.update_size_for_overwrite(wnd.width(), wnd.height());
+        if (render_view.traces_bidirectionally())
+        {
+            for (auto& buffer : splats)
+                buffer.resize(wnd.width(), wnd.height());
+            splat_sums.update_size_for_overwrite(wnd.width(), wnd.height());
+        }
+        // The workers of each node write their own rows of the frames first
+        frames.for_each([&](pixel_buffer& frame) { frame.update_size_for_overwrite(wnd.width(), wnd.height()); });
+        if (!options.stream.empty())
+        {
+            stream = std::make_unique<shared_frame_stream>(options.stream);
+            stream->begin_frame(wnd.width(), wnd.height());
+        }
         if (NFD::Init() != NFD_OKAY)
         {
             throw std::runtime_error("Failed to initialize File Dialog library");
         }
     }
 
-	void add(raytraceable* obj)
+    void run()
     {
-        world_.add(obj);
+        world_.build(&pool());
+        world_.update(0.0f);
+        scene_animated = world_.animated();
+        reset_guide();
+        if (render_view.maps_photons())
+            photon_tracer::emit(world_, pool(), photon_count, accumulated_frames, max_depth, photons);
+        scheduler::run();
     }
 };
 
 
-int main() {
+int main(int argc, char** argv) {
     std::cout << std::setprecision(2) << std::fixed;
 
-    render_scheduler mgr;
-
-    const lambertian_material floor{ {0.7, 0.7, 0.7} };
-    mgr.add(new single_sided<plane>(floor, transform{ {0, 0.05, 0}, {0,0,0}, {1,1,1} }));
+    render_options options;
+    try
+    {
+        options = render_options::parse(argc, argv);
+    }
+    catch (const std::exception& e)
+    {
+        std::cerr << e.what() << '\n' << render_options::usage();
+        return 1;
+    }
+    if (options.help)
+    {
+        std::cout << render_options::usage();
+        return 0;
+    }
+    try
+    {
+        if (options.isa)
+            select_isa(*options.isa);
+    }
+    catch (const std::exception& e)
+    {
+        std::cerr << e.what() << '\n';
+        return 1;
+    }
+    // On stderr, as the other modes print results to stdout
+    std::clog << "Kernels: " << isa_name(active_isa()) << " (best supported: " << isa_name(detect_isa_level()) << ")\n";
+    if (!options.quality_dir.empty())
+    {
+        try
+        {
+            quality_settings settings;
+            settings.render.width = options.width;
+            settings.render.height = options.height;
+            settings.render.samples = options.samples;
+            settings.render.packets = options.packets;
+            settings.render.bidirectional = options.bidirectional;
+            settings.render.photons = options.photons;
+            settings.render.guiding = options.guiding;
+            settings.time_budget = options.time_budget;
+            settings.reference_dir = options.quality_dir;
+            settings.scene_filter = options.quality_scene;
+            job_pool pool{ options.thread_count, options.placement };
+            std::cout << std::setprecision(6);
+            if (options.make_references)
+                render_quality_references(settings, pool, std::cout);
+            else
+                run_quality_harness(settings, pool, std::cout);
+        }
+        catch (const std::exception& e)
+        {
+            std::cerr << e.what() << '\n';
+            return 1;
+        }
+        return 0;
+    }
+    if (!options.serve_socket.empty())
+    {
+        try
+        {
+            job_pool pool{ options.thread_count, options.placement };
+            render_server server{ pool, options.serve_socket, options.texture_cache_mb << 20, options.geometry_cache_mb << 20 };
+            server.run();
+        }
+        catch (const std::exception& e)
+        {
+            std::cerr << e.what() << '\n';
+            return 1;
+        }
+        return 0;
+    }
+    world scene;
+    std::shared_ptr<geometry_cache> geometry;
+    const auto report_geometry = [&]
+    {
+        if (geometry)
+            std::clog << "Geometry: " << geometry->faults() << " cluster faults, " << geometry->evictions() << " evictions, "
+                << (geometry->resident_bytes() >> 20) << " MiB resident\n";
+    };
+    try
+    {
+        std::shared_ptr<const image_texture> floor_texture;
+        if (!options.floor_texture.empty())
+        {
+            const auto textures = std::make_shared<texture_cache>(options.texture_cache_mb << 20);
+            floor_texture = std::make_shared<image_texture>(textures, options.floor_texture);
+        }
+        add_showcase_scene(scene, options.animate, std::move(floor_texture));
+        if (!options.mesh.empty())
+        {
+            geometry = std::make_shared<geometry_cache>(options.geometry_cache_mb << 20);
+            add_showcase_mesh(scene, geometry, options.mesh);
+        }
+        if (!options.environment.empty())
+        {
+            scene.set_environment(environment_map::load(options.environment, options.environment_intensity));
+        }
+    }
+    catch (const std::exception& e)
+    {
+        std::cerr << e.what() << '\n';
+        return 1;
+    }
 
-    const dielectric_material glass{ 1.5f };
-    mgr.add(new sphere(glass, transform{ {1.1, -1, 0},{0, 0, 0}, {1, 1, 1} }));
-    mgr.add(new inverted_facing<sphere>(glass, transform{ {1.1, -1, 0},{0, 0, 0}, {0.95, 0.95, 0.95} }));
+    if (options.benchmark || options.check_determinism)
+    {
+        try
+        {
+            benchmark_settings settings;
+            settings.render.width = options.width;
+            settings.render.height = options.height;
+            settings.render.samples = options.samples;
+            settings.render.packets = options.packets;
+            settings.render.bidirectional = options.bidirectional;
+            settings.render.photons = options.photons;
+            settings.render.guiding = options.guiding;
+            settings.reference = options.reference;
+            settings.output = options.benchmark_output;
 
-    const metallic_material gold{ {1.0f, 0.84f, 0.0f}, 0.0f };
-    mgr.add(new sphere{ gold, {{ -1.1, -1, 0 }, { 0,0,0 }, { 1,1,1 }} });
+            job_pool pool{ options.thread_count, options.placement };
+            // The showcase from the view the interactive mode starts with, or a harness scene
+            // from its view, such as the SDF shapes
+            camera cam;
+            std::optional<world> harness_scene;
+            if (options.quality_scene.empty())
+            {
+                cam.update(70.0f, static_cast<float>(options.width) / static_cast<float>(options.height));
+            }
+            else
+            {
+                const auto& quality = find_quality_scene(options.quality_scene);
+                harness_scene.emplace();
+                quality.build(*harness_scene);
+                cam.trans.set_position(quality.camera_position);
+                cam.update(quality.fov, static_cast<float>(options.width) / static_cast<float>(options.height));
+            }
+            auto& timed = harness_scene ? *harness_scene : scene;
+            timed.build(&pool);
+            (void)timed.update(0.0f);
+            if (options.check_determinism)
+            {
+                if (!check_determinism(timed, cam, settings, options.thread_count, std::cout))
+                {
+                    std::cerr << "The images differ between thread counts\n";
+                    return 1;
+                }
+                return 0;
+            }
+            std::cout << std::setprecision(6) << run_benchmark(timed, cam, settings, pool) << '\n';
+            report_geometry();
+        }
+        catch (const std::exception& e)
+        {
+            std::cerr << e.what() << '\n';
+            return 1;
+        }
+        return 0;
+    }
+    if (!options.poster.empty())
+    {
+        try
+        {
+            render_settings settings;
+            settings.width = options.width;
+            settings.height = options.height;
+            settings.samples = options.samples;
+            settings.packets = options.packets;
+            settings.bidirectional = options.bidirectional;
+            settings.photons = options.photons;
+            settings.guiding = options.guiding;
 
-    const lambertian_material wall1{ {0.7, 0.3, 0.3} };
-    mgr.add(new rectangle(wall1, {{ 3, -1.45, -2 }, { degToRad(90.0f),degToRad(-45.0f),0 }, { 1,1,1.5 }}));
-    const metallic_material wall2{ {0.95, 0.95, 0.95}, 0.03f };
-    mgr.add(new rectangle(wall2, { { -3, -1.45, -2 }, { degToRad(90.0f),degToRad(45.0f),0 }, { 1,1,1.5 } }));
+            job_pool pool{ options.thread_count, options.placement };
+            scene.build(&pool);
+            (void)scene.update(0.0f);
+            // The view the interactive mode starts with
+            camera cam;
+            cam.update(70.0f, static_cast<float>(options.width) / static_cast<float>(options.height));
+            const auto writer = open_scanline_writer(options.poster, options.width, options.height);
+            const auto start = time_now();
+            render_streamed(scene, cam, settings, pool, *writer, options.bands_in_flight);
+            std::cout << options.width << "x" << options.height << " written to " << options.poster.string() << " in " << time_now() - start << "s\n";
+            report_geometry();
+        }
+        catch (const std::exception& e)
+        {
+            std::cerr << e.what() << '\n';
+            return 1;
+        }
+        return 0;
+    }
+    if (!options.camera_path.empty())
+    {
+        try
+        {
+            const auto path = camera_path::load(options.camera_path);
+            sequence_settings settings;
+            settings.render.width = options.width;
+            settings.render.height = options.height;
+            settings.render.samples = options.samples;
+            settings.render.packets = options.packets;
+            settings.render.bidirectional = options.bidirectional;
+            settings.render.photons = options.photons;
+            settings.render.guiding = options.guiding;
+            settings.frames_in_flight = options.frames_in_flight;
+            settings.output_pattern = options.output_pattern;
+            settings.frame_count = options.frame_count ? options.frame_count : static_cast<size_t>(path.duration() * 24.0f) + 1;
 
-    const lambertian_material blue{ {0.2, 0.2, 0.6} };
-    mgr.add(new sphere(blue, {{ 0, -5, -10 }, { 0, 0, 0 }, { 5, 5, 5 }}));
+            // Animated objects are posed at the time of each frame on copies of the scene
+            job_pool pool{ options.thread_count, options.placement };
+            scene.build(&pool);
+            (void)scene.update(0.0f);
+            const auto start = time_now();
+            render_sequence(scene, path, settings, pool);
+            std::cout << settings.frame_count << " frames in " << time_now() - start << "s\n";
+            report_geometry();
+        }
+        catch (const std::exception& e)
+        {
+            std::cerr << e.what() << '\n';
+            return 1;
+        }
+        return 0;
+    }
 
+    render_scheduler mgr{ options, std::move(scene), std::move(geometry) };
 	mgr.run();
 	
     return 0;
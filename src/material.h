@@ -1,8 +1,12 @@
 #ifndef MATERIAL_H
 #define MATERIAL_H
+#include <cmath>
+#include <memory>
+#include <optional>
 #include <glm/glm.hpp>
 #include "ray.h"
 #include "utility.h"
+#include "texture.h"
 
 class material
 {
@@ -12,49 +16,75 @@ public:
 		glm::vec3 attenuation;
 		std::optional<ray> scattered;
 	};
-	[[nodiscard]] virtual shade_info shade(const glm::vec3& position, const glm::vec3& normal, const glm::vec3& view, bool front_facing, int& seed) const noexcept = 0;
-	[[nodiscard]] virtual glm::vec3 emission(const glm::vec3& position, const glm::vec3& normal, const glm::vec3& view, bool front_facing, int& seed) const noexcept
+	[[nodiscard]] virtual shade_info shade(const glm::vec3& position, const glm::vec3& normal, const glm::vec3& view, bool front_facing, const texture_coords& tex, int& seed) const noexcept = 0;
+	[[nodiscard]] virtual glm::vec3 emission(const glm::vec3& position, const glm::vec3& normal, const glm::vec3& view, bool front_facing, const texture_coords& tex, int& seed) const noexcept
 	{
 		return glm::vec3{ 0, 0, 0 };
 	}
+	// Whether emission() can be non-zero, so that the surface is sampled as a light
+	[[nodiscard]] virtual bool emissive() const noexcept
+	{
+		return false;
+	}
+	// Albedo of an ideal diffuse lobe, which lets the light be sampled directly at the hit.
+	// Materials returning non-zero here must scatter with a cosine distribution around the normal.
+	[[nodiscard]] virtual glm::vec3 diffuse_reflectance(const texture_coords& tex) const noexcept
+	{
+		return glm::vec3{ 0, 0, 0 };
+	}
+	// Normal of the surface that the scattered rays leave, which is the hit's own but for portals
+	[[nodiscard]] virtual glm::vec3 exit_normal(const glm::vec3& normal) const noexcept
+	{
+		return normal;
+	}
 	virtual ~material() = default;
 };
 class lambertian_material : public material
 {
 public:
 	glm::vec3 albedo;
+	// Multiplied with albedo when set
+	std::shared_ptr<const image_texture> albedo_map;
 
-	explicit lambertian_material(const glm::vec3& albedo) :
-		albedo{albedo}
+	explicit lambertian_material(const glm::vec3& albedo, std::shared_ptr<const image_texture> albedo_map = nullptr) :
+		albedo{albedo},
+		albedo_map{std::move(albedo_map)}
 	{
 	}
 private:
-	[[nodiscard]] shade_info shade(const glm::vec3& position, const glm::vec3& normal, const glm::vec3& view, bool front_facing, int& seed) const noexcept override
+	[[nodiscard]] shade_info shade(const glm::vec3& position, const glm::vec3& normal, const glm::vec3& view, bool front_facing, const texture_coords& tex, int& seed) const noexcept override
 	{
-		const auto scatter_dir = normalize(normal + random_unit_sphere_vector(seed));
+		const auto scatter_dir = glm::normalize(normal + random_unit_sphere_vector(seed));
 		return {
-			albedo,
+			diffuse_reflectance(tex),
 			ray{position, scatter_dir}
 		};
 	}
+	[[nodiscard]] glm::vec3 diffuse_reflectance(const texture_coords& tex) const noexcept override
+	{
+		return albedo_map ? albedo * albedo_map->sample(tex) : albedo;
+	}
 };
 class metallic_material : public material
 {
 public:
 	glm::vec3 albedo;
 	float roughness;
+	// Multiplied with albedo when set
+	std::shared_ptr<const image_texture> albedo_map;
 
-	metallic_material(const glm::vec3& albedo, float roughness) :
+	metallic_material(const glm::vec3& albedo, float roughness, std::shared_ptr<const image_texture> albedo_map = nullptr) :
 		albedo{albedo},
-		roughness{roughness}
+		roughness{roughness},
+		albedo_map{std::move(albedo_map)}
 	{
 	}
 private:
-	[[nodiscard]] shade_info shade(const glm::vec3& position, const glm::vec3& normal, const glm::vec3& view, bool front_facing, int& seed) const noexcept override
+	[[nodiscard]] shade_info shade(const glm::vec3& position, const glm::vec3& normal, const glm::vec3& view, bool front_facing, const texture_coords& tex, int& seed) const noexcept override
 	{
 		const auto scatter_dir = reflect(view, normal) + roughness * random_hemisphere_vector(seed);
 		return {
-			albedo,
+			albedo_map ? albedo * albedo_map->sample(tex) : albedo,
 			ray{position, scatter_dir}
 		};
 	}
@@ -67,8 +97,12 @@ public:
 		from_to_transform{to.to_mat4() * inverse(from.to_mat4())}
 	{
 	}
+	[[nodiscard]] glm::vec3 exit_normal(const glm::vec3& normal) const noexcept override
+	{
+		return glm::normalize(glm::vec3{ from_to_transform * glm::vec4{ normal, 0.0f } });
+	}
 private:
-	[[nodiscard]] shade_info shade(const glm::vec3& position, const glm::vec3& normal, const glm::vec3& view, bool front_facing, int& seed) const noexcept override
+	[[nodiscard]] shade_info shade(const glm::vec3& position, const glm::vec3& normal, const glm::vec3& view, bool front_facing, const texture_coords& tex, int& seed) const noexcept override
 	{
 		return {
 			glm::vec3{1,1,1},
@@ -86,17 +120,21 @@ public:
 	{
 	}
 protected:
-	[[nodiscard]] shade_info shade(const glm::vec3& position, const glm::vec3& normal, const glm::vec3& view, bool front_facing, int& seed) const noexcept override
+	[[nodiscard]] shade_info shade(const glm::vec3& position, const glm::vec3& normal, const glm::vec3& view, bool front_facing, const texture_coords& tex, int& seed) const noexcept override
 	{
 		return {
-			glm::vec3{1,1,1},
+			glm::vec3{0,0,0},
 			std::nullopt
 		};
 	}
-	[[nodiscard]] glm::vec3 emission(const glm::vec3& position, const glm::vec3& normal, const glm::vec3& view, bool front_facing, int& seed) const noexcept override
+	[[nodiscard]] glm::vec3 emission(const glm::vec3& position, const glm::vec3& normal, const glm::vec3& view, bool front_facing, const texture_coords& tex, int& seed) const noexcept override
 	{
 		return color;
 	}
+	[[nodiscard]] bool emissive() const noexcept override
+	{
+		return color != glm::vec3{ 0, 0, 0 };
+	}
 };
 class dielectric_material : public material
 {
@@ -111,12 +149,12 @@ public:
 	{
 	}
 protected:
-	[[nodiscard]] shade_info shade(const glm::vec3& position, const glm::vec3& normal, const glm::vec3& view, bool front_facing, int& seed) const noexcept override
+	[[nodiscard]] shade_info shade(const glm::vec3& position, const glm::vec3& normal, const glm::vec3& view, bool front_facing, const texture_coords& tex, int& seed) const noexcept override
 	{
 		const auto ior_ratio = front_facing ? (1.0f / ior) : ior;
 
 		const auto cos_theta = dot(-view, normal);
-		const auto sin_theta = sqrt(1.0f - cos_theta * cos_theta);
+		const auto sin_theta = std::sqrt(1.0f - cos_theta * cos_theta);
 
 		const bool cannot_refract = ior_ratio * sin_theta > 1.0f;
 		glm::vec3 direction;
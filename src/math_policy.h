@@ -0,0 +1,164 @@
+#ifndef MATH_POLICY_H
+#define MATH_POLICY_H
+#include <bit>
+#include <cmath>
+#include <cstdint>
+#include <glm/glm.hpp>
+#if defined(__SSE__) || defined(_M_X64) || (defined(_M_IX86_FP) && _M_IX86_FP >= 1)
+#include <xmmintrin.h>
+#define MATH_POLICY_HAS_SSE
+#endif
+
+inline constexpr long double pi = 3.14159265358979323846264338327950288419716939937510L;
+
+[[nodiscard]] inline float fast_sqrt(float x) noexcept
+{
+	// from https://stackoverflow.com/a/18662665/12501684
+	auto i = std::bit_cast<uint32_t>(x);
+	i += 127 << 23;
+	i >>= 1;
+	return std::bit_cast<float>(i);
+}
+[[nodiscard]] inline float fast_rsqrt(float x) noexcept
+{
+	// Bit hack estimate refined by one Newton step, within 0.2% of 1/sqrt(x)
+	const auto y = std::bit_cast<float>(0x5f375a86u - (std::bit_cast<uint32_t>(x) >> 1));
+	return y * (1.5f - 0.5f * x * y * y);
+}
+template <typename Sqrt>
+[[nodiscard]] inline float fast_acos(float a, Sqrt&& sqrt) noexcept
+{
+	// from https://stackoverflow.com/a/48157547/12501684
+	const float C = 0.10501094f;
+	const auto t = (a < 0) ? (-a) : a;  // handle negative arguments
+	const auto u = 1.0f - t;
+	const auto s = sqrt(u + u);
+	auto r = C * u * s + s;  // or fmaf (C * u, s, s) if FMA support in hardware
+	if (a < 0) r = static_cast<float>(pi) - r;  // handle negative arguments
+	return r;
+}
+[[nodiscard]] inline float fast_acos(float a) noexcept
+{
+	return fast_acos(a, fast_sqrt);
+}
+template<typename Arithmetic>
+Arithmetic fast_cos(Arithmetic x) noexcept
+{
+	// from https://stackoverflow.com/a/28050328/12501684
+	constexpr Arithmetic tp{ 1.0L / (2.0L * pi) };
+	x *= tp;
+	x -= Arithmetic(.25) + std::floor(x + Arithmetic(.25));
+	x *= Arithmetic(16.) * (std::abs(x) - Arithmetic(.5));
+	return x;
+}
+
+// Precision policies for the math on the hot path. Each one provides the same
+// static functions, so code templated on a policy (or using default_math) can be
+// built with any of them and compared for speed and image error. They are only
+// used for sampling directions, texture coordinates and points on lights: the
+// intersections, camera rays and surface normals always use glm directly, as the
+// error of a ray parameter grows with the distance it is measured over.
+
+// The standard library and glm
+struct exact_math
+{
+	constexpr static const char* name = "exact";
+
+	[[nodiscard]] static float sqrt(float x) noexcept
+	{
+		return std::sqrt(x);
+	}
+	[[nodiscard]] static float cos(float x) noexcept
+	{
+		return std::cos(x);
+	}
+	[[nodiscard]] static float acos(float x) noexcept
+	{
+		return std::acos(x);
+	}
+	[[nodiscard]] static float length(const glm::vec3& v) noexcept
+	{
+		return glm::length(v);
+	}
+	[[nodiscard]] static glm::vec3 normalize(const glm::vec3& v) noexcept
+	{
+		return glm::normalize(v);
+	}
+};
+
+// Scalar bit hacks and polynomial approximations
+struct fast_math
+{
+	constexpr static const char* name = "fast";
+
+	[[nodiscard]] static float sqrt(float x) noexcept
+	{
+		return x > 0.0f ? x * fast_rsqrt(x) : 0.0f;
+	}
+	[[nodiscard]] static float cos(float x) noexcept
+	{
+		return fast_cos(x);
+	}
+	[[nodiscard]] static float acos(float x) noexcept
+	{
+		return fast_acos(x, sqrt);
+	}
+	[[nodiscard]] static float length(const glm::vec3& v) noexcept
+	{
+		return sqrt(dot(v, v));
+	}
+	[[nodiscard]] static glm::vec3 normalize(const glm::vec3& v) noexcept
+	{
+		return v * fast_rsqrt(dot(v, v));
+	}
+};
+
+// The hardware reciprocal square root estimate, refined by one Newton step.
+// Falls back to fast_math where SSE isn't available.
+struct simd_approx_math
+{
+	constexpr static const char* name = "simd";
+
+	[[nodiscard]] static float rsqrt(float x) noexcept
+	{
+#ifdef MATH_POLICY_HAS_SSE
+		const auto y = _mm_cvtss_f32(_mm_rsqrt_ss(_mm_set_ss(x)));
+		return y * (1.5f - 0.5f * x * y * y);
+#else
+		return fast_rsqrt(x);
+#endif
+	}
+	[[nodiscard]] static float sqrt(float x) noexcept
+	{
+		return x > 0.0f ? x * rsqrt(x) : 0.0f;
+	}
+	[[nodiscard]] static float cos(float x) noexcept
+	{
+		// fast_cos with its extra precision step
+		const auto y = fast_cos(x);
+		return y + 0.225f * y * (std::abs(y) - 1.0f);
+	}
+	[[nodiscard]] static float acos(float x) noexcept
+	{
+		return fast_acos(x, sqrt);
+	}
+	[[nodiscard]] static float length(const glm::vec3& v) noexcept
+	{
+		return sqrt(dot(v, v));
+	}
+	[[nodiscard]] static glm::vec3 normalize(const glm::vec3& v) noexcept
+	{
+		return v * rsqrt(dot(v, v));
+	}
+};
+
+// Chosen at build time with the MATH_POLICY CMake option. The approximations are opt-in.
+#if defined(MATH_POLICY_FAST)
+using default_math = fast_math;
+#elif defined(MATH_POLICY_SIMD)
+using default_math = simd_approx_math;
+#else
+using default_math = exact_math;
+#endif
+
+#endif // MATH_POLICY_H
@@ -0,0 +1,156 @@
+#ifndef MESH_H
+#define MESH_H
+#include <array>
+#include <cmath>
+#include <filesystem>
+#include <limits>
+#include <memory>
+#include <optional>
+#include <glm/glm.hpp>
+#include "raytraceable.h"
+#include "geometry_cache.h"
+
+// Triangle mesh read from an OBJ file through a geometry_cache, which pages its clusters in
+// as rays reach them. Triangles face the side from which their vertices go counterclockwise.
+// The primitive of a hit is its cluster and its triangle in the cluster.
+class mesh : public raytraceable
+{
+	constexpr static uint32_t triangle_bits = 10;
+	static_assert(detail::max_cluster_triangles <= 1u << triangle_bits);
+
+	std::shared_ptr<geometry_cache> cache;
+	const mesh_file* file;
+
+	// Calls visit(leaf) for the leaves of the hierarchy starting at nodes whose bounds r
+	// enters before max_t, nearest first. visit may lower max_t as it finds hits.
+	template <typename Func>
+	static void traverse(const detail::mesh_node* nodes, const ray& r, const glm::vec3& inv_dir, const float& max_t, Func&& visit)
+	{
+		struct entry
+		{
+			uint32_t node;
+			float t;
+		};
+		// The trees are balanced, so even 2^32 triangles are 32 levels deep
+		std::array<entry, 64> stack;
+		size_t stack_size = 0;
+		stack[stack_size++] = { 0, nodes[0].bounds.intersect(r, inv_dir) };
+		while (stack_size > 0)
+		{
+			const auto [node_idx, t] = stack[--stack_size];
+			if (!(t < max_t))
+				continue;
+			const auto& n = nodes[node_idx];
+			if (n.count > 0)
+			{
+				visit(n);
+				continue;
+			}
+			entry first{ n.first, nodes[n.first].bounds.intersect(r, inv_dir) };
+			entry second{ n.first + 1, nodes[n.first + 1].bounds.intersect(r, inv_dir) };
+			if (second.t < first.t)
+				std::swap(first, second);
+			if (second.t < max_t)
+				stack[stack_size++] = second;
+			if (first.t < max_t)
+				stack[stack_size++] = first;
+		}
+	}
+	// Möller-Trumbore
+	[[nodiscard]] static float intersect_triangle(const detail::mesh_triangle& tri, const ray& r) noexcept
+	{
+		constexpr auto miss = std::numeric_limits<float>::infinity();
+		const auto e1 = tri.v1 - tri.v0;
+		const auto e2 = tri.v2 - tri.v0;
+		const auto p = cross(r.direction, e2);
+		const auto det = dot(e1, p);
+		if (std::abs(det) < 1e-12f)
+			return miss;
+		const auto inv_det = 1.0f / det;
+		const auto s = r.origin - tri.v0;
+		const auto u = dot(s, p) * inv_det;
+		if (u < 0.0f || u > 1.0f)
+			return miss;
+		const auto q = cross(s, e1);
+		const auto v = dot(r.direction, q) * inv_det;
+		if (v < 0.0f || u + v > 1.0f)
+			return miss;
+		const auto t = dot(e2, q) * inv_det;
+		return t > 0.0f ? t : miss;
+	}
+	[[nodiscard]] const detail::mesh_triangle& triangle(uint32_t primitive) const noexcept
+	{
+		return cache->cluster(*file, primitive >> triangle_bits).triangles[primitive & ((1u << triangle_bits) - 1)];
+	}
+public:
+	mesh(const material& m, const transform& trans, std::shared_ptr<geometry_cache> cache, const std::filesystem::path& obj) :
+		raytraceable{ m, trans },
+		cache{ std::move(cache) },
+		file{ &this->cache->open(obj) }
+	{
+	}
+	[[nodiscard]] std::unique_ptr<raytraceable> clone() const override
+	{
+		return std::make_unique<mesh>(*this);
+	}
+protected:
+	[[nodiscard]] std::optional<float> _intersect(const ray& r) const noexcept override
+	{
+		uint32_t primitive;
+		return _intersect_primitive(r, primitive);
+	}
+	[[nodiscard]] std::optional<float> _intersect_primitive(const ray& r, uint32_t& primitive) const noexcept override
+	{
+		const auto inv_dir = 1.0f / r.direction;
+		auto closest = std::numeric_limits<float>::infinity();
+		traverse(file->nodes().data(), r, inv_dir, closest, [&](const detail::mesh_node& top_leaf)
+		{
+			const auto cluster = top_leaf.first;
+			const auto view = cache->cluster(*file, cluster);
+			traverse(view.nodes, r, inv_dir, closest, [&](const detail::mesh_node& leaf)
+			{
+				for (auto i = leaf.first; i < leaf.first + leaf.count; ++i)
+				{
+					const auto t = intersect_triangle(view.triangles[i], r);
+					if (t < closest)
+					{
+						closest = t;
+						primitive = cluster << triangle_bits | i;
+					}
+				}
+			});
+		});
+		if (closest == std::numeric_limits<float>::infinity())
+			return std::nullopt;
+		return closest;
+	}
+	[[nodiscard]] local_surface _surface(const ray& r, const glm::vec3& local_pos, uint32_t primitive) const noexcept override
+	{
+		const auto& tri = triangle(primitive);
+		const auto normal = cross(tri.v1 - tri.v0, tri.v2 - tri.v0);
+		return { normal, dot(normal, r.direction) < 0.0f, { local_pos.x, local_pos.z } };
+	}
+	// Only _surface knows which triangle was hit, these are for wrappers that meshes don't support
+	[[nodiscard]] bool _front_facing(const ray& r) const noexcept override
+	{
+		return true;
+	}
+	[[nodiscard]] glm::vec3 _normal(const glm::vec3& local_pos) const noexcept override
+	{
+		return { 0, -1, 0 };
+	}
+	// The texture repeats every unit, seen from above
+	[[nodiscard]] glm::vec2 _uv(const glm::vec3& local_pos) const noexcept override
+	{
+		return { local_pos.x, local_pos.z };
+	}
+	[[nodiscard]] float _uv_per_unit() const noexcept override
+	{
+		return 1.0f;
+	}
+	[[nodiscard]] std::optional<aabb> _bounds() const noexcept override
+	{
+		return file->nodes().front().bounds;
+	}
+};
+#endif // MESH_H
@@ -0,0 +1,124 @@
+#ifndef OBJECT_EDIT_H
+#define OBJECT_EDIT_H
+#include <algorithm>
+#include <array>
+#include <memory>
+#include <optional>
+#include <glm/glm.hpp>
+#include "material.h"
+#include "transform.h"
+
+// Changes the interactive mode makes to the object picked with the left mouse button.
+// Moves are along the world axes, whose up is -y.
+enum class object_edit
+{
+	move_left, move_right, move_up, move_down, move_away, move_closer,
+	grow, shrink,
+	next_color, darker, brighter,
+	smoother, rougher // roughness of metals, index of refraction of glass
+};
+
+[[nodiscard]] inline std::optional<object_edit> object_edit_for_key(int key) noexcept
+{
+	switch (key)
+	{
+	case 'h': return object_edit::move_left;
+	case 'l': return object_edit::move_right;
+	case 'k': return object_edit::move_up;
+	case 'j': return object_edit::move_down;
+	case 'u': return object_edit::move_away;
+	case 'n': return object_edit::move_closer;
+	case '=': return object_edit::grow;
+	case '-': return object_edit::shrink;
+	case 'c': return object_edit::next_color;
+	case '[': return object_edit::darker;
+	case ']': return object_edit::brighter;
+	case ',': return object_edit::smoother;
+	case '.': return object_edit::rougher;
+	default: return std::nullopt;
+	}
+}
+
+[[nodiscard]] inline bool edits_transform(object_edit edit) noexcept
+{
+	return edit <= object_edit::shrink;
+}
+
+[[nodiscard]] inline transform edited_transform(transform trans, object_edit edit) noexcept
+{
+	constexpr auto step = 0.1f;
+	switch (edit)
+	{
+	case object_edit::move_left: trans.translate({ -step, 0, 0 }); break;
+	case object_edit::move_right: trans.translate({ step, 0, 0 }); break;
+	case object_edit::move_up: trans.translate({ 0, -step, 0 }); break;
+	case object_edit::move_down: trans.translate({ 0, step, 0 }); break;
+	case object_edit::move_away: trans.translate({ 0, 0, -step }); break;
+	case object_edit::move_closer: trans.translate({ 0, 0, step }); break;
+	case object_edit::grow: trans.set_scale(trans.get_scale() * 1.1f); break;
+	case object_edit::shrink: trans.set_scale(trans.get_scale() / 1.1f); break;
+	default: break;
+	}
+	return trans;
+}
+
+// Copy of mat with the edit applied, or nullptr if mat has nothing it changes
+[[nodiscard]] inline std::unique_ptr<material> edited_material(const material& mat, object_edit edit)
+{
+	static const std::array<glm::vec3, 6> palette{ {
+		{ 0.7f, 0.3f, 0.3f }, { 0.3f, 0.7f, 0.3f }, { 0.2f, 0.2f, 0.6f }, { 0.8f, 0.7f, 0.2f }, { 0.7f, 0.7f, 0.7f }, { 0.1f, 0.1f, 0.1f }
+	} };
+	// Steps through the palette from the entry nearest to color
+	const auto next_color = [&](const glm::vec3& color)
+	{
+		size_t nearest = 0;
+		for (size_t i = 1; i < palette.size(); ++i)
+		{
+			if (glm::distance(palette[i], color) < glm::distance(palette[nearest], color))
+				nearest = i;
+		}
+		return palette[(nearest + 1) % palette.size()];
+	};
+	const auto scale = edit == object_edit::darker ? 0.8f : 1.25f;
+	if (const auto* m = dynamic_cast<const lambertian_material*>(&mat))
+	{
+		auto albedo = m->albedo;
+		if (edit == object_edit::next_color)
+			albedo = next_color(albedo);
+		else if (edit == object_edit::darker || edit == object_edit::brighter)
+			albedo = glm::min(albedo * scale, glm::vec3{ 1 });
+		else
+			return nullptr;
+		return std::make_unique<lambertian_material>(albedo, m->albedo_map);
+	}
+	if (const auto* m = dynamic_cast<const metallic_material*>(&mat))
+	{
+		auto albedo = m->albedo;
+		auto roughness = m->roughness;
+		if (edit == object_edit::next_color)
+			albedo = next_color(albedo);
+		else if (edit == object_edit::darker || edit == object_edit::brighter)
+			albedo = glm::min(albedo * scale, glm::vec3{ 1 });
+		else if (edit == object_edit::smoother || edit == object_edit::rougher)
+			roughness = std::clamp(roughness + (edit == object_edit::rougher ? 0.05f : -0.05f), 0.0f, 1.0f);
+		else
+			return nullptr;
+		return std::make_unique<metallic_material>(albedo, roughness, m->albedo_map);
+	}
+	if (const auto* m = dynamic_cast<const emmisive_material*>(&mat))
+	{
+		const auto brightness = std::max({ m->color.r, m->color.g, m->color.b });
+		if (edit == object_edit::next_color && brightness > 0.0f)
+			return std::make_unique<emmisive_material>(next_color(m->color / brightness) * brightness);
+		if (edit == object_edit::darker || edit == object_edit::brighter)
+			return std::make_unique<emmisive_material>(m->color * scale);
+		return nullptr;
+	}
+	if (const auto* m = dynamic_cast<const dielectric_material*>(&mat))
+	{
+		if (edit == object_edit::smoother || edit == object_edit::rougher)
+			return std::make_unique<dielectric_material>(std::max(m->ior + (edit == object_edit::rougher ? 0.05f : -0.05f), 1.0f));
+	}
+	return nullptr;
+}
+#endif // OBJECT_EDIT_H
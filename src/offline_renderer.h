@@ -0,0 +1,481 @@
+#ifndef OFFLINE_RENDERER_H
+#define OFFLINE_RENDERER_H
+#include <algorithm>
+#include <array>
+#include <deque>
+#include <string>
+#include <filesystem>
+#include <iostream>
+#include <memory>
+#include <stdexcept>
+#include <glm/glm.hpp>
+#include "world.h"
+#include "bidirectional.h"
+#include "photon_tracer.h"
+#include "guided_tracer.h"
+#include "camera.h"
+#include "camera_path.h"
+#include "framebuffer.h"
+#include "image_writer.h"
+#include "scanline_writer.h"
+#include "job_pool.h"
+#include "utility.h"
+#include "cpu_dispatch.h"
+
+struct render_settings
+{
+	size_t width = 1280;
+	size_t height = 720;
+	int samples = 64;
+	int max_depth = 32;
+	size_t tile_size = 32;
+	bool packets = true; // trace primary rays in 8x8 packets
+	// Use the bidirectional path tracer, which needs a splat buffer; packets are ignored then
+	bool bidirectional = false;
+	// Photons shot per frame for the caustics, which need a photon map; 0 path traces them
+	size_t photons = 0;
+	// Guide the paths by where light came from in earlier passes, of 1, 2, 4, ... samples per pixel
+	bool guiding = false;
+};
+
+// Seeds one sample of the pixels of a block, block_width wide and starting at (block_x,
+// block_y), row by row, and jitters their image coordinates. count is a multiple of block_width.
+inline void jitter_block(uint64_t image_key, size_t block_x, size_t block_y, size_t block_width, size_t count, int sample, float xMax, float yMax, int* seeds, float* us, float* vs) noexcept
+{
+	for (size_t row = 0; row < count / block_width; ++row)
+	{
+		const auto y = block_y + row;
+		for (size_t col = 0; col < block_width; ++col)
+		{
+			const auto x = block_x + col;
+			const auto lane = row * block_width + col;
+			auto seed = pixel_seed(image_key, static_cast<uint32_t>(x), static_cast<uint32_t>(y), sample);
+			us[lane] = (x + 0.5f * sfrand(seed)) / xMax;
+			vs[lane] = (y + 0.5f * sfrand(seed)) / yMax;
+			seeds[lane] = seed;
+		}
+	}
+}
+
+// Renders every pixel of tile to its final sample count. image_key identifies the image
+// (e.g. the frame index), and every sample is seeded by it and its pixel, so the result
+// is the same however the image is split into tiles and whichever thread renders them.
+// The bidirectional tracer also splats into splats, which add_splats adds to the image
+// once all tiles are done. With settings.photons, the caustics are gathered from photons,
+// which photon_tracer::emit must have shot for the image. target holds the rows of the
+// image from first_row on.
+inline void render_tile(const world& scene, const camera& cam, const tile_range& tile, const render_settings& settings, uint64_t image_key, framebuffer& target, splat_buffer* splats = nullptr, const photon_map* photons = nullptr, size_t first_row = 0)
+{
+	const float xMax = settings.width - 1;
+	const float yMax = settings.height - 1;
+	const auto weight = 1.0f / static_cast<float>(settings.samples);
+	const auto spread = cam.pixel_spread(settings.height);
+	auto buffer = target.buffer();
+	if (settings.guiding)
+	{
+		throw std::invalid_argument("Guided frames are rendered in passes by render_frame");
+	}
+	if (settings.bidirectional)
+	{
+		if (!splats)
+		{
+			throw std::invalid_argument("The bidirectional path tracer needs a splat buffer");
+		}
+		bidirectional_tracer tracer{ scene, cam, *splats, settings.max_depth };
+		for (auto y = tile.y_begin; y < tile.y_end; ++y) {
+			for (auto x = tile.x_begin; x < tile.x_end; ++x) {
+				glm::vec3 color{ 0, 0, 0 };
+				for (int sample = 0; sample < settings.samples; ++sample)
+				{
+					auto seed = pixel_seed(image_key, static_cast<uint32_t>(x), static_cast<uint32_t>(y), sample);
+					const auto u = (x + 0.5f * sfrand(seed)) / xMax;
+					const auto v = (y + 0.5f * sfrand(seed)) / yMax;
+					color += tracer.trace(cam.get_ray(u, v, spread), seed);
+				}
+				buffer[y - first_row][x] = glm::vec4{ color * weight, 1.0f };
+			}
+		}
+		return;
+	}
+	if (settings.photons > 0)
+	{
+		if (!photons)
+		{
+			throw std::invalid_argument("Photon mapping needs a photon map");
+		}
+		const photon_tracer tracer{ scene, *photons, settings.max_depth };
+		for (auto y = tile.y_begin; y < tile.y_end; ++y) {
+			for (auto x = tile.x_begin; x < tile.x_end; ++x) {
+				glm::vec3 color{ 0, 0, 0 };
+				for (int sample = 0; sample < settings.samples; ++sample)
+				{
+					auto seed = pixel_seed(image_key, static_cast<uint32_t>(x), static_cast<uint32_t>(y), sample);
+					const auto u = (x + 0.5f * sfrand(seed)) / xMax;
+					const auto v = (y + 0.5f * sfrand(seed)) / yMax;
+					color += tracer.trace(cam.get_ray(u, v, spread), seed);
+				}
+				buffer[y - first_row][x] = glm::vec4{ color * weight, 1.0f };
+			}
+		}
+		return;
+	}
+	if (settings.packets)
+	{
+		constexpr auto block = ray_packet::block_size;
+		ray_packet packet;
+		std::array<float, ray_packet::max_size> us, vs;
+		std::array<int, ray_packet::max_size> seeds;
+		std::array<glm::vec3, ray_packet::max_size> colors, sums;
+		for (auto block_y = tile.y_begin; block_y < tile.y_end; block_y += block) {
+			for (auto block_x = tile.x_begin; block_x < tile.x_end; block_x += block) {
+				const auto block_width = std::min(block, tile.x_end - block_x);
+				const auto count = block_width * std::min(block, tile.y_end - block_y);
+				std::fill_n(sums.begin(), count, glm::vec3{ 0, 0, 0 });
+				for (int sample = 0; sample < settings.samples; ++sample)
+				{
+					isa_dispatch<&jitter_block>(image_key, block_x, block_y, block_width, count, sample, xMax, yMax, seeds.data(), us.data(), vs.data());
+					cam.get_packet(us, vs, count, spread, packet);
+					scene.raytrace(packet, settings.max_depth, seeds.data(), colors.data());
+					for (size_t lane = 0; lane < count; ++lane)
+						sums[lane] += colors[lane];
+				}
+				for (size_t lane = 0; lane < count; ++lane)
+					buffer[block_y - first_row + lane / block_width][block_x + lane % block_width] = glm::vec4{ sums[lane] * weight, 1.0f };
+			}
+		}
+		return;
+	}
+	for (auto y = tile.y_begin; y < tile.y_end; ++y) {
+		for (auto x = tile.x_begin; x < tile.x_end; ++x) {
+			glm::vec3 color{ 0, 0, 0 };
+			for (int sample = 0; sample < settings.samples; ++sample)
+			{
+				auto seed = pixel_seed(image_key, static_cast<uint32_t>(x), static_cast<uint32_t>(y), sample);
+				const auto u = (x + 0.5f * sfrand(seed)) / xMax;
+				const auto v = (y + 0.5f * sfrand(seed)) / yMax;
+				color += scene.raytrace(cam.get_ray(u, v, spread), settings.max_depth, seed);
+			}
+			buffer[y - first_row][x] = glm::vec4{ color * weight, 1.0f };
+		}
+	}
+}
+
+// Adds the splats of tile, averaged over samples per pixel, to target
+inline void add_splats(const splat_buffer& splats, const tile_range& tile, int samples, framebuffer& target)
+{
+	const auto weight = 1.0f / static_cast<float>(samples);
+	auto buffer = target.buffer();
+	for (auto y = tile.y_begin; y < tile.y_end; ++y) {
+		for (auto x = tile.x_begin; x < tile.x_end; ++x) {
+			buffer[y][x] += glm::vec4{ splats.get(x, y) * weight, 0.0f };
+		}
+	}
+}
+
+// Adds samples [first_sample, first_sample + sample_count) of every pixel of tile, traced
+// by the guided path tracer and weighted as one of settings.samples, to target. The first
+// samples overwrite target.
+inline void render_guided_tile(const world& scene, const camera& cam, const tile_range& tile, const render_settings& settings, uint64_t image_key, int first_sample, int sample_count, path_guide& guide, framebuffer& target)
+{
+	const float xMax = settings.width - 1;
+	const float yMax = settings.height - 1;
+	const auto weight = 1.0f / static_cast<float>(settings.samples);
+	const auto spread = cam.pixel_spread(settings.height);
+	auto buffer = target.buffer();
+	guided_tracer tracer{ scene, guide, settings.max_depth };
+	for (auto y = tile.y_begin; y < tile.y_end; ++y) {
+		for (auto x = tile.x_begin; x < tile.x_end; ++x) {
+			glm::vec3 color{ 0, 0, 0 };
+			for (auto sample = first_sample; sample < first_sample + sample_count; ++sample)
+			{
+				auto seed = pixel_seed(image_key, static_cast<uint32_t>(x), static_cast<uint32_t>(y), sample);
+				const auto u = (x + 0.5f * sfrand(seed)) / xMax;
+				const auto v = (y + 0.5f * sfrand(seed)) / yMax;
+				color += tracer.trace(cam.get_ray(u, v, spread), seed);
+			}
+			const auto previous = first_sample > 0 ? glm::vec3{ buffer[y][x] } : glm::vec3{ 0, 0, 0 };
+			buffer[y][x] = glm::vec4{ previous + color * weight, 1.0f };
+		}
+	}
+}
+
+// Renders a whole frame on the pool and waits for it. Frames with the same index come out
+// bit for bit the same, whatever the number of threads in the pool.
+inline void render_frame(const world& scene, const camera& cam, const render_settings& settings, job_pool& pool, uint64_t frame_idx, framebuffer& target)
+{
+	target.update_size_for_overwrite(settings.width, settings.height);
+	if (settings.guiding)
+	{
+		// Every pass trains the guide for the next one, which takes twice the samples. The last
+		// pass takes all that are left once they're too few for another two.
+		path_guide guide{ guided_tracer::scene_bounds(scene) };
+		for (int first_sample = 0, pass_samples = 1; first_sample < settings.samples; pass_samples *= 2)
+		{
+			const auto left = settings.samples - first_sample;
+			const auto sample_count = left - pass_samples < 2 * pass_samples ? left : pass_samples;
+			pool.parallel_for_tiles(settings.width, settings.height, settings.tile_size, [&](const tile_range& tile)
+			{
+				render_guided_tile(scene, cam, tile, settings, frame_idx, first_sample, sample_count, guide, target);
+			});
+			first_sample += sample_count;
+			if (first_sample < settings.samples)
+				guide.refine(pool, sample_count);
+		}
+		return;
+	}
+	splat_buffer splats;
+	if (settings.bidirectional)
+		splats.resize(settings.width, settings.height);
+	photon_map photons;
+	if (settings.photons > 0)
+		photon_tracer::emit(scene, pool, settings.photons, frame_idx, settings.max_depth, photons);
+	pool.parallel_for_tiles(settings.width, settings.height, settings.tile_size, [&](const tile_range& tile)
+	{
+		render_tile(scene, cam, tile, settings, frame_idx, target, &splats, &photons);
+	});
+	if (settings.bidirectional)
+	{
+		pool.parallel_for_tiles(settings.width, settings.height, settings.tile_size, [&](const tile_range& tile)
+		{
+			add_splats(splats, tile, settings.samples, target);
+		});
+	}
+}
+
+// Renders an image in bands of settings.tile_size rows, each to its final sample count, and
+// streams them to writer from the top down, so that the image never has to fit in memory.
+// Up to bands_in_flight bands are rendered at once, while the finished ones are written.
+// The bidirectional and the guided tracer need the whole image at once, so they can't be used.
+inline void render_streamed(const world& scene, const camera& cam, const render_settings& settings, job_pool& pool, scanline_writer& writer, size_t bands_in_flight = 4)
+{
+	if (settings.bidirectional || settings.guiding)
+	{
+		throw std::invalid_argument("Streamed images can't be rendered bidirectionally or with guiding");
+	}
+	photon_map photons;
+	if (settings.photons > 0)
+		photon_tracer::emit(scene, pool, settings.photons, 0, settings.max_depth, photons);
+	const auto band_rows = settings.tile_size;
+	const auto band_count = (settings.height + band_rows - 1) / band_rows;
+	const auto tiles_x = (settings.width + settings.tile_size - 1) / settings.tile_size;
+	// Band b is rendered into buffers[b % buffers.size()]
+	std::vector<framebuffer> buffers(std::max<size_t>(bands_in_flight, 1));
+	for (auto& buffer : buffers)
+		buffer.update_size_for_overwrite(settings.width, band_rows);
+	std::deque<std::vector<job<void>>> in_flight;
+	size_t written = 0;
+	const auto write_oldest = [&]
+	{
+		for (const auto& tile : in_flight.front())
+			tile.get();
+		in_flight.pop_front();
+		const auto y = written * band_rows;
+		writer.write_rows(buffers[written % buffers.size()].buffer().data, std::min(band_rows, settings.height - y));
+		++written;
+	};
+	try
+	{
+		for (size_t band = 0; band < band_count; ++band)
+		{
+			if (in_flight.size() == buffers.size())
+				write_oldest();
+			const auto y = band * band_rows;
+			auto& target = buffers[band % buffers.size()];
+			auto& tiles = in_flight.emplace_back();
+			tiles.reserve(tiles_x);
+			for (size_t x = 0; x < settings.width; x += settings.tile_size)
+			{
+				const tile_range tile{ x, y, std::min(x + settings.tile_size, settings.width), std::min(y + band_rows, settings.height) };
+				tiles.push_back(pool.submit([&scene, &cam, &settings, &photons, &target, tile, y]
+				{
+					render_tile(scene, cam, tile, settings, 0, target, nullptr, &photons, y);
+				}));
+			}
+		}
+		while (!in_flight.empty())
+			write_oldest();
+	}
+	catch (...)
+	{
+		// The tiles still being rendered refer to the buffers
+		for (const auto& tiles : in_flight)
+		{
+			for (const auto& tile : tiles)
+				tile.wait();
+		}
+		throw;
+	}
+	writer.finish();
+}
+
+struct sequence_settings
+{
+	render_settings render;
+	size_t frame_count = 1;
+	// Frames rendered at the same time, so that the tail of one frame overlaps with the next
+	size_t frames_in_flight = 2;
+	// Every run of '#' is replaced by the zero padded frame number
+	std::string output_pattern = "frame_####.png";
+};
+
+[[nodiscard]] inline std::filesystem::path sequence_frame_path(const std::string& pattern, size_t frame_idx)
+{
+	auto number = std::to_string(frame_idx);
+	const auto first = pattern.find('#');
+	if (first == std::string::npos)
+	{
+		const std::filesystem::path path{ pattern };
+		return path.parent_path() / (path.stem().string() + "_" + number + path.extension().string());
+	}
+	const auto last = pattern.find_first_not_of('#', first);
+	const auto width = (last == std::string::npos ? pattern.size() : last) - first;
+	if (number.size() < width)
+		number.insert(0, width - number.size(), '0');
+	return pattern.substr(0, first) + number + (last == std::string::npos ? "" : pattern.substr(last));
+}
+
+// Renders frame_count frames along path to numbered image files. Tiles of up to
+// frames_in_flight frames are queued on the pool at once, and every frame is
+// written out by a job that depends on all of its tiles. Animated scenes are posed
+// at the time of each frame on a copy of scene, which the frame keeps until it's written.
+inline void render_sequence(const world& scene, const camera_path& path, const sequence_settings& settings, job_pool& pool)
+{
+	if (!find_image_format(sequence_frame_path(settings.output_pattern, 0)))
+	{
+		throw std::runtime_error("Unsupported output format in " + settings.output_pattern);
+	}
+	const auto& render = settings.render;
+	const auto aspect_ratio = static_cast<float>(render.width) / static_cast<float>(render.height);
+	const auto tiles_x = (render.width + render.tile_size - 1) / render.tile_size;
+	const auto tiles_y = (render.height + render.tile_size - 1) / render.tile_size;
+
+	struct frame_job
+	{
+		size_t frame_idx;
+		double start_time;
+		job<bool> written;
+		std::shared_ptr<photon_map> photons;
+		std::shared_ptr<world> posed;
+	};
+	std::deque<frame_job> in_flight;
+	// Photon maps and posed scenes of finished frames, reused by later ones so that they don't allocate
+	std::vector<std::shared_ptr<photon_map>> spare_photon_maps;
+	std::vector<std::shared_ptr<world>> spare_worlds;
+	const auto animated = scene.animated();
+	size_t failures = 0;
+	const auto report = [&](size_t frame_idx, bool ok, double start_time)
+	{
+		std::cout << "Frame " << frame_idx + 1 << "/" << settings.frame_count
+			<< (ok ? " written to " : " FAILED to write to ") << sequence_frame_path(settings.output_pattern, frame_idx).string()
+			<< " (" << time_now() - start_time << "s)\n";
+		failures += !ok;
+	};
+	const auto finish_oldest = [&]
+	{
+		auto& oldest = in_flight.front();
+		report(oldest.frame_idx, oldest.written.get(), oldest.start_time);
+		if (oldest.photons)
+			spare_photon_maps.push_back(std::move(oldest.photons));
+		if (oldest.posed)
+			spare_worlds.push_back(std::move(oldest.posed));
+		in_flight.pop_front();
+	};
+
+	const auto frame_time = [&](size_t frame_idx)
+	{
+		return path.start_time() + path.duration() * static_cast<float>(frame_idx) / static_cast<float>(std::max<size_t>(settings.frame_count - 1, 1));
+	};
+	const auto frame_camera = [&](size_t frame_idx)
+	{
+		return path.camera_at(frame_time(frame_idx), aspect_ratio);
+	};
+	// The scene at the time of the frame, or nullptr if it isn't animated
+	const auto pose = [&](size_t frame_idx)
+	{
+		std::shared_ptr<world> posed;
+		if (!animated)
+			return posed;
+		if (spare_worlds.empty())
+		{
+			posed = std::make_shared<world>(scene);
+		}
+		else
+		{
+			posed = std::move(spare_worlds.back());
+			spare_worlds.pop_back();
+		}
+		(void)posed->update(frame_time(frame_idx));
+		return posed;
+	};
+
+	// Guided frames are rendered in passes that each wait for the one before, so they can't overlap
+	for (size_t frame_idx = 0; render.guiding && frame_idx < settings.frame_count; ++frame_idx)
+	{
+		const auto start_time = time_now();
+		auto posed = pose(frame_idx);
+		framebuffer target;
+		render_frame(posed ? *posed : scene, frame_camera(frame_idx), render, pool, frame_idx, target);
+		report(frame_idx, write_image(sequence_frame_path(settings.output_pattern, frame_idx), target), start_time);
+		if (posed)
+			spare_worlds.push_back(std::move(posed));
+	}
+	for (size_t frame_idx = 0; !render.guiding && frame_idx < settings.frame_count; ++frame_idx)
+	{
+		if (in_flight.size() >= std::max<size_t>(settings.frames_in_flight, 1))
+			finish_oldest();
+
+		const auto cam = frame_camera(frame_idx);
+		// Shared with the jobs of the frame, so that it outlives them
+		auto posed = pose(frame_idx);
+		auto target = std::make_shared<framebuffer>();
+		target->update_size_for_overwrite(render.width, render.height);
+		auto splats = std::make_shared<splat_buffer>();
+		if (render.bidirectional)
+			splats->resize(render.width, render.height);
+		std::shared_ptr<photon_map> photons;
+		job<void> photons_shot;
+		if (render.photons > 0)
+		{
+			if (spare_photon_maps.empty())
+			{
+				photons = std::make_shared<photon_map>();
+			}
+			else
+			{
+				photons = std::move(spare_photon_maps.back());
+				spare_photon_maps.pop_back();
+			}
+			photons_shot = pool.submit([&scene, posed, &render, &pool, photons, frame_idx]
+			{
+				photon_tracer::emit(posed ? *posed : scene, pool, render.photons, frame_idx, render.max_depth, *photons);
+			});
+		}
+
+		std::vector<job<void>> tiles;
+		tiles.reserve(tiles_x * tiles_y);
+		for (size_t tile_idx = 0; tile_idx < tiles_x * tiles_y; ++tile_idx)
+		{
+			const auto x = tile_idx % tiles_x * render.tile_size;
+			const auto y = tile_idx / tiles_x * render.tile_size;
+			const tile_range tile{ x, y, std::min(x + render.tile_size, render.width), std::min(y + render.tile_size, render.height) };
+			tiles.push_back(pool.submit([&scene, posed, cam, tile, &render, target, splats, photons, frame_idx]
+			{
+				render_tile(posed ? *posed : scene, cam, tile, render, frame_idx, *target, splats.get(), photons.get());
+			}, photons_shot));
+		}
+		auto output = sequence_frame_path(settings.output_pattern, frame_idx);
+		in_flight.push_back({ frame_idx, time_now(), pool.submit([target, splats, &render, output = std::move(output)]
+		{
+			if (render.bidirectional)
+				add_splats(*splats, { 0, 0, render.width, render.height }, render.samples, *target);
+			return write_image(output, *target);
+		}, tiles), photons, std::move(posed) });
+	}
+	while (!in_flight.empty())
+		finish_oldest();
+	if (failures > 0)
+	{
+		throw std::runtime_error(std::to_string(failures) + " frame(s) could not be written");
+	}
+}
+#endif // OFFLINE_RENDERER_H
@@ -0,0 +1,302 @@
+#ifndef OPTIONS_H
+#define OPTIONS_H
+#include <string>
+#include <stdexcept>
+#include <filesystem>
+#include <optional>
+#include "topology.h"
+#include "cpu_dispatch.h"
+
+struct render_options
+{
+	size_t thread_count = 0; // 0 picks one worker per CPU allowed by the placement policy
+	placement_policy placement = placement_policy::none;
+	bool animate = false;
+	std::filesystem::path floor_texture;
+	size_t texture_cache_mb = 256;
+	std::filesystem::path mesh; // OBJ file added to the showcase scene
+	size_t geometry_cache_mb = 1024;
+	std::filesystem::path environment;
+	float environment_intensity = 1.0f;
+	bool packets = true;
+	bool primary_cache = false;
+	bool bidirectional = false;
+	size_t photons = 0; // per frame, 0 path traces the caustics
+	bool guiding = false;
+	std::string stream; // shared memory object the interactive mode also publishes its frames to
+	std::optional<isa_level> isa; // of the kernels, the best the CPU supports if empty
+
+	// Sequence mode, rendering frames along a camera path without a window
+	std::filesystem::path camera_path;
+	std::string output_pattern = "frame_####.png";
+	size_t frame_count = 0; // 0 means one frame per second of the camera path, at 24 FPS
+	size_t frames_in_flight = 2;
+	size_t width = 1280;
+	size_t height = 720;
+	int samples = 64;
+
+	// Poster mode, streaming one image too large for memory to a file band by band
+	std::filesystem::path poster;
+	size_t bands_in_flight = 4;
+
+	// Benchmark mode, timing one frame with the math policy chosen at build time
+	bool benchmark = false;
+	std::filesystem::path reference;
+	std::filesystem::path benchmark_output;
+	bool check_determinism = false;
+
+	// Quality harness, measuring the error against references over time
+	std::filesystem::path quality_dir;
+	bool make_references = false;
+	double time_budget = 10.0;
+	std::string quality_scene; // also what the benchmark times, if set
+
+	// Render server, taking jobs over a Unix domain socket
+	std::filesystem::path serve_socket;
+
+	bool help = false; // only print the usage
+
+	[[nodiscard]] static const char* usage() noexcept
+	{
+		return
+			"Usage: Engine [options]\n"
+			"  --threads <count>       number of render workers (default: one per CPU)\n"
+			"  --placement <policy>    none | cores | threads (default: none)\n"
+			"                          cores pins one worker per physical core,\n"
+			"                          threads pins one worker per logical CPU\n"
+			"  --animate               animate the showcase scene (space pauses)\n"
+			"  --floor-texture <image> texture the floor of the showcase scene\n"
+			"  --texture-cache <MiB>   memory budget for texture tiles (default: 256)\n"
+			"  --mesh <file.obj>       stand a triangle mesh in the showcase scene\n"
+			"  --geometry-cache <MiB>  memory budget for mesh clusters (default: 1024)\n"
+			"  --environment <file>    light the scene by an equirectangular HDR image\n"
+			"  --environment-intensity <factor> scale the environment map (default: 1)\n"
+			"  --no-packets            trace primary rays one by one instead of in 8x8 packets\n"
+			"  --primary-cache         reuse the first hits of 4 jitters per pixel while the view stays still\n"
+			"  --bidirectional         use the bidirectional path tracer, which finds caustics\n"
+			"                          and small lights (in every mode; b toggles it)\n"
+			"  --photons <count>       gather the caustics from this many photons shot per frame\n"
+			"                          (in every mode; m toggles photon mapping)\n"
+			"  --guiding               guide paths by where light was found before, for scenes\n"
+			"                          lit mostly indirectly (in every mode; g toggles it)\n"
+			"  --stream <name>         also publish the frames to the POSIX shared memory\n"
+			"                          object /name, for viewers in other processes\n"
+			"  --isa <name>            auto | baseline | sse4.2 | avx2 | avx512, the instruction\n"
+			"                          set the render kernels run with (default: auto, the best\n"
+			"                          this CPU supports)\n"
+			"\n"
+			"Sequence mode:\n"
+			"  --sequence <file>       render the frames of a camera path file to images\n"
+			"  --output <pattern>      output file names, # is replaced by the frame number\n"
+			"                          (default: frame_####.png)\n"
+			"  --frames <count>        number of frames (default: 24 per second of the path)\n"
+			"  --frames-in-flight <n>  frames rendered at the same time (default: 2)\n"
+			"  --size <width>x<height> output resolution (default: 1280x720)\n"
+			"  --samples <count>       samples per pixel (default: 64)\n"
+			"\n"
+			"Poster mode (uses --size and --samples):\n"
+			"  --poster <file>         render the showcase scene straight into a .tif or .hdr\n"
+			"                          file in bands of rows, for sizes the memory can't hold\n"
+			"  --bands-in-flight <n>   bands of 32 rows held at the same time (default: 4)\n"
+			"\n"
+			"Benchmark mode (uses --size and --samples):\n"
+			"  --benchmark             time the showcase scene and print one line of results\n"
+			"  --scene <name>          time a scene of the quality harness instead, e.g. sdf\n"
+			"  --reference <file>      also print the RMSE against this image (e.g. a .hdr\n"
+			"                          rendered by a build with MATH_POLICY=exact)\n"
+			"  --benchmark-output <file> write the rendered image\n"
+			"  --check-determinism     instead render the frame with 1, 4 and --threads workers\n"
+			"                          and fail unless the images are bit for bit the same\n"
+			"\n"
+			"Quality harness (uses --size, and --samples for the references):\n"
+			"  --quality <dir>         render the reference scenes for --budget seconds each and\n"
+			"                          print their error against the references in dir over time,\n"
+			"                          one JSON object per line\n"
+			"  --make-references       render the references into the --quality directory instead\n"
+			"  --budget <seconds>      render time per scene (default: 10)\n"
+			"  --scene <name>          only showcase, sphere_grid, glass, small_light or sdf\n"
+			"\n"
+			"Render server (uses --texture-cache and --geometry-cache):\n"
+			"  --serve <socket>        render scene files for clients connecting to this\n"
+			"                          Unix domain socket until one sends \"shutdown\"\n";
+	}
+
+	[[nodiscard]] static render_options parse(int argc, char** argv)
+	{
+		render_options options;
+		for (int i = 1; i < argc; ++i)
+		{
+			const std::string arg = argv[i];
+			if (arg == "--help" || arg == "-h")
+			{
+				options.help = true;
+				return options;
+			}
+			const auto value = [&]() -> std::string
+			{
+				if (i + 1 >= argc)
+					throw std::runtime_error("Missing value for " + arg);
+				return argv[++i];
+			};
+			const auto count = [&](long long min) -> long long
+			{
+				const auto result = std::stoll(value());
+				if (result < min)
+					throw std::runtime_error("Value of " + arg + " must be at least " + std::to_string(min));
+				return result;
+			};
+			if (arg == "--threads")
+			{
+				options.thread_count = static_cast<size_t>(count(0));
+			}
+			else if (arg == "--placement")
+			{
+				options.placement = parse_placement_policy(value());
+			}
+			else if (arg == "--isa")
+			{
+				const auto name = value();
+				options.isa = name == "auto" ? std::nullopt : std::optional{ parse_isa_level(name) };
+			}
+			else if (arg == "--animate")
+			{
+				options.animate = true;
+			}
+			else if (arg == "--floor-texture")
+			{
+				options.floor_texture = value();
+			}
+			else if (arg == "--texture-cache")
+			{
+				options.texture_cache_mb = static_cast<size_t>(count(1));
+			}
+			else if (arg == "--mesh")
+			{
+				options.mesh = value();
+			}
+			else if (arg == "--geometry-cache")
+			{
+				options.geometry_cache_mb = static_cast<size_t>(count(1));
+			}
+			else if (arg == "--environment")
+			{
+				options.environment = value();
+			}
+			else if (arg == "--no-packets")
+			{
+				options.packets = false;
+			}
+			else if (arg == "--primary-cache")
+			{
+				options.primary_cache = true;
+			}
+			else if (arg == "--bidirectional")
+			{
+				options.bidirectional = true;
+			}
+			else if (arg == "--photons")
+			{
+				options.photons = static_cast<size_t>(count(1));
+			}
+			else if (arg == "--guiding")
+			{
+				options.guiding = true;
+			}
+			else if (arg == "--stream")
+			{
+				options.stream = value();
+			}
+			else if (arg == "--environment-intensity")
+			{
+				options.environment_intensity = std::stof(value());
+				if (options.environment_intensity < 0.0f)
+					throw std::runtime_error("The environment intensity can't be negative");
+			}
+			else if (arg == "--sequence")
+			{
+				options.camera_path = value();
+			}
+			else if (arg == "--output")
+			{
+				options.output_pattern = value();
+			}
+			else if (arg == "--frames")
+			{
+				options.frame_count = static_cast<size_t>(count(1));
+			}
+			else if (arg == "--frames-in-flight")
+			{
+				options.frames_in_flight = static_cast<size_t>(count(1));
+			}
+			else if (arg == "--size")
+			{
+				const auto size = value();
+				const auto separator = size.find('x');
+				if (separator == std::string::npos)
+					throw std::runtime_error("Expected --size <width>x<height>");
+				options.width = std::stoul(size.substr(0, separator));
+				options.height = std::stoul(size.substr(separator + 1));
+				if (options.width < 2 || options.height < 2)
+					throw std::runtime_error("The output must be at least 2x2 pixels");
+			}
+			else if (arg == "--samples")
+			{
+				options.samples = static_cast<int>(count(1));
+			}
+			else if (arg == "--poster")
+			{
+				options.poster = value();
+			}
+			else if (arg == "--bands-in-flight")
+			{
+				options.bands_in_flight = static_cast<size_t>(count(1));
+			}
+			else if (arg == "--benchmark")
+			{
+				options.benchmark = true;
+			}
+			else if (arg == "--reference")
+			{
+				options.reference = value();
+			}
+			else if (arg == "--benchmark-output")
+			{
+				options.benchmark_output = value();
+			}
+			else if (arg == "--check-determinism")
+			{
+				options.check_determinism = true;
+			}
+			else if (arg == "--quality")
+			{
+				options.quality_dir = value();
+			}
+			else if (arg == "--make-references")
+			{
+				options.make_references = true;
+			}
+			else if (arg == "--budget")
+			{
+				options.time_budget = std::stod(value());
+				if (options.time_budget <= 0.0)
+					throw std::runtime_error("The time budget must be positive");
+			}
+			else if (arg == "--scene")
+			{
+				options.quality_scene = value();
+			}
+			else if (arg == "--serve")
+			{
+				options.serve_socket = value();
+			}
+			else
+			{
+				throw std::runtime_error("Unknown option " + arg);
+			}
+		}
+		if (options.bidirectional + (options.photons > 0) + options.guiding > 1)
+			throw std::runtime_error("Only one of --bidirectional, --photons and --guiding can be used");
+		return options;
+	}
+};
+#endif // OPTIONS_H
@@ -0,0 +1,310 @@
+#ifndef PATH_GUIDE_H
+#define PATH_GUIDE_H
+#include <algorithm>
+#include <array>
+#include <atomic>
+#include <cmath>
+#include <cstdint>
+#include <vector>
+#include <glm/glm.hpp>
+#include "aabb.h"
+#include "job_pool.h"
+#include "utility.h"
+
+// Learned distribution of the light arriving anywhere in the scene, for choosing where diffuse
+// surfaces scatter to (after Müller et al., "Practical Path Guiding for Efficient Light-Transport
+// Simulation"). Space is split by a binary tree, and every leaf holds a quadtree over the
+// directions, mapped to the unit square by (cos theta, phi).
+// Training runs in iterations. During one, paths sample from what the previous iterations
+// recorded and record into a second quadtree per leaf, from any number of threads. refine()
+// then makes the recorded quadtrees the ones sampled from. Records are added in fixed point,
+// so the guide doesn't depend on the order of the samples.
+class path_guide
+{
+	// Quadtree over the unit square
+	struct quadtree
+	{
+		struct node
+		{
+			std::array<uint32_t, 4> children{}; // 0 for leaves, as the root is no child
+			std::array<uint64_t, 4> energy{}; // of the quadrants
+		};
+		std::vector<node> nodes{ 1 };
+
+		[[nodiscard]] uint64_t total() const noexcept
+		{
+			const auto& e = nodes[0].energy;
+			return e[0] + e[1] + e[2] + e[3];
+		}
+		// Sums the energy of the leaves up into the quadrants of their parents
+		uint64_t sum_up(uint32_t idx = 0) noexcept
+		{
+			auto& n = nodes[idx];
+			uint64_t sum = 0;
+			for (int q = 0; q < 4; ++q)
+			{
+				if (n.children[q] != 0)
+					n.energy[q] = sum_up(n.children[q]);
+				sum += n.energy[q];
+			}
+			return sum;
+		}
+		// Subdivides the quadrants of source holding more than a fraction threshold of its
+		// energy, down to max_depth, and merges the rest. The energy is zeroed.
+		void build_from(const quadtree& source, float threshold)
+		{
+			nodes.assign(1, node{});
+			const auto total = static_cast<double>(source.total());
+			if (total <= 0.0)
+			{
+				nodes = source.nodes;
+				for (auto& n : nodes)
+					n.energy = {};
+				return;
+			}
+			// Quadrants below the leaves of source split their energy evenly
+			constexpr auto none = ~uint32_t{ 0 };
+			struct item
+			{
+				uint32_t target;
+				uint32_t source; // none below the leaves of source
+				double energy;
+				int depth;
+			};
+			std::vector<item> stack{ { 0, 0, total, 0 } };
+			while (!stack.empty())
+			{
+				const auto [target, source_idx, energy, depth] = stack.back();
+				stack.pop_back();
+				for (int q = 0; q < 4; ++q)
+				{
+					auto child_energy = energy / 4.0;
+					auto child_source = none;
+					if (source_idx != none)
+					{
+						const auto& n = source.nodes[source_idx];
+						child_energy = static_cast<double>(n.energy[q]);
+						child_source = n.children[q] != 0 ? n.children[q] : none;
+					}
+					if (child_energy / total <= threshold || depth + 1 >= max_depth)
+						continue;
+					const auto child = static_cast<uint32_t>(nodes.size());
+					nodes[target].children[q] = child;
+					nodes.emplace_back();
+					stack.push_back({ child, child_source, child_energy, depth + 1 });
+				}
+			}
+		}
+		// Point in the unit square with a density proportional to the energy, which must not be 0
+		[[nodiscard]] glm::vec2 sample(int& seed) const noexcept
+		{
+			uint32_t idx = 0;
+			glm::vec2 origin{ 0, 0 };
+			auto size = 1.0f;
+			while (true)
+			{
+				const auto& e = nodes[idx].energy;
+				auto pick = frand(seed) * static_cast<float>(e[0] + e[1] + e[2] + e[3]);
+				int q = 0;
+				while (q < 3 && (e[q] == 0 || pick >= static_cast<float>(e[q])))
+				{
+					pick -= static_cast<float>(e[q]);
+					++q;
+				}
+				// Rounding can leave the pick on an empty last quadrant
+				while (e[q] == 0)
+					--q;
+				size *= 0.5f;
+				origin += size * glm::vec2{ static_cast<float>(q & 1), static_cast<float>(q >> 1) };
+				if (nodes[idx].children[q] == 0)
+					return origin + size * glm::vec2{ frand(seed), frand(seed) };
+				idx = nodes[idx].children[q];
+			}
+		}
+		// Density of sample at p
+		[[nodiscard]] float pdf(glm::vec2 p) const noexcept
+		{
+			uint32_t idx = 0;
+			auto result = 1.0f;
+			while (true)
+			{
+				const auto& n = nodes[idx];
+				const auto q = quadrant(p);
+				const auto total = n.energy[0] + n.energy[1] + n.energy[2] + n.energy[3];
+				if (n.energy[q] == 0)
+					return 0.0f;
+				result *= 4.0f * static_cast<float>(n.energy[q]) / static_cast<float>(total);
+				if (n.children[q] == 0)
+					return result;
+				idx = n.children[q];
+			}
+		}
+		// Adds energy to the leaf at p. Safe to call from several threads at once.
+		void record(glm::vec2 p, uint64_t energy) noexcept
+		{
+			uint32_t idx = 0;
+			while (true)
+			{
+				auto& n = nodes[idx];
+				const auto q = quadrant(p);
+				if (n.children[q] == 0)
+				{
+					std::atomic_ref{ n.energy[q] }.fetch_add(energy, std::memory_order_relaxed);
+					return;
+				}
+				idx = n.children[q];
+			}
+		}
+		// Quadrant of p, which is moved into the quadrant's own unit square
+		[[nodiscard]] static int quadrant(glm::vec2& p) noexcept
+		{
+			const auto right = p.x >= 0.5f;
+			const auto top = p.y >= 0.5f;
+			p = glm::clamp(2.0f * p - glm::vec2{ static_cast<float>(right), static_cast<float>(top) }, 0.0f, 1.0f);
+			return right | top << 1;
+		}
+	};
+	struct leaf
+	{
+		quadtree sampled, recording;
+		uint32_t samples = 0; // recorded this iteration
+	};
+	struct region
+	{
+		std::array<uint32_t, 2> children{}; // 0 for leaves
+		uint32_t leaf = 0; // index into leaves
+	};
+
+	constexpr static int max_depth = 20;
+	// Quadrants with less than this fraction of a quadtree's energy are merged
+	constexpr static float subdivision_threshold = 0.01f;
+	// A region is split once it records more than this many samples, times the square root
+	// of the samples per pixel of the iteration
+	constexpr static float split_samples = 12000.0f;
+	// Value that recorded energy is scaled by, and the most a single sample adds
+	constexpr static float scale = 1 << 12;
+	constexpr static float max_value = 1e6f;
+
+	aabb bounds;
+	glm::vec3 inv_extent;
+	std::vector<region> regions{ 1 };
+	std::vector<leaf> leaves{ 1 };
+	size_t m_iterations = 0;
+
+	void split(uint32_t region_idx, int depth, float threshold)
+	{
+		auto& l = leaves[regions[region_idx].leaf];
+		if (static_cast<float>(l.samples) <= threshold || depth >= 3 * max_depth)
+			return;
+		// Each half starts out with a copy of the quadtrees, and is assumed to have half the samples
+		l.samples /= 2;
+		const auto first = static_cast<uint32_t>(regions.size());
+		const auto new_leaf = static_cast<uint32_t>(leaves.size());
+		leaves.push_back(leaves[regions[region_idx].leaf]);
+		regions.push_back({ {}, regions[region_idx].leaf });
+		regions.push_back({ {}, new_leaf });
+		regions[region_idx].children = { first, first + 1 };
+		split(first, depth + 1, threshold);
+		split(first + 1, depth + 1, threshold);
+	}
+public:
+	explicit path_guide(const aabb& scene_bounds) :
+		bounds{ scene_bounds }
+	{
+		if (bounds.empty())
+			bounds = { glm::vec3{ -1 }, glm::vec3{ 1 } };
+		// A little larger, so that nothing on the bounds falls outside
+		const auto margin = 1e-3f * (bounds.max - bounds.min) + 1e-3f;
+		bounds.min -= margin;
+		bounds.max += margin;
+		inv_extent = 1.0f / (bounds.max - bounds.min);
+	}
+
+	// Index of the leaf holding the quadtrees for position. Positions outside the bounds
+	// belong to the nearest leaf.
+	[[nodiscard]] uint32_t locate(const glm::vec3& position) const noexcept
+	{
+		auto p = glm::clamp((position - bounds.min) * inv_extent, 0.0f, 1.0f);
+		uint32_t idx = 0;
+		// Regions are halved along x, y and z in turn
+		for (int axis = 0; regions[idx].children[0] != 0; axis = (axis + 1) % 3)
+		{
+			const auto upper = p[axis] >= 0.5f;
+			p[axis] = 2.0f * p[axis] - static_cast<float>(upper);
+			idx = regions[idx].children[upper];
+		}
+		return regions[idx].leaf;
+	}
+	// Whether anything was recorded for the leaf before the current iteration
+	[[nodiscard]] bool trained(uint32_t leaf) const noexcept
+	{
+		return leaves[leaf].sampled.total() > 0;
+	}
+	// Direction from the distribution of the leaf, which must be trained
+	[[nodiscard]] glm::vec3 sample(uint32_t leaf, int& seed) const noexcept
+	{
+		return to_direction(leaves[leaf].sampled.sample(seed));
+	}
+	// Density per unit solid angle of sample for the leaf
+	[[nodiscard]] float pdf(uint32_t leaf, const glm::vec3& dir) const noexcept
+	{
+		return leaves[leaf].sampled.pdf(to_square(dir)) / (4.0f * static_cast<float>(pi));
+	}
+	// Records a path that left a point in the leaf in direction dir with density pdf per unit
+	// solid angle, and brought back radiance of the given luminance. Safe to call from
+	// several threads at once, but not during refine().
+	void record(uint32_t leaf, const glm::vec3& dir, float pdf, float luminance) noexcept
+	{
+		auto& l = leaves[leaf];
+		std::atomic_ref{ l.samples }.fetch_add(1, std::memory_order_relaxed);
+		if (!(luminance > 0.0f) || !(pdf > 0.0f))
+			return;
+		l.recording.record(to_square(dir), static_cast<uint64_t>(std::min(luminance / pdf, max_value) * scale));
+	}
+	// Ends an iteration in which paths were traced with samples_per_pixel samples per pixel:
+	// splits the regions that recorded enough samples, samples from what was recorded and
+	// records into quadtrees refined where the most light was recorded
+	void refine(job_pool& pool, int samples_per_pixel)
+	{
+		const auto threshold = split_samples * std::sqrt(static_cast<float>(std::max(samples_per_pixel, 1)));
+		const auto region_count = static_cast<uint32_t>(regions.size());
+		for (uint32_t idx = 0; idx < region_count; ++idx)
+		{
+			if (regions[idx].children[0] == 0)
+				split(idx, 0, threshold);
+		}
+		pool.parallel_for(0, leaves.size(), 1, [&](size_t idx)
+		{
+			auto& l = leaves[idx];
+			l.recording.sum_up();
+			l.sampled.build_from(l.recording, subdivision_threshold);
+			std::swap(l.sampled, l.recording);
+			l.samples = 0;
+		});
+		++m_iterations;
+	}
+	[[nodiscard]] size_t iterations() const noexcept
+	{
+		return m_iterations;
+	}
+	[[nodiscard]] size_t leaf_count() const noexcept
+	{
+		return leaves.size();
+	}
+
+	[[nodiscard]] static glm::vec2 to_square(const glm::vec3& dir) noexcept
+	{
+		auto phi = std::atan2(dir.y, dir.x) / (2.0f * static_cast<float>(pi));
+		if (phi < 0.0f)
+			phi += 1.0f;
+		return { std::clamp(0.5f * (dir.z + 1.0f), 0.0f, 1.0f), std::clamp(phi, 0.0f, 1.0f) };
+	}
+	[[nodiscard]] static glm::vec3 to_direction(const glm::vec2& p) noexcept
+	{
+		const auto cos_theta = 2.0f * p.x - 1.0f;
+		const auto sin_theta = std::sqrt(std::max(0.0f, 1.0f - cos_theta * cos_theta));
+		const auto phi = 2.0f * static_cast<float>(pi) * p.y;
+		return { sin_theta * std::cos(phi), sin_theta * std::sin(phi), cos_theta };
+	}
+};
+#endif // PATH_GUIDE_H
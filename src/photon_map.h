@@ -0,0 +1,211 @@
+#ifndef PHOTON_MAP_H
+#define PHOTON_MAP_H
+#include <algorithm>
+#include <array>
+#include <cstdint>
+#include <limits>
+#include <vector>
+#include <glm/glm.hpp>
+#include "aabb.h"
+#include "job_pool.h"
+
+struct photon
+{
+	glm::vec3 position;
+	glm::vec3 power;
+	glm::vec3 direction; // of travel
+};
+
+// Photons in a balanced kd-tree for nearest neighbour lookups. The tree is implicit: every
+// range of photons is split at its middle element, along the widest axis of the range, so it
+// needs no pointers. Lookups only walk the positions, which are kept apart from the rest.
+// A map keeps all its memory when it's refilled, so refilling it every frame doesn't allocate
+// once it has grown to the size needed.
+class photon_map
+{
+	struct node
+	{
+		glm::vec3 position;
+		uint32_t axis;
+	};
+	struct range
+	{
+		uint32_t begin, end;
+	};
+
+	// Below this many photons a range is split by a single thread
+	constexpr static uint32_t parallel_split_size = 4096;
+
+	std::vector<node> nodes;
+	std::vector<photon> photons;
+	std::vector<uint32_t> axes; // of the photons, while building
+	std::vector<std::vector<photon>> batches;
+	std::vector<range> ranges, next_ranges;
+
+	// Splits r at its middle along its widest axis and returns the axis
+	uint32_t split(range r) noexcept
+	{
+		aabb bounds;
+		for (auto i = r.begin; i < r.end; ++i)
+			bounds.grow(photons[i].position);
+		const auto extent = bounds.max - bounds.min;
+		const uint32_t axis = extent.x >= extent.y && extent.x >= extent.z ? 0 : extent.y >= extent.z ? 1 : 2;
+		const auto middle = r.begin + (r.end - r.begin) / 2;
+		std::nth_element(photons.begin() + r.begin, photons.begin() + middle, photons.begin() + r.end, [axis](const photon& a, const photon& b)
+		{
+			return a.position[axis] < b.position[axis];
+		});
+		axes[middle] = axis;
+		return axis;
+	}
+	void build_subtree(range r) noexcept
+	{
+		while (r.end - r.begin > 1)
+		{
+			split(r);
+			const auto middle = r.begin + (r.end - r.begin) / 2;
+			build_subtree({ r.begin, middle });
+			r.begin = middle + 1;
+		}
+	}
+	// The top levels split one range per task, and each range that is small enough, or one
+	// of enough ranges, is finished by a single task
+	void build(job_pool& pool)
+	{
+		const auto count = static_cast<uint32_t>(photons.size());
+		axes.resize(count);
+		ranges.assign(1, { 0, count });
+		while (ranges.size() < 4 * pool.worker_count())
+		{
+			next_ranges.clear();
+			for (const auto r : ranges)
+			{
+				if (r.end - r.begin < parallel_split_size)
+					continue;
+				const auto middle = r.begin + (r.end - r.begin) / 2;
+				next_ranges.push_back({ r.begin, middle });
+				next_ranges.push_back({ middle + 1, r.end });
+			}
+			if (next_ranges.empty())
+				break;
+			// Ranges too small to split further are left to the last step
+			pool.parallel_for(0, ranges.size(), 1, [&](size_t idx)
+			{
+				if (ranges[idx].end - ranges[idx].begin >= parallel_split_size)
+					split(ranges[idx]);
+			});
+			for (const auto r : ranges)
+			{
+				if (r.end - r.begin < parallel_split_size)
+					next_ranges.push_back(r);
+			}
+			ranges.swap(next_ranges);
+		}
+		pool.parallel_for(0, ranges.size(), 1, [&](size_t idx)
+		{
+			build_subtree(ranges[idx]);
+		});
+		nodes.resize(count);
+		pool.parallel_for(0, count, parallel_split_size, [&](size_t idx)
+		{
+			nodes[idx] = { photons[idx].position, axes[idx] };
+		});
+	}
+public:
+	struct neighbour
+	{
+		float dist2;
+		uint32_t idx;
+	};
+
+	// Replaces the photons with those that emit_batch(batch_idx, std::vector<photon>& out)
+	// appends for every batch in [0, batch_count), in this order, and builds the tree.
+	// The batches run in parallel on pool.
+	template <typename Func>
+	void fill(job_pool& pool, size_t batch_count, Func&& emit_batch)
+	{
+		if (batches.size() < batch_count)
+			batches.resize(batch_count);
+		pool.parallel_for(0, batch_count, 1, [&](size_t idx)
+		{
+			batches[idx].clear();
+			emit_batch(idx, batches[idx]);
+		});
+		photons.clear();
+		for (size_t idx = 0; idx < batch_count; ++idx)
+			photons.insert(photons.end(), batches[idx].begin(), batches[idx].end());
+		build(pool);
+	}
+	[[nodiscard]] size_t size() const noexcept
+	{
+		return photons.size();
+	}
+	[[nodiscard]] const photon& operator[](size_t idx) const noexcept
+	{
+		return photons[idx];
+	}
+	// Finds the up to k photons nearest to position within sqrt(max_dist2), in no particular
+	// order, and returns how many there are. Their distance is at most max_dist2 on return.
+	size_t nearest(const glm::vec3& position, size_t k, float& max_dist2, neighbour* found) const noexcept
+	{
+		struct entry
+		{
+			uint32_t begin, end;
+			float plane_dist2; // of the range's side of the splitting plane
+		};
+		// Only the range on the far side of each split waits on the stack
+		std::array<entry, 64> stack;
+		size_t stack_size = 0;
+		stack[stack_size++] = { 0, static_cast<uint32_t>(nodes.size()), 0.0f };
+		size_t count = 0;
+		const auto closer = [](const neighbour& a, const neighbour& b) { return a.dist2 < b.dist2; };
+		while (stack_size > 0)
+		{
+			auto [begin, end, plane_dist2] = stack[--stack_size];
+			if (plane_dist2 >= max_dist2)
+				continue;
+			while (begin < end)
+			{
+				const auto middle = begin + (end - begin) / 2;
+				const auto& n = nodes[middle];
+				const auto d = position - n.position;
+				const auto dist2 = dot(d, d);
+				if (dist2 < max_dist2)
+				{
+					// found is a max-heap once k photons are in it
+					if (count < k)
+					{
+						found[count++] = { dist2, middle };
+						if (count == k)
+						{
+							std::make_heap(found, found + k, closer);
+							max_dist2 = found[0].dist2;
+						}
+					}
+					else
+					{
+						std::pop_heap(found, found + k, closer);
+						found[k - 1] = { dist2, middle };
+						std::push_heap(found, found + k, closer);
+						max_dist2 = found[0].dist2;
+					}
+				}
+				if (end - begin == 1)
+					break;
+				const auto offset = position[n.axis] - n.position[n.axis];
+				if (offset < 0.0f)
+				{
+					stack[stack_size++] = { middle + 1, end, offset * offset };
+					end = middle;
+				}
+				else
+				{
+					stack[stack_size++] = { begin, middle, offset * offset };
+					begin = middle + 1;
+				}
+			}
+		}
+		return count;
+	}
+};
+#endif // PHOTON_MAP_H
@@ -0,0 +1,203 @@
+#ifndef PHOTON_TRACER_H
+#define PHOTON_TRACER_H
+#include <algorithm>
+#include <array>
+#include <cmath>
+#include <limits>
+#include <vector>
+#include <glm/glm.hpp>
+#include "world.h"
+#include "job_pool.h"
+#include "photon_map.h"
+#include "utility.h"
+
+// Path tracer that leaves caustics to a photon map. Photons are shot from the emissive
+// objects and stored where they reach a diffuse surface through glass or metal, which paths
+// from the camera only find by chance. Camera paths gather the photons near every diffuse
+// surface they hit, and ignore the lights they reach through glass or metal from a diffuse
+// surface, as those are the same paths. Diffuse surfaces also sample the emissive objects
+// and the environment directly. Frames averaged with new photons gather them within a radius
+// that shrinks with every frame, as in probabilistic progressive photon mapping, so the
+// average converges to the sharp caustic.
+class photon_tracer
+{
+	constexpr static size_t batch_size = 4096;
+	// At most this many photons are gathered, closer than the radius where they're dense
+	constexpr static size_t gather_count = 64;
+	// The radius of frame i + 1 has (i + alpha) / (i + 1) the area of that of frame i, which
+	// trades the variance against the bias of the average
+	constexpr static float initial_radius = 0.2f;
+	constexpr static float radius_alpha = 2.0f / 3.0f;
+
+	const world& scene;
+	const photon_map& photons;
+	int max_depth;
+public:
+	photon_tracer(const world& scene, const photon_map& photons, int max_depth) :
+		scene{ scene },
+		photons{ photons },
+		max_depth{ max_depth }
+	{
+	}
+
+	// Refills map with the caustic photons of count photons shot in parallel on pool. Photons
+	// emitted with the same key are the same, whatever the number of threads.
+	static void emit(const world& scene, job_pool& pool, size_t count, uint64_t key, int max_depth, photon_map& map)
+	{
+		const auto batch_count = scene.emitters.empty() ? 0 : (count + batch_size - 1) / batch_size;
+		map.fill(pool, batch_count, [&](size_t batch, std::vector<photon>& out)
+		{
+			auto seed = mix_seed(splitmix64(key) + batch);
+			const auto end = std::min(count, (batch + 1) * batch_size);
+			for (auto idx = batch * batch_size; idx < end; ++idx)
+				emit(scene, count, max_depth, seed, out);
+		});
+	}
+
+	// Gather radius of the given frame of an average, counted from 0
+	[[nodiscard]] static float gather_radius(uint32_t frame) noexcept
+	{
+		// The product of (i + alpha) / (i + 1) for i < frame, as a ratio of gamma functions
+		const auto n = static_cast<double>(frame);
+		const auto area = std::exp(std::lgamma(n + radius_alpha) - std::lgamma(radius_alpha) - std::lgamma(n + 1.0));
+		return initial_radius * static_cast<float>(std::sqrt(area));
+	}
+
+	// Light reaching the camera along r, gathering photons within radius
+	[[nodiscard]] glm::vec3 trace(ray r, int& seed, float radius = initial_radius) const noexcept
+	{
+		glm::vec3 color{ 0, 0, 0 };
+		glm::vec3 beta{ 1, 1, 1 };
+		// Density with which the last hit, if diffuse, chose r, as it also sampled the lights
+		float bsdf_pdf = 0.0f;
+		// Whether the path has hit a diffuse surface, and glass or metal since the last one
+		bool after_diffuse = false;
+		bool specular_since = false;
+		for (int depth = 0; depth < max_depth; ++depth)
+		{
+			const auto hit = scene.closest_hit(r, 0, std::numeric_limits<float>::infinity(), nullptr);
+			if (!hit.object)
+			{
+				auto light = scene.backdrop(r.direction);
+				if (bsdf_pdf > 0.0f && scene.env && scene.env->emits())
+					light *= world::power_heuristic(bsdf_pdf, scene.env->pdf(r.direction));
+				color += beta * light;
+				break;
+			}
+			const auto [position, normal, front_facing, tex] = hit.object->surface(r, hit);
+			const auto& mat = *hit.object->mat;
+			if (mat.emissive())
+			{
+				if (after_diffuse && specular_since)
+					break;
+				auto weight = 1.0f;
+				if (bsdf_pdf > 0.0f)
+				{
+					const auto light_pdf = scene.emitter_pdf(hit.object, position) * hit.t * hit.t / std::abs(dot(normal, r.direction));
+					weight = world::power_heuristic(bsdf_pdf, light_pdf);
+				}
+				color += beta * mat.emission(position, normal, r.direction, front_facing, tex, seed) * weight;
+				break;
+			}
+			const auto shade_info = mat.shade(position, normal, r.direction, front_facing, tex, seed);
+			if (!shade_info.scattered)
+				break;
+			const auto dir = default_math::normalize(shade_info.scattered->direction);
+			const auto reflectance = mat.diffuse_reflectance(tex);
+			bsdf_pdf = 0.0f;
+			if (reflectance != glm::vec3{ 0, 0, 0 })
+			{
+				color += beta * (caustics(position, normal, reflectance, radius) + sample_emitters(position, normal, reflectance, seed));
+				if (scene.env && scene.env->emits())
+					color += beta * scene.sample_environment(position, normal, reflectance, seed, nullptr);
+				bsdf_pdf = std::max(dot(normal, dir), 0.0f) / static_cast<float>(pi);
+				after_diffuse = true;
+				specular_since = false;
+			}
+			else
+			{
+				specular_since = true;
+			}
+			beta *= shade_info.attenuation;
+			const auto cone_width = r.cone_width + r.cone_spread * hit.t;
+			r = ray{ shade_info.scattered->origin + dir * 0.005f, dir, cone_width, r.cone_spread };
+		}
+		return color;
+	}
+private:
+	// Traces one of count photons and stores it if it reaches a diffuse surface through glass or metal
+	static void emit(const world& scene, size_t count, int max_depth, int& seed, std::vector<photon>& out) noexcept
+	{
+		const auto emitter = scene.sample_emitter(seed);
+		if (emitter.pdf <= 0.0f)
+			return;
+		const auto& point = emitter.point;
+		// Both sides emit, each with a cosine distribution, so the cosine cancels out
+		auto power = emitter.object->mat->emission(point.pos, point.normal, -point.normal, true, point.tex, seed)
+			* (2.0f * static_cast<float>(pi) / (emitter.pdf * static_cast<float>(count)));
+		const auto side = frand(seed) < 0.5f ? point.normal : -point.normal;
+		auto dir = default_math::normalize(side + random_unit_sphere_vector(seed));
+		ray r{ point.pos + dir * 0.005f, dir };
+		for (int depth = 0; depth < max_depth; ++depth)
+		{
+			const auto hit = scene.closest_hit(r, 0, std::numeric_limits<float>::infinity(), nullptr);
+			if (!hit.object || hit.object->mat->emissive())
+				return;
+			const auto [position, normal, front_facing, tex] = hit.object->surface(r, hit);
+			if (hit.object->mat->diffuse_reflectance(tex) != glm::vec3{ 0, 0, 0 })
+			{
+				// Light reaching diffuse surfaces directly is sampled by the camera paths
+				if (depth > 0)
+					out.push_back({ position, power, r.direction });
+				return;
+			}
+			const auto shade_info = hit.object->mat->shade(position, normal, r.direction, front_facing, tex, seed);
+			if (!shade_info.scattered)
+				return;
+			power *= shade_info.attenuation;
+			dir = default_math::normalize(shade_info.scattered->direction);
+			r = ray{ shade_info.scattered->origin + dir * 0.005f, dir };
+		}
+	}
+	// Light from a point on the emissive objects reaching a diffuse surface, weighted
+	// against finding it by the scattered ray
+	[[nodiscard]] glm::vec3 sample_emitters(const glm::vec3& position, const glm::vec3& normal, const glm::vec3& reflectance, int& seed) const noexcept
+	{
+		if (scene.emitters.empty())
+			return glm::vec3{ 0, 0, 0 };
+		const auto light = scene.sample_emitter(seed);
+		const auto d = light.point.pos - position;
+		const auto dist2 = dot(d, d);
+		const auto dist = std::sqrt(dist2);
+		const auto dir = d / dist;
+		const auto cos_theta = dot(normal, dir);
+		const auto cos_light = std::abs(dot(light.point.normal, dir));
+		if (light.pdf <= 0.0f || cos_theta <= 0.0f || cos_light <= 0.0f)
+			return glm::vec3{ 0, 0, 0 };
+		if (scene.occluded(ray{ position + dir * 0.005f, dir }, dist - 0.01f))
+			return glm::vec3{ 0, 0, 0 };
+		const auto light_pdf = light.pdf * dist2 / cos_light;
+		const auto emission = light.object->mat->emission(light.point.pos, light.point.normal, dir, dot(light.point.normal, dir) < 0.0f, light.point.tex, seed);
+		return reflectance / static_cast<float>(pi) * emission * cos_theta / light_pdf
+			* world::power_heuristic(light_pdf, cos_theta / static_cast<float>(pi));
+	}
+	// Light of the photons within radius of position reflected towards the camera
+	[[nodiscard]] glm::vec3 caustics(const glm::vec3& position, const glm::vec3& normal, const glm::vec3& reflectance, float radius) const noexcept
+	{
+		if (photons.size() == 0)
+			return glm::vec3{ 0, 0, 0 };
+		std::array<photon_map::neighbour, gather_count> found;
+		auto dist2 = radius * radius;
+		const auto count = photons.nearest(position, gather_count, dist2, found.data());
+		glm::vec3 power{ 0, 0, 0 };
+		for (size_t i = 0; i < count; ++i)
+		{
+			const auto& p = photons[found[i].idx];
+			// Only photons arriving on the side seen from the camera
+			if (dot(p.direction, normal) < 0.0f)
+				power += p.power;
+		}
+		return reflectance / static_cast<float>(pi) * power / (static_cast<float>(pi) * dist2);
+	}
+};
+#endif // PHOTON_TRACER_H
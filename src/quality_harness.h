@@ -0,0 +1,164 @@
+#ifndef QUALITY_HARNESS_H
+#define QUALITY_HARNESS_H
+#include <array>
+#include <filesystem>
+#include <ostream>
+#include <stdexcept>
+#include <string>
+#include <vector>
+#include <glm/glm.hpp>
+#include "world.h"
+#include "camera.h"
+#include "framebuffer.h"
+#include "image_writer.h"
+#include "job_pool.h"
+#include "math_policy.h"
+#include "offline_renderer.h"
+#include "benchmark.h"
+#include "scenes.h"
+#include "utility.h"
+
+// A fixed scene and view rendered by the quality harness
+struct quality_scene
+{
+	const char* name;
+	void (*build)(world&);
+	glm::vec3 camera_position;
+	float fov;
+};
+
+inline const std::array<quality_scene, 5> quality_scenes{ {
+	{ "showcase", [](world& scene) { add_showcase_scene(scene); }, { 0, 0, 0 }, 70.0f },
+	{ "sphere_grid", add_sphere_grid_scene, { 0, -1, 0 }, 60.0f },
+	{ "glass", add_glass_scene, { 0, -1, 0 }, 60.0f },
+	{ "small_light", add_small_light_scene, { 0, -2, 0 }, 70.0f },
+	{ "sdf", add_sdf_scene, { 0, -1.3, 0 }, 60.0f },
+} };
+
+// The scene called name, which the benchmark can also time
+[[nodiscard]] inline const quality_scene& find_quality_scene(const std::string& name)
+{
+	for (const auto& scene : quality_scenes)
+	{
+		if (scene.name == name)
+			return scene;
+	}
+	throw std::runtime_error("No quality scene is called " + name);
+}
+
+struct quality_settings
+{
+	render_settings render; // samples is only used for the references
+	double time_budget = 10.0; // seconds per scene
+	std::filesystem::path reference_dir;
+	std::string scene_filter; // renders every scene if empty
+};
+
+namespace detail {
+	[[nodiscard]] inline std::filesystem::path quality_reference_path(const quality_settings& settings, const quality_scene& scene)
+	{
+		return settings.reference_dir / (std::string{ scene.name } + "_" + std::to_string(settings.render.width) + "x" + std::to_string(settings.render.height) + ".hdr");
+	}
+	[[nodiscard]] inline world build_quality_scene(const quality_scene& scene)
+	{
+		world result;
+		scene.build(result);
+		result.build();
+		(void)result.update(0.0f);
+		return result;
+	}
+	[[nodiscard]] inline camera quality_camera(const quality_scene& scene, const render_settings& settings)
+	{
+		camera cam;
+		cam.trans.set_position(scene.camera_position);
+		cam.update(scene.fov, static_cast<float>(settings.width) / static_cast<float>(settings.height));
+		return cam;
+	}
+	template <typename Func>
+	void for_each_quality_scene(const quality_settings& settings, Func&& func)
+	{
+		bool found = false;
+		for (const auto& scene : quality_scenes)
+		{
+			if (!settings.scene_filter.empty() && settings.scene_filter != scene.name)
+				continue;
+			found = true;
+			func(scene);
+		}
+		if (!found)
+		{
+			throw std::runtime_error("No quality scene is called " + settings.scene_filter);
+		}
+	}
+}
+
+// Renders the high sample count images the harness compares against
+inline void render_quality_references(const quality_settings& settings, job_pool& pool, std::ostream& log)
+{
+	std::filesystem::create_directories(settings.reference_dir);
+	detail::for_each_quality_scene(settings, [&](const quality_scene& scene)
+	{
+		const auto w = detail::build_quality_scene(scene);
+		framebuffer image;
+		const auto start = time_now();
+		// A frame index no measured pass uses, so the reference noise is independent
+		render_frame(w, detail::quality_camera(scene, settings.render), settings.render, pool, ~0u, image);
+		const auto path = detail::quality_reference_path(settings, scene);
+		if (!write_image(path, image))
+		{
+			throw std::runtime_error("Cannot write " + path.string());
+		}
+		log << "{\"scene\":\"" << scene.name << "\",\"reference\":\"" << path.generic_string() << "\",\"samples\":" << settings.render.samples
+			<< ",\"seconds\":" << time_now() - start << "}\n";
+	});
+}
+
+// Renders every scene one sample per pixel at a time until the time budget is spent,
+// and prints a JSON object per line whenever the sample count reaches a power of two
+// and at the end. Comparing the error reached at equal times shows whether a change
+// made the renderer converge faster, not just run faster.
+inline void run_quality_harness(const quality_settings& settings, job_pool& pool, std::ostream& out)
+{
+	detail::for_each_quality_scene(settings, [&](const quality_scene& scene)
+	{
+		const auto reference_path = detail::quality_reference_path(settings, scene);
+		if (!std::filesystem::exists(reference_path))
+		{
+			throw std::runtime_error("Missing reference " + reference_path.string() + ", render it with --make-references first");
+		}
+		const auto reference = load_linear_image(reference_path);
+		const auto w = detail::build_quality_scene(scene);
+		const auto cam = detail::quality_camera(scene, settings.render);
+		auto pass_settings = settings.render;
+		pass_settings.samples = 1;
+
+		framebuffer pass, average;
+		average.update_size_for_overwrite(pass_settings.width, pass_settings.height);
+		std::vector<glm::vec3> sum(pass_settings.width * pass_settings.height, glm::vec3{ 0, 0, 0 });
+		double render_time = 0.0;
+		const auto report = [&](uint32_t samples)
+		{
+			const auto weight = 1.0f / static_cast<float>(samples);
+			for (size_t i = 0; i < sum.size(); ++i)
+				average.buffer().data[i] = glm::vec4{ sum[i] * weight, 1.0f };
+			out << "{\"scene\":\"" << scene.name << "\",\"policy\":\"" << default_math::name << "\",\"samples\":" << samples
+				<< ",\"seconds\":" << render_time << ",\"rmse\":" << rmse(average, reference) << ",\"relmse\":" << relmse(average, reference) << "}\n";
+		};
+		for (uint32_t samples = 1; ; ++samples)
+		{
+			// Only the rendering counts against the budget, not measuring the error
+			const auto start = time_now();
+			render_frame(w, cam, pass_settings, pool, samples, pass);
+			for (size_t i = 0; i < sum.size(); ++i)
+				sum[i] += glm::vec3{ pass.buffer().data[i] };
+			render_time += time_now() - start;
+
+			const auto done = render_time >= settings.time_budget;
+			if (done || (samples & (samples - 1)) == 0)
+				report(samples);
+			if (done)
+				break;
+		}
+	});
+}
+#endif // QUALITY_HARNESS_H
@@ -5,6 +5,10 @@
 
 struct ray {
     glm::vec3 origin, direction;
+    // Ray cone approximating the footprint of a pixel: its width at the origin,
+    // and how much wider it gets per unit of distance
+    float cone_width = 0.0f;
+    float cone_spread = 0.0f;
 
     [[nodiscard]] glm::vec3 at(float t) const {
         return origin + t * direction;
@@ -15,7 +19,9 @@ inline ray operator*(const glm::mat4& trans, const ray& r) noexcept
 {
     return ray{
 		trans * glm::vec4{r.origin, 1.0f},
-    	normalize(trans * glm::vec4{r.direction, 0.0f})
+    	glm::normalize(glm::vec3{ trans * glm::vec4{r.direction, 0.0f} }),
+    	r.cone_width,
+    	r.cone_spread
     };
 }
 
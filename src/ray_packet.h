@@ -0,0 +1,69 @@
+#ifndef RAY_PACKET_H
+#define RAY_PACKET_H
+#include <array>
+#include <cstddef>
+#include <limits>
+#include <glm/glm.hpp>
+#include "aabb.h"
+#include "ray.h"
+#include "simd.h"
+
+class raytraceable;
+
+// Primary rays of a block of up to 8x8 pixels, stored lane by lane so that they can be
+// intersected four at a time. They all start at the camera, which makes a frustum
+// through the origin bound all of them and lets whole objects be culled at once.
+struct ray_packet
+{
+	constexpr static size_t block_size = 8;
+	constexpr static size_t max_size = block_size * block_size;
+
+	glm::vec3 origin{};
+	float cone_spread = 0.0f;
+	size_t size = 0;
+	alignas(16) std::array<float, max_size> dx, dy, dz;
+	// Closest hit of every lane so far
+	alignas(16) std::array<float, max_size> t;
+	std::array<const raytraceable*, max_size> object;
+	std::array<uint32_t, max_size> primitive;
+	// Largest t of any lane, beyond which nothing needs to be intersected anymore
+	float far_t = std::numeric_limits<float>::infinity();
+	// Inward normals of the planes through origin bounding all directions
+	std::array<glm::vec3, 4> frustum;
+
+	// Lanes are processed in groups of four, so the last group is padded with copies of lane 0
+	[[nodiscard]] size_t padded_size() const noexcept
+	{
+		return (size + 3) & ~size_t{ 3 };
+	}
+	[[nodiscard]] ray lane_ray(size_t lane) const noexcept
+	{
+		return ray{ origin, { dx[lane], dy[lane], dz[lane] }, 0.0f, cone_spread };
+	}
+	// Whether any ray of the packet may hit box closer than the farthest hit found so far
+	[[nodiscard]] bool may_hit(const aabb& box) const noexcept
+	{
+		for (const auto& n : frustum)
+		{
+			// The corner of the box farthest along n
+			const glm::vec3 corner{ n.x >= 0.0f ? box.max.x : box.min.x, n.y >= 0.0f ? box.max.y : box.min.y, n.z >= 0.0f ? box.max.z : box.min.z };
+			if (dot(n, corner - origin) < 0.0f)
+				return false;
+		}
+		return distance(box) <= far_t;
+	}
+	// Lower bound of the t at which any of the rays, with their normalized directions, can reach box
+	[[nodiscard]] float distance(const aabb& box) const noexcept
+	{
+		return glm::length(glm::clamp(origin, box.min, box.max) - origin);
+	}
+	// Recomputes far_t once lanes found closer hits
+	void update_far_t() noexcept
+	{
+		auto result = f32x4::load(t.data());
+		for (size_t lane = 4; lane < padded_size(); lane += 4)
+			result = max(result, f32x4::load(t.data() + lane));
+		far_t = result.max_element();
+	}
+};
+#endif // RAY_PACKET_H
@@ -2,30 +2,53 @@
 #define RAYTRACEABLE_H
 
 #include <optional>
+#include <memory>
+#include <cmath>
+#include <algorithm>
+#include <array>
+#include <limits>
 #include <glm/glm.hpp>
 #include "ray.h"
+#include "ray_packet.h"
+#include "simd.h"
+#include "math_policy.h"
+#include "aabb.h"
+#include "animation.h"
 #include "material.h"
+#include "texture.h"
 
 class raytraceable
 {
 public:
-	struct hit_info
+	// What the intersection loop keeps track of. Everything else about the hit
+	// is only evaluated for the closest one, by surface(), including the local
+	// coordinates and barycentrics, which it recomputes from t and primitive.
+	struct hit_record
+	{
+		float t; // world space ray parameter
+		const raytraceable* object;
+		uint32_t primitive = 0; // of objects made of several, e.g. the triangle of a mesh
+	};
+	struct surface_info
 	{
-		float depth;
 		glm::vec3 pos;
-		glm::vec3 local_pos;
+		glm::vec3 normal;
 		bool front_facing;
-		const raytraceable* hit;
-		ray transformed_ray;
+		texture_coords tex;
 	};
-	struct geometry_info
+	// Point picked on the surface, with its density per unit of world space area
+	struct surface_sample
 	{
-		glm::vec3 normal;
+		glm::vec3 pos;
+		glm::vec3 normal; // the way _normal() points
+		texture_coords tex;
+		float pdf;
 	};
 	const material* mat;
-	const transform trans;
 private:
-	const glm::mat4 inv_trans;
+	transform trans;
+	glm::mat4 inv_trans;
+	std::shared_ptr<const transform_animation> anim;
 public:
 	raytraceable(const material& m, const transform& trans) :
 		mat{ &m },
@@ -33,49 +56,209 @@ public:
 		inv_trans{inverse(trans.to_mat4())}
 	{
 	}
+
+	[[nodiscard]] const transform& get_transform() const noexcept
+	{
+		return trans;
+	}
+	void set_transform(const transform& new_trans) noexcept
+	{
+		trans = new_trans;
+		inv_trans = inverse(trans.to_mat4());
+	}
+	// The animation is shared between all copies of the object
+	void set_animation(std::shared_ptr<const transform_animation> animation) noexcept
+	{
+		anim = std::move(animation);
+	}
+	[[nodiscard]] const transform_animation* animation() const noexcept
+	{
+		return anim.get();
+	}
+	// World space bounds, or nullopt for unbounded objects
+	[[nodiscard]] std::optional<aabb> bounds() const noexcept
+	{
+		const auto local = _bounds();
+		if (!local)
+			return std::nullopt;
+		return local->transformed(trans.to_mat4());
+	}
 	
-	[[nodiscard]] std::optional<hit_info> intersect(const ray& r, float t_min, float t_max) const noexcept
+	// Replaces closest if r hits this object in [t_min, closest.t). Returns true if it did.
+	bool intersect(const ray& r, float t_min, hit_record& closest) const noexcept
 	{ // TODO: this function takes 75% of all processing time. optimize (maybe with SIMD??)
-		const auto transformed_ray = inv_trans * r;
-		const auto intersect_info = _intersect(transformed_ray);
+		const auto local_dir = glm::vec3{ inv_trans * glm::vec4{ r.direction, 0.0f } };
+		const auto local_dir_length = glm::length(local_dir);
+		const ray local_ray{ inv_trans * glm::vec4{ r.origin, 1.0f }, local_dir / local_dir_length };
+		uint32_t primitive = 0;
+		const auto local_t = _intersect_primitive(local_ray, primitive);
+		if (!local_t)
+			return false;
+
+		// The local ray direction is normalized, so its parameter is scaled relative to r's
+		const auto t = *local_t / local_dir_length;
+		if (!(t >= t_min && t < closest.t))
+			return false;
+		closest = { t, this, primitive };
+		return true;
+	}
+	// Whether r hits this object in [t_min, t_max), without working out anything else about the hit
+	[[nodiscard]] bool occludes(const ray& r, float t_min, float t_max) const noexcept
+	{
+		hit_record hit{ t_max, nullptr };
+		return intersect(r, t_min, hit);
+	}
+	// Packet version of intersect, for every lane of p. Returns true if any lane hit.
+	bool intersect(ray_packet& p, float t_min) const noexcept
+	{
+		// Like primary rays, all lanes start at the same point
+		const auto local_origin = glm::vec3{ inv_trans * glm::vec4{ p.origin, 1.0f } };
+		alignas(16) std::array<float, ray_packet::max_size> x, y, z, local_length, local_t;
+		std::array<uint32_t, ray_packet::max_size> primitive{};
+		const auto count = p.padded_size();
+		const auto m = [&](int col, int row) { return f32x4::broadcast(inv_trans[col][row]); };
+		for (size_t lane = 0; lane < count; lane += 4)
+		{
+			const auto dx = f32x4::load(p.dx.data() + lane);
+			const auto dy = f32x4::load(p.dy.data() + lane);
+			const auto dz = f32x4::load(p.dz.data() + lane);
+			const auto lx = m(0, 0) * dx + m(1, 0) * dy + m(2, 0) * dz;
+			const auto ly = m(0, 1) * dx + m(1, 1) * dy + m(2, 1) * dz;
+			const auto lz = m(0, 2) * dx + m(1, 2) * dy + m(2, 2) * dz;
+			const auto length = sqrt(lx * lx + ly * ly + lz * lz);
+			const auto inv_length = f32x4::broadcast(1.0f) / length;
+			(lx * inv_length).store(x.data() + lane);
+			(ly * inv_length).store(y.data() + lane);
+			(lz * inv_length).store(z.data() + lane);
+			length.store(local_length.data() + lane);
+		}
+		_intersect_packet(local_origin, x.data(), y.data(), z.data(), count, local_t.data(), primitive.data());
 
-		if(intersect_info)
+		bool any = false;
+		for (size_t lane = 0; lane < count; lane += 4)
 		{
-			const auto& [local_pos, front_facing] = *intersect_info;
-			
-			const auto pos = glm::vec3{ trans.to_mat4() * glm::vec4{ local_pos, 1.0f } };
-			const auto depth = signed_length2(pos - r.origin, r.direction);
-			if (depth < t_min || depth > t_max)
-				return std::nullopt;
-			return hit_info{ depth, pos, local_pos, front_facing, this, transformed_ray };
+			const auto t = f32x4::load(local_t.data() + lane) / f32x4::load(local_length.data() + lane);
+			const auto closest = f32x4::load(p.t.data() + lane);
+			const auto closer = (t >= f32x4::broadcast(t_min)) & (t < closest);
+			const auto bits = closer.bits();
+			if (!bits)
+				continue;
+			any = true;
+			select(closer, t, closest).store(p.t.data() + lane);
+			for (int i = 0; i < 4; ++i)
+			{
+				if (bits & (1 << i))
+				{
+					p.object[lane + i] = this;
+					p.primitive[lane + i] = primitive[lane + i];
+				}
+			}
 		}
-		
-		return std::nullopt;
+		return any;
 	}
-	[[nodiscard]] geometry_info hit(const hit_info& hit) const noexcept
+	[[nodiscard]] surface_info surface(const ray& r, const hit_record& hit) const noexcept
 	{
-		auto normal = normalize(trans.to_mat3() * _hit(hit));
-		if (!hit.front_facing)
+		const auto pos = r.at(hit.t);
+		const auto local_ray = inv_trans * r;
+		const auto local_pos = glm::vec3{ inv_trans * glm::vec4{ pos, 1.0f } };
+		const auto local = _surface(local_ray, local_pos, hit.primitive);
+		auto normal = glm::normalize(trans.to_mat3() * local.normal);
+		if (!local.front_facing)
 			normal *= -1;
-		return { normal };
+		return { pos, normal, local.front_facing, { local.uv, uv_width(r, hit.t) } };
 	}
+	// Width of r's cone at distance t, brought into object space and then into uv units
+	[[nodiscard]] float uv_width(const ray& r, float t) const noexcept
+	{
+		const auto scale = abs(trans.get_scale());
+		const auto local_width = (r.cone_width + r.cone_spread * t) * 3.0f / (scale.x + scale.y + scale.z);
+		return local_width * _uv_per_unit();
+	}
+	// Whether points on the surface can be sampled, which lights need
+	[[nodiscard]] bool sampleable() const noexcept
+	{
+		return _area() > 0.0f;
+	}
+	// Uniformly distributed over the object space surface, which the transform may stretch
+	[[nodiscard]] surface_sample sample_surface(int& seed) const noexcept
+	{
+		const auto local_pos = _sample({ frand(seed), frand(seed) });
+		const auto pos = glm::vec3{ trans.to_mat4() * glm::vec4{ local_pos, 1.0f } };
+		return { pos, default_math::normalize(trans.to_mat3() * _normal(local_pos)), { _uv(local_pos), 0.0f }, area_pdf(pos) };
+	}
+	// Density of sample_surface at pos, which must lie on the surface
+	[[nodiscard]] float area_pdf(const glm::vec3& pos) const noexcept
+	{
+		// World space area per object space area, for the linear part M of the transform
+		const auto local_pos = glm::vec3{ inv_trans * glm::vec4{ pos, 1.0f } };
+		const auto m = trans.to_mat3();
+		const auto stretch = std::abs(determinant(m)) * length(transpose(glm::mat3{ inv_trans }) * default_math::normalize(_normal(local_pos)));
+		return 1.0f / (_area() * stretch);
+	}
+	// Roughly the world space area, for weighting lights against each other
+	[[nodiscard]] float approximate_area() const noexcept
+	{
+		return _area() * std::pow(std::abs(determinant(trans.to_mat3())), 2.0f / 3.0f);
+	}
+	[[nodiscard]] virtual std::unique_ptr<raytraceable> clone() const = 0;
 	virtual ~raytraceable() = default;
 protected:
-	struct intersect_info
+	// Ray parameter of the hit along the normalized, object space ray r
+	[[nodiscard]] virtual std::optional<float> _intersect(const ray& r) const noexcept = 0;
+	// _intersect for objects made of several primitives, which also sets the one r hit
+	[[nodiscard]] virtual std::optional<float> _intersect_primitive(const ray& r, uint32_t& primitive) const noexcept
+	{
+		return _intersect(r);
+	}
+	// _intersect_primitive for count rays from origin along the normalized (x, y, z), writing
+	// infinity for misses. count is a multiple of 4 and the float arrays are 16 byte aligned.
+	// Objects that aren't made of several primitives may leave primitive as it is.
+	virtual void _intersect_packet(const glm::vec3& origin, const float* x, const float* y, const float* z, size_t count, float* t, uint32_t* primitive) const noexcept
 	{
-		glm::vec3 local_pos;
+		for (size_t lane = 0; lane < count; ++lane)
+		{
+			t[lane] = _intersect_primitive(ray{ origin, { x[lane], y[lane], z[lane] } }, primitive[lane]).value_or(std::numeric_limits<float>::infinity());
+		}
+	}
+	struct local_surface
+	{
+		glm::vec3 normal; // the way _normal() points
 		bool front_facing;
+		glm::vec2 uv;
 	};
-	[[nodiscard]] virtual std::optional<intersect_info> _intersect(const ray& r) const noexcept = 0;
-	[[nodiscard]] virtual glm::vec3 _hit(const hit_info& hit) const noexcept = 0;
+	// Surface at local_pos, where the object space ray r hit primitive
+	[[nodiscard]] virtual local_surface _surface(const ray& r, const glm::vec3& local_pos, uint32_t primitive) const noexcept
+	{
+		return { _normal(local_pos), _front_facing(r), _uv(local_pos) };
+	}
+	[[nodiscard]] virtual bool _front_facing(const ray& r) const noexcept = 0;
+	[[nodiscard]] virtual glm::vec3 _normal(const glm::vec3& local_pos) const noexcept = 0;
+	[[nodiscard]] virtual glm::vec2 _uv(const glm::vec3& local_pos) const noexcept = 0;
+	// How far the uv coordinates move per object space unit along the surface
+	[[nodiscard]] virtual float _uv_per_unit() const noexcept = 0;
+	[[nodiscard]] virtual std::optional<aabb> _bounds() const noexcept = 0;
+	// Object space area of the surface, or 0 if it can't be sampled
+	[[nodiscard]] virtual float _area() const noexcept
+	{
+		return 0.0f;
+	}
+	// Maps u in [0, 1)^2 uniformly onto the object space surface
+	[[nodiscard]] virtual glm::vec3 _sample(const glm::vec2& u) const noexcept
+	{
+		return glm::vec3{ 0, 0, 0 };
+	}
 };
 
 class sphere : public raytraceable
 {
 public:
 	using raytraceable::raytraceable;
+	[[nodiscard]] std::unique_ptr<raytraceable> clone() const override
+	{
+		return std::make_unique<sphere>(*this);
+	}
 protected:
-	[[nodiscard]] std::optional<intersect_info> _intersect(const ray& r) const noexcept override
+	[[nodiscard]] std::optional<float> _intersect(const ray& r) const noexcept override
 	{
 		const auto oc = r.origin /* - center */;
 		const auto a = 1.0f;
@@ -87,16 +270,56 @@ protected:
 			return std::nullopt;
 		}
 
-		const auto front_facing = length2(r.origin) >= 1.0f;
-		const auto sqrt_disc = front_facing ? -sqrt(discriminant) : sqrt(discriminant);
-		return intersect_info{
-			r.at((-half_b + sqrt_disc) / a),
-			front_facing
-		};
+		const auto sqrt_disc = sphere::_front_facing(r) ? -std::sqrt(discriminant) : std::sqrt(discriminant);
+		return (-half_b + sqrt_disc) / a;
+	}
+	void _intersect_packet(const glm::vec3& origin, const float* x, const float* y, const float* z, size_t count, float* t, uint32_t* primitive) const noexcept override
+	{
+		// The origin is shared, so whether the rays start outside is too
+		const auto c = f32x4::broadcast(dot(origin, origin) - 1.0f);
+		const auto sign = f32x4::broadcast(sphere::_front_facing(ray{ origin, {} }) ? -1.0f : 1.0f);
+		const auto ox = f32x4::broadcast(origin.x), oy = f32x4::broadcast(origin.y), oz = f32x4::broadcast(origin.z);
+		const auto miss = f32x4::broadcast(std::numeric_limits<float>::infinity());
+		for (size_t lane = 0; lane < count; lane += 4)
+		{
+			const auto half_b = ox * f32x4::load(x + lane) + oy * f32x4::load(y + lane) + oz * f32x4::load(z + lane);
+			const auto discriminant = half_b * half_b - c;
+			const auto hit = f32x4::broadcast(0.0f) - half_b + sign * sqrt(max(discriminant, f32x4::broadcast(0.0f)));
+			select(discriminant >= f32x4::broadcast(0.0f), hit, miss).store(t + lane);
+		}
 	}
-	[[nodiscard]] glm::vec3 _hit(const hit_info& hit) const noexcept override
+	[[nodiscard]] bool _front_facing(const ray& r) const noexcept override
 	{
-		return hit.local_pos;
+		return length2(r.origin) >= 1.0f;
+	}
+	[[nodiscard]] glm::vec3 _normal(const glm::vec3& local_pos) const noexcept override
+	{
+		return local_pos;
+	}
+	[[nodiscard]] glm::vec2 _uv(const glm::vec3& local_pos) const noexcept override
+	{
+		const auto u = 0.5f + std::atan2(local_pos.z, local_pos.x) / (2.0f * static_cast<float>(pi));
+		const auto v = default_math::acos(std::clamp(local_pos.y, -1.0f, 1.0f)) / static_cast<float>(pi);
+		return { u, v };
+	}
+	[[nodiscard]] float _uv_per_unit() const noexcept override
+	{
+		return 1.0f / static_cast<float>(pi);
+	}
+	[[nodiscard]] std::optional<aabb> _bounds() const noexcept override
+	{
+		return aabb{ { -1, -1, -1 }, { 1, 1, 1 } };
+	}
+	[[nodiscard]] float _area() const noexcept override
+	{
+		return 4.0f * static_cast<float>(pi);
+	}
+	[[nodiscard]] glm::vec3 _sample(const glm::vec2& u) const noexcept override
+	{
+		const auto y = 1.0f - 2.0f * u.x;
+		const auto r = std::sqrt(std::max(1.0f - y * y, 0.0f));
+		const auto phi = 2.0f * static_cast<float>(pi) * u.y;
+		return { r * std::cos(phi), y, r * std::sin(phi) };
 	}
 };
 
@@ -104,40 +327,104 @@ class plane : public raytraceable
 {
 public:
 	using raytraceable::raytraceable;
+	[[nodiscard]] std::unique_ptr<raytraceable> clone() const override
+	{
+		return std::make_unique<plane>(*this);
+	}
 protected:
-	[[nodiscard]] std::optional<intersect_info> _intersect(const ray& r) const noexcept override
+	[[nodiscard]] std::optional<float> _intersect(const ray& r) const noexcept override
 	{
 		const auto cos_theta = -r.direction.y; // dot(normal, r.direction)
 		const auto dir = /* position */ -r.origin;
-		const auto t = -dir.y / cos_theta; // dot(dir, normal) / front_facing
-		return intersect_info{
-			r.at(t),
-			cos_theta < 0.0f
-		};
+		return -dir.y / cos_theta; // dot(dir, normal) / cos_theta
 	}
-	[[nodiscard]] glm::vec3 _hit(const hit_info& hit) const noexcept override
+	void _intersect_packet(const glm::vec3& origin, const float* x, const float* y, const float* z, size_t count, float* t, uint32_t* primitive) const noexcept override
 	{
-		return { 0, -1, 0}; // normal
+		const auto oy = f32x4::broadcast(-origin.y);
+		for (size_t lane = 0; lane < count; lane += 4)
+			(oy / f32x4::load(y + lane)).store(t + lane);
+	}
+	[[nodiscard]] bool _front_facing(const ray& r) const noexcept override
+	{
+		return -r.direction.y < 0.0f;
+	}
+	[[nodiscard]] glm::vec3 _normal(const glm::vec3& local_pos) const noexcept override
+	{
+		return { 0, -1, 0};
+	}
+	// The texture repeats every unit
+	[[nodiscard]] glm::vec2 _uv(const glm::vec3& local_pos) const noexcept override
+	{
+		return { local_pos.x, local_pos.z };
+	}
+	[[nodiscard]] float _uv_per_unit() const noexcept override
+	{
+		return 1.0f;
+	}
+	[[nodiscard]] std::optional<aabb> _bounds() const noexcept override
+	{
+		return std::nullopt; // infinite
 	}
 };
 class rectangle : public plane
 {
 public:
 	using plane::plane;
+	[[nodiscard]] std::unique_ptr<raytraceable> clone() const override
+	{
+		return std::make_unique<rectangle>(*this);
+	}
 protected:
-	[[nodiscard]] std::optional<intersect_info> _intersect(const ray& r) const noexcept override
+	[[nodiscard]] std::optional<float> _intersect(const ray& r) const noexcept override
 	{
-		const auto intersect_info = plane::_intersect(r);
-		if (intersect_info)
+		const auto t = plane::_intersect(r);
+		if (t)
 		{
-			const auto& [local_pos, front_facing] = *intersect_info;
+			const auto local_pos = r.at(*t);
 			if (local_pos.x >= -1 && local_pos.x <= 1 && local_pos.z >= -1 && local_pos.z <= 1)
 			{
-				return intersect_info;
+				return t;
 			}
 		}
 		return std::nullopt;
 	}
+	void _intersect_packet(const glm::vec3& origin, const float* x, const float* y, const float* z, size_t count, float* t, uint32_t* primitive) const noexcept override
+	{
+		plane::_intersect_packet(origin, x, y, z, count, t, primitive);
+		const auto ox = f32x4::broadcast(origin.x), oz = f32x4::broadcast(origin.z);
+		const auto low = f32x4::broadcast(-1.0f), high = f32x4::broadcast(1.0f);
+		const auto miss = f32x4::broadcast(std::numeric_limits<float>::infinity());
+		for (size_t lane = 0; lane < count; lane += 4)
+		{
+			const auto hit = f32x4::load(t + lane);
+			const auto px = ox + hit * f32x4::load(x + lane);
+			const auto pz = oz + hit * f32x4::load(z + lane);
+			const auto inside = (px >= low) & (px <= high) & (pz >= low) & (pz <= high);
+			select(inside, hit, miss).store(t + lane);
+		}
+	}
+	// The texture covers the rectangle once
+	[[nodiscard]] glm::vec2 _uv(const glm::vec3& local_pos) const noexcept override
+	{
+		return { 0.5f * (local_pos.x + 1.0f), 0.5f * (local_pos.z + 1.0f) };
+	}
+	[[nodiscard]] float _uv_per_unit() const noexcept override
+	{
+		return 0.5f;
+	}
+	[[nodiscard]] std::optional<aabb> _bounds() const noexcept override
+	{
+		// Slightly thickened so that the box never degenerates to a plane
+		return aabb{ { -1, -1e-4f, -1 }, { 1, 1e-4f, 1 } };
+	}
+	[[nodiscard]] float _area() const noexcept override
+	{
+		return 4.0f;
+	}
+	[[nodiscard]] glm::vec3 _sample(const glm::vec2& u) const noexcept override
+	{
+		return { 2.0f * u.x - 1.0f, 0.0f, 2.0f * u.y - 1.0f };
+	}
 };
 
 template <typename Raytraceable>
@@ -145,19 +432,27 @@ class single_sided : public Raytraceable
 {
 public:
 	using Raytraceable::Raytraceable;
+	[[nodiscard]] std::unique_ptr<raytraceable> clone() const override
+	{
+		return std::make_unique<single_sided>(*this);
+	}
 protected:
-	[[nodiscard]] std::optional<raytraceable::intersect_info> _intersect(const ray& r) const noexcept override
+	[[nodiscard]] std::optional<float> _intersect(const ray& r) const noexcept override
 	{
-		const auto intersect_info = Raytraceable::_intersect(r);
-		if (intersect_info)
+		if (!Raytraceable::_front_facing(r))
 		{
-			const auto& [local_pos, front_facing] = *intersect_info;
-			if (front_facing)
-			{
-				return intersect_info;
-			}
+			return std::nullopt;
+		}
+		return Raytraceable::_intersect(r);
+	}
+	void _intersect_packet(const glm::vec3& origin, const float* x, const float* y, const float* z, size_t count, float* t, uint32_t* primitive) const noexcept override
+	{
+		Raytraceable::_intersect_packet(origin, x, y, z, count, t, primitive);
+		for (size_t lane = 0; lane < count; ++lane)
+		{
+			if (!Raytraceable::_front_facing(ray{ origin, { x[lane], y[lane], z[lane] } }))
+				t[lane] = std::numeric_limits<float>::infinity();
 		}
-		return std::nullopt;
 	}
 };
 
@@ -166,22 +461,18 @@ class inverted_facing : public Raytraceable
 {
 public:
 	using Raytraceable::Raytraceable;
+	[[nodiscard]] std::unique_ptr<raytraceable> clone() const override
+	{
+		return std::make_unique<inverted_facing>(*this);
+	}
 protected:
-	[[nodiscard]] std::optional<raytraceable::intersect_info> _intersect(const ray& r) const noexcept override
+	[[nodiscard]] bool _front_facing(const ray& r) const noexcept override
 	{
-		const auto intersect_info = Raytraceable::_intersect(r);
-		if (intersect_info)
-		{
-			return raytraceable::intersect_info{
-				intersect_info->local_pos,
-				!intersect_info->front_facing
-			};
-		}
-		return std::nullopt;
+		return !Raytraceable::_front_facing(r);
 	}
-	[[nodiscard]] glm::vec3 _hit(const raytraceable::hit_info& hit) const noexcept override
+	[[nodiscard]] glm::vec3 _normal(const glm::vec3& local_pos) const noexcept override
 	{
-		return -Raytraceable::_hit(hit);
+		return -Raytraceable::_normal(local_pos);
 	}
 };
 
@@ -0,0 +1,523 @@
+#ifndef RENDER_SERVER_H
+#define RENDER_SERVER_H
+#include <algorithm>
+#include <atomic>
+#include <cerrno>
+#include <chrono>
+#include <condition_variable>
+#include <cstdint>
+#include <cstring>
+#include <filesystem>
+#include <iostream>
+#include <list>
+#include <map>
+#include <memory>
+#include <mutex>
+#include <optional>
+#include <queue>
+#include <sstream>
+#include <stdexcept>
+#include <string>
+#include <thread>
+#include <utility>
+#include <vector>
+#include <stb_image_write.h>
+#include <glm/glm.hpp>
+#if defined(__unix__) || defined(__APPLE__)
+#include <sys/socket.h>
+#include <sys/time.h>
+#include <sys/un.h>
+#include <unistd.h>
+#define RENDER_SERVER_SUPPORTED
+#endif
+#include "camera.h"
+#include "framebuffer.h"
+#include "geometry_cache.h"
+#include "image_writer.h"
+#include "job_pool.h"
+#include "offline_renderer.h"
+#include "scene_file.h"
+#include "texture.h"
+#include "utility.h"
+
+// Parsed scenes with their BVHs, shared by all jobs naming the same file content
+class scene_cache
+{
+	struct key
+	{
+		std::string path;
+		uint64_t hash;
+		auto operator<=>(const key&) const = default;
+	};
+	std::mutex mutex;
+	std::map<key, std::shared_ptr<const loaded_scene>> scenes;
+	std::shared_ptr<texture_cache> textures;
+	std::shared_ptr<geometry_cache> geometry;
+public:
+	scene_cache(std::shared_ptr<texture_cache> textures, std::shared_ptr<geometry_cache> geometry) :
+		textures{ std::move(textures) },
+		geometry{ std::move(geometry) }
+	{
+	}
+
+	// Reloads the file if its content changed. Older versions stay alive while jobs use them.
+	[[nodiscard]] std::shared_ptr<const loaded_scene> get(const std::filesystem::path& path)
+	{
+		const auto absolute = std::filesystem::absolute(path);
+		const auto text = read_file(absolute);
+		const key k{ absolute.string(), content_hash(text) };
+		std::lock_guard lk{ mutex };
+		if (const auto it = scenes.find(k); it != scenes.end())
+			return it->second;
+		// Only the latest version of each file is kept
+		std::erase_if(scenes, [&](const auto& entry) { return entry.first.path == k.path; });
+		std::shared_ptr<const loaded_scene> scene = parse_scene(text, absolute.parent_path(), textures, geometry);
+		scenes.emplace(k, scene);
+		return scene;
+	}
+};
+
+// One request, parsed from a line of space separated key=value pairs after the word "render":
+//   scene=<file> size=<w>x<h> samples=<n> priority=<p> camera=<x,y,z,pitch,yaw,roll>
+//   fov=<degrees> format=png|hdr|float preview=<every n samples, 0 for none>
+struct render_request
+{
+	std::filesystem::path scene;
+	render_settings settings;
+	int priority = 0;
+	glm::vec3 camera_position{ 0, 0, 0 };
+	glm::vec3 camera_rotation{ 0, 0, 0 }; // degrees
+	float fov = 70.0f;
+	std::string format = "png";
+	int preview_interval = 0;
+
+	[[nodiscard]] static render_request parse(const std::string& line)
+	{
+		std::istringstream in{ line };
+		std::string word;
+		if (!(in >> word) || word != "render")
+			throw std::runtime_error("Expected 'render key=value ...'");
+		render_request request;
+		while (in >> word)
+		{
+			const auto separator = word.find('=');
+			if (separator == std::string::npos)
+				throw std::runtime_error("Expected key=value, got " + word);
+			const auto key = word.substr(0, separator);
+			const auto value = word.substr(separator + 1);
+			const auto numbers = [&](size_t count)
+			{
+				std::vector<float> result;
+				std::istringstream values{ value };
+				for (std::string number; std::getline(values, number, ',');)
+					result.push_back(std::stof(number));
+				if (result.size() != count)
+					throw std::runtime_error(key + " needs " + std::to_string(count) + " comma separated numbers");
+				return result;
+			};
+			if (key == "scene")
+				request.scene = value;
+			else if (key == "size")
+			{
+				const auto x = value.find('x');
+				if (x == std::string::npos)
+					throw std::runtime_error("Expected size=<width>x<height>");
+				request.settings.width = std::stoul(value.substr(0, x));
+				request.settings.height = std::stoul(value.substr(x + 1));
+			}
+			else if (key == "samples")
+				request.settings.samples = std::stoi(value);
+			else if (key == "priority")
+				request.priority = std::stoi(value);
+			else if (key == "camera")
+			{
+				const auto v = numbers(6);
+				request.camera_position = { v[0], v[1], v[2] };
+				request.camera_rotation = { v[3], v[4], v[5] };
+			}
+			else if (key == "fov")
+				request.fov = std::stof(value);
+			else if (key == "format")
+				request.format = value;
+			else if (key == "preview")
+				request.preview_interval = std::stoi(value);
+			else
+				throw std::runtime_error("Unknown key " + key);
+		}
+		if (request.scene.empty())
+			throw std::runtime_error("The request doesn't name a scene");
+		if (request.settings.width < 2 || request.settings.height < 2 || request.settings.samples < 1)
+			throw std::runtime_error("The image must be at least 2x2 pixels with at least one sample");
+		if (request.format != "png" && request.format != "hdr" && request.format != "float")
+			throw std::runtime_error("Unknown format " + request.format);
+		return request;
+	}
+};
+
+namespace detail {
+	// png and hdr as files would be written; float is the width and height as uint32
+	// followed by RGBA float32 texels, in host byte order
+	[[nodiscard]] inline std::vector<unsigned char> encode_image(const std::string& format, const framebuffer& fb)
+	{
+		std::vector<unsigned char> result;
+		const auto append = [](void* context, void* data, int size)
+		{
+			auto& out = *static_cast<std::vector<unsigned char>*>(context);
+			out.insert(out.end(), static_cast<unsigned char*>(data), static_cast<unsigned char*>(data) + size);
+		};
+		const auto width = static_cast<int>(fb.width());
+		const auto height = static_cast<int>(fb.height());
+		if (format == "png")
+		{
+			stbi_write_png_to_func(append, &result, width, height, 4, to_pixels(fb).get(), 0);
+		}
+		else if (format == "hdr")
+		{
+			stbi_write_hdr_to_func(append, &result, width, height, 4, &fb.buffer().data->x);
+		}
+		else
+		{
+			const uint32_t size[2]{ static_cast<uint32_t>(width), static_cast<uint32_t>(height) };
+			result.resize(sizeof(size) + fb.width() * fb.height() * sizeof(glm::vec4));
+			std::memcpy(result.data(), size, sizeof(size));
+			std::memcpy(result.data() + sizeof(size), fb.buffer().data, fb.width() * fb.height() * sizeof(glm::vec4));
+		}
+		return result;
+	}
+}
+
+// Long running renderer taking jobs over a Unix domain socket, so that scenes are
+// parsed once and rendering doesn't pay for process start up. A client sends one
+// line, either a render_request or "shutdown", and reads back messages of a header
+// line followed by the number of bytes it announces:
+//   preview <samples> <bytes>   progressive result, if the request asked for them
+//   done <samples> <bytes>      final image
+//   error <bytes>               message of why the job failed
+// Queued jobs run one after another in order of priority (highest first), each
+// using the whole pool. Clients have request_timeout to send their line, and only
+// those running as the server's user may shut it down.
+class render_server
+{
+	struct queued_job
+	{
+		int priority;
+		uint64_t sequence;
+		int connection;
+		render_request request;
+
+		bool operator<(const queued_job& other) const noexcept
+		{
+			// priority_queue pops the largest, so earlier jobs of equal priority must compare larger
+			return priority != other.priority ? priority < other.priority : sequence > other.sequence;
+		}
+	};
+
+	// Thread receiving the request of a connection, joined once it is done
+	struct reader
+	{
+		int connection = -1;
+		std::thread thread;
+		bool done = false;
+	};
+
+	job_pool& pool;
+	scene_cache scenes;
+	std::filesystem::path socket_path;
+	int listener = -1;
+	std::thread acceptor;
+	std::mutex queue_mutex;
+	std::condition_variable queue_changed;
+	std::priority_queue<queued_job> queue;
+	uint64_t next_sequence = 0;
+	std::list<reader> readers;
+	std::atomic<bool> stopping{ false };
+
+#ifdef RENDER_SERVER_SUPPORTED
+	static bool send_all(int connection, const void* data, size_t size) noexcept
+	{
+		auto bytes = static_cast<const char*>(data);
+		while (size > 0)
+		{
+#ifdef MSG_NOSIGNAL
+			const auto sent = ::send(connection, bytes, size, MSG_NOSIGNAL);
+#else
+			const auto sent = ::send(connection, bytes, size, 0);
+#endif
+			if (sent <= 0)
+				return false;
+			bytes += sent;
+			size -= static_cast<size_t>(sent);
+		}
+		return true;
+	}
+	static bool send_message(int connection, const std::string& header, const void* data, size_t size) noexcept
+	{
+		return send_all(connection, header.data(), header.size()) && send_all(connection, data, size);
+	}
+	static bool send_error(int connection, const std::string& message) noexcept
+	{
+		return send_message(connection, "error " + std::to_string(message.size()) + "\n", message.data(), message.size());
+	}
+	// Reads up to the first newline. Clients send a single line, so anything after it is ignored.
+	[[nodiscard]] static std::string receive_line(int connection)
+	{
+		std::string line;
+		char buffer[512];
+		while (true)
+		{
+			const auto received = ::recv(connection, buffer, sizeof(buffer), 0);
+			if (received < 0)
+			{
+				if (errno == EINTR)
+					continue;
+				if (errno == EAGAIN || errno == EWOULDBLOCK)
+					throw std::runtime_error("Timed out waiting for the request");
+				throw std::runtime_error(std::string{ "Cannot receive the request: " } + std::strerror(errno));
+			}
+			if (received == 0)
+				return line;
+			const auto end = std::find(buffer, buffer + received, '\n');
+			line.append(buffer, end);
+			if (line.size() > 4096)
+				throw std::runtime_error("Request line too long");
+			if (end != buffer + received)
+				return line;
+		}
+	}
+	// Whether the client runs as the same user as the server
+	[[nodiscard]] static bool same_user(int connection) noexcept
+	{
+#ifdef SO_PEERCRED
+		ucred credentials{};
+		socklen_t size = sizeof(credentials);
+		return ::getsockopt(connection, SOL_SOCKET, SO_PEERCRED, &credentials, &size) == 0 && credentials.uid == ::geteuid();
+#else
+		uid_t uid;
+		gid_t gid;
+		return ::getpeereid(connection, &uid, &gid) == 0 && uid == ::geteuid();
+#endif
+	}
+
+	void accept_connections()
+	{
+		bool failing = false;
+		while (!stopping)
+		{
+			const auto connection = ::accept(listener, nullptr, nullptr);
+			if (connection < 0)
+			{
+				if (stopping || errno == EINTR || errno == ECONNABORTED)
+					continue;
+				// Errors such as running out of file descriptors persist for a while, so
+				// they are reported once and retried after a pause instead of spinning
+				if (!failing)
+					std::cerr << "Cannot accept connections: " << std::strerror(errno) << '\n';
+				failing = true;
+				std::this_thread::sleep_for(std::chrono::milliseconds{ 100 });
+				continue;
+			}
+			failing = false;
+			timeval timeout{ static_cast<time_t>(request_timeout.count()), 0 };
+			(void)::setsockopt(connection, SOL_SOCKET, SO_RCVTIMEO, &timeout, sizeof(timeout));
+			// Reading the request on its own thread, so a slow client can't hold up the others
+			std::lock_guard lk{ queue_mutex };
+			if (stopping)
+			{
+				::close(connection);
+				break;
+			}
+			std::erase_if(readers, [](reader& r)
+			{
+				if (r.done)
+					r.thread.join();
+				return r.done;
+			});
+			auto& r = readers.emplace_back();
+			r.connection = connection;
+			r.thread = std::thread{ [this, &r] { receive_request(r); } };
+		}
+	}
+	void receive_request(reader& r)
+	{
+		const auto connection = r.connection;
+		std::optional<render_request> request;
+		std::string error;
+		bool shutdown = false;
+		try
+		{
+			const auto line = receive_line(connection);
+			if (line != "shutdown")
+				request = render_request::parse(line);
+			else if (same_user(connection))
+				shutdown = true;
+			else
+				error = "Only the user running the server can shut it down";
+		}
+		catch (const std::exception& e)
+		{
+			error = e.what();
+		}
+		if (shutdown)
+			stop();
+		if (!request && !shutdown)
+			(void)send_error(connection, stopping ? "The server is shutting down" : error);
+
+		std::lock_guard lk{ queue_mutex };
+		r.done = true;
+		if (request && stopping)
+		{
+			(void)send_error(connection, "The server is shutting down");
+			request.reset();
+		}
+		if (request)
+			queue.push({ request->priority, next_sequence++, connection, std::move(*request) });
+		else
+			::close(connection);
+		// Also tells run() when the last reader is done
+		queue_changed.notify_all();
+	}
+	void render(const queued_job& job)
+	{
+		const auto& request = job.request;
+		const auto scene = scenes.get(request.scene);
+		const auto& settings = request.settings;
+
+		camera cam;
+		cam.trans = transform{ request.camera_position, glm::radians(request.camera_rotation), { 1, 1, 1 } };
+		cam.update(request.fov, static_cast<float>(settings.width) / static_cast<float>(settings.height));
+
+		// Render in passes ending at every preview, accumulating their sum
+		framebuffer pass, result;
+		result.update_size_for_overwrite(settings.width, settings.height);
+		std::vector<glm::vec3> sum(settings.width * settings.height, glm::vec3{ 0, 0, 0 });
+		const auto interval = request.preview_interval > 0 ? request.preview_interval : settings.samples;
+		int samples = 0;
+		for (uint64_t pass_idx = 0; samples < settings.samples; ++pass_idx)
+		{
+			auto pass_settings = settings;
+			pass_settings.samples = std::min(interval, settings.samples - samples);
+			render_frame(scene->geometry, cam, pass_settings, pool, pass_idx, pass);
+			for (size_t i = 0; i < sum.size(); ++i)
+				sum[i] += glm::vec3{ pass.buffer().data[i] } * static_cast<float>(pass_settings.samples);
+			samples += pass_settings.samples;
+
+			const auto weight = 1.0f / static_cast<float>(samples);
+			for (size_t i = 0; i < sum.size(); ++i)
+				result.buffer().data[i] = glm::vec4{ sum[i] * weight, 1.0f };
+			const auto image = detail::encode_image(samples < settings.samples ? "png" : request.format, result);
+			const auto header = std::string{ samples < settings.samples ? "preview " : "done " } + std::to_string(samples) + " " + std::to_string(image.size()) + "\n";
+			// The client went away, so nobody wants the rest
+			if (!send_message(job.connection, header, image.data(), image.size()))
+				return;
+		}
+	}
+	void stop()
+	{
+		std::lock_guard lk{ queue_mutex };
+		stopping = true;
+		// Wakes up accept() and the readers still waiting for a request
+		::shutdown(listener, SHUT_RDWR);
+		for (const auto& r : readers)
+		{
+			if (!r.done)
+				::shutdown(r.connection, SHUT_RD);
+		}
+		queue_changed.notify_all();
+	}
+	[[nodiscard]] bool reading() const noexcept
+	{
+		return std::ranges::any_of(readers, [](const reader& r) { return !r.done; });
+	}
+	// Stops accepting connections and waits for the threads still running
+	void join_threads()
+	{
+		if (acceptor.joinable())
+		{
+			stop();
+			acceptor.join();
+		}
+		for (auto& r : readers)
+		{
+			if (r.thread.joinable())
+				r.thread.join();
+		}
+		readers.clear();
+	}
+#endif
+public:
+	// How long a client may take to send its request
+	static constexpr std::chrono::seconds request_timeout{ 10 };
+
+	render_server(job_pool& pool, std::filesystem::path socket_path, size_t texture_budget = texture_cache::default_budget,
+		size_t geometry_budget = geometry_cache::default_budget) :
+		pool{ pool },
+		scenes{ std::make_shared<texture_cache>(texture_budget), std::make_shared<geometry_cache>(geometry_budget) },
+		socket_path{ std::move(socket_path) }
+	{
+	}
+	render_server(const render_server&) = delete;
+	render_server& operator=(const render_server&) = delete;
+	~render_server()
+	{
+#ifdef RENDER_SERVER_SUPPORTED
+		join_threads();
+#endif
+	}
+
+	// Serves requests until the server's user sends "shutdown", finishing the jobs that are already queued
+	void run()
+	{
+#ifdef RENDER_SERVER_SUPPORTED
+		sockaddr_un address{};
+		address.sun_family = AF_UNIX;
+		const auto path = socket_path.string();
+		if (path.size() >= sizeof(address.sun_path))
+		{
+			throw std::runtime_error("Socket path " + path + " is too long");
+		}
+		std::strcpy(address.sun_path, path.c_str());
+		listener = ::socket(AF_UNIX, SOCK_STREAM, 0);
+		if (listener < 0)
+		{
+			throw std::runtime_error("Cannot create a socket");
+		}
+		std::filesystem::remove(socket_path);
+		if (::bind(listener, reinterpret_cast<const sockaddr*>(&address), sizeof(address)) != 0 || ::listen(listener, 16) != 0)
+		{
+			::close(listener);
+			throw std::runtime_error("Cannot listen on " + path + ": " + std::strerror(errno));
+		}
+		std::cout << "Listening on " << path << '\n';
+		acceptor = std::thread{ [this] { accept_connections(); } };
+		while (true)
+		{
+			std::unique_lock lk{ queue_mutex };
+			queue_changed.wait(lk, [&] { return !queue.empty() || (stopping && !reading()); });
+			if (queue.empty())
+				break;
+			const auto job = queue.top();
+			queue.pop();
+			lk.unlock();
+
+			const auto start = time_now();
+			try
+			{
+				render(job);
+				std::cout << "Rendered " << job.request.scene.string() << " (priority " << job.priority << ") in " << time_now() - start << "s\n";
+			}
+			catch (const std::exception& e)
+			{
+				std::cerr << "Job for " << job.request.scene.string() << " failed: " << e.what() << '\n';
+				(void)send_error(job.connection, e.what());
+			}
+			::close(job.connection);
+		}
+		join_threads();
+		::close(listener);
+		std::filesystem::remove(socket_path);
+#else
+		throw std::runtime_error("The render server needs Unix domain sockets, which this platform doesn't provide");
+#endif
+	}
+};
+#endif // RENDER_SERVER_H
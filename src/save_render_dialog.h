@@ -4,79 +4,19 @@
 #include <string>
 #include <nfd.hpp>
 #include <array>
-#include <stb_image_write.h>
 #include <boxer/boxer.h>
 
-#include "framebuffer.h"
-#include "pixel.h"
+#include "image_writer.h"
 
 inline bool save_render_dialog(const framebuffer& fb)
 {
-    struct file_format
-    {
-        using func_t = bool(*)(const std::string&, const framebuffer&);
-        const char* friendly_name;
-    	const char* extension_list;
-        func_t write_func;
-    };
-    constexpr static auto to_pixels = [](const framebuffer& fb)
-    {
-        auto pixels = std::make_unique_for_overwrite<pixel[]>(fb.height() * fb.width());
-        for (auto pixel_idx = 0; pixel_idx < fb.width() * fb.height(); ++pixel_idx)
-        {
-            pixels[pixel_idx] = pixel{ fb.buffer().data[pixel_idx] }.to_rgba();
-        }
-        return pixels;
-    };
-    constexpr static std::array<file_format, 5> formats{ {
-        {
-            "Portable Network Graphics",
-            "png",
-            [](const std::string& path, const framebuffer& fb) -> bool
-            {
-                return stbi_write_png(path.c_str(), fb.width(), fb.height(), 4, to_pixels(fb).get(),0);
-            }
-        },
-        {
-			"Bitmap",
-            "bmp,dib",
-            [](const std::string& path, const framebuffer& fb) -> bool
-            {
-                return stbi_write_bmp(path.c_str(), fb.width(), fb.height(), 4, to_pixels(fb).get());
-            }
-        },
-        {
-			"TARGA",
-            "tga,icb,vda,vst",
-            [](const std::string& path, const framebuffer& fb) -> bool
-            {
-                return stbi_write_tga(path.c_str(), fb.width(), fb.height(), 4, to_pixels(fb).get());
-            }
-        },
-        {
-			"RGBE",
-            "hdr",
-            [](const std::string& path, const framebuffer& fb) -> bool
-            {
-                return stbi_write_hdr(path.c_str(), fb.width(), fb.height(), 4, &fb.buffer().data->x);
-            }
-        },
-        {
-            "JPEG",
-            "jpg,jpeg,jpe,jif,jfif,jfi",
-            [](const std::string& path, const framebuffer& fb) -> bool
-            {
-                return stbi_write_jpg(path.c_str(), fb.width(), fb.height(), 4, to_pixels(fb).get(), 100);
-            }
-        }
-    } };
 	// MSVC complains about constexpr, but Clang compiles fine
     /* constexpr */ static auto supported_extensions = []()
     {
-        std::array<nfdfilteritem_t, formats.size()> supported_extensions{};
-        for (int i = 0; i < formats.size(); ++i)
+        std::array<nfdfilteritem_t, image_formats.size()> supported_extensions{};
+        for (int i = 0; i < image_formats.size(); ++i)
         {
-            supported_extensions[i] = { formats[i].friendly_name, formats[i].extension_list };
+            supported_extensions[i] = { image_formats[i].friendly_name, image_formats[i].extension_list };
         }
         return supported_extensions;
     }();
@@ -85,13 +25,9 @@ inline bool save_render_dialog(const framebuffer& fb)
     while (SaveDialog(save_path_string, supported_extensions.data(), supported_extensions.size(), nullptr, "render.png") == NFD_OKAY)
     {
         std::filesystem::path save_path{ save_path_string.get() };
-        const auto extension = save_path.extension().string().substr(1);
-        for (const auto& format : formats)
+        if (const auto format = find_image_format(save_path))
         {
-            if (std::strstr(format.extension_list, extension.c_str()) != nullptr)
-            {
-                return format.write_func(save_path.string(), fb);
-            }
+            return format->write_func(save_path.string(), fb);
         }
         const auto selection = show("Unsupported image format chosen. Please choose one of the supported image formats", "Unsupported format", boxer::Style::Warning, boxer::Buttons::OKCancel);
         if (selection == boxer::Selection::Cancel)
@@ -99,4 +35,18 @@ inline bool save_render_dialog(const framebuffer& fb)
     }
     return false;
 }
+
+// Only offers Radiance HDR, for data that has to keep its float values (r, g and b are written as is)
+inline bool save_float_image_dialog(const framebuffer& fb, const char* default_name)
+{
+    const auto& hdr = *find_image_format("image.hdr");
+    const nfdfilteritem_t filter{ hdr.friendly_name, hdr.extension_list };
+    NFD::UniquePathU8 save_path_string;
+    if (SaveDialog(save_path_string, &filter, 1, nullptr, default_name) != NFD_OKAY)
+        return false;
+    std::filesystem::path save_path{ save_path_string.get() };
+    if (find_image_format(save_path) != &hdr)
+        save_path += ".hdr";
+    return hdr.write_func(save_path.string(), fb);
+}
 #endif // SAVE_RENDER_DIALOG_H
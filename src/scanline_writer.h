@@ -0,0 +1,243 @@
+#ifndef SCANLINE_WRITER_H
+#define SCANLINE_WRITER_H
+#include <algorithm>
+#include <array>
+#include <cmath>
+#include <cstdint>
+#include <cstdlib>
+#include <filesystem>
+#include <fstream>
+#include <memory>
+#include <stdexcept>
+#include <string>
+#include <vector>
+#include <glm/glm.hpp>
+#include "pixel.h"
+
+// Defined by the stb_image_write implementation in stb_impl.cpp, which only uses it for PNGs
+extern "C" unsigned char* stbi_zlib_compress(unsigned char* data, int data_len, int* out_len, int quality);
+
+// Writes an image from the top down, a few rows at a time, so that it never has to be held whole
+class scanline_writer
+{
+protected:
+	std::filesystem::path path;
+	std::ofstream out;
+	size_t width;
+	size_t height;
+	size_t rows_written = 0;
+
+	scanline_writer(const std::filesystem::path& path, size_t width, size_t height) :
+		path{ path },
+		out{ path, std::ios::binary },
+		width{ width },
+		height{ height }
+	{
+		if (!out)
+			throw std::runtime_error("Cannot create " + path.string());
+	}
+	void check() const
+	{
+		if (!out)
+			throw std::runtime_error("Cannot write " + path.string());
+	}
+	virtual void _write_rows(const glm::vec4* colors, size_t row_count) = 0;
+	virtual void _finish() {}
+public:
+	virtual ~scanline_writer() = default;
+
+	// Appends row_count rows of width colors each
+	void write_rows(const glm::vec4* colors, size_t row_count)
+	{
+		if (rows_written + row_count > height)
+			throw std::logic_error("More rows written than the image has");
+		_write_rows(colors, row_count);
+		rows_written += row_count;
+		check();
+	}
+	// Completes the file once all rows are written
+	void finish()
+	{
+		if (rows_written != height)
+			throw std::logic_error("The image isn't complete");
+		_finish();
+		out.flush();
+		check();
+	}
+};
+
+// Radiance RGBE, one uncompressed scanline after the other
+class hdr_scanline_writer : public scanline_writer
+{
+	std::vector<std::array<uint8_t, 4>> row;
+protected:
+	void _write_rows(const glm::vec4* colors, size_t row_count) override
+	{
+		for (size_t y = 0; y < row_count; ++y)
+		{
+			for (size_t x = 0; x < width; ++x)
+			{
+				const auto& color = colors[y * width + x];
+				const auto max = std::max({ color.r, color.g, color.b });
+				if (!(max > 1e-32f))
+				{
+					row[x] = { 0, 0, 0, 0 };
+					continue;
+				}
+				int exponent;
+				const auto scale = std::frexp(max, &exponent) * 256.0f / max;
+				row[x] = { static_cast<uint8_t>(std::max(color.r, 0.0f) * scale), static_cast<uint8_t>(std::max(color.g, 0.0f) * scale),
+					static_cast<uint8_t>(std::max(color.b, 0.0f) * scale), static_cast<uint8_t>(exponent + 128) };
+			}
+			out.write(reinterpret_cast<const char*>(row.data()), static_cast<std::streamsize>(row.size() * sizeof(row[0])));
+		}
+	}
+public:
+	hdr_scanline_writer(const std::filesystem::path& path, size_t width, size_t height) :
+		scanline_writer{ path, width, height },
+		row(width)
+	{
+		out << "#?RADIANCE\nFORMAT=32-bit_rle_rgbe\n\n-Y " << height << " +X " << width << '\n';
+		check();
+	}
+};
+
+// Baseline TIFF in deflated strips of 8 bit RGBA, whose offsets are written after them. The
+// strips are compressed on their own, so only one is held at a time. As TIFF offsets are 32
+// bits, the file has to stay below 4 GiB, which deflated 8 bit images of a gigapixel do.
+class tiff_scanline_writer : public scanline_writer
+{
+	constexpr static size_t rows_per_strip = 32;
+	std::vector<uint8_t> strip;
+	size_t strip_rows = 0;
+	std::vector<uint32_t> strip_offsets;
+	std::vector<uint32_t> strip_sizes;
+
+	template <typename T>
+	void put(T value)
+	{
+		out.write(reinterpret_cast<const char*>(&value), sizeof(value));
+	}
+	[[nodiscard]] uint32_t offset()
+	{
+		const auto pos = static_cast<uint64_t>(out.tellp());
+		if (pos > UINT32_MAX)
+			throw std::runtime_error(path.string() + " would exceed the 4 GiB a TIFF file can have");
+		return static_cast<uint32_t>(pos);
+	}
+	void flush_strip()
+	{
+		const auto row_bytes = width * 4;
+		// Horizontal differencing, which makes smooth gradients compress well
+		for (size_t y = 0; y < strip_rows; ++y)
+		{
+			auto* row = strip.data() + y * row_bytes;
+			for (auto i = row_bytes - 1; i >= 4; --i)
+				row[i] = static_cast<uint8_t>(row[i] - row[i - 4]);
+		}
+		int size;
+		std::unique_ptr<unsigned char, decltype(&std::free)> deflated{ stbi_zlib_compress(strip.data(), static_cast<int>(strip_rows * row_bytes), &size, 8), &std::free };
+		if (!deflated)
+			throw std::runtime_error("Cannot compress a strip of " + path.string());
+		strip_offsets.push_back(offset());
+		strip_sizes.push_back(static_cast<uint32_t>(size));
+		out.write(reinterpret_cast<const char*>(deflated.get()), size);
+		strip_rows = 0;
+	}
+protected:
+	void _write_rows(const glm::vec4* colors, size_t row_count) override
+	{
+		for (size_t y = 0; y < row_count; ++y)
+		{
+			auto* row = reinterpret_cast<pixel*>(strip.data() + strip_rows * width * 4);
+			for (size_t x = 0; x < width; ++x)
+				row[x] = pixel{ glm::clamp(colors[y * width + x], 0.0f, 1.0f) }.to_rgba();
+			if (++strip_rows == rows_per_strip)
+				flush_strip();
+		}
+	}
+	void _finish() override
+	{
+		if (strip_rows > 0)
+			flush_strip();
+		// Word aligned, as the IFD and the arrays it points to must be
+		if (offset() % 2)
+			put<uint8_t>(0);
+		const auto bits_offset = offset();
+		for (int channel = 0; channel < 4; ++channel)
+			put<uint16_t>(8);
+		const auto offsets_offset = offset();
+		out.write(reinterpret_cast<const char*>(strip_offsets.data()), static_cast<std::streamsize>(strip_offsets.size() * sizeof(uint32_t)));
+		const auto sizes_offset = offset();
+		out.write(reinterpret_cast<const char*>(strip_sizes.data()), static_cast<std::streamsize>(strip_sizes.size() * sizeof(uint32_t)));
+		const auto ifd_offset = offset();
+
+		constexpr uint16_t type_short = 3, type_long = 4;
+		const auto strip_count = static_cast<uint32_t>(strip_offsets.size());
+		// The values of arrays with more than 4 bytes are stored at the offset instead
+		const auto single = [](uint32_t count, uint32_t value, uint32_t offset) { return count == 1 ? value : offset; };
+		struct entry
+		{
+			uint16_t tag, type;
+			uint32_t count, value;
+		};
+		const std::array<entry, 12> entries{ {
+			{ 256, type_long, 1, static_cast<uint32_t>(width) },
+			{ 257, type_long, 1, static_cast<uint32_t>(height) },
+			{ 258, type_short, 4, bits_offset }, // bits per sample
+			{ 259, type_short, 1, 8 }, // deflate
+			{ 262, type_short, 1, 2 }, // RGB
+			{ 273, type_long, strip_count, single(strip_count, strip_offsets.front(), offsets_offset) },
+			{ 277, type_short, 1, 4 }, // samples per pixel
+			{ 278, type_long, 1, rows_per_strip },
+			{ 279, type_long, strip_count, single(strip_count, strip_sizes.front(), sizes_offset) },
+			{ 284, type_short, 1, 1 }, // interleaved channels
+			{ 317, type_short, 1, 2 }, // horizontal differencing
+			{ 338, type_short, 1, 2 } // unassociated alpha
+		} };
+		put(static_cast<uint16_t>(entries.size()));
+		for (const auto& e : entries)
+		{
+			put(e.tag);
+			put(e.type);
+			put(e.count);
+			// Shorts are left-justified in the value field
+			if (e.type == type_short && e.count == 1)
+			{
+				put(static_cast<uint16_t>(e.value));
+				put<uint16_t>(0);
+			}
+			else
+			{
+				put(e.value);
+			}
+		}
+		put<uint32_t>(0); // no further images
+		out.seekp(4);
+		put(ifd_offset);
+	}
+public:
+	tiff_scanline_writer(const std::filesystem::path& path, size_t width, size_t height) :
+		scanline_writer{ path, width, height },
+		strip(width * 4 * rows_per_strip)
+	{
+		if (width > UINT32_MAX / 4 || height > UINT32_MAX)
+			throw std::runtime_error("The image is too large for a TIFF file");
+		out.write("II", 2);
+		put<uint16_t>(42);
+		put<uint32_t>(0); // offset of the IFD, once it's written
+		check();
+	}
+};
+
+// Writer for the format matching the extension of path, .tif(f) or .hdr
+[[nodiscard]] inline std::unique_ptr<scanline_writer> open_scanline_writer(const std::filesystem::path& path, size_t width, size_t height)
+{
+	const auto extension = path.extension().string();
+	if (extension == ".tif" || extension == ".tiff")
+		return std::make_unique<tiff_scanline_writer>(path, width, height);
+	if (extension == ".hdr")
+		return std::make_unique<hdr_scanline_writer>(path, width, height);
+	throw std::runtime_error("Streamed images can only be written as .tif or .hdr, not " + path.string());
+}
+#endif // SCANLINE_WRITER_H
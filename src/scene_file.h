@@ -0,0 +1,176 @@
+#ifndef SCENE_FILE_H
+#define SCENE_FILE_H
+#include <cstdint>
+#include <filesystem>
+#include <fstream>
+#include <iterator>
+#include <memory>
+#include <sstream>
+#include <stdexcept>
+#include <string>
+#include <unordered_map>
+#include <vector>
+#include <glm/glm.hpp>
+#include "world.h"
+#include "material.h"
+#include "raytraceable.h"
+#include "texture.h"
+#include "mesh.h"
+#include "environment.h"
+#include "transform.h"
+
+// A world loaded from a scene file, together with the materials its objects point to
+struct loaded_scene
+{
+	std::vector<std::unique_ptr<material>> materials;
+	world geometry;
+};
+
+// Text format, one statement per line, '#' starts a comment:
+//   material <name> lambertian <r g b> [texture]
+//   material <name> metallic <r g b> <roughness> [texture]
+//   material <name> dielectric <ior>
+//   material <name> emissive <r g b>
+//   <shape> <material> <x y z> <pitch yaw roll> <sx sy sz>
+//   mesh <material> <file.obj> <x y z> <pitch yaw roll> <sx sy sz>
+//   environment <file> [intensity]
+// where shape is sphere, inverted_sphere, plane, single_sided_plane or rectangle,
+// the angles are in degrees and file names are relative to the scene file.
+[[nodiscard]] inline std::unique_ptr<loaded_scene> parse_scene(const std::string& text, const std::filesystem::path& directory,
+	const std::shared_ptr<texture_cache>& textures, const std::shared_ptr<geometry_cache>& geometry)
+{
+	auto scene = std::make_unique<loaded_scene>();
+	std::unordered_map<std::string, const material*> materials;
+	std::istringstream lines{ text };
+	std::string line;
+	for (size_t line_number = 1; std::getline(lines, line); ++line_number)
+	{
+		line = line.substr(0, line.find('#'));
+		std::istringstream in{ line };
+		std::string keyword;
+		if (!(in >> keyword))
+			continue;
+		const auto fail = [&](const std::string& message)
+		{
+			throw std::runtime_error("Line " + std::to_string(line_number) + ": " + message);
+		};
+		const auto read_vec3 = [&]
+		{
+			glm::vec3 v;
+			if (!(in >> v.x >> v.y >> v.z))
+				fail("expected three numbers after " + keyword);
+			return v;
+		};
+		const auto optional_texture = [&]() -> std::shared_ptr<const image_texture>
+		{
+			std::string file;
+			if (!(in >> file))
+				return nullptr;
+			return std::make_shared<image_texture>(textures, directory / file);
+		};
+
+		if (keyword == "material")
+		{
+			std::string name, type;
+			if (!(in >> name >> type))
+				fail("expected 'material <name> <type> ...'");
+			std::unique_ptr<material> mat;
+			if (type == "lambertian")
+			{
+				const auto albedo = read_vec3();
+				mat = std::make_unique<lambertian_material>(albedo, optional_texture());
+			}
+			else if (type == "metallic")
+			{
+				const auto albedo = read_vec3();
+				float roughness;
+				if (!(in >> roughness))
+					fail("expected the roughness of " + name);
+				mat = std::make_unique<metallic_material>(albedo, roughness, optional_texture());
+			}
+			else if (type == "dielectric")
+			{
+				float ior;
+				if (!(in >> ior))
+					fail("expected the index of refraction of " + name);
+				mat = std::make_unique<dielectric_material>(ior);
+			}
+			else if (type == "emissive")
+			{
+				mat = std::make_unique<emmisive_material>(read_vec3());
+			}
+			else
+			{
+				fail("unknown material type " + type);
+			}
+			materials[name] = mat.get();
+			scene->materials.push_back(std::move(mat));
+		}
+		else if (keyword == "environment")
+		{
+			std::string file;
+			float intensity = 1.0f;
+			if (!(in >> file))
+				fail("expected 'environment <file> [intensity]'");
+			in >> intensity;
+			scene->geometry.set_environment(environment_map::load(directory / file, intensity));
+		}
+		else
+		{
+			std::string material_name;
+			if (!(in >> material_name))
+				fail("expected a material name after " + keyword);
+			const auto mat = materials.find(material_name);
+			if (mat == materials.end())
+				fail("unknown material " + material_name);
+			std::string file;
+			if (keyword == "mesh" && !(in >> file))
+				fail("expected the file of the mesh");
+			const auto position = read_vec3();
+			const auto rotation = glm::radians(read_vec3());
+			const auto scale = read_vec3();
+			const transform trans{ position, rotation, scale };
+			const auto& m = *mat->second;
+			if (keyword == "sphere")
+				scene->geometry.add(new sphere(m, trans));
+			else if (keyword == "inverted_sphere")
+				scene->geometry.add(new inverted_facing<sphere>(m, trans));
+			else if (keyword == "plane")
+				scene->geometry.add(new plane(m, trans));
+			else if (keyword == "single_sided_plane")
+				scene->geometry.add(new single_sided<plane>(m, trans));
+			else if (keyword == "rectangle")
+				scene->geometry.add(new rectangle(m, trans));
+			else if (keyword == "mesh")
+				scene->geometry.add(new mesh(m, trans, geometry, directory / file));
+			else
+				fail("unknown statement " + keyword);
+		}
+	}
+	scene->geometry.build();
+	(void)scene->geometry.update(0.0f);
+	return scene;
+}
+
+[[nodiscard]] inline std::string read_file(const std::filesystem::path& path)
+{
+	std::ifstream file{ path, std::ios::binary };
+	if (!file)
+	{
+		throw std::runtime_error("Cannot open " + path.string());
+	}
+	return { std::istreambuf_iterator<char>{ file }, std::istreambuf_iterator<char>{} };
+}
+
+// FNV-1a, to tell whether a file changed since it was last loaded
+[[nodiscard]] inline uint64_t content_hash(const std::string& data) noexcept
+{
+	uint64_t hash = 0xcbf29ce484222325ull;
+	for (const auto c : data)
+	{
+		hash ^= static_cast<unsigned char>(c);
+		hash *= 0x100000001b3ull;
+	}
+	return hash;
+}
+#endif // SCENE_FILE_H
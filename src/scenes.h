@@ -0,0 +1,151 @@
+#ifndef SCENES_H
+#define SCENES_H
+#include <array>
+#include <memory>
+#include <vector>
+#include "world.h"
+#include "material.h"
+#include "raytraceable.h"
+#include "animation.h"
+#include "texture.h"
+#include "mesh.h"
+#include "sdf.h"
+#include "utility.h"
+
+// The scene from the README screenshot. Materials are static, as objects only point to them.
+inline void add_showcase_scene(world& scene, bool animate = false, std::shared_ptr<const image_texture> floor_texture = nullptr)
+{
+    static const lambertian_material floor{ {0.7, 0.7, 0.7} };
+    static std::unique_ptr<lambertian_material> textured_floor;
+    if (floor_texture)
+    {
+        textured_floor = std::make_unique<lambertian_material>(glm::vec3{ 1, 1, 1 }, std::move(floor_texture));
+    }
+    scene.add(new single_sided<plane>(textured_floor ? *textured_floor : floor, transform{ {0, 0.05, 0}, {0,0,0}, {1,1,1} }));
+
+    static const dielectric_material glass{ 1.5f };
+    scene.add(new sphere(glass, transform{ {1.1, -1, 0},{0, 0, 0}, {1, 1, 1} }));
+    scene.add(new inverted_facing<sphere>(glass, transform{ {1.1, -1, 0},{0, 0, 0}, {0.95, 0.95, 0.95} }));
+
+    static const metallic_material gold{ {1.0f, 0.84f, 0.0f}, 0.0f };
+    auto* gold_sphere = new sphere{ gold, {{ -1.1, -1, 0 }, { 0,0,0 }, { 1,1,1 }} };
+    if (animate)
+    {
+        const auto rest = gold_sphere->get_transform();
+        auto raised = rest;
+        raised.translate({ 0, -1, 0 });
+        raised.set_orientation(glm::vec3{ 0, degToRad(180.0f), 0 });
+        gold_sphere->set_animation(std::make_shared<transform_animation>(std::vector<transform_animation::keyframe>{
+            { 0.0f, rest }, { 1.0f, raised }, { 2.0f, rest }
+        }));
+    }
+    scene.add(gold_sphere);
+
+    static const lambertian_material wall1{ {0.7, 0.3, 0.3} };
+    scene.add(new rectangle(wall1, {{ 3, -1.45, -2 }, { degToRad(90.0f),degToRad(-45.0f),0 }, { 1,1,1.5 }}));
+    static const metallic_material wall2{ {0.95, 0.95, 0.95}, 0.03f };
+    scene.add(new rectangle(wall2, { { -3, -1.45, -2 }, { degToRad(90.0f),degToRad(45.0f),0 }, { 1,1,1.5 } }));
+
+    static const lambertian_material blue{ {0.2, 0.2, 0.6} };
+    scene.add(new sphere(blue, {{ 0, -5, -10 }, { 0, 0, 0 }, { 5, 5, 5 }}));
+}
+// Stands an OBJ mesh, modelled with +y up as is usual, on the floor behind the spheres of
+// the showcase, scaled to fit into 2 units
+inline void add_showcase_mesh(world& scene, std::shared_ptr<geometry_cache> geometry, const std::filesystem::path& obj)
+{
+    static const lambertian_material clay{ {0.75, 0.7, 0.65} };
+    auto* object = new mesh{ clay, transform{}, std::move(geometry), obj };
+    const auto bounds = *object->bounds();
+    const auto extent = bounds.max - bounds.min;
+    const auto scale = 2.0f / std::max({ extent.x, extent.y, extent.z, 1e-6f });
+    const auto center = bounds.centroid();
+    // Turning it around z flips it upright and keeps its triangles facing outwards
+    object->set_transform(transform{ { scale * center.x, 0.05f + scale * bounds.min.y, -3.0f - scale * center.z },
+        { 0, 0, degToRad(180.0f) }, { scale, scale, scale } });
+    scene.add(object);
+}
+// Stress scenes for the quality harness. The world's up is -y, as in the showcase.
+
+// Hundreds of small spheres, mostly exercising the BVH
+inline void add_sphere_grid_scene(world& scene)
+{
+    static const lambertian_material floor{ {0.6, 0.6, 0.6} };
+    scene.add(new single_sided<plane>(floor, transform{ {0, 0.05, 0}, {0,0,0}, {1,1,1} }));
+
+    static const lambertian_material red{ {0.7, 0.2, 0.2} };
+    static const lambertian_material green{ {0.2, 0.6, 0.3} };
+    static const metallic_material steel{ {0.8, 0.8, 0.85}, 0.2f };
+    static const dielectric_material glass{ 1.5f };
+    static const std::array<const material*, 4> materials{ &red, &green, &steel, &glass };
+    size_t idx = 0;
+    for (int z = 0; z < 19; ++z)
+    {
+        for (int x = 0; x < 17; ++x, ++idx)
+        {
+            const glm::vec3 position{ -4.0f + 0.5f * x, -0.15f, -3.0f - 0.5f * z };
+            scene.add(new sphere(*materials[idx % materials.size()], { position, { 0, 0, 0 }, { 0.2, 0.2, 0.2 } }));
+        }
+    }
+}
+
+// Nested and high index glass, giving long specular paths
+inline void add_glass_scene(world& scene)
+{
+    static const lambertian_material floor{ {0.7, 0.7, 0.7} };
+    scene.add(new single_sided<plane>(floor, transform{ {0, 0.05, 0}, {0,0,0}, {1,1,1} }));
+
+    static const dielectric_material glass{ 1.5f };
+    scene.add(new sphere(glass, { { 0, -1, -4 }, { 0, 0, 0 }, { 1, 1, 1 } }));
+    scene.add(new inverted_facing<sphere>(glass, { { 0, -1, -4 }, { 0, 0, 0 }, { 0.9, 0.9, 0.9 } }));
+    static const dielectric_material diamond{ 2.42f };
+    scene.add(new sphere(diamond, { { 2, -0.6, -5 }, { 0, 0, 0 }, { 0.6, 0.6, 0.6 } }));
+    scene.add(new sphere(diamond, { { -1.8, -0.4, -3 }, { 0, 0, 0 }, { 0.4, 0.4, 0.4 } }));
+
+    static const lambertian_material orange{ {0.9, 0.5, 0.1} };
+    static const lambertian_material blue{ {0.1, 0.3, 0.8} };
+    scene.add(new sphere(orange, { { -1, -0.5, -7 }, { 0, 0, 0 }, { 0.5, 0.5, 0.5 } }));
+    scene.add(new sphere(blue, { { 1.2, -0.5, -8 }, { 0, 0, 0 }, { 0.5, 0.5, 0.5 } }));
+}
+
+// A closed room lit only by a small, bright sphere, which is hard for a path tracer
+inline void add_small_light_scene(world& scene)
+{
+    static const lambertian_material white{ {0.75, 0.75, 0.75} };
+    static const lambertian_material red{ {0.7, 0.15, 0.15} };
+    static const lambertian_material green{ {0.15, 0.6, 0.2} };
+    // Floor, ceiling, back and front walls, then the side walls
+    scene.add(new rectangle(white, { { 0, 0, -3 }, { 0, 0, 0 }, { 2, 1, 3.5 } }));
+    scene.add(new rectangle(white, { { 0, -4, -3 }, { 0, 0, 0 }, { 2, 1, 3.5 } }));
+    scene.add(new rectangle(white, { { 0, -2, -6.5 }, { degToRad(90.0f), 0, 0 }, { 2, 1, 2 } }));
+    scene.add(new rectangle(white, { { 0, -2, 0.5 }, { degToRad(90.0f), 0, 0 }, { 2, 1, 2 } }));
+    scene.add(new rectangle(red, { { -2, -2, -3 }, { 0, 0, degToRad(90.0f) }, { 2, 1, 3.5 } }));
+    scene.add(new rectangle(green, { { 2, -2, -3 }, { 0, 0, degToRad(90.0f) }, { 2, 1, 3.5 } }));
+
+    static const emmisive_material lamp{ {40, 38, 32} };
+    scene.add(new sphere(lamp, { { 0, -3.6, -3 }, { 0, 0, 0 }, { 0.2, 0.2, 0.2 } }));
+
+    static const metallic_material gold{ {1.0f, 0.84f, 0.0f}, 0.1f };
+    scene.add(new sphere(white, { { -0.8, -0.6, -3.5 }, { 0, 0, 0 }, { 0.6, 0.6, 0.6 } }));
+    scene.add(new sphere(gold, { { 0.9, -0.5, -4.2 }, { 0, 0, 0 }, { 0.5, 0.5, 0.5 } }));
+}
+
+// Instances of one sculpted distance field, baked once, in diffuse, metallic and glass finishes
+inline void add_sdf_scene(world& scene)
+{
+    static const lambertian_material floor{ {0.7, 0.7, 0.7} };
+    scene.add(new single_sided<plane>(floor, transform{ {0, 0.05, 0}, {0,0,0}, {1,1,1} }));
+
+    // A rounded block on a ring, hollowed out at the top
+    static const auto shape = baked_sdf::bake([](const glm::vec3& pos)
+    {
+        const auto body = sdf_smooth_union(sdf_round_box(pos, { 0.5f, 0.35f, 0.5f }, 0.12f), sdf_torus(pos, 0.6f, 0.16f), 0.15f);
+        return sdf_subtraction(body, sdf_sphere(pos - glm::vec3{ 0, -0.4f, 0 }, 0.35f));
+    });
+    static const lambertian_material clay{ {0.75, 0.45, 0.35} };
+    static const metallic_material gold{ {1.0f, 0.84f, 0.0f}, 0.15f };
+    static const dielectric_material glass{ 1.5f };
+    scene.add(new sdf_shape(clay, { { -1.9, -0.3, -3.8 }, { 0, degToRad(30.0f), 0 }, { 1, 1, 1 } }, shape));
+    scene.add(new sdf_shape(gold, { { 0, -0.3, -4.3 }, { 0, degToRad(-20.0f), 0 }, { 1, 1, 1 } }, shape));
+    scene.add(new sdf_shape(glass, { { 1.9, -0.3, -3.8 }, { 0, degToRad(60.0f), 0 }, { 1, 1, 1 } }, shape));
+}
+#endif // SCENES_H
@@ -1,40 +1,89 @@
 #ifndef SCHEDULER_H
 #define SCHEDULER_H
 #include <vector>
-#include <thread>
-#include <barrier>
-#include "duplex.h"
+#include <atomic>
+#include <mutex>
+#include <condition_variable>
+#include <functional>
+#include <future>
+#include <memory>
 #include "holder_or_void.h"
+#include "job_pool.h"
 
+// Runs frames as jobs on a job_pool: every frame submits one worker_run slice per
+// worker and a continuation running worker_sync once all slices have finished.
+// The main thread runs main_run independently and only blocks the frame chain
+// via run_synchronized. Other jobs can share the pool and overlap with frames.
+//
+// A slice may land on any worker, and a worker may run several slices of one
+// frame (or none), so worker_run has to claim its work dynamically. worker_init
+// runs on each worker's own thread before its first slice, and what it returns is
+// kept per worker until the scheduler is destroyed.
 template <typename CRTP>
 class scheduler
 {
-	struct sync_func
+	std::atomic<bool> stop_requested;
+	std::promise<void> frames_stopped;
+	std::mutex task_mutex;
+	std::condition_variable task_done;
+	std::function<void()> pending_task;
+	// Result of worker_init by worker index. Its type needs CRTP to be complete, so it's
+	// only known in run_slice.
+	std::vector<std::shared_ptr<void>> worker_data;
+	std::vector<uint8_t> worker_busy; // whether the worker is in a slice
+	// Declared last so its threads are joined before anything they use is destroyed
+	job_pool m_pool;
+
+	void run_slice()
 	{
-		scheduler& sch;
-		
-		void operator()() const noexcept
+		const auto idx = m_pool.current_worker();
+		// A worker waiting for a job may start another slice meanwhile. Work is claimed
+		// dynamically, so the outer slice does what the nested one would have done.
+		if (worker_busy[idx])
+			return;
+		worker_busy[idx] = true;
+		using data_t = decltype(holder_or_void{ &CRTP::worker_init, static_cast<CRTP*>(this), idx });
+		try
 		{
-			sch.render_main_sync.release();
-			static_cast<CRTP*>(&sch)->worker_sync();
-			sch.render_main_sync.acquire();
+			auto& data = worker_data[idx];
+			if (!data)
+				data = std::make_shared<data_t>(&CRTP::worker_init, static_cast<CRTP*>(this), idx);
+			static_cast<data_t*>(data.get())->invoke(&CRTP::worker_run, static_cast<CRTP*>(this), idx);
 		}
-	};
-	
-	std::vector<std::thread> workers;
-	bool should_run;
-	duplex render_main_sync;
-	std::barrier<sync_func> sync;
-
-	void worker(size_t idx)
+		catch (...)
+		{
+			worker_busy[idx] = false;
+			throw;
+		}
+		worker_busy[idx] = false;
+	}
+	void submit_frame()
+	{
+		std::vector<job<void>> slices;
+		slices.reserve(worker_count());
+		for (size_t i = 0; i < worker_count(); ++i)
+		{
+			slices.push_back(m_pool.submit([this] { run_slice(); }));
+		}
+		(void)m_pool.submit([this] { end_frame(); }, slices);
+	}
+	void end_frame()
 	{
-		holder_or_void init_data{ &CRTP::worker_init, static_cast<CRTP*>(this), idx };
-		while (should_run) {
-			if (enable_synchronization)
-			{
-				sync.arrive_and_wait();
-			}
-			init_data.invoke(&CRTP::worker_run, static_cast<CRTP*>(this), idx);
+		static_cast<CRTP*>(this)->worker_sync();
+		run_pending_task();
+		if (stop_requested)
+			frames_stopped.set_value();
+		else
+			submit_frame();
+	}
+	void run_pending_task()
+	{
+		std::lock_guard lk{ task_mutex };
+		if (pending_task)
+		{
+			pending_task();
+			pending_task = nullptr;
+			task_done.notify_all();
 		}
 	}
 
@@ -43,42 +92,55 @@ class scheduler
 	constexpr void worker_run(size_t worker_idx) const noexcept {}
 	constexpr void worker_sync() const noexcept {}
 public:
-	scheduler(size_t worker_count = std::thread::hardware_concurrency()) :
-		workers{ worker_count },
-		should_run{ true },
-		sync{ static_cast<ptrdiff_t>(worker_count), { *this } },
-		enable_synchronization{true}
+	// A worker_count of 0 means one worker per CPU allowed by the placement policy
+	scheduler(size_t worker_count = 0, placement_policy placement = placement_policy::none) :
+		stop_requested{ false },
+		m_pool{ worker_count, placement }
 	{
+		worker_data.resize(m_pool.worker_count());
+		worker_busy.resize(m_pool.worker_count());
 	}
 
 	void run()
 	{
-		should_run = true;
-		for (int i = 0; i < worker_count(); ++i) {
-			workers[i] = std::thread{ &scheduler::worker, this, i };
-		}
-		while (should_run)
+		stop_requested = false;
+		frames_stopped = {};
+		submit_frame();
+		while (static_cast<CRTP*>(this)->main_run())
 		{
-			if(enable_synchronization)
-			{
-				std::unique_lock lk{ render_main_sync };
-				should_run = static_cast<CRTP*>(this)->main_run();
-			}
-			else
-			{
-				should_run = static_cast<CRTP*>(this)->main_run();
-			}
-		}
-		for (auto& worker : workers) {
-			worker.join();
 		}
-		workers.clear();
+		stop_requested = true;
+		frames_stopped.get_future().wait();
 	}
 protected:
-	std::atomic<bool> enable_synchronization;
+	[[nodiscard]] job_pool& pool() noexcept
+	{
+		return m_pool;
+	}
 	[[nodiscard]] size_t worker_count() const noexcept
 	{
-		return workers.size();
+		return m_pool.worker_count();
+	}
+	[[nodiscard]] size_t group_count() const noexcept
+	{
+		return m_pool.group_count();
+	}
+	// Index of the NUMA node group the worker runs on, in [0, group_count())
+	[[nodiscard]] size_t worker_group(size_t worker_idx) const noexcept
+	{
+		return m_pool.worker_group(worker_idx);
+	}
+	[[nodiscard]] size_t group_worker_count(size_t group) const noexcept
+	{
+		return m_pool.group_worker_count(group);
+	}
+	// Called from the main thread. Blocks until func has run between two frames.
+	template <typename Func>
+	void run_synchronized(Func&& func)
+	{
+		std::unique_lock lk{ task_mutex };
+		pending_task = std::forward<Func>(func);
+		task_done.wait(lk, [&] { return !pending_task; });
 	}
 };
 #endif // SCHEDULER_H
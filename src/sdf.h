@@ -0,0 +1,298 @@
+#ifndef SDF_H
+#define SDF_H
+#include <algorithm>
+#include <array>
+#include <cmath>
+#include <cstdint>
+#include <limits>
+#include <memory>
+#include <optional>
+#include <vector>
+#include <glm/glm.hpp>
+#include "raytraceable.h"
+
+// Signed distance field sampled over the object space cube [-1, 1]^3, negative inside.
+// Only the bricks of 8^3 cells that the surface passes through hold samples, 9^3 each so
+// that lookups never need a neighbouring brick. The others, and the nodes of 4^3 bricks
+// without any such brick, only know on which side of the surface they are, so rays skip
+// them whole. Baked once and shared by every object tracing it.
+class baked_sdf
+{
+public:
+	constexpr static uint32_t brick_cells = 8;
+	constexpr static uint32_t node_bricks = 4;
+	// Bricks and nodes the surface doesn't pass through
+	constexpr static uint32_t outside = ~0u;
+	constexpr static uint32_t inside = ~0u - 1;
+private:
+	constexpr static uint32_t brick_samples = brick_cells + 1;
+
+	uint32_t bricks_per_axis;
+	uint32_t nodes_per_axis;
+	float cell_size;
+	// First sample of each brick, or outside or inside
+	std::vector<uint32_t> bricks;
+	// 0 for nodes with bricks that hold samples, else outside or inside
+	std::vector<uint32_t> nodes;
+	std::vector<float> samples;
+
+	[[nodiscard]] glm::vec3 grid_coords(const glm::vec3& pos) const noexcept
+	{
+		return glm::clamp((pos + 1.0f) / cell_size, glm::vec3{ 0 }, glm::vec3{ static_cast<float>(bricks_per_axis * brick_cells) });
+	}
+	template <typename Vec>
+	[[nodiscard]] static glm::uvec3 cell_of(const Vec& grid, uint32_t cells, uint32_t count) noexcept
+	{
+		return glm::min(glm::uvec3{ grid / static_cast<typename Vec::value_type>(cells) }, glm::uvec3{ count - 1 });
+	}
+	[[nodiscard]] float trilinear(uint32_t first, const glm::vec3& brick_pos) const noexcept
+	{
+		const auto cell = glm::min(glm::uvec3{ brick_pos }, glm::uvec3{ brick_cells - 1 });
+		const auto f = brick_pos - glm::vec3{ cell };
+		const auto* s = samples.data() + first + (cell.z * brick_samples + cell.y) * brick_samples + cell.x;
+		constexpr auto dy = brick_samples, dz = brick_samples * brick_samples;
+		const auto x00 = s[0] + (s[1] - s[0]) * f.x;
+		const auto x10 = s[dy] + (s[dy + 1] - s[dy]) * f.x;
+		const auto x01 = s[dz] + (s[dz + 1] - s[dz]) * f.x;
+		const auto x11 = s[dz + dy] + (s[dz + dy + 1] - s[dz + dy]) * f.x;
+		const auto y0 = x00 + (x10 - x00) * f.y;
+		const auto y1 = x01 + (x11 - x01) * f.y;
+		return y0 + (y1 - y0) * f.z;
+	}
+public:
+	// Samples distance, a function of object space positions that mustn't overestimate the
+	// distance to its surface, at resolution^3 points rounded up to whole bricks. The surface
+	// has to stay inside the cube.
+	template <typename Func>
+	[[nodiscard]] static std::shared_ptr<const baked_sdf> bake(Func&& distance, uint32_t resolution = 128)
+	{
+		auto result = std::make_shared<baked_sdf>();
+		auto& field = *result;
+		field.bricks_per_axis = std::max((resolution + brick_cells - 1) / brick_cells, 1u);
+		field.nodes_per_axis = (field.bricks_per_axis + node_bricks - 1) / node_bricks;
+		field.cell_size = 2.0f / static_cast<float>(field.bricks_per_axis * brick_cells);
+		const auto brick_size = field.cell_size * brick_cells;
+		// Lookups up to a cell away from the surface, as for gradients, stay in bricks with samples
+		const auto near_surface = 0.5f * std::sqrt(3.0f) * brick_size + field.cell_size;
+		const auto per_axis = field.bricks_per_axis;
+		field.bricks.resize(static_cast<size_t>(per_axis) * per_axis * per_axis);
+		field.nodes.assign(static_cast<size_t>(field.nodes_per_axis) * field.nodes_per_axis * field.nodes_per_axis, outside);
+		std::vector<bool> node_seen(field.nodes.size());
+		for (uint32_t z = 0; z < per_axis; ++z)
+		{
+			for (uint32_t y = 0; y < per_axis; ++y)
+			{
+				for (uint32_t x = 0; x < per_axis; ++x)
+				{
+					const glm::vec3 corner{ -1.0f + brick_size * glm::vec3{ x, y, z } };
+					const auto center_distance = distance(corner + 0.5f * brick_size);
+					auto& brick = field.bricks[(static_cast<size_t>(z) * per_axis + y) * per_axis + x];
+					const auto node_idx = (static_cast<size_t>(z / node_bricks) * field.nodes_per_axis + y / node_bricks) * field.nodes_per_axis + x / node_bricks;
+					auto& node = field.nodes[node_idx];
+					if (std::abs(center_distance) > near_surface)
+					{
+						brick = center_distance < 0.0f ? inside : outside;
+						if (!node_seen[node_idx])
+							node = brick;
+						node_seen[node_idx] = true;
+						continue;
+					}
+					brick = static_cast<uint32_t>(field.samples.size());
+					node = 0;
+					node_seen[node_idx] = true;
+					for (uint32_t k = 0; k < brick_samples; ++k)
+						for (uint32_t j = 0; j < brick_samples; ++j)
+							for (uint32_t i = 0; i < brick_samples; ++i)
+								field.samples.push_back(distance(corner + field.cell_size * glm::vec3{ i, j, k }));
+				}
+			}
+		}
+		return result;
+	}
+
+	// Interpolated distance, or for positions in bricks without samples which side they're on
+	[[nodiscard]] float distance(const glm::vec3& pos) const noexcept
+	{
+		const auto grid = grid_coords(pos);
+		const auto brick = cell_of(grid, brick_cells, bricks_per_axis);
+		const auto first = bricks[(static_cast<size_t>(brick.z) * bricks_per_axis + brick.y) * bricks_per_axis + brick.x];
+		if (first == outside || first == inside)
+			return first == inside ? -cell_size : cell_size;
+		return trilinear(first, grid - glm::vec3{ brick * brick_cells });
+	}
+	// Of the interpolated distance, by central differences a cell apart
+	[[nodiscard]] glm::vec3 gradient(const glm::vec3& pos) const noexcept
+	{
+		const auto h = cell_size;
+		return {
+			distance(pos + glm::vec3{ h, 0, 0 }) - distance(pos - glm::vec3{ h, 0, 0 }),
+			distance(pos + glm::vec3{ 0, h, 0 }) - distance(pos - glm::vec3{ 0, h, 0 }),
+			distance(pos + glm::vec3{ 0, 0, h }) - distance(pos - glm::vec3{ 0, 0, h })
+		};
+	}
+	// Ray parameter at which the normalized, object space ray r crosses the interpolated
+	// surface. Rays starting on it find where they cross it next.
+	[[nodiscard]] std::optional<float> intersect(const ray& r) const noexcept
+	{
+		constexpr auto max_iterations = 2048;
+		const auto inv_dir = 1.0f / r.direction;
+		const auto t0 = (-1.0f - r.origin) * inv_dir;
+		const auto t1 = (1.0f - r.origin) * inv_dir;
+		const auto t_end = std::min({ std::max(t0.x, t1.x), std::max(t0.y, t1.y), std::max(t0.z, t1.z) });
+		auto t = std::max({ std::min(t0.x, t1.x), std::min(t0.y, t1.y), std::min(t0.z, t1.z), 0.0f });
+		// Steps are at least this long, so that rays grazing the surface still get past it
+		const auto min_step = 0.1f * cell_size;
+		// Where the ray leaves the box of the cell at index of a grid whose cells are size wide
+		const auto exit = [&](const glm::uvec3& index, float size)
+		{
+			const auto low = -1.0f + size * glm::vec3{ index };
+			const auto e0 = (low - r.origin) * inv_dir;
+			const auto e1 = (low + size - r.origin) * inv_dir;
+			return std::min({ std::max(e0.x, e1.x), std::max(e0.y, e1.y), std::max(e0.z, e1.z) }) + 1e-3f * cell_size;
+		};
+		// In double, as a position a fraction of a cell past a boundary that the ray nearly
+		// runs along may not be past it in float
+		const glm::dvec3 origin{ r.origin }, direction{ r.direction };
+		const auto grid_at = [&](float t)
+		{
+			const auto grid = (origin + static_cast<double>(t) * direction + 1.0) / static_cast<double>(cell_size);
+			return glm::clamp(grid, glm::dvec3{ 0 }, glm::dvec3{ static_cast<double>(bricks_per_axis * brick_cells) });
+		};
+		std::optional<bool> in_solid; // which side of the surface the ray is on, once known
+		bool skipped_start = false;
+		float previous_t = t;
+		std::optional<float> previous_distance;
+		for (int iteration = 0; iteration < max_iterations && t <= t_end; ++iteration)
+		{
+			const auto grid = grid_at(t);
+			// Regions the surface doesn't pass through are crossed in one step
+			auto region = 0u;
+			std::optional<float> region_exit;
+			const auto node = cell_of(grid, brick_cells * node_bricks, nodes_per_axis);
+			const auto brick = cell_of(grid, brick_cells, bricks_per_axis);
+			if (const auto n = nodes[(static_cast<size_t>(node.z) * nodes_per_axis + node.y) * nodes_per_axis + node.x]; n != 0)
+			{
+				region = n;
+				region_exit = exit(node, cell_size * brick_cells * node_bricks);
+			}
+			else if (const auto b = bricks[(static_cast<size_t>(brick.z) * bricks_per_axis + brick.y) * bricks_per_axis + brick.x]; b == outside || b == inside)
+			{
+				region = b;
+				region_exit = exit(brick, cell_size * brick_cells);
+			}
+			if (region_exit)
+			{
+				if (in_solid && *in_solid != (region == inside))
+					return t;
+				in_solid = region == inside;
+				previous_distance.reset();
+				t = *region_exit;
+				continue;
+			}
+			const auto first = bricks[(static_cast<size_t>(brick.z) * bricks_per_axis + brick.y) * bricks_per_axis + brick.x];
+			const auto d = trilinear(first, glm::vec3{ grid - glm::dvec3{ brick * brick_cells } });
+			// A ray starting on the surface is on the side it leaves it to
+			if (!in_solid && !skipped_start && std::abs(d) < min_step)
+			{
+				skipped_start = true;
+				t += min_step;
+				continue;
+			}
+			if (!in_solid)
+			{
+				in_solid = d < 0.0f;
+			}
+			else if (*in_solid != (d < 0.0f))
+			{
+				// Between the last two steps, where the distances interpolate to 0
+				if (!previous_distance)
+					return t;
+				return previous_t + (t - previous_t) * *previous_distance / (*previous_distance - d);
+			}
+			previous_t = t;
+			previous_distance = d;
+			t += std::max(std::abs(d), min_step);
+		}
+		return std::nullopt;
+	}
+	// Bytes taken by the samples and the two levels of the hierarchy
+	[[nodiscard]] size_t size_bytes() const noexcept
+	{
+		return samples.size() * sizeof(float) + (bricks.size() + nodes.size()) * sizeof(uint32_t);
+	}
+};
+
+// Object tracing a baked_sdf, which may be shared with any number of others
+class sdf_shape : public raytraceable
+{
+	std::shared_ptr<const baked_sdf> field;
+public:
+	sdf_shape(const material& m, const transform& trans, std::shared_ptr<const baked_sdf> field) :
+		raytraceable{ m, trans },
+		field{ std::move(field) }
+	{
+	}
+	[[nodiscard]] std::unique_ptr<raytraceable> clone() const override
+	{
+		return std::make_unique<sdf_shape>(*this);
+	}
+protected:
+	[[nodiscard]] std::optional<float> _intersect(const ray& r) const noexcept override
+	{
+		return field->intersect(r);
+	}
+	[[nodiscard]] local_surface _surface(const ray& r, const glm::vec3& local_pos, uint32_t primitive) const noexcept override
+	{
+		const auto normal = field->gradient(local_pos);
+		return { normal, dot(normal, r.direction) < 0.0f, _uv(local_pos) };
+	}
+	[[nodiscard]] bool _front_facing(const ray& r) const noexcept override
+	{
+		return field->distance(r.origin) >= 0.0f;
+	}
+	[[nodiscard]] glm::vec3 _normal(const glm::vec3& local_pos) const noexcept override
+	{
+		return field->gradient(local_pos);
+	}
+	// The texture repeats every unit, seen from above
+	[[nodiscard]] glm::vec2 _uv(const glm::vec3& local_pos) const noexcept override
+	{
+		return { local_pos.x, local_pos.z };
+	}
+	[[nodiscard]] float _uv_per_unit() const noexcept override
+	{
+		return 1.0f;
+	}
+	[[nodiscard]] std::optional<aabb> _bounds() const noexcept override
+	{
+		return aabb{ { -1, -1, -1 }, { 1, 1, 1 } };
+	}
+};
+
+// Distance functions to build shapes from, in the space of the shape
+[[nodiscard]] inline float sdf_sphere(const glm::vec3& pos, float radius) noexcept
+{
+	return length(pos) - radius;
+}
+[[nodiscard]] inline float sdf_round_box(const glm::vec3& pos, const glm::vec3& half_extent, float radius) noexcept
+{
+	const auto q = abs(pos) - half_extent + radius;
+	return length(glm::max(q, glm::vec3{ 0 })) + std::min(std::max({ q.x, q.y, q.z }), 0.0f) - radius;
+}
+// Ring around the y axis
+[[nodiscard]] inline float sdf_torus(const glm::vec3& pos, float major_radius, float minor_radius) noexcept
+{
+	const glm::vec2 q{ length(glm::vec2{ pos.x, pos.z }) - major_radius, pos.y };
+	return length(q) - minor_radius;
+}
+// Union of two shapes whose seam is rounded over about smoothness
+[[nodiscard]] inline float sdf_smooth_union(float a, float b, float smoothness) noexcept
+{
+	const auto h = std::clamp(0.5f + 0.5f * (b - a) / smoothness, 0.0f, 1.0f);
+	return b + (a - b) * h - smoothness * h * (1.0f - h);
+}
+[[nodiscard]] inline float sdf_subtraction(float a, float cut) noexcept
+{
+	return std::max(a, -cut);
+}
+#endif // SDF_H
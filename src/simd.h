@@ -0,0 +1,128 @@
+#ifndef SIMD_H
+#define SIMD_H
+#include <algorithm>
+#include <array>
+#include <cmath>
+#include "math_policy.h"
+
+// Four floats processed together, with SSE where math_policy.h found it and a plain
+// loop otherwise. Only what the ray packets need.
+struct mask4
+{
+#ifdef MATH_POLICY_HAS_SSE
+	__m128 v;
+	[[nodiscard]] int bits() const noexcept
+	{
+		return _mm_movemask_ps(v);
+	}
+	[[nodiscard]] friend mask4 operator&(mask4 a, mask4 b) noexcept
+	{
+		return { _mm_and_ps(a.v, b.v) };
+	}
+	[[nodiscard]] friend mask4 operator|(mask4 a, mask4 b) noexcept
+	{
+		return { _mm_or_ps(a.v, b.v) };
+	}
+#else
+	std::array<bool, 4> v;
+	[[nodiscard]] int bits() const noexcept
+	{
+		return v[0] | v[1] << 1 | v[2] << 2 | v[3] << 3;
+	}
+	[[nodiscard]] friend mask4 operator&(mask4 a, mask4 b) noexcept
+	{
+		return { { a.v[0] && b.v[0], a.v[1] && b.v[1], a.v[2] && b.v[2], a.v[3] && b.v[3] } };
+	}
+	[[nodiscard]] friend mask4 operator|(mask4 a, mask4 b) noexcept
+	{
+		return { { a.v[0] || b.v[0], a.v[1] || b.v[1], a.v[2] || b.v[2], a.v[3] || b.v[3] } };
+	}
+#endif
+};
+
+struct f32x4
+{
+#ifdef MATH_POLICY_HAS_SSE
+	__m128 v;
+
+	[[nodiscard]] static f32x4 broadcast(float x) noexcept
+	{
+		return { _mm_set1_ps(x) };
+	}
+	// p must be 16 byte aligned
+	[[nodiscard]] static f32x4 load(const float* p) noexcept
+	{
+		return { _mm_load_ps(p) };
+	}
+	void store(float* p) const noexcept
+	{
+		_mm_store_ps(p, v);
+	}
+	[[nodiscard]] friend f32x4 operator+(f32x4 a, f32x4 b) noexcept { return { _mm_add_ps(a.v, b.v) }; }
+	[[nodiscard]] friend f32x4 operator-(f32x4 a, f32x4 b) noexcept { return { _mm_sub_ps(a.v, b.v) }; }
+	[[nodiscard]] friend f32x4 operator*(f32x4 a, f32x4 b) noexcept { return { _mm_mul_ps(a.v, b.v) }; }
+	[[nodiscard]] friend f32x4 operator/(f32x4 a, f32x4 b) noexcept { return { _mm_div_ps(a.v, b.v) }; }
+	[[nodiscard]] friend mask4 operator<(f32x4 a, f32x4 b) noexcept { return { _mm_cmplt_ps(a.v, b.v) }; }
+	[[nodiscard]] friend mask4 operator<=(f32x4 a, f32x4 b) noexcept { return { _mm_cmple_ps(a.v, b.v) }; }
+	[[nodiscard]] friend mask4 operator>(f32x4 a, f32x4 b) noexcept { return { _mm_cmpgt_ps(a.v, b.v) }; }
+	[[nodiscard]] friend mask4 operator>=(f32x4 a, f32x4 b) noexcept { return { _mm_cmpge_ps(a.v, b.v) }; }
+	[[nodiscard]] friend f32x4 min(f32x4 a, f32x4 b) noexcept { return { _mm_min_ps(a.v, b.v) }; }
+	[[nodiscard]] friend f32x4 max(f32x4 a, f32x4 b) noexcept { return { _mm_max_ps(a.v, b.v) }; }
+	[[nodiscard]] friend f32x4 sqrt(f32x4 a) noexcept { return { _mm_sqrt_ps(a.v) }; }
+	// a where m is set, otherwise b
+	[[nodiscard]] friend f32x4 select(mask4 m, f32x4 a, f32x4 b) noexcept
+	{
+		return { _mm_or_ps(_mm_and_ps(m.v, a.v), _mm_andnot_ps(m.v, b.v)) };
+	}
+	[[nodiscard]] float max_element() const noexcept
+	{
+		const auto m = _mm_max_ps(v, _mm_shuffle_ps(v, v, _MM_SHUFFLE(1, 0, 3, 2)));
+		return _mm_cvtss_f32(_mm_max_ss(m, _mm_shuffle_ps(m, m, _MM_SHUFFLE(2, 3, 0, 1))));
+	}
+#else
+	std::array<float, 4> v;
+
+	[[nodiscard]] static f32x4 broadcast(float x) noexcept
+	{
+		return { { x, x, x, x } };
+	}
+	[[nodiscard]] static f32x4 load(const float* p) noexcept
+	{
+		return { { p[0], p[1], p[2], p[3] } };
+	}
+	void store(float* p) const noexcept
+	{
+		std::copy(v.begin(), v.end(), p);
+	}
+	template <typename Op>
+	[[nodiscard]] static f32x4 map(f32x4 a, f32x4 b, Op op) noexcept
+	{
+		return { { op(a.v[0], b.v[0]), op(a.v[1], b.v[1]), op(a.v[2], b.v[2]), op(a.v[3], b.v[3]) } };
+	}
+	template <typename Op>
+	[[nodiscard]] static mask4 compare(f32x4 a, f32x4 b, Op op) noexcept
+	{
+		return { { op(a.v[0], b.v[0]), op(a.v[1], b.v[1]), op(a.v[2], b.v[2]), op(a.v[3], b.v[3]) } };
+	}
+	[[nodiscard]] friend f32x4 operator+(f32x4 a, f32x4 b) noexcept { return map(a, b, [](float x, float y) { return x + y; }); }
+	[[nodiscard]] friend f32x4 operator-(f32x4 a, f32x4 b) noexcept { return map(a, b, [](float x, float y) { return x - y; }); }
+	[[nodiscard]] friend f32x4 operator*(f32x4 a, f32x4 b) noexcept { return map(a, b, [](float x, float y) { return x * y; }); }
+	[[nodiscard]] friend f32x4 operator/(f32x4 a, f32x4 b) noexcept { return map(a, b, [](float x, float y) { return x / y; }); }
+	[[nodiscard]] friend mask4 operator<(f32x4 a, f32x4 b) noexcept { return compare(a, b, [](float x, float y) { return x < y; }); }
+	[[nodiscard]] friend mask4 operator<=(f32x4 a, f32x4 b) noexcept { return compare(a, b, [](float x, float y) { return x <= y; }); }
+	[[nodiscard]] friend mask4 operator>(f32x4 a, f32x4 b) noexcept { return compare(a, b, [](float x, float y) { return x > y; }); }
+	[[nodiscard]] friend mask4 operator>=(f32x4 a, f32x4 b) noexcept { return compare(a, b, [](float x, float y) { return x >= y; }); }
+	[[nodiscard]] friend f32x4 min(f32x4 a, f32x4 b) noexcept { return map(a, b, [](float x, float y) { return std::min(x, y); }); }
+	[[nodiscard]] friend f32x4 max(f32x4 a, f32x4 b) noexcept { return map(a, b, [](float x, float y) { return std::max(x, y); }); }
+	[[nodiscard]] friend f32x4 sqrt(f32x4 a) noexcept { return map(a, a, [](float x, float) { return std::sqrt(x); }); }
+	[[nodiscard]] friend f32x4 select(mask4 m, f32x4 a, f32x4 b) noexcept
+	{
+		return { { m.v[0] ? a.v[0] : b.v[0], m.v[1] ? a.v[1] : b.v[1], m.v[2] ? a.v[2] : b.v[2], m.v[3] ? a.v[3] : b.v[3] } };
+	}
+	[[nodiscard]] float max_element() const noexcept
+	{
+		return std::max({ v[0], v[1], v[2], v[3] });
+	}
+#endif
+};
+#endif // SIMD_H
@@ -0,0 +1,67 @@
+#ifndef SPLAT_BUFFER_H
+#define SPLAT_BUFFER_H
+#include <algorithm>
+#include <atomic>
+#include <cmath>
+#include <cstdint>
+#include <memory>
+#include <glm/glm.hpp>
+
+// Light that paths started at the lights carry to arbitrary pixels, added from any number
+// of threads at once. The sums are kept in fixed point, so they don't depend on the
+// order of the additions and the image stays the same for any number of threads.
+class splat_buffer
+{
+	constexpr static float scale = 1 << 20;
+	// Contributions beyond this are clamped, so that no sum can overflow
+	constexpr static float max_value = 1e6f;
+
+	std::unique_ptr<uint64_t[]> sums;
+	size_t m_width = 0, m_height = 0;
+public:
+	// Zeroes the buffer
+	void resize(size_t width, size_t height)
+	{
+		m_width = width;
+		m_height = height;
+		sums = std::make_unique<uint64_t[]>(3 * width * height);
+	}
+	[[nodiscard]] size_t width() const noexcept
+	{
+		return m_width;
+	}
+	[[nodiscard]] size_t height() const noexcept
+	{
+		return m_height;
+	}
+	// Adds color to the pixel at image coordinates (u, v), as used by camera::get_ray
+	void splat(const glm::vec2& uv, const glm::vec3& color) noexcept
+	{
+		const auto x = static_cast<int64_t>(std::floor(uv.x * static_cast<float>(m_width - 1) + 0.5f));
+		const auto y = static_cast<int64_t>(std::floor(uv.y * static_cast<float>(m_height - 1) + 0.5f));
+		if (x < 0 || y < 0 || x >= static_cast<int64_t>(m_width) || y >= static_cast<int64_t>(m_height))
+			return;
+		auto* sum = &sums[3 * (static_cast<size_t>(y) * m_width + static_cast<size_t>(x))];
+		for (int c = 0; c < 3; ++c)
+		{
+			if (!(color[c] > 0.0f))
+				continue;
+			std::atomic_ref{ sum[c] }.fetch_add(static_cast<uint64_t>(std::llround(std::min(color[c], max_value) * scale)), std::memory_order_relaxed);
+		}
+	}
+	[[nodiscard]] glm::vec3 get(size_t x, size_t y) const noexcept
+	{
+		const auto* sum = &sums[3 * (y * m_width + x)];
+		return glm::vec3{ static_cast<float>(sum[0]), static_cast<float>(sum[1]), static_cast<float>(sum[2]) } / scale;
+	}
+	// Returns the sum of the pixel and zeroes it
+	[[nodiscard]] glm::vec3 take(size_t x, size_t y) noexcept
+	{
+		auto* sum = &sums[3 * (y * m_width + x)];
+		glm::vec3 result;
+		for (int c = 0; c < 3; ++c)
+			result[c] = static_cast<float>(std::atomic_ref{ sum[c] }.exchange(0, std::memory_order_relaxed));
+		return result / scale;
+	}
+};
+#endif // SPLAT_BUFFER_H
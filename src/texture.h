@@ -0,0 +1,420 @@
+#ifndef TEXTURE_H
+#define TEXTURE_H
+#include <algorithm>
+#include <array>
+#include <atomic>
+#include <cmath>
+#include <cstdint>
+#include <cstring>
+#include <filesystem>
+#include <fstream>
+#include <functional>
+#include <iostream>
+#include <list>
+#include <memory>
+#include <mutex>
+#include <stdexcept>
+#include <string>
+#include <unordered_map>
+#include <utility>
+#include <vector>
+#include <stb_image.h>
+#include <glm/glm.hpp>
+
+// Where a ray hit a surface in texture space. width is the size of the ray's
+// footprint in uv units, which selects the mip level.
+struct texture_coords
+{
+	glm::vec2 uv;
+	float width;
+};
+
+class texture_cache;
+
+namespace detail {
+	// On disk, a texture is stored as a header followed by all mip levels, finest
+	// first. Each level is split into square tiles of RGBA8 texels in row major
+	// order, with the tiles on the right and bottom edges padded to full size.
+	struct tiled_texture_header
+	{
+		std::array<char, 4> magic;
+		uint32_t width;
+		uint32_t height;
+		uint32_t tile_size;
+	};
+	inline constexpr std::array<char, 4> tiled_texture_magic{ 'R', 'T', 'X', '2' };
+
+	// Texels hold sRGB encoded colors, as the images they come from do, and linear alpha
+	[[nodiscard]] inline const std::array<float, 256>& srgb_to_linear() noexcept
+	{
+		static const auto table = []
+		{
+			std::array<float, 256> result;
+			for (size_t i = 0; i < result.size(); ++i)
+			{
+				const auto c = static_cast<float>(i) / 255.0f;
+				result[i] = c <= 0.04045f ? c / 12.92f : std::pow((c + 0.055f) / 1.055f, 2.4f);
+			}
+			return result;
+		}();
+		return table;
+	}
+	[[nodiscard]] inline uint8_t linear_to_srgb(float c) noexcept
+	{
+		const auto encoded = c <= 0.0031308f ? c * 12.92f : 1.055f * std::pow(c, 1.0f / 2.4f) - 0.055f;
+		return static_cast<uint8_t>(std::clamp(encoded * 255.0f + 0.5f, 0.0f, 255.0f));
+	}
+
+	struct texture_level
+	{
+		uint32_t width, height;
+		uint32_t tiles_x, tiles_y;
+		uint64_t offset; // of the first tile, in bytes from the start of the file
+	};
+
+	[[nodiscard]] inline std::vector<texture_level> texture_levels(uint32_t width, uint32_t height, uint32_t tile_size)
+	{
+		std::vector<texture_level> levels;
+		uint64_t offset = sizeof(tiled_texture_header);
+		while (true)
+		{
+			const texture_level level{ width, height, (width + tile_size - 1) / tile_size, (height + tile_size - 1) / tile_size, offset };
+			levels.push_back(level);
+			offset += static_cast<uint64_t>(level.tiles_x) * level.tiles_y * tile_size * tile_size * 4;
+			if (width == 1 && height == 1)
+				return levels;
+			width = std::max(width / 2, 1u);
+			height = std::max(height / 2, 1u);
+		}
+	}
+
+	// Converts an image that stb can load into the tiled format. This is the only
+	// time all of its texels are in memory; renders only read the tiles they touch.
+	inline void write_tiled_texture(const std::filesystem::path& source, const std::filesystem::path& destination, uint32_t tile_size)
+	{
+		int width, height, channels;
+		const std::unique_ptr<stbi_uc, decltype(&stbi_image_free)> data{
+			stbi_load(source.string().c_str(), &width, &height, &channels, 4), &stbi_image_free };
+		if (!data)
+		{
+			throw std::runtime_error("Cannot load texture " + source.string() + ": " + stbi_failure_reason());
+		}
+		std::filesystem::create_directories(destination.parent_path());
+		const auto temporary = std::filesystem::path{ destination }.concat(".tmp");
+		{
+			std::ofstream out{ temporary, std::ios::binary };
+			const tiled_texture_header header{ tiled_texture_magic, static_cast<uint32_t>(width), static_cast<uint32_t>(height), tile_size };
+			out.write(reinterpret_cast<const char*>(&header), sizeof(header));
+
+			std::vector<std::array<uint8_t, 4>> level(static_cast<size_t>(width) * height);
+			std::memcpy(level.data(), data.get(), level.size() * 4);
+			std::vector<std::array<uint8_t, 4>> tile(static_cast<size_t>(tile_size) * tile_size);
+			for (const auto& info : texture_levels(width, height, tile_size))
+			{
+				for (uint32_t ty = 0; ty < info.tiles_y; ++ty)
+				{
+					for (uint32_t tx = 0; tx < info.tiles_x; ++tx)
+					{
+						for (uint32_t y = 0; y < tile_size; ++y)
+						{
+							for (uint32_t x = 0; x < tile_size; ++x)
+							{
+								// Padding repeats the edge texels
+								const auto src_x = std::min(tx * tile_size + x, info.width - 1);
+								const auto src_y = std::min(ty * tile_size + y, info.height - 1);
+								tile[y * tile_size + x] = level[static_cast<size_t>(src_y) * info.width + src_x];
+							}
+						}
+						out.write(reinterpret_cast<const char*>(tile.data()), static_cast<std::streamsize>(tile.size() * 4));
+					}
+				}
+				// Box filter down to the next level, averaging light rather than its encoding
+				const auto& to_linear = srgb_to_linear();
+				const auto next_width = std::max(info.width / 2, 1u);
+				const auto next_height = std::max(info.height / 2, 1u);
+				std::vector<std::array<uint8_t, 4>> next(static_cast<size_t>(next_width) * next_height);
+				for (uint32_t y = 0; y < next_height; ++y)
+				{
+					for (uint32_t x = 0; x < next_width; ++x)
+					{
+						glm::vec3 color{ 0, 0, 0 };
+						unsigned alpha = 0;
+						for (const auto& [dx, dy] : { std::pair{ 0u, 0u }, { 1u, 0u }, { 0u, 1u }, { 1u, 1u } })
+						{
+							const auto src_x = std::min(2 * x + dx, info.width - 1);
+							const auto src_y = std::min(2 * y + dy, info.height - 1);
+							const auto& t = level[static_cast<size_t>(src_y) * info.width + src_x];
+							color += glm::vec3{ to_linear[t[0]], to_linear[t[1]], to_linear[t[2]] };
+							alpha += t[3];
+						}
+						color /= 4.0f;
+						next[static_cast<size_t>(y) * next_width + x] = {
+							linear_to_srgb(color.r), linear_to_srgb(color.g), linear_to_srgb(color.b), static_cast<uint8_t>((alpha + 2) / 4) };
+					}
+				}
+				level = std::move(next);
+			}
+			if (!out)
+			{
+				throw std::runtime_error("Cannot write tiled texture " + temporary.string());
+			}
+		}
+		// Other processes never see a partially written texture
+		std::filesystem::rename(temporary, destination);
+	}
+}
+
+// A texture opened through a texture_cache, which owns it
+class texture_file
+{
+	friend class texture_cache;
+
+	uint32_t id;
+	uint32_t m_tile_size;
+	std::vector<detail::texture_level> m_levels;
+	mutable std::mutex file_mutex;
+	mutable std::ifstream file;
+
+	texture_file(uint32_t id, const std::filesystem::path& path) :
+		id{ id },
+		file{ path, std::ios::binary }
+	{
+		detail::tiled_texture_header header{};
+		if (!file.read(reinterpret_cast<char*>(&header), sizeof(header)) || header.magic != detail::tiled_texture_magic ||
+			header.width == 0 || header.height == 0 || header.tile_size == 0)
+		{
+			throw std::runtime_error("Invalid tiled texture " + path.string());
+		}
+		m_tile_size = header.tile_size;
+		m_levels = detail::texture_levels(header.width, header.height, header.tile_size);
+	}
+public:
+	using texel = std::array<uint8_t, 4>;
+	struct tile
+	{
+		std::vector<texel> texels;
+	};
+
+	[[nodiscard]] uint32_t tile_size() const noexcept
+	{
+		return m_tile_size;
+	}
+	[[nodiscard]] const std::vector<detail::texture_level>& levels() const noexcept
+	{
+		return m_levels;
+	}
+	[[nodiscard]] std::shared_ptr<const tile> read_tile(uint32_t level, uint32_t tx, uint32_t ty) const
+	{
+		const auto& info = m_levels[level];
+		const auto texel_count = static_cast<size_t>(m_tile_size) * m_tile_size;
+		auto result = std::make_shared<tile>();
+		result->texels.resize(texel_count);
+		std::lock_guard lk{ file_mutex };
+		file.seekg(static_cast<std::streamoff>(info.offset + (static_cast<uint64_t>(ty) * info.tiles_x + tx) * texel_count * sizeof(texel)));
+		if (!file.read(reinterpret_cast<char*>(result->texels.data()), static_cast<std::streamsize>(texel_count * sizeof(texel))))
+		{
+			file.clear();
+			throw std::runtime_error("Cannot read tile " + std::to_string(tx) + "," + std::to_string(ty) + " of level " + std::to_string(level) + " of a texture");
+		}
+		return result;
+	}
+};
+
+// Keeps the most recently used texture tiles of all textures in memory, up to a
+// budget in bytes, and loads the others from disk when they are sampled.
+// Tiles are spread over independently locked shards so that workers rarely contend.
+class texture_cache
+{
+	constexpr static size_t shard_count = 16;
+
+	struct shard
+	{
+		using entry = std::pair<uint64_t, std::shared_ptr<const texture_file::tile>>;
+		std::mutex mutex;
+		std::list<entry> lru; // most recently used first
+		std::unordered_map<uint64_t, std::list<entry>::iterator> entries;
+		size_t bytes = 0;
+	};
+
+	size_t shard_budget;
+	uint32_t m_tile_size;
+	std::filesystem::path directory;
+	std::mutex files_mutex;
+	std::vector<std::unique_ptr<texture_file>> files;
+	// Tiled copy to the file opened from it, so that reopening a texture doesn't open it again
+	std::unordered_map<std::string, const texture_file*> opened;
+	std::array<shard, shard_count> shards;
+	std::atomic<size_t> m_misses{ 0 };
+	std::atomic<bool> failure_reported{ false };
+
+	[[nodiscard]] static uint64_t tile_key(const texture_file& file, uint32_t level, uint32_t tx, uint32_t ty) noexcept
+	{
+		return static_cast<uint64_t>(file.id) << 48 | static_cast<uint64_t>(level) << 40 | static_cast<uint64_t>(ty) << 20 | tx;
+	}
+	[[nodiscard]] std::shared_ptr<const texture_file::tile> load_tile(const texture_file& file, uint32_t level, uint32_t tx, uint32_t ty)
+	{
+		const auto key = tile_key(file, level, tx, ty);
+		auto& s = shards[std::hash<uint64_t>{}(key) % shard_count];
+		{
+			std::lock_guard lk{ s.mutex };
+			if (const auto it = s.entries.find(key); it != s.entries.end())
+			{
+				s.lru.splice(s.lru.begin(), s.lru, it->second);
+				return it->second->second;
+			}
+		}
+		// Read without holding the shard, another thread may load the same tile meanwhile
+		auto loaded = file.read_tile(level, tx, ty);
+		++m_misses;
+		const auto tile_bytes = loaded->texels.size() * sizeof(texture_file::texel);
+		std::lock_guard lk{ s.mutex };
+		if (const auto it = s.entries.find(key); it != s.entries.end())
+		{
+			return it->second->second;
+		}
+		s.lru.emplace_front(key, loaded);
+		s.entries.emplace(key, s.lru.begin());
+		s.bytes += tile_bytes;
+		// Evicted tiles stay alive for as long as a sampler still holds them
+		while (s.bytes > shard_budget && s.lru.size() > 1)
+		{
+			s.bytes -= s.lru.back().second->texels.size() * sizeof(texture_file::texel);
+			s.entries.erase(s.lru.back().first);
+			s.lru.pop_back();
+		}
+		return loaded;
+	}
+public:
+	constexpr static size_t default_budget = size_t{ 256 } << 20;
+
+	// Tiled copies of the source images are kept in directory, so that they're only converted once
+	explicit texture_cache(size_t budget_bytes = default_budget, uint32_t tile_size = 64,
+		std::filesystem::path directory = std::filesystem::temp_directory_path() / "cpuraytracer-textures") :
+		shard_budget{ std::max<size_t>(budget_bytes / shard_count, 1) },
+		m_tile_size{ tile_size },
+		directory{ std::move(directory) }
+	{
+	}
+
+	// Converts the image if there's no up to date tiled copy yet, and returns the file
+	// opened before if there's one. Textures have to be opened before rendering starts.
+	[[nodiscard]] const texture_file& open(const std::filesystem::path& image)
+	{
+		const auto source = std::filesystem::absolute(image);
+		const auto stamp = std::to_string(std::filesystem::file_size(source)) + "_" +
+			std::to_string(std::filesystem::last_write_time(source).time_since_epoch().count()) + "_" + std::to_string(m_tile_size);
+		const auto tiled = directory / (std::to_string(std::hash<std::string>{}(source.string())) + "_" + stamp + ".rtx2");
+		std::lock_guard lk{ files_mutex };
+		if (const auto it = opened.find(tiled.string()); it != opened.end())
+			return *it->second;
+		if (!std::filesystem::exists(tiled))
+		{
+			detail::write_tiled_texture(source, tiled, m_tile_size);
+		}
+		files.push_back(std::unique_ptr<texture_file>{ new texture_file{ static_cast<uint32_t>(files.size()), tiled } });
+		opened.emplace(tiled.string(), files.back().get());
+		return *files.back();
+	}
+
+	// Null if the tile can't be loaded, which samplers render as black. Only the first
+	// failure is reported, as a broken file fails on every tile.
+	[[nodiscard]] std::shared_ptr<const texture_file::tile> tile(const texture_file& file, uint32_t level, uint32_t tx, uint32_t ty) noexcept
+	{
+		try
+		{
+			return load_tile(file, level, tx, ty);
+		}
+		catch (const std::exception& e)
+		{
+			if (!failure_reported.exchange(true))
+				std::cerr << "Texture tile unavailable, rendering it black: " << e.what() << '\n';
+			return nullptr;
+		}
+	}
+
+	[[nodiscard]] size_t misses() const noexcept
+	{
+		return m_misses;
+	}
+	[[nodiscard]] size_t resident_bytes()
+	{
+		size_t total = 0;
+		for (auto& s : shards)
+		{
+			std::lock_guard lk{ s.mutex };
+			total += s.bytes;
+		}
+		return total;
+	}
+};
+
+// Repeating RGB texture of sRGB encoded colors, which it samples as linear light, filtered
+// trilinearly between the two mip levels that match the footprint
+class image_texture
+{
+	std::shared_ptr<texture_cache> cache;
+	const texture_file* file;
+
+	// Texel lookups of one sample mostly fall into the same tile, so it's looked up once
+	struct tile_ref
+	{
+		uint32_t level = ~0u, tx = 0, ty = 0;
+		std::shared_ptr<const texture_file::tile> data;
+	};
+	[[nodiscard]] glm::vec3 texel(uint32_t level, int x, int y, tile_ref& current) const noexcept
+	{
+		const auto& info = file->levels()[level];
+		const auto wrap = [](int i, uint32_t size) { return static_cast<uint32_t>((i % static_cast<int>(size) + static_cast<int>(size)) % static_cast<int>(size)); };
+		const auto px = wrap(x, info.width);
+		const auto py = wrap(y, info.height);
+		const auto tile_size = file->tile_size();
+		const auto tx = px / tile_size;
+		const auto ty = py / tile_size;
+		if (current.level != level || current.tx != tx || current.ty != ty)
+		{
+			current = { level, tx, ty, cache->tile(*file, level, tx, ty) };
+		}
+		if (!current.data)
+			return { 0, 0, 0 };
+		const auto& t = current.data->texels[(py % tile_size) * tile_size + px % tile_size];
+		const auto& to_linear = detail::srgb_to_linear();
+		return { to_linear[t[0]], to_linear[t[1]], to_linear[t[2]] };
+	}
+	[[nodiscard]] glm::vec3 bilinear(uint32_t level, const glm::vec2& uv, tile_ref& current) const noexcept
+	{
+		const auto& info = file->levels()[level];
+		const auto x = uv.x * static_cast<float>(info.width) - 0.5f;
+		const auto y = uv.y * static_cast<float>(info.height) - 0.5f;
+		const auto x0 = std::floor(x);
+		const auto y0 = std::floor(y);
+		const auto fx = x - x0;
+		const auto fy = y - y0;
+		const auto ix = static_cast<int>(x0);
+		const auto iy = static_cast<int>(y0);
+		return glm::mix(
+			glm::mix(texel(level, ix, iy, current), texel(level, ix + 1, iy, current), fx),
+			glm::mix(texel(level, ix, iy + 1, current), texel(level, ix + 1, iy + 1, current), fx),
+			fy);
+	}
+public:
+	image_texture(std::shared_ptr<texture_cache> cache, const std::filesystem::path& image) :
+		cache{ std::move(cache) },
+		file{ &this->cache->open(image) }
+	{
+	}
+
+	[[nodiscard]] glm::vec3 sample(const texture_coords& coords) const noexcept
+	{
+		const auto uv = coords.uv - glm::floor(coords.uv);
+		const auto& levels = file->levels();
+		const auto texels_across = static_cast<float>(std::max(levels.front().width, levels.front().height));
+		const auto lod = std::clamp(std::log2(std::max(coords.width * texels_across, 1.0f)), 0.0f, static_cast<float>(levels.size() - 1));
+		const auto level = static_cast<uint32_t>(lod);
+		tile_ref current;
+		const auto fine = bilinear(level, uv, current);
+		if (level + 1 >= levels.size() || lod == static_cast<float>(level))
+			return fine;
+		return glm::mix(fine, bilinear(level + 1, uv, current), lod - static_cast<float>(level));
+	}
+};
+#endif // TEXTURE_H
@@ -0,0 +1,208 @@
+#ifndef TOPOLOGY_H
+#define TOPOLOGY_H
+#include <vector>
+#include <string>
+#include <fstream>
+#include <algorithm>
+#include <thread>
+#include <stdexcept>
+#ifdef __linux__
+#include <sched.h>
+#endif
+
+enum class placement_policy
+{
+	none,    // leave threads to the OS scheduler
+	cores,   // pin one worker per physical core
+	threads  // pin one worker per logical CPU, hyperthreads included
+};
+
+[[nodiscard]] inline placement_policy parse_placement_policy(const std::string& name)
+{
+	if (name == "none") return placement_policy::none;
+	if (name == "cores") return placement_policy::cores;
+	if (name == "threads") return placement_policy::threads;
+	throw std::runtime_error("Unknown placement policy '" + name + "', expected none, cores or threads");
+}
+
+struct cpu_slot
+{
+	int cpu;      // logical CPU id, -1 if the worker is not pinned
+	int core;     // physical core id, unique across packages
+	int node;     // NUMA node id
+};
+
+class cpu_topology
+{
+	std::vector<cpu_slot> cpus;
+
+	// Parses the sysfs list format, e.g. "0-3,8,10-11"
+	[[nodiscard]] static std::vector<int> parse_cpu_list(const std::string& list)
+	{
+		std::vector<int> result;
+		size_t pos = 0;
+		while (pos < list.size())
+		{
+			auto end = list.find(',', pos);
+			if (end == std::string::npos)
+				end = list.size();
+			const auto range = list.substr(pos, end - pos);
+			const auto dash = range.find('-');
+			const auto first = std::stoi(range.substr(0, dash));
+			const auto last = dash == std::string::npos ? first : std::stoi(range.substr(dash + 1));
+			for (auto cpu = first; cpu <= last; ++cpu)
+				result.push_back(cpu);
+			pos = end + 1;
+		}
+		return result;
+	}
+	[[nodiscard]] static bool read_line(const std::string& path, std::string& line)
+	{
+		std::ifstream file{ path };
+		return static_cast<bool>(std::getline(file, line));
+	}
+	[[nodiscard]] static bool read_int(const std::string& path, int& value)
+	{
+		std::string line;
+		if (!read_line(path, line))
+			return false;
+		value = std::stoi(line);
+		return true;
+	}
+public:
+	[[nodiscard]] static cpu_topology detect()
+	{
+		cpu_topology topology;
+#ifdef __linux__
+		const std::string cpu_root = "/sys/devices/system/cpu/";
+		std::string online;
+		if (read_line(cpu_root + "online", online))
+		{
+			for (const auto cpu : parse_cpu_list(online))
+			{
+				const auto cpu_dir = cpu_root + "cpu" + std::to_string(cpu) + "/topology/";
+				int core = cpu, package = 0;
+				(void)read_int(cpu_dir + "core_id", core);
+				(void)read_int(cpu_dir + "physical_package_id", package);
+				topology.cpus.push_back({ cpu, (package << 16) | core, 0 });
+			}
+			const std::string node_root = "/sys/devices/system/node/";
+			std::string nodes;
+			if (read_line(node_root + "online", nodes))
+			{
+				for (const auto node : parse_cpu_list(nodes))
+				{
+					std::string node_cpus;
+					if (!read_line(node_root + "node" + std::to_string(node) + "/cpulist", node_cpus) || node_cpus.empty())
+						continue;
+					for (const auto cpu : parse_cpu_list(node_cpus))
+					{
+						for (auto& slot : topology.cpus)
+						{
+							if (slot.cpu == cpu)
+								slot.node = node;
+						}
+					}
+				}
+			}
+			// Only the CPUs the process may run on, which taskset, cpusets and containers restrict
+			cpu_set_t allowed;
+			if (sched_getaffinity(0, sizeof(allowed), &allowed) == 0)
+				std::erase_if(topology.cpus, [&](const cpu_slot& slot) { return slot.cpu >= CPU_SETSIZE || !CPU_ISSET(slot.cpu, &allowed); });
+		}
+#endif
+		if (topology.cpus.empty())
+		{
+			const auto count = std::max(1u, std::thread::hardware_concurrency());
+			for (unsigned cpu = 0; cpu < count; ++cpu)
+				topology.cpus.push_back({ static_cast<int>(cpu), static_cast<int>(cpu), 0 });
+		}
+		return topology;
+	}
+
+	// Chooses a CPU for each worker. Workers are spread evenly over the NUMA nodes
+	// and returned sorted by node, so neighbouring worker indices share a node.
+	// A worker_count of 0 means one worker per CPU allowed by the policy.
+	[[nodiscard]] std::vector<cpu_slot> assign(size_t worker_count, placement_policy policy) const
+	{
+		if (policy == placement_policy::none)
+		{
+			if (worker_count == 0)
+				worker_count = cpus.size();
+			return std::vector<cpu_slot>(worker_count, cpu_slot{ -1, -1, 0 });
+		}
+
+		// Per node: first thread of every core, then the hyperthread siblings
+		std::vector<int> node_ids;
+		for (const auto& slot : cpus)
+		{
+			if (std::find(node_ids.begin(), node_ids.end(), slot.node) == node_ids.end())
+				node_ids.push_back(slot.node);
+		}
+		std::sort(node_ids.begin(), node_ids.end());
+		std::vector<std::vector<cpu_slot>> candidates(node_ids.size());
+		for (size_t n = 0; n < node_ids.size(); ++n)
+		{
+			std::vector<cpu_slot> siblings;
+			std::vector<int> seen_cores;
+			for (const auto& slot : cpus)
+			{
+				if (slot.node != node_ids[n])
+					continue;
+				if (std::find(seen_cores.begin(), seen_cores.end(), slot.core) == seen_cores.end())
+				{
+					seen_cores.push_back(slot.core);
+					candidates[n].push_back(slot);
+				}
+				else
+				{
+					siblings.push_back(slot);
+				}
+			}
+			if (policy == placement_policy::threads)
+				candidates[n].insert(candidates[n].end(), siblings.begin(), siblings.end());
+		}
+
+		size_t available = 0, max_per_node = 0;
+		for (const auto& node_candidates : candidates)
+		{
+			available += node_candidates.size();
+			max_per_node = std::max(max_per_node, node_candidates.size());
+		}
+		if (worker_count == 0)
+			worker_count = available;
+
+		// Round-robin over nodes; starts over (oversubscribes) if more workers than CPUs were requested
+		std::vector<cpu_slot> result;
+		result.reserve(worker_count);
+		while (result.size() < worker_count)
+		{
+			for (size_t round = 0; round < max_per_node; ++round)
+			{
+				for (const auto& node_candidates : candidates)
+				{
+					if (round < node_candidates.size() && result.size() < worker_count)
+						result.push_back(node_candidates[round]);
+				}
+			}
+		}
+		std::stable_sort(result.begin(), result.end(), [](const cpu_slot& a, const cpu_slot& b) { return a.node < b.node; });
+		return result;
+	}
+};
+
+// Pins the calling thread to a single logical CPU. Returns false where unsupported.
+inline bool pin_current_thread(int cpu) noexcept
+{
+#ifdef __linux__
+	if (cpu < 0 || cpu >= CPU_SETSIZE)
+		return false;
+	cpu_set_t set;
+	CPU_ZERO(&set);
+	CPU_SET(cpu, &set);
+	return sched_setaffinity(0, sizeof(set), &set) == 0;
+#else
+	return false;
+#endif
+}
+#endif // TOPOLOGY_H
@@ -0,0 +1,51 @@
+#ifndef TRIPLE_BUFFER_H
+#define TRIPLE_BUFFER_H
+#include <array>
+#include <mutex>
+#include <utility>
+
+// Hands completed buffers from one producer thread to one consumer thread.
+// Both sides always own a buffer, so neither waits for the other to finish.
+template <typename T>
+class triple_buffer
+{
+	std::array<T, 3> buffers{};
+	size_t back_idx = 0;
+	size_t ready_idx = 1;
+	size_t front_idx = 2;
+	bool ready_is_fresh = false;
+	std::mutex m;
+public:
+	[[nodiscard]] T& back() noexcept
+	{
+		return buffers[back_idx];
+	}
+	[[nodiscard]] T& front() noexcept
+	{
+		return buffers[front_idx];
+	}
+	// Producer: make the back buffer the newest completed one
+	void publish()
+	{
+		std::lock_guard lk{ m };
+		std::swap(back_idx, ready_idx);
+		ready_is_fresh = true;
+	}
+	// Consumer: take the newest completed buffer, if there is one it hasn't seen
+	bool acquire()
+	{
+		std::lock_guard lk{ m };
+		if (!ready_is_fresh)
+			return false;
+		std::swap(front_idx, ready_idx);
+		ready_is_fresh = false;
+		return true;
+	}
+	template <typename Func>
+	void for_each(Func&& func)
+	{
+		for (auto& buffer : buffers)
+			func(buffer);
+	}
+};
+#endif // TRIPLE_BUFFER_H
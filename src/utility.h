@@ -1,6 +1,10 @@
 #ifndef UTILITY_H
 #define UTILITY_H
 #include <chrono>
+#include <cstdint>
+#include <cmath>
+#include <glm/glm.hpp>
+#include "math_policy.h"
 
 [[nodiscard]] inline double time_now() noexcept
 {
@@ -12,6 +16,26 @@
 {
     return 0x00269ec3;
 }
+[[nodiscard]] inline uint64_t splitmix64(uint64_t key) noexcept
+{
+    key += 0x9e3779b97f4a7c15ull;
+    key = (key ^ (key >> 30)) * 0xbf58476d1ce4e5b9ull;
+    key = (key ^ (key >> 27)) * 0x94d049bb133111ebull;
+    return key ^ (key >> 31);
+}
+// Turns an arbitrary key (e.g. frame and tile index) into a well mixed, non-zero seed
+[[nodiscard]] inline int mix_seed(uint64_t key) noexcept
+{
+    return static_cast<int>(splitmix64(key)) | 1;
+}
+// Seed of one sample of pixel (x, y) of the image identified by image_key. Every random
+// number of the sample comes from it, so the result doesn't depend on which thread,
+// or in what order, renders the pixel.
+[[nodiscard]] inline int pixel_seed(uint64_t image_key, uint32_t x, uint32_t y, uint32_t sample) noexcept
+{
+    const auto key = splitmix64(image_key) ^ (uint64_t{ y } << 32 | x);
+    return mix_seed(splitmix64(key) ^ sample);
+}
 [[nodiscard]] inline float sfrand(int& seed) noexcept
 {
     // from https://www.iquilezles.org/www/articles/sfrand/sfrand.htm
@@ -38,7 +62,6 @@
     i_res = (static_cast<unsigned>(seed) >> 9) | 0x3f800000;
     return f_res - 1.0f;
 }
-inline constexpr long double pi = 3.14159265358979323846264338327950288419716939937510L;
 template <typename Arithmetic>
 Arithmetic degToRad(const Arithmetic& x)
 {
@@ -49,44 +72,16 @@ Arithmetic radToDeg(const Arithmetic& x)
 {
     return x * static_cast<Arithmetic>(180.0L / pi);
 }
-[[nodiscard]] inline float fast_sqrt(float x) noexcept
-{
-	// from https://stackoverflow.com/a/18662665/12501684
-    auto i = *reinterpret_cast<unsigned*>(&x);
-    i += 127 << 23;
-    i >>= 1;
-    return *reinterpret_cast<float*>(&i);
-}
-[[nodiscard]] inline float fast_acos(float a) noexcept
-{
-	// from https://stackoverflow.com/a/48157547/12501684
-    const float C = 0.10501094f;
-    const auto t = (a < 0) ? (-a) : a;  // handle negative arguments
-    const auto u = 1.0f - t;
-    const auto s = fast_sqrt(u + u);
-    auto r = C * u * s + s;  // or fmaf (C * u, s, s) if FMA support in hardware
-    if (a < 0) r = static_cast<float>(pi) - r;  // handle negative arguments
-    return r;
-}
-template<typename Arithmetic>
-Arithmetic fast_cos(Arithmetic x) noexcept
-{
-	// from https://stackoverflow.com/a/28050328/12501684
-    constexpr Arithmetic tp{ 1.0L / (2.0L * pi) };
-    x *= tp;
-    x -= Arithmetic(.25) + std::floor(x + Arithmetic(.25));
-    x *= Arithmetic(16.) * (std::abs(x) - Arithmetic(.5));
-    return x;
-}
 // Random vector on a unit hemisphere oriented along with normal (0, 1, 0)
-[[nodiscard]] inline glm::vec3 random_hemisphere_vector(int& seed) noexcept
+template <typename Math = default_math>
+[[nodiscard]] glm::vec3 random_hemisphere_vector(int& seed) noexcept
 {
 	// loosely based on http://corysimon.github.io/articles/uniformdistn-on-sphere/
-    const auto cos_theta = fast_cos(2.0f * static_cast<float>(pi) * frand(seed));
-    const auto sin_theta = fast_sqrt(1.0f - cos_theta * cos_theta);
+    const auto cos_theta = Math::cos(2.0f * static_cast<float>(pi) * frand(seed));
+    const auto sin_theta = Math::sqrt(1.0f - cos_theta * cos_theta);
 
     const auto cos_phi = sfrand(seed);
-    const auto sin_phi = fast_sqrt(1.0f - cos_phi * cos_phi);
+    const auto sin_phi = Math::sqrt(1.0f - cos_phi * cos_phi);
 
     const auto x = sin_phi * cos_theta;
     const auto y = sin_phi * sin_theta;
@@ -94,19 +89,21 @@ Arithmetic fast_cos(Arithmetic x) noexcept
 
     return { x, y, z };
 }
-[[nodiscard]] inline glm::vec3 random_unit_sphere_vector(int& seed) noexcept
+template <typename Math = default_math>
+[[nodiscard]] glm::vec3 random_unit_sphere_vector(int& seed) noexcept
 {
-    auto result = random_hemisphere_vector(seed);
+    auto result = random_hemisphere_vector<Math>(seed);
     *reinterpret_cast<int*>(&result.y) |= (seed & (1 << 24)) << 7; // randomly flip sign bit
     return result;
 }
-[[nodiscard]] inline glm::vec2 random_unit_disk_vector(int& seed) noexcept
+template <typename Math = default_math>
+[[nodiscard]] glm::vec2 random_unit_disk_vector(int& seed) noexcept
 {
-    const auto r = fast_sqrt(frand(seed));
+    const auto r = Math::sqrt(frand(seed));
     const auto phi = frand(seed) * 2.0f * static_cast<float>(pi);
 	
-    const auto cos_phi = fast_cos(phi);
-    auto sin_phi = fast_sqrt(1.0f - cos_phi * cos_phi);
+    const auto cos_phi = Math::cos(phi);
+    auto sin_phi = Math::sqrt(1.0f - cos_phi * cos_phi);
     if (phi > static_cast<float>(pi))
         sin_phi *= -1;
 
@@ -2,13 +2,11 @@
 #define ENGINE_WINDOW_H
 
 #include <MiniFB.h>
-#include "array_wrapper.h"
-#include "pixel.h"
+#include "framebuffer.h"
 
 class window {
     uint32_t m_width;
     uint32_t m_height;
-    std::unique_ptr<pixel[]> m_buffer;
     mfb_window* m_handle;
     bool mouse_button_pressed[8]{};
     float scrollDx{}, scrollDy{};
@@ -19,7 +17,6 @@ class window {
         window& self = *static_cast<window*>(mfb_get_user_data(handle));
         self.m_width = width;
         self.m_height = height;
-        self.m_buffer = std::make_unique<pixel[]>(width * height);
         self.m_resized = true;
     }
 
@@ -45,7 +42,6 @@ public:
     window(const char* title, uint32_t width, uint32_t height, mfb_window_flags flags = WF_RESIZABLE) :
         m_width{ width },
         m_height{ height },
-        m_buffer{ std::make_unique<pixel[]>(width * height) },
         m_handle{ mfb_open_ex(title, width, height, flags) } {
         if (!m_handle) {
             throw std::runtime_error("Cannot open window");
@@ -57,11 +53,12 @@ public:
         mfb_set_user_data(m_handle, this);
     }
 
-    bool update() {
+    // Presents frame, stretching it if it doesn't match the window size yet
+    bool update(const pixel_buffer& frame) {
         m_resized = false;
         scrollDx = scrollDy = 0.0f;
         for (bool& key : pressed_keys) key = false;
-        mfb_update_state state = mfb_update_ex(m_handle, m_buffer.get(), m_width, m_height);
+        mfb_update_state state = mfb_update_ex(m_handle, frame.buffer().data, frame.width(), frame.height());
         return state == STATE_OK;
     }
 
@@ -89,10 +86,6 @@ public:
     }
 
     [[nodiscard]] float get_scroll() const { return scrollDy; }
-
-    [[nodiscard]] auto buffer() const {
-        return array_wrapper<pixel, 2>(m_buffer.get(), m_height, m_width);
-    };
 };
 
 #endif //ENGINE_WINDOW_H
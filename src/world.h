@@ -2,89 +2,535 @@
 #define WORLD_H
 #include <memory>
 #include <vector>
+#include <algorithm>
+#include <functional>
 #include <glm/glm.hpp>
 #include "ray.h"
 #include "raytraceable.h"
+#include "bvh.h"
+#include "ray_packet.h"
+#include "environment.h"
+#include "alias_table.h"
+#include "utility.h"
+
+class bidirectional_tracer;
+class photon_tracer;
+class guided_tracer;
 
 class world
 {
+	friend class bidirectional_tracer;
+	friend class photon_tracer;
+	friend class guided_tracer;
+public:
+	constexpr static uint32_t no_object = ~0u;
+	// What one path did, collected by the debug heatmap and for re-rendering after edits
+	struct trace_stats
+	{
+		uint32_t bounces = 0;
+		uint32_t intersection_tests = 0; // of objects, not of BVH nodes
+		uint32_t first_hit = no_object; // index of the object the path started on
+		uint64_t touched = 0; // object_bit of the objects it hit or was shadowed by
+	};
+	// Surface at the first hit of a primary ray, from which later paths along the same ray start
+	// with raytrace_from instead of intersecting it again. Several are kept per pixel, so it's
+	// packed: the normal is octahedral encoded in two 16 bit values, which is off by less than
+	// 1e-4 radians, and the texture footprint is recomputed from the ray.
+	struct primary_hit
+	{
+		constexpr static uint32_t missed = (1u << 31) - 1;
+
+		uint32_t object : 31; // missed for misses
+		uint32_t front_facing : 1;
+		float t;
+		uint32_t normal;
+		glm::vec2 uv;
+
+		[[nodiscard]] static constexpr primary_hit miss() noexcept
+		{
+			return { missed, 0, 0.0f, 0, { 0, 0 } };
+		}
+	};
+	static_assert(sizeof(primary_hit) == 20);
+	// Coarse bit of an object in trace_stats::touched, shared by every 64th object
+	[[nodiscard]] static uint64_t object_bit(uint32_t idx) noexcept
+	{
+		return uint64_t{ 1 } << (idx % 64);
+	}
+private:
 	std::vector<std::unique_ptr<raytraceable>> objects;
+	// (object, index into objects), sorted by address, to find the index of a packet's hits
+	std::vector<std::pair<const raytraceable*, uint32_t>> object_indices;
+	// Indices into objects; bounded ones are referenced by the BVH through their position in bounded
+	std::vector<uint32_t> bounded;
+	std::vector<uint32_t> unbounded;
+	std::vector<aabb> object_bounds;
+	// Indices into objects of the emissive ones, picked by their area
+	std::vector<uint32_t> emitters;
+	alias_table emitter_table;
+	bvh accel;
+	std::shared_ptr<const environment_map> env;
 
 	struct trace_result
 	{
 		glm::vec3 position;
 		glm::vec3 normal;
 		glm::vec3 color;
-		glm::vec3 emission;
+		glm::vec3 emission; // including the environment light sampled at the hit
 		std::optional<ray> scattered;
+		float scatter_pdf; // of the scattered direction if the environment was sampled at the hit, otherwise 0
 	};
 	
-	[[nodiscard]] static glm::vec4 backdrop(const glm::vec3& dir) noexcept
+	[[nodiscard]] glm::vec3 backdrop(const glm::vec3& dir) const noexcept
 	{
+		if (env)
+			return env->radiance(dir);
 		const auto t = 0.5f * (dir.y + 1.0f);
-		return { (1.0f - t) * glm::vec3(1.0, 1.0, 1.0) + t * glm::vec3(0.5, 0.7, 1.0), 1.0 };
+		return (1.0f - t) * glm::vec3(1.0, 1.0, 1.0) + t * glm::vec3(0.5, 0.7, 1.0);
 	}
-	[[nodiscard]] trace_result trace_single(const ray& r, float min_t, float max_t, int& seed) const noexcept
+	// Multiple importance sampling weight of a strategy with density pdf against one with other_pdf
+	[[nodiscard]] static float power_heuristic(float pdf, float other_pdf) noexcept
 	{
-		raytraceable::hit_info hit_info{ max_t };
-		for (auto&& obj : objects)
+		return pdf * pdf / (pdf * pdf + other_pdf * other_pdf);
+	}
+	static void record(trace_stats& stats, uint32_t tests, uint32_t hit_idx) noexcept
+	{
+		stats.intersection_tests += tests;
+		if (hit_idx == no_object)
+			return;
+		// The first hit of a path is the one of its primary ray
+		if (stats.first_hit == no_object)
+			stats.first_hit = hit_idx;
+		stats.touched |= object_bit(hit_idx);
+	}
+	[[nodiscard]] uint32_t index_of(const raytraceable* object) const noexcept
+	{
+		const auto it = std::lower_bound(object_indices.begin(), object_indices.end(), object,
+			[](const auto& entry, const raytraceable* o) { return std::less<>{}(entry.first, o); });
+		return it != object_indices.end() && it->first == object ? it->second : no_object;
+	}
+	[[nodiscard]] raytraceable::hit_record closest_hit(const ray& r, float min_t, float max_t, trace_stats* stats) const noexcept
+	{
+		raytraceable::hit_record closest{ max_t, nullptr };
+		auto closest_idx = no_object;
+		for (const auto idx : unbounded)
 		{
-			hit_info = obj->intersect(r, min_t, hit_info.depth).value_or(hit_info);
+			if (objects[idx]->intersect(r, min_t, closest))
+				closest_idx = idx;
 		}
-		if (!hit_info.hit)
+		uint32_t tests = static_cast<uint32_t>(unbounded.size());
+		accel.traverse(r, closest.t, [&](uint32_t prim)
+		{
+			if (objects[bounded[prim]]->intersect(r, min_t, closest))
+				closest_idx = bounded[prim];
+			++tests;
+		});
+		if (stats)
+			record(*stats, tests, closest_idx);
+		return closest;
+	}
+	[[nodiscard]] bool occluded(const ray& r, float t_max, trace_stats* stats) const noexcept
+	{
+		uint32_t tests = 0;
+		auto occluder = no_object;
+		const auto hits = [&](uint32_t idx)
+		{
+			++tests;
+			if (!objects[idx]->occludes(r, 0.0f, t_max))
+				return false;
+			occluder = idx;
+			return true;
+		};
+		const auto result = std::any_of(unbounded.begin(), unbounded.end(), hits)
+			|| accel.any(r, t_max, [&](uint32_t prim) { return hits(bounded[prim]); });
+		if (stats)
 		{
+			stats->intersection_tests += tests;
+			if (result)
+				stats->touched |= object_bit(occluder);
+		}
+		return result;
+	}
+	// Light from the environment reaching a diffuse surface, sampled directly
+	[[nodiscard]] glm::vec3 sample_environment(const glm::vec3& position, const glm::vec3& normal, const glm::vec3& reflectance, int& seed, trace_stats* stats) const noexcept
+	{
+		const auto light = env->sample_direction(seed);
+		const auto cos_theta = dot(normal, light.direction);
+		if (cos_theta <= 0.0f || light.pdf <= 0.0f)
+			return glm::vec3{ 0, 0, 0 };
+		if (occluded(ray{ position + light.direction * 0.005f, light.direction }, std::numeric_limits<float>::infinity(), stats))
+			return glm::vec3{ 0, 0, 0 };
+		const auto bsdf_pdf = cos_theta / static_cast<float>(pi);
+		return reflectance / static_cast<float>(pi) * light.radiance * cos_theta / light.pdf * power_heuristic(light.pdf, bsdf_pdf);
+	}
+	struct emitter_sample
+	{
+		const raytraceable* object;
+		raytraceable::surface_sample point;
+		float pdf; // per unit area, including the choice of the emitter
+	};
+	// Point on one of the emissive objects. There must be at least one.
+	[[nodiscard]] emitter_sample sample_emitter(int& seed) const noexcept
+	{
+		const auto idx = emitter_table.sample(frand(seed));
+		const auto& object = *objects[emitters[idx]];
+		const auto point = object.sample_surface(seed);
+		return { &object, point, emitter_table.pmf_of(idx) * point.pdf };
+	}
+	// Density of sample_emitter at pos on object
+	[[nodiscard]] float emitter_pdf(const raytraceable* object, const glm::vec3& pos) const noexcept
+	{
+		for (size_t idx = 0; idx < emitters.size(); ++idx)
+		{
+			if (objects[emitters[idx]].get() == object)
+				return emitter_table.pmf_of(idx) * object->area_pdf(pos);
+		}
+		return 0.0f;
+	}
+	// bsdf_pdf is the density with which the previous hit chose r, if it also sampled the environment directly
+	[[nodiscard]] trace_result trace_single(const ray& r, float min_t, float max_t, float bsdf_pdf, int& seed, trace_stats* stats) const noexcept
+	{
+		if (stats)
+			++stats->bounces;
+		return shade(r, closest_hit(r, min_t, max_t, stats), bsdf_pdf, seed, stats);
+	}
+	// The rest of trace_single, once the closest hit along r is known
+	[[nodiscard]] trace_result shade(const ray& r, const raytraceable::hit_record& closest, float bsdf_pdf, int& seed, trace_stats* stats) const noexcept
+	{
+		if (!closest.object)
+		{
+			auto color = backdrop(r.direction);
+			if (bsdf_pdf > 0.0f)
+				color *= power_heuristic(bsdf_pdf, env->pdf(r.direction));
 			return {
 				{},
 				{},
-				backdrop(r.direction),
+				color,
 				glm::vec3{0, 0, 0},
-				std::nullopt
+				std::nullopt,
+				0.0f
 			};
 		}
 
-		const auto geometry_info = hit_info.hit->hit(hit_info);
-		const auto normal = geometry_info.normal;
-		const auto position = hit_info.pos;
-		const auto shade_info = hit_info.hit->mat->shade(
+		return shade(r, *closest.object, closest.object->surface(r, closest), closest.t, seed, stats);
+	}
+	// The rest of shade, once the surface at the hit t along r is known
+	[[nodiscard]] trace_result shade(const ray& r, const raytraceable& object, const raytraceable::surface_info& surface, float t, int& seed, trace_stats* stats) const noexcept
+	{
+		const auto& [position, normal, front_facing, tex] = surface;
+		auto shade_info = object.mat->shade(
 			position,
 			normal,
 			r.direction,
-			hit_info.front_facing,
+			front_facing,
+			tex,
 			seed
 		);
-		const auto emission = hit_info.hit->mat->emission(
+		auto emission = object.mat->emission(
 			position,
 			normal,
 			r.direction,
-			hit_info.front_facing,
+			front_facing,
+			tex,
 			seed
 		);
+		// The scattered ray's cone continues from the footprint at the hit
+		if (shade_info.scattered)
+		{
+			shade_info.scattered->cone_width = r.cone_width + r.cone_spread * t;
+			shade_info.scattered->cone_spread = r.cone_spread;
+		}
+		// Bright, small parts of the environment are hardly ever hit by chance, so diffuse
+		// surfaces sample them directly as well. Both strategies are weighted by MIS.
+		float scatter_pdf = 0.0f;
+		if (env && env->emits() && shade_info.scattered)
+		{
+			const auto reflectance = object.mat->diffuse_reflectance(tex);
+			if (reflectance != glm::vec3{ 0, 0, 0 })
+			{
+				emission += sample_environment(position, normal, reflectance, seed, stats);
+				scatter_pdf = std::max(dot(normal, shade_info.scattered->direction), 0.0f) / static_cast<float>(pi);
+			}
+		}
 		return {
 			position,
 			normal,
 			shade_info.attenuation,
 			emission,
-			shade_info.scattered
+			shade_info.scattered,
+			scatter_pdf
 		};
 	}
-public:
-	[[nodiscard]] glm::vec3 raytrace(const ray& r, int depth, int& seed) const noexcept
+	[[nodiscard]] glm::vec3 raytrace(const ray& r, int depth, float bsdf_pdf, int& seed, trace_stats* stats) const noexcept
 	{
 		if (depth <= 0)
 			return glm::vec3(0, 0, 0);
 		
-		const auto trace_result = trace_single(r, 0, std::numeric_limits<float>::infinity(), seed);
-		if (trace_result.scattered)
+		return follow(trace_single(r, 0, std::numeric_limits<float>::infinity(), bsdf_pdf, seed, stats), depth, seed, stats);
+	}
+	// Unit vector folded onto the octahedron, as two 16 bit signed normalized values
+	[[nodiscard]] static uint32_t encode_octahedral(const glm::vec3& n) noexcept
+	{
+		const auto norm = std::abs(n.x) + std::abs(n.y) + std::abs(n.z);
+		auto x = n.x / norm;
+		auto y = n.y / norm;
+		if (n.z < 0.0f)
+		{
+			const auto folded_x = (1.0f - std::abs(y)) * (x >= 0.0f ? 1.0f : -1.0f);
+			y = (1.0f - std::abs(x)) * (y >= 0.0f ? 1.0f : -1.0f);
+			x = folded_x;
+		}
+		const auto snorm = [](float c) { return static_cast<uint16_t>(static_cast<int16_t>(std::lround(std::clamp(c, -1.0f, 1.0f) * 32767.0f))); };
+		return snorm(x) | static_cast<uint32_t>(snorm(y)) << 16;
+	}
+	[[nodiscard]] static glm::vec3 decode_octahedral(uint32_t packed) noexcept
+	{
+		const auto x = static_cast<float>(static_cast<int16_t>(packed & 0xffff)) / 32767.0f;
+		const auto y = static_cast<float>(static_cast<int16_t>(packed >> 16)) / 32767.0f;
+		glm::vec3 n{ x, y, 1.0f - std::abs(x) - std::abs(y) };
+		if (n.z < 0.0f)
+		{
+			n.x = (1.0f - std::abs(y)) * (x >= 0.0f ? 1.0f : -1.0f);
+			n.y = (1.0f - std::abs(x)) * (y >= 0.0f ? 1.0f : -1.0f);
+		}
+		return glm::normalize(n);
+	}
+	[[nodiscard]] primary_hit primary_hit_of(const ray& r, const raytraceable::hit_record& hit) const noexcept
+	{
+		if (!hit.object)
+			return primary_hit::miss();
+		const auto surface = hit.object->surface(r, hit);
+		return { index_of(hit.object), surface.front_facing, hit.t, encode_octahedral(surface.normal), surface.tex.uv };
+	}
+	[[nodiscard]] trace_result shade(const ray& r, const primary_hit& first, int& seed, trace_stats* stats) const noexcept
+	{
+		if (first.object == primary_hit::missed)
+			return shade(r, raytraceable::hit_record{ std::numeric_limits<float>::infinity(), nullptr }, 0.0f, seed, stats);
+		const auto& object = *objects[first.object];
+		const raytraceable::surface_info surface{ r.at(first.t), decode_octahedral(first.normal), first.front_facing != 0, { first.uv, object.uv_width(r, first.t) } };
+		return shade(r, object, surface, first.t, seed, stats);
+	}
+	// Continues the path past a hit traced with depth bounces left
+	[[nodiscard]] glm::vec3 follow(const trace_result& hit, int depth, int& seed, trace_stats* stats) const noexcept
+	{
+		if (hit.scattered)
 		{
 			// TODO: currently due to the slightly translated ray origin artifacts occur at object intersections
-			const auto ray_origin = trace_result.scattered->origin + trace_result.scattered->direction * 0.005f;
-			return trace_result.emission + trace_result.color * raytrace(ray{ ray_origin, trace_result.scattered->direction }, depth - 1, seed);
+			const auto ray_origin = hit.scattered->origin + hit.scattered->direction * 0.005f;
+			return hit.emission + hit.color * raytrace(ray{ ray_origin, hit.scattered->direction, hit.scattered->cone_width, hit.scattered->cone_spread }, depth - 1, hit.scatter_pdf, seed, stats);
 		}
-		return trace_result.color;
+		// Paths end at lights and, with color holding the backdrop, at misses
+		return hit.emission + hit.color;
 	}
+	void build_emitters()
+	{
+		emitters.clear();
+		std::vector<float> emitter_areas;
+		for (uint32_t idx = 0; idx < objects.size(); ++idx)
+		{
+			if (objects[idx]->mat->emissive() && objects[idx]->sampleable())
+			{
+				emitters.push_back(idx);
+				emitter_areas.push_back(objects[idx]->approximate_area());
+			}
+		}
+		emitter_table = alias_table{ emitter_areas };
+	}
+	void index_objects()
+	{
+		object_indices.clear();
+		for (uint32_t idx = 0; idx < objects.size(); ++idx)
+			object_indices.emplace_back(objects[idx].get(), idx);
+		std::sort(object_indices.begin(), object_indices.end(), [](const auto& a, const auto& b) { return std::less<>{}(a.first, b.first); });
+	}
+public:
+	world() = default;
+	// Deep copy, so that every NUMA node can trace against its own replica of the scene. The
+	// materials and textures aren't owned by the world, so the replicas still share them.
+	world(const world& other) :
+		bounded{ other.bounded },
+		unbounded{ other.unbounded },
+		object_bounds{ other.object_bounds },
+		emitters{ other.emitters },
+		emitter_table{ other.emitter_table },
+		accel{ other.accel },
+		env{ other.env }
+	{
+		objects.reserve(other.objects.size());
+		for (auto&& obj : other.objects)
+		{
+			objects.push_back(obj->clone());
+		}
+		index_objects();
+	}
+	world(world&&) noexcept = default;
+
+	[[nodiscard]] glm::vec3 raytrace(const ray& r, int depth, int& seed) const noexcept
+	{
+		return raytrace(r, depth, 0.0f, seed, nullptr);
+	}
+	// Also counts the work done for the path into stats
+	[[nodiscard]] glm::vec3 raytrace(const ray& r, int depth, int& seed, trace_stats& stats) const noexcept
+	{
+		return raytrace(r, depth, 0.0f, seed, &stats);
+	}
+	// Also keeps the first hit of the path in first
+	[[nodiscard]] glm::vec3 raytrace(const ray& r, int depth, int& seed, trace_stats& stats, primary_hit& first) const noexcept
+	{
+		first = primary_hit::miss();
+		if (depth <= 0)
+			return glm::vec3(0, 0, 0);
+		++stats.bounces;
+		const auto hit = closest_hit(r, 0, std::numeric_limits<float>::infinity(), &stats);
+		first = primary_hit_of(r, hit);
+		return follow(shade(r, hit, 0.0f, seed, &stats), depth, seed, &stats);
+	}
+	// Traces a path like raytrace, but starts it at first, kept by an earlier path along r
+	[[nodiscard]] glm::vec3 raytrace_from(const ray& r, const primary_hit& first, int depth, int& seed, trace_stats& stats) const noexcept
+	{
+		if (depth <= 0)
+			return glm::vec3(0, 0, 0);
+		++stats.bounces;
+		record(stats, 0, first.object == primary_hit::missed ? no_object : first.object);
+		return follow(shade(r, first, seed, &stats), depth, seed, &stats);
+	}
+	// Index of the object first hit along r, or no_object
+	[[nodiscard]] uint32_t pick(const ray& r) const noexcept
+	{
+		trace_stats stats;
+		(void)closest_hit(r, 0, std::numeric_limits<float>::infinity(), &stats);
+		return stats.first_hit;
+	}
+	// Whether anything is hit along r before t_max. Stops at the first hit found.
+	[[nodiscard]] bool occluded(const ray& r, float t_max) const noexcept
+	{
+		return occluded(r, t_max, nullptr);
+	}
+	// Preview of the geometry alone: 0 or 1 for whether a cosine distributed ray from the
+	// first hit escapes further than radius, so that averaging gives ambient occlusion.
+	// Misses are 1.
+	[[nodiscard]] float ambient_occlusion(const ray& r, float radius, int& seed) const noexcept
+	{
+		const auto hit = closest_hit(r, 0, std::numeric_limits<float>::infinity(), nullptr);
+		if (!hit.object)
+			return 1.0f;
+		const auto surface = hit.object->surface(r, hit);
+		const auto dir = default_math::normalize(surface.normal + random_unit_sphere_vector(seed));
+		return occluded(ray{ surface.pos + dir * 0.005f, dir }, radius) ? 0.0f : 1.0f;
+	}
+	// Traces the primary rays of p together, culling objects outside the packet's frustum,
+	// and continues every path on its own from its first hit, drawing from the seed of its lane.
+	// Writes the colors of the lanes to colors, what their paths did to stats and their first
+	// hits to firsts, if given.
+	void raytrace(ray_packet& p, int depth, int* seeds, glm::vec3* colors, trace_stats* stats = nullptr, primary_hit* firsts = nullptr) const noexcept
+	{
+		for (const auto idx : unbounded)
+		{
+			(void)objects[idx]->intersect(p, 0.0f);
+		}
+		p.update_far_t();
+		accel.traverse(p, [&](uint32_t prim)
+		{
+			if (objects[bounded[prim]]->intersect(p, 0.0f))
+				p.update_far_t();
+		});
+		for (size_t lane = 0; lane < p.size; ++lane)
+		{
+			auto* lane_stats = stats ? &stats[lane] : nullptr;
+			if (lane_stats && p.object[lane])
+				record(*lane_stats, 0, index_of(p.object[lane]));
+			const auto r = p.lane_ray(lane);
+			const raytraceable::hit_record hit{ p.t[lane], p.object[lane], p.primitive[lane] };
+			if (firsts)
+				firsts[lane] = primary_hit_of(r, hit);
+			if (depth <= 0)
+				colors[lane] = glm::vec3{ 0, 0, 0 };
+			else
+				colors[lane] = follow(shade(r, hit, 0.0f, seeds[lane], lane_stats), depth, seeds[lane], lane_stats);
+		}
+	}
+	// Replaces the sky gradient. The environment is shared between copies of the world.
+	void set_environment(std::shared_ptr<const environment_map> environment) noexcept
+	{
+		env = std::move(environment);
+	}
+	// Objects can only be traced after the next build()
 	void add(raytraceable* object)
 	{
 		objects.emplace_back(object);
 	}
+	// Subtrees of the BVH over large scenes are built on the pool, if one is given
+	void build(job_pool* pool = nullptr)
+	{
+		bounded.clear();
+		unbounded.clear();
+		object_bounds.clear();
+		for (uint32_t idx = 0; idx < objects.size(); ++idx)
+		{
+			if (const auto b = objects[idx]->bounds())
+			{
+				bounded.push_back(idx);
+				object_bounds.push_back(*b);
+			}
+			else
+			{
+				unbounded.push_back(idx);
+			}
+		}
+		build_emitters();
+		accel.build(object_bounds, pool);
+		index_objects();
+	}
+	[[nodiscard]] size_t object_count() const noexcept
+	{
+		return objects.size();
+	}
+	[[nodiscard]] const raytraceable& object(uint32_t idx) const noexcept
+	{
+		return *objects[idx];
+	}
+	// Edits of a built world, which take effect for the next ray traced. The material has
+	// to outlive the world, as objects only point to theirs.
+	void set_transform(uint32_t idx, const transform& trans)
+	{
+		objects[idx]->set_transform(trans);
+		if (const auto it = std::find(bounded.begin(), bounded.end(), idx); it != bounded.end())
+		{
+			object_bounds[it - bounded.begin()] = objects[idx]->bounds().value_or(aabb{});
+			(void)accel.refit(object_bounds);
+		}
+		build_emitters();
+	}
+	void set_material(uint32_t idx, const material& mat)
+	{
+		objects[idx]->mat = &mat;
+		build_emitters();
+	}
+	[[nodiscard]] bool animated() const noexcept
+	{
+		return std::any_of(objects.begin(), objects.end(), [](auto&& obj) { return obj->animation() != nullptr; });
+	}
+	// Moves animated objects to where they are at time and refits the BVH around them.
+	// Returns true if anything moved.
+	bool update(float time)
+	{
+		bool moved = false;
+		for (auto&& obj : objects)
+		{
+			if (const auto anim = obj->animation())
+			{
+				obj->set_transform(anim->evaluate(time));
+				moved = true;
+			}
+		}
+		if (!moved)
+			return false;
+		for (size_t prim = 0; prim < bounded.size(); ++prim)
+		{
+			object_bounds[prim] = objects[bounded[prim]]->bounds().value_or(aabb{});
+		}
+		(void)accel.refit(object_bounds);
+		return true;
+	}
 };
 #endif // WORLD_H